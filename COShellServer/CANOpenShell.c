@@ -48,6 +48,12 @@ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <sys/epoll.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <errno.h>
 #define CLEARSCREEN "clear"
 #define SLEEP(time) sleep(time)
 #endif
@@ -62,15 +68,39 @@ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 #include "CANOpenShellMasterOD.h"
 #include "CANOpenShellSlaveOD.h"
 //#endif //------- REMOVE TAGS WHEN TO TEST WITHOUT CAN INTERFACE
+#include "gateway.h"
+#include "sdosched.h"
+#include "odcache.h"
+#include "cantap.h"
+#include "pdoshadow.h"
+#include "subscribe.h"
+#include "download.h"
+#include "inventory.h"
+#include "scan.h"
+#include "netqueue.h"
+#include "motion.h"
+#include "stream.h"
+#include "rtprofile.h"
+#include "socketcan.h"
+#include "simbus.h"
+#include "tunnel.h"
+#include "trace.h"
 
 //****************************************************************************
 // DEFINES
 #define MAXBUF 200
 #define NPORT 5000
 #define BKLOG 10
-#define MAXMSG 128
+#define MAXMSG NET_FRAME_MAX
+#define MAX_SESSIONS 16
+#define MAX_BATCHES 8
+#define MAX_WAITS 8                         //wait# commands pending at once in a session
+#define BSDO_MAX_ITEMS 128
+#define SCRIPT_LINE_TIMEOUT 10              //seconds to wait for the completion of an init file line
+#define BUS_NAME_MAX 16
+#define BUS_PDO_MAX 64                      //transmit and receive PDO of the dictionary, for the buses after the first
+#define BUS_HB_MAX 127                      //heartbeat consumers of the dictionary, for the buses after the first
 
-#define MAX_NODES 127
 #define cst_str4(c1, c2, c3, c4) ((((unsigned int)0 | \
                                     (char)c4 << 8) | \
                                    (char)c3) << 8 | \
@@ -84,13 +114,297 @@ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 
 //****************************************************************************
 // GLOBALS
-char BoardBusName[31];
-char BoardBaudRate[5];
-s_BOARD Board = {BoardBusName, BoardBaudRate};
-CO_Data* CANOpenShellOD_Data;
+CO_Data* CANOpenShellOD_Data;      /* CO_Data structure of the bus addressed by the command */
 char LibraryPath[512];
 
-static int gstaticSocketCanGateway;
+/*
+CAN buses served by the gateway, the first one is the default bus of the commands.
+The object dictionary of the gateway is generated once: the first bus use the
+generated CO_Data structure and the next ones a copy of it, taken before the
+first bus was opened. A copy has its own SDO lines, NMT table and CAN port but
+share the objects of the dictionary, so all the buses have the node id and the
+type of the first one. The state the generated structure points to is not
+shared: a copy points to its own PDO status, PDO event timers, heartbeat
+consumer timers and SYNC COB-ID and period.
+*/
+typedef struct
+{
+    char name[BUS_NAME_MAX];    /* name used to address the commands, "bus<n>" by default */
+    char busName[31];           /* channel of the driver */
+    char baudRate[5];
+    s_BOARD board;
+    CO_Data* d;
+    CO_Data data;               /* copy of the generated CO_Data structure, for the buses after the first */
+
+    /* State of a copy, the generated structure points to the state of the first bus */
+    s_PDO_status pdoStatus[BUS_PDO_MAX];
+    TIMER_HANDLE rpdoTimers[BUS_PDO_MAX];
+    TIMER_HANDLE heartbeatTimers[BUS_HB_MAX];
+    UNS8 heartbeatCount;
+    UNS32 syncCobId;
+    UNS32 syncPeriod;
+} s_BUS;
+
+s_BUS Buses[MAX_BUSES];
+int BusCount;
+static CO_Data gstaticPristineData;         /* CO_Data structure of the first bus before it was opened */
+static UNS32 gstaticPristineSync[2];        /* SYNC COB-ID and period of the dictionary before the first bus was opened */
+static int gstaticNodeType;
+
+/*
+Per connection state, one entry for each remote host connected to the gateway.
+Sessions are referenced by their identifier so that a reply delivered by a
+late SDO callback never reaches a host that reused the same slot.
+The socket and the receive buffer belong to the network thread (main), the
+messages received go to the command thread through the command ring. A slot
+is freed by the command thread when it has dropped the state of a closed session.
+*/
+typedef struct
+{
+    int id;                 /* session identifier, 0 when the slot is free */
+    int fd;                 /* socket connected to the remote host, -1 once closed */
+    char host[MAXBUF];      /* remote host ip address string */
+    int waitsec[MAX_WAITS];         /* delay of the pending wait# commands */
+    unsigned int waittag[MAX_WAITS];/* correlation identifier of the pending wait# commands */
+    UNS8 waitused[MAX_WAITS];       /* the entry is pending, its alarm id is session * MAX_WAITS + entry */
+    s_NETBUF nb;            /* receive buffer and wire protocol mode of the network thread */
+    s_NETOUT out;           /* replies not yet accepted by the socket */
+    int mode;               /* wire protocol mode seen by the commands */
+    int paused;             /* not read until its command ring has room */
+    int throttled;          /* not read until its replies are below the low watermark */
+    int closed;             /* disconnected by the network thread */
+    int quit;               /* disconnection requested by the command thread */
+    unsigned long lost;     /* binary messages dropped, the send buffer or the reply queue was full */
+    int overflow;           /* a reply could not be queued, the host is disconnected */
+    s_CMDRING cmds;         /* messages waiting for the command thread */
+} s_SESSION;
+
+s_SESSION Sessions[MAX_SESSIONS];
+static int gstaticLastSessionId;
+static int gstaticWakePipe[2] = {-1, -1};   /* wake the network thread from the other threads */
+static int gstaticWakePending;              /* a wake up is in the pipe */
+static sem_t gstaticCmdSem;                 /* wake the command thread */
+static sem_t gstaticRoomSem;                /* wake the command thread waiting for room in the reply queue */
+static int gstaticRoomWait;                 /* the command thread wait for room in the reply queue */
+
+int ReadSession(int, s_SESSION*);
+
+/*
+Completion of the init file line in progress: the line is tagged with its
+number and the last of its replies carrying this tag wake up the init file
+processing.
+*/
+static pthread_mutex_t gstaticScriptMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t gstaticScriptCond = PTHREAD_COND_INITIALIZER;
+static unsigned int gstaticScriptTag;
+static int gstaticScriptLeft;               /* replies of the line not yet sent */
+
+/*
+This function find a connected session from its identifier
+input: session identifier
+return: session or NULL if the host is disconnected
+*/
+
+s_SESSION* FindSession(int session)
+{
+    int i;
+
+    if(session <= 0) return NULL;
+    for(i=0; i<MAX_SESSIONS; i++)
+    {
+        if(__atomic_load_n(&Sessions[i].id, __ATOMIC_ACQUIRE) == session) return &Sessions[i];
+    }
+    return NULL;
+}
+
+/*
+This function queue a reply string for the host of a session
+Replies to the init file pseudo session (0) or to a disconnected host are only printed.
+The network thread send the reply: a slow host never hold the stack mutex.
+input: requester, reply string, kind of reply (NQ_REPLY or NQ_MODE), new protocol mode
+*/
+
+static void QueueReply(s_REQUESTER* rq, char* buf, int kind, int mode)
+{
+    char tagbuf[NET_FRAME_MAX];
+    s_SESSION* s = FindSession(rq->session);
+
+    if(rq->tag)
+    {
+        snprintf(tagbuf, sizeof tagbuf, "@%u %s", rq->tag, buf);
+        buf = tagbuf;
+    }
+    if(s == NULL)
+    {
+        printf("%s\n", buf);
+        if(rq->session == 0 && rq->tag != 0) ScriptReplied(rq->tag);
+        return;
+    }
+    if(ReplyPush(rq->session, kind, mode, buf) < 0)
+    {
+            /*the host would wait for this reply forever, it is disconnected*/
+        printf("Reply to session %d dropped, queue full: %s\n", rq->session, buf);
+        __atomic_store_n(&s->overflow, 1, __ATOMIC_RELEASE);
+    }
+    WakeNetwork();
+}
+
+/*
+This function send a reply string to the host of a session
+Replies to the init file pseudo session (0) or to a disconnected host are only printed
+input: requester, reply string
+*/
+
+void SendReply(s_REQUESTER* rq, char* buf)
+{
+    QueueReply(rq, buf, NQ_REPLY, 0);
+}
+
+/*
+This function send a binary message to the host of a session in the framed
+protocol, it is dropped when the host is disconnected
+input: session identifier, message, number of bytes (NET_FRAME_MAX at most)
+return: 0 or -1 if the reply queue is full, the message is counted as lost
+*/
+
+int SendData(int session, char* buf, int len)
+{
+    s_SESSION* s = FindSession(session);
+
+    if(s == NULL) return 0;
+    if(ReplyPush(session, NQ_DATA, len, buf) < 0)
+    {
+        __atomic_add_fetch(&s->lost, 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+    WakeNetwork();
+    return 0;
+}
+
+/*
+This function signal the completion of an init file line
+input: correlation identifier of the reply
+*/
+
+void ScriptReplied(unsigned int tag)
+{
+    pthread_mutex_lock(&gstaticScriptMutex);
+    if(tag == gstaticScriptTag && gstaticScriptLeft > 0 && --gstaticScriptLeft == 0)
+        pthread_cond_signal(&gstaticScriptCond);
+    pthread_mutex_unlock(&gstaticScriptMutex);
+}
+
+/*
+This function return the number of replies of an init file line, info# give
+one reply per node and the other commands one reply
+input: command
+return: number of replies
+*/
+
+static int ScriptReplies(char* command)
+{
+    int n = 0, item = 0;
+
+    if(strncmp(command, "info#", 5)) return 1;
+    for(command += 5; *command; command++)
+    {
+        /* Items are separated like the strtok of NodeInfo */
+        if(strchr(",\r\n", *command) != NULL) item = 0;
+        else if(!item)
+        {
+            item = 1;
+            n++;
+        }
+    }
+    return n;
+}
+
+/*
+This function wait for the replies of the init file line in progress
+input: timeout in seconds
+return: 0 or -1 if the line is not completed before the timeout
+*/
+
+int ScriptWait(int timeout)
+{
+    struct timespec ts;
+    int ret = 0;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += timeout;
+
+    pthread_mutex_lock(&gstaticScriptMutex);
+    while(gstaticScriptLeft > 0 && ret == 0)
+        ret = pthread_cond_timedwait(&gstaticScriptCond, &gstaticScriptMutex, &ts);
+    ret = gstaticScriptLeft > 0 ? -1 : 0;
+    gstaticScriptTag = 0;
+    pthread_mutex_unlock(&gstaticScriptMutex);
+    return ret;
+}
+
+/*
+This function return a monotonic time in milliseconds
+*/
+
+unsigned long GatewayTime(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+This function make the command thread serve again the sessions that wait for
+room in a download, it may be called from any thread
+*/
+
+void WakeSessions(void)
+{
+    sem_post(&gstaticCmdSem);
+}
+
+/*
+This function make the network thread read the reply queue and the sessions
+paused by a full command ring, it may be called from any thread
+*/
+
+void WakeNetwork(void)
+{
+    char c = 0;
+
+    /* One byte in the pipe until the network thread wake up */
+    if(__atomic_exchange_n(&gstaticWakePending, 1, __ATOMIC_ACQ_REL)) return;
+    if(gstaticWakePipe[1] >= 0 && write(gstaticWakePipe[1], &c, 1) < 0) {}
+}
+
+/*
+This function switch the wire protocol of a session, the reply is sent with the previous protocol
+input: requester, command string
+*/
+
+void SetProtocol(s_REQUESTER* rq, char* command)
+{
+    char retbuf[50];
+    s_SESSION* s = FindSession(rq->session);
+    int mode;
+
+    if(!strncmp(command + 5, "frame", 5)) mode = NET_FRAMED;
+    else if(!strncmp(command + 5, "text", 4)) mode = NET_TEXT;
+    else mode = -1;
+
+    if(mode < 0)
+    {
+        sprintf(retbuf,"404 unknown protocol");
+        SendReply(rq, retbuf);
+        return;
+    }
+
+    /* The network thread switch the protocol of the host after sending the reply */
+    sprintf(retbuf,"000 %s protocol enabled",mode == NET_FRAMED ? "framed" : "text");
+    QueueReply(rq, retbuf, NQ_MODE, mode);
+    if(s != NULL) s->mode = mode;
+}
 
 /*
 This function Sleep for n seconds
@@ -105,10 +419,10 @@ void SleepFunction(int second)
 
 /*
 This function ask a slave node to go in operational mode
-input: node identifier
+input: requester, node identifier
 */
 
-void StartNode(UNS8 nodeid)
+void StartNode(s_REQUESTER* rq, UNS8 nodeid)
 {
     char retbuf[100];
 
@@ -116,21 +430,22 @@ void StartNode(UNS8 nodeid)
     {
         strcpy(retbuf,"404");
         sprintf(retbuf,"%s Unable to start node %d ",retbuf,nodeid);
-        sendData(gstaticSocketCanGateway, retbuf);
+        SendReply(rq, retbuf);
+        return;
     }
 
 	strcpy(retbuf,"000");
     sprintf(retbuf,"%s Node %d started ok",retbuf,nodeid);
-    sendData(gstaticSocketCanGateway, retbuf);
+    SendReply(rq, retbuf);
 }
 
 
 /*
 This function ask a slave node to go in pre-operational mode
-input: node identifier
+input: requester, node identifier
 */
 
-void StopNode(UNS8 nodeid)
+void StopNode(s_REQUESTER* rq, UNS8 nodeid)
 {
 	char retbuf[100];
 
@@ -138,21 +453,25 @@ void StopNode(UNS8 nodeid)
     {
         strcpy(retbuf,"404");
         sprintf(retbuf,"%s Unable to stop node %d",retbuf,nodeid);
-        sendData(gstaticSocketCanGateway, retbuf);
+        SendReply(rq, retbuf);
+        return;
     }
 
+	/* A stopped node do not send PDO anymore */
+	ShadowInvalidateNode(CANOpenShellOD_Data, nodeid);
+
 	strcpy(retbuf,"000");
     sprintf(retbuf,"%s Node %d stopped ok",retbuf,nodeid);
-    sendData(gstaticSocketCanGateway, retbuf);
+    SendReply(rq, retbuf);
 }
 
 
 /*
 This function ask a slave node to reset
-input: node identifier
+input: requester, node identifier
 */
 
-void ResetNode(UNS8 nodeid)
+void ResetNode(s_REQUESTER* rq, UNS8 nodeid)
 {
     char retbuf[100];
 
@@ -160,147 +479,277 @@ void ResetNode(UNS8 nodeid)
 	{
 	    strcpy(retbuf,"404");
         sprintf(retbuf,"%s Unable to reset node %d",retbuf,nodeid);
-        sendData(gstaticSocketCanGateway, retbuf);
+        SendReply(rq, retbuf);
+        return;
 	}
 
+	/* The objects of the node get their default values back */
+	OdCacheFlushNode(CANOpenShellOD_Data, nodeid);
+	ShadowInvalidateNode(CANOpenShellOD_Data, nodeid);
+
 	strcpy(retbuf,"000");
     sprintf(retbuf,"%s Node %d reseted ok",retbuf,nodeid);
-    sendData(gstaticSocketCanGateway, retbuf);
+    SendReply(rq, retbuf);
 }
 
 
 /*
-This function reset all nodes on the network and print message when boot-up
+This function look for the nodes of the bus, the requester get the list of
+the nodes found with their identity
+input: requester
 */
 
-void DiscoverNodes()
+void DiscoverNodes(s_REQUESTER* rq)
 {
     char retbuf[100];
 
-    printf("Wait for Slave nodes bootup...\n\n");
-    //strcpy(retbuf,"000");											//not implemented because of the number of node is unknown by the remote host
-    //sprintf(retbuf,"%s Wait for Slave nodes bootup...",retbuf);	//and because this host still wait for a receive from the remote host in a
-	//sendData(gstaticSocketCanGateway, retbuf);					//non multi-thread environnement
-    ResetNode(0x00);	//tags this line when the CAN bus contain more than a master node and 1 slave node
+    printf("Scanning the nodes...\n\n");
+    if(ScanStart(CANOpenShellOD_Data, rq) < 0)
+    {
+        sprintf(retbuf,"404 scan already running");
+        SendReply(rq, retbuf);
+    }
 }
 
-int get_info_step = 0;
-
-
 /*
-This function callback function that check the read SDO demand
-input: CO_Data structure, node id
-
+This function send the identity of nodes, each one in its own reply.
+The nodes are queried concurrently, a recorded node is answered from the
+inventory when it was checked since the start of the gateway.
+input: requester, command (info#nodeid[,nodeid...])
 */
-void CheckReadInfoSDO(CO_Data* d, UNS8 nodeid)
+void NodeInfo(s_REQUESTER* rq, char* command)
 {
-    UNS32 abortCode;
-    UNS32 data=0;
-    UNS32 size=64;
-    char retbuf[100];
-
-    if(getReadResultNetworkDict(CANOpenShellOD_Data, nodeid, &data, &size, &abortCode) != SDO_FINISHED)
-        {
-            printf("Master : Failed in getting information for slave %2.2x, AbortCode :%4.4x \n", nodeid, abortCode);
-            //strcpy(retbuf,"404");
-            //sprintf(retbuf,"%s Master : Failed in getting information for slave %2.2x, AbortCode :%4.4x ",retbuf, nodeid, abortCode);
-            //sendData(gstaticSocketCanGateway, retbuf);
-        }
-    else
-    {
-        /* Display data received */
-        switch(get_info_step)
-        {
-        case 1:
-            printf("Device type     : %x\n", data);
-            break;
-        case 2:
-            printf("Vendor ID       : %x\n", data);
-            break;
-        case 3:
-            printf("Product Code    : %x\n", data);
-            break;
-        case 4:
-            printf("Revision Number : %x\n", data);
-            break;
-        }
-    }
-    /* Finalize last SDO transfer with this node */
-    closeSDOtransfer(CANOpenShellOD_Data, nodeid, SDO_CLIENT);
+    char retbuf[50];
+    char* p;
+    int nodeid, ret;
 
-    GetSlaveNodeInfo(nodeid);
-}
-
-/* Retrieve node informations located at index 0x1000 (Device Type) and 0x1018 (Identity) */
-void GetSlaveNodeInfo(UNS8 nodeid)
-{
-    switch(++get_info_step)
+    for(p = strtok(command + 5, ",\r\n"); p != NULL; p = strtok(NULL, ",\r\n"))
     {
-    case 1: /* Get device type */
-        printf("##################################\n");
-        printf("#### Informations for node %x ####\n", nodeid);
-        printf("##################################\n");
-        readNetworkDictCallback(CANOpenShellOD_Data, nodeid, 0x1000, 0x00, 0, CheckReadInfoSDO);
-        break;
-
-    case 2: /* Get Vendor ID */
-        readNetworkDictCallback(CANOpenShellOD_Data, nodeid, 0x1018, 0x01, 0, CheckReadInfoSDO);
-        break;
-
-    case 3: /* Get Product Code */
-        readNetworkDictCallback(CANOpenShellOD_Data, nodeid, 0x1018, 0x02, 0, CheckReadInfoSDO);
-        break;
-
-    case 4: /* Get Revision Number */
-        readNetworkDictCallback(CANOpenShellOD_Data, nodeid, 0x1018, 0x03, 0, CheckReadInfoSDO);
-        break;
-
-    case 5: /* Print node info */
-        get_info_step = 0;
+        nodeid = ExtractNodeId(p);
+        printf("Informations for node %x\n", nodeid);
+        if((ret = InvQuery(CANOpenShellOD_Data, (UNS8)nodeid, rq)) == 0) continue;
+        if(ret == -1) sprintf(retbuf,"404 info invalid node %d",nodeid);
+        else sprintf(retbuf,"404 info node %d gateway busy",nodeid);
+        SendReply(rq, retbuf);
     }
 }
 
 /* Callback function that check the read SDO demand */
-void CheckReadSDO(CO_Data* d, UNS8 nodeid)
+void CheckReadSDO(CO_Data* d, s_SDOREQ* req)
 {
-    UNS32 abortCode;
-    UNS32 data=0;
-    UNS32 size=64;
+    UNS8 nodeid = req->nodeid;
+    UNS32 abortCode = req->abortCode;
+    UNS32 data = req->data;
     char retbuf[100]; //RSDO
+    s_REQUESTER* rq = &req->rq;
 
-    if(getReadResultNetworkDict(CANOpenShellOD_Data, nodeid, &data, &size, &abortCode) != SDO_FINISHED)
+    if(req->result != SDO_FINISHED)
     {
         printf("\nResult : Failed in getting information for slave %2.2x, AbortCode :%4.4x \n", nodeid, abortCode);
         strcpy(retbuf,"404"); //RSDO
         sprintf(retbuf,"%s Error ssdo node %d with abort code: %x",retbuf,nodeid,abortCode); //RSDO
-        sendData(gstaticSocketCanGateway, retbuf); //RSDO
+        SendReply(rq, retbuf); //RSDO
     }
 
     else
     {
+        /* A value about to be overwritten by a queued write is not kept */
+        if(!SdoWritePending(d, nodeid, req->index, req->subindex))
+            OdCacheStore(d, nodeid, req->index, req->subindex, data);
+        SubsNotify(d, nodeid, req->index, req->subindex, data);
         printf("\nResult : %x\n", data);
         strcpy(retbuf,"000"); //RSDO
         sprintf(retbuf,"%s ssdo node %d ok with result: %x ",retbuf,nodeid,data); //RSDO
-        sendData(gstaticSocketCanGateway, retbuf); //RSDO
+        SendReply(rq, retbuf); //RSDO
+
+    }
+}
+
+/*
+This function return the value of an hexadecimal digit
+input: character
+return: value or -1 if the character is not an hexadecimal digit
+*/
+int HexDigit(char c)
+{
+    if(c >= '0' && c <= '9') return c - '0';
+    if(c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if(c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
 
+/*
+This function write bytes in hexadecimal
+input: bytes, number of bytes, string receiving 2 characters per byte
+*/
+void HexEncode(const UNS8* p, int n, char* out)
+{
+    int i;
+
+    for(i=0; i<n; i++) sprintf(out + 2 * i, "%2.2x", p[i]);
+    out[2 * n] = 0;
+}
+
+/*
+This function read bytes written in hexadecimal, up to the end of the string
+or a blank character
+input: string, buffer, size of the buffer
+return: number of bytes or -1 if the string is not valid
+*/
+int HexDecode(const char* s, UNS8* buf, int max)
+{
+    int n = 0, hi, lo;
+
+    while(*s && *s != ' ' && *s != '\r' && *s != '\n')
+    {
+        if(n == max || (hi = HexDigit(s[0])) < 0 || (lo = HexDigit(s[1])) < 0) return -1;
+        buf[n++] = hi << 4 | lo;
+        s += 2;
     }
+    return n;
+}
+
+static const char Base64Chars[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+/*
+This function write bytes in base64
+input: bytes, number of bytes, string receiving 4 characters per 3 bytes
+*/
+void Base64Encode(const UNS8* p, int n, char* out)
+{
+    int i;
+    UNS32 v;
 
-    /* Finalize last SDO transfer with this node */
-    closeSDOtransfer(CANOpenShellOD_Data, nodeid, SDO_CLIENT);
+    for(i=0; i<n; i+=3)
+    {
+        v = p[i] << 16 | (i + 1 < n ? p[i + 1] << 8 : 0) | (i + 2 < n ? p[i + 2] : 0);
+        *out++ = Base64Chars[(v >> 18) & 0x3F];
+        *out++ = Base64Chars[(v >> 12) & 0x3F];
+        *out++ = i + 1 < n ? Base64Chars[(v >> 6) & 0x3F] : '=';
+        *out++ = i + 2 < n ? Base64Chars[v & 0x3F] : '=';
+    }
+    *out = 0;
+}
+
+/*
+This function read bytes written in base64, up to the end of the string or a
+blank character
+input: string, buffer, size of the buffer
+return: number of bytes or -1 if the string is not valid
+*/
+int Base64Decode(const char* s, UNS8* buf, int max)
+{
+    int n = 0, bits = 0, pad = 0;
+    UNS32 v = 0;
+    const char* c;
+
+    for(; *s && *s != ' ' && *s != '\r' && *s != '\n'; s++)
+    {
+        if(*s == '=')
+        {
+            pad++;
+            continue;
+        }
+        if(pad || (c = strchr(Base64Chars, *s)) == NULL) return -1;
+        v = (v << 6) | (c - Base64Chars);
+        bits += 6;
+        if(bits >= 8)
+        {
+            bits -= 8;
+            if(n == max) return -1;
+            buf[n++] = (v >> bits) & 0xFF;
+        }
+    }
+    return pad > 2 ? -1 : n;
+}
+
+/*
+This function look for a value of a slave node object kept by the gateway,
+received in a PDO or read recently
+input: CO_Data structure of the bus, node identifier, index, subindex, pointer receiving the value
+return: 1 when the value is known, 0 otherwise
+*/
+int ReadGatewayImage(CO_Data* d, UNS8 nodeid, UNS16 index, UNS8 subindex, UNS32* data)
+{
+    return ShadowLookup(d, nodeid, index, subindex, data) || OdCacheLookup(d, nodeid, index, subindex, data);
+}
+
+/* Callback function of the read of a variable length value */
+void CheckReadBuffer(CO_Data* d, s_SDOREQ* req)
+{
+    char retbuf[NET_FRAME_MAX - 16];
+    int n;
+
+    if(req->result != SDO_FINISHED)
+    {
+        printf("\nResult : Failed in getting information for slave %2.2x, AbortCode :%4.4x \n", req->nodeid, req->abortCode);
+        sprintf(retbuf,"404 Error ssdo node %d with abort code: %x",req->nodeid,req->abortCode);
+    }
+    else
+    {
+        printf("\nResult : %d bytes\n", req->size);
+        if(req->context)
+        {
+            n = sprintf(retbuf,"000 ssdo node %d ok with %d bytes b64: ",req->nodeid,req->size);
+            Base64Encode(req->buffer, req->size, retbuf + n);
+        }
+        else
+        {
+            n = sprintf(retbuf,"000 ssdo node %d ok with %d bytes: ",req->nodeid,req->size);
+            HexEncode(req->buffer, req->size, retbuf + n);
+        }
+    }
+    SendReply(&req->rq, retbuf);
 }
 
 /* Read a slave node object dictionary entry */
-void ReadDeviceEntry(char* sdo)
+void ReadDeviceEntry(s_REQUESTER* rq, char* sdo)
 {
     int ret=0;
     int nodeid;
     int index;
     int subindex;
-    int datatype = 0;
+    UNS32 value;
     char retbuf[100];
+    char format[4];
+    s_SDOREQ* req;
 
-    ret = sscanf(sdo, "rsdo#%2x,%4x,%2x", &nodeid, &index, &subindex);
-    if (ret == 3)
+    /* A format (x: hexadecimal, b64: base64) ask for a variable length value */
+    ret = sscanf(sdo, "rsdo#%2x,%4x,%2x,%3s", &nodeid, &index, &subindex, format);
+    if (ret == 4 && strcmp(format,"x") && strcmp(format,"b64")) ret = 0;
+    if (ret == 4 && ((req = SdoAlloc()) == NULL || SdoAllocBuffer(req) < 0))
+    {
+        if(req != NULL) SdoRelease(req);
+        sprintf(retbuf,"404 rsdo node %d gateway busy",nodeid);
+        SendReply(rq, retbuf);
+    }
+    else if (ret == 4)
+    {
+        req->type = SDO_READ;
+        req->nodeid = (UNS8)nodeid;
+        req->index = (UNS16)index;
+        req->subindex = (UNS8)subindex;
+        req->rq = *rq;
+        req->context = format[0] == 'b' ? req : NULL;
+        req->done = CheckReadBuffer;
+        if(SdoSubmit(CANOpenShellOD_Data, req) < 0)
+        {
+            sprintf(retbuf,"404 rsdo invalid node %d",nodeid);
+            SendReply(rq, retbuf);
+        }
+    }
+    else if (ret == 3 && ReadGatewayImage(CANOpenShellOD_Data, (UNS8)nodeid, (UNS16)index, (UNS8)subindex, &value))
+    {
+        /* Answered from memory without using the bus */
+        sprintf(retbuf,"000 ssdo node %d ok with result: %x ",nodeid,value);
+        SendReply(rq, retbuf);
+    }
+    else if (ret == 3 && (req = SdoAlloc()) == NULL)
+    {
+        sprintf(retbuf,"404 rsdo node %d gateway busy",nodeid);
+        SendReply(rq, retbuf);
+    }
+    else if (ret == 3)
     {
 
         printf("##################################\n");
@@ -310,44 +759,98 @@ void ReadDeviceEntry(char* sdo)
         printf("Index    : %4.4x\n", index);
         printf("SubIndex : %2.2x\n", subindex);
 
-        readNetworkDictCallback(CANOpenShellOD_Data, (UNS8)nodeid, (UNS16)index, (UNS8)subindex, (UNS8)datatype, CheckReadSDO);
+        /* The transfer is queued behind the pending transfers with this node */
+        req->type = SDO_READ;
+        req->nodeid = (UNS8)nodeid;
+        req->index = (UNS16)index;
+        req->subindex = (UNS8)subindex;
+        req->rq = *rq;
+        req->done = CheckReadSDO;
+        if(SdoSubmit(CANOpenShellOD_Data, req) < 0)
+        {
+            sprintf(retbuf,"404 rsdo invalid node %d",nodeid);
+            SendReply(rq, retbuf);
+        }
     }
     else
         {
             printf("Wrong command  : %s\n", sdo);
             strcpy(retbuf,"404");
             sprintf(retbuf,"%s wrong command sent",retbuf);
+            SendReply(rq, retbuf);
         }
 }
 
 /* Callback function that check the write SDO demand */
-void CheckWriteSDO(CO_Data* d, UNS8 nodeid)
+void CheckWriteSDO(CO_Data* d, s_SDOREQ* req)
 {
-    UNS32 abortCode;
+    UNS8 nodeid = req->nodeid;
+    UNS32 abortCode = req->abortCode;
     char retbuf[100];
+    s_REQUESTER* rq = &req->rq;
 
-    if(getWriteResultNetworkDict(CANOpenShellOD_Data, nodeid, &abortCode) != SDO_FINISHED)
+    if(req->result != SDO_FINISHED)
     {
         printf("\nResult : Failed in getting information for slave %2.2x, AbortCode :%4.4x \n", nodeid, abortCode);
         strcpy(retbuf,"404");
         sprintf(retbuf,"%s Error wsdo node %d with abort code %x",retbuf,nodeid,abortCode);
-        sendData(gstaticSocketCanGateway, retbuf);
+        SendReply(rq, retbuf);
     }
     else
     {
+        OdCacheInvalidate(d, nodeid, req->index, req->subindex);
         printf("\nSend data OK\n");
         strcpy(retbuf,"000");
         sprintf(retbuf,"%s wsdo node %d ok",retbuf,nodeid);
-        sendData(gstaticSocketCanGateway, retbuf);
+        SendReply(rq, retbuf);
     }
+}
 
+/*
+This function write a variable length value given in hexadecimal or in base64
+input: requester, node identifier, index, subindex, size in bytes (-1: base64), value
+*/
+void WriteDeviceBuffer(s_REQUESTER* rq, int nodeid, int index, int subindex, int size, char* value)
+{
+    int n;
+    char retbuf[100];
+    s_SDOREQ* req;
 
-    /* Finalize last SDO transfer with this node */
-    closeSDOtransfer(CANOpenShellOD_Data, nodeid, SDO_CLIENT);
+    if((req = SdoAlloc()) == NULL || SdoAllocBuffer(req) < 0)
+    {
+        if(req != NULL) SdoRelease(req);
+        sprintf(retbuf,"404 wsdo node %d gateway busy",nodeid);
+        SendReply(rq, retbuf);
+        return;
+    }
+
+    n = size < 0 ? Base64Decode(value, req->buffer, SDO_DATA_MAX) : HexDecode(value, req->buffer, SDO_DATA_MAX);
+    if(n <= 0 || (size >= 0 && n != size))
+    {
+        SdoRelease(req);
+        sprintf(retbuf,"404 wsdo node %d invalid data",nodeid);
+        SendReply(rq, retbuf);
+        return;
+    }
+
+    /* The transfer is queued behind the pending transfers with this node */
+    req->type = SDO_WRITE;
+    req->nodeid = (UNS8)nodeid;
+    req->index = (UNS16)index;
+    req->subindex = (UNS8)subindex;
+    req->size = n;
+    req->rq = *rq;
+    req->done = CheckWriteSDO;
+    OdCacheInvalidate(CANOpenShellOD_Data, req->nodeid, req->index, req->subindex);
+    if(SdoSubmit(CANOpenShellOD_Data, req) < 0)
+    {
+        sprintf(retbuf,"404 wsdo invalid node %d",nodeid);
+        SendReply(rq, retbuf);
+    }
 }
 
 /* Write a slave node object dictionnary entry */
-void WriteDeviceEntry(char* sdo)
+void WriteDeviceEntry(s_REQUESTER* rq, char* sdo)
 {
     int ret=0;
     int nodeid;
@@ -355,10 +858,25 @@ void WriteDeviceEntry(char* sdo)
     int subindex;
     int size;
     int data;
+    int pos=0;
     char retbuf[100];
+    s_SDOREQ* req;
 
-    ret = sscanf(sdo, "wsdo#%2x,%4x,%2x,%2x,%x", &nodeid , &index, &subindex, &size, &data);
-    if (ret == 5)
+    /* Values of more than 4 bytes are given in hexadecimal after their size, or in base64 */
+    if (sscanf(sdo, "wsdo#%2x,%4x,%2x,b64,%n", &nodeid, &index, &subindex, &pos) == 3 && pos > 0)
+    {
+        WriteDeviceBuffer(rq, nodeid, index, subindex, -1, sdo + pos);
+        return;
+    }
+    ret = sscanf(sdo, "wsdo#%2x,%4x,%2x,%x,%n%x", &nodeid , &index, &subindex, &size, &pos, &data);
+    if (ret == 5 && size > 4 && size <= SDO_DATA_MAX)
+        WriteDeviceBuffer(rq, nodeid, index, subindex, size, sdo + pos);
+    else if (ret == 5 && size >= 1 && size <= 4 && (req = SdoAlloc()) == NULL)
+    {
+        sprintf(retbuf,"404 wsdo node %d gateway busy",nodeid);
+        SendReply(rq, retbuf);
+    }
+    else if (ret == 5 && size >= 1 && size <= 4)
     {
         printf("##################################\n");
         printf("#### Write SDO                ####\n");
@@ -369,21 +887,729 @@ void WriteDeviceEntry(char* sdo)
         printf("Size     : %2.2x\n", size);
         printf("Data     : %x\n", data);
 
-        writeNetworkDictCallBack(CANOpenShellOD_Data, nodeid, index, subindex, size, 0, &data, CheckWriteSDO);
+        /* The transfer is queued behind the pending transfers with this node */
+        req->type = SDO_WRITE;
+        req->nodeid = (UNS8)nodeid;
+        req->index = (UNS16)index;
+        req->subindex = (UNS8)subindex;
+        req->size = size;
+        req->data = data;
+        req->rq = *rq;
+        req->done = CheckWriteSDO;
+        /* A read queued behind this write must not be answered with the old value */
+        OdCacheInvalidate(CANOpenShellOD_Data, req->nodeid, req->index, req->subindex);
+        if(SdoSubmit(CANOpenShellOD_Data, req) < 0)
+        {
+            sprintf(retbuf,"404 wsdo invalid node %d",nodeid);
+            SendReply(rq, retbuf);
+        }
+    }
+    else
+    {
+        printf("Wrong command  : %s\n", sdo);
+        strcpy(retbuf,"404");
+        sprintf(retbuf,"%s wrong command sent",retbuf);
+        SendReply(rq, retbuf);
+
+    }
+}
+
+/*
+This function start the download of a file sent by the host after the reply
+input: requester, command string "dl#nodeid,index,subindex,size"
+*/
+void DownloadEntry(s_REQUESTER* rq, char* command)
+{
+    int nodeid, index, subindex, size;
+    char retbuf[80];
+    s_SESSION* s = FindSession(rq->session);
+
+    if(sscanf(command, "dl#%2x,%4x,%2x,%x", &nodeid, &index, &subindex, &size) != 4 || size <= 0)
+    {
+        printf("Wrong command  : %s\n", command);
+        sprintf(retbuf,"404 wrong command sent");
+    }
+    /* The file is delimited by the frames only */
+    else if(s == NULL || s->mode != NET_FRAMED)
+        sprintf(retbuf,"404 dl node %d require the framed protocol",nodeid);
+    else if(DlExpected(rq->session))
+        sprintf(retbuf,"404 dl node %d a file is being received",nodeid);
+    else
+    {
+        switch(DlStart(CANOpenShellOD_Data, rq, (UNS8)nodeid, (UNS16)index, (UNS8)subindex, (UNS32)size))
+        {
+        case 0:
+            OdCacheInvalidate(CANOpenShellOD_Data, (UNS8)nodeid, (UNS16)index, (UNS8)subindex);
+            sprintf(retbuf,"000 dl node %d ready for %d bytes",nodeid,size);
+            break;
+        case -1:
+            sprintf(retbuf,"404 dl invalid node %d",nodeid);
+            break;
+        default:
+            sprintf(retbuf,"404 dl node %d gateway busy",nodeid);
+        }
+    }
+    SendReply(rq, retbuf);
+}
+
+/*
+Batch of SDO transfers requested by one bsdo# command.
+All the transfers are queued at once, the scheduler run them concurrently on
+different nodes and in order on each node. One reply is sent when all are completed.
+*/
+typedef struct s_BATCH s_BATCH;
+
+typedef struct
+{
+    UNS8 type;              /* SDO_READ or SDO_WRITE */
+    UNS8 nodeid;
+    UNS16 index;
+    UNS8 subindex;
+    UNS32 size;             /* bytes to write */
+    UNS32 data;             /* value to write, value read */
+    UNS8 result;            /* SDO_FINISHED when the transfer succeeded */
+    UNS32 abortCode;
+    s_BATCH* batch;
+} s_BATCHITEM;
+
+struct s_BATCH
+{
+    int used;
+    int count;              /* number of items */
+    int remaining;          /* items not completed yet */
+    s_REQUESTER rq;
+    s_BATCHITEM items[BSDO_MAX_ITEMS];
+};
+
+static s_BATCH gstaticBatches[MAX_BATCHES];
+
+/*
+This function send the aggregated reply of a batch and release it
+input: batch
+*/
+void SendBatchReply(s_BATCH* b)
+{
+    char retbuf[NET_FRAME_MAX - 16];
+    int i, n, failed = 0;
+    s_BATCHITEM* it;
+
+    for(i=0; i<b->count; i++) if(b->items[i].result != SDO_FINISHED) failed++;
+
+    n = sprintf(retbuf, "%s bsdo %d ok %d failed", failed ? "404" : "000", b->count - failed, failed);
+    for(i=0; i<b->count && n < (int)sizeof retbuf - 32; i++)
+    {
+        it = &b->items[i];
+        n += sprintf(retbuf + n, "%c%c%x,%4.4x,%2.2x", i ? ';' : ':', it->type == SDO_READ ? 'r' : 'w',
+                     it->nodeid, it->index, it->subindex);
+        if(it->result != SDO_FINISHED)
+            n += sprintf(retbuf + n, "!%x", it->abortCode);
+        else if(it->type == SDO_READ)
+            n += sprintf(retbuf + n, "=%x", it->data);
+        else
+            n += sprintf(retbuf + n, "=ok");
+    }
+    SendReply(&b->rq, retbuf);
+    b->used = 0;
+}
+
+/* Callback function of the transfers of a batch */
+void CheckBatchSDO(CO_Data* d, s_SDOREQ* req)
+{
+    s_BATCHITEM* it = req->context;
+
+    it->result = req->result;
+    it->data = req->data;
+    it->abortCode = req->abortCode;
+    if(req->result == SDO_FINISHED && req->type == SDO_WRITE)
+        OdCacheInvalidate(d, req->nodeid, req->index, req->subindex);
+    else if(req->result == SDO_FINISHED && !SdoWritePending(d, req->nodeid, req->index, req->subindex))
+        OdCacheStore(d, req->nodeid, req->index, req->subindex, req->data);
+    if(--it->batch->remaining == 0) SendBatchReply(it->batch);
+}
+
+/*
+Read and write several slave node object dictionary entries with one command
+command: bsdo#r<nodeid>,<index>,<subindex>;w<nodeid>,<index>,<subindex>,<size>,<data>;...
+*/
+void BatchDeviceEntries(s_REQUESTER* rq, char* command)
+{
+    int i, ret, nodeid, index, subindex, size, data;
+    char* op;
+    char retbuf[100];
+    s_BATCH* b;
+    s_BATCHITEM* it;
+    s_SDOREQ* req;
+
+    if(strlen(command) <= 5)
+    {
+        sprintf(retbuf,"404 wrong command sent");
+        SendReply(rq, retbuf);
+        return;
+    }
+
+    for(i=0; i<MAX_BATCHES && gstaticBatches[i].used; i++) {}
+    if(i == MAX_BATCHES)
+    {
+        sprintf(retbuf,"404 bsdo gateway busy");
+        SendReply(rq, retbuf);
+        return;
+    }
+    b = &gstaticBatches[i];
+    b->count = 0;
+    b->rq = *rq;
+
+    /* Parse every operation before starting any transfer */
+    for(op = strtok(command + 5, ";\r\n"); op != NULL; op = strtok(NULL, ";\r\n"))
+    {
+        if(b->count == BSDO_MAX_ITEMS) break;
+        it = &b->items[b->count];
+        it->batch = b;
+        it->result = 0;
+        it->abortCode = 0;
+        it->data = 0;
+        size = 0;
+        data = 0;
+        if(op[0] == 'r')
+        {
+            ret = sscanf(op + 1, "%2x,%4x,%2x", &nodeid, &index, &subindex);
+            it->type = SDO_READ;
+            if(ret != 3) break;
+        }
+        else if(op[0] == 'w')
+        {
+            ret = sscanf(op + 1, "%2x,%4x,%2x,%2x,%x", &nodeid, &index, &subindex, &size, &data);
+            it->type = SDO_WRITE;
+            if(ret != 5 || size < 1 || size > 4) break;
+        }
+        else break;
+        it->nodeid = (UNS8)nodeid;
+        it->index = (UNS16)index;
+        it->subindex = (UNS8)subindex;
+        it->size = size;
+        it->data = data;
+        b->count++;
+    }
+
+    if(op != NULL || b->count == 0)
+    {
+        printf("Wrong command  : %s\n", command);
+        sprintf(retbuf,"404 wrong bsdo operation %d",b->count + 1);
+        SendReply(rq, retbuf);
+        return;
+    }
+
+    /* The batch is completed when the last transfer completes, not while it is being queued */
+    b->used = 1;
+    b->remaining = b->count + 1;
+    for(i=0; i<b->count; i++)
+    {
+        it = &b->items[i];
+        if(it->type == SDO_READ && ReadGatewayImage(CANOpenShellOD_Data, it->nodeid, it->index, it->subindex, &it->data))
+        {
+            it->result = SDO_FINISHED;
+            b->remaining--;
+            continue;
+        }
+        if(it->type == SDO_WRITE) OdCacheInvalidate(CANOpenShellOD_Data, it->nodeid, it->index, it->subindex);
+        if((req = SdoAlloc()) == NULL)
+        {
+            it->result = SDO_ABORTED_INTERNAL;
+            b->remaining--;
+            continue;
+        }
+        req->type = it->type;
+        req->nodeid = it->nodeid;
+        req->index = it->index;
+        req->subindex = it->subindex;
+        req->size = it->size;
+        req->data = it->data;
+        req->rq = *rq;
+        req->context = it;
+        req->done = CheckBatchSDO;
+        if(SdoSubmit(CANOpenShellOD_Data, req) < 0)
+        {
+            it->result = SDO_ABORTED_INTERNAL;
+            b->remaining--;
+        }
+    }
+    if(--b->remaining == 0) SendBatchReply(b);
+}
+
+/*
+Configure and query the object dictionary read cache
+command: cach#stat, cach#ttl,<first index>,<last index>,<milliseconds>, cach#flush[,<nodeid>]
+*/
+void CacheCommand(s_REQUESTER* rq, char* command)
+{
+    int first, last, ttl, nodeid = 0, entries;
+    unsigned long hits, misses;
+    char retbuf[100];
+
+    if(!strncmp(command + 5, "stat", 4))
+    {
+        OdCacheStats(&hits, &misses, &entries);
+        sprintf(retbuf,"000 cach hits %lu misses %lu entries %d",hits,misses,entries);
+    }
+    else if(sscanf(command, "cach#ttl,%4x,%4x,%d", &first, &last, &ttl) == 3 && first <= last && ttl >= 0)
+    {
+        if(OdCacheSetTTL((UNS16)first, (UNS16)last, (UNS32)ttl) < 0)
+            sprintf(retbuf,"404 cach too many ranges");
+        else
+            sprintf(retbuf,"000 cach %4.4x-%4.4x ttl %d ms",first,last,ttl);
+    }
+    else if(!strncmp(command + 5, "flush", 5))
+    {
+        /* Without node, the values of all the buses are forgotten */
+        sscanf(command, "cach#flush,%2x", &nodeid);
+        OdCacheFlushNode(nodeid ? CANOpenShellOD_Data : NULL, (UNS8)nodeid);
+        sprintf(retbuf,"000 cach flushed");
+    }
+    else
+    {
+        printf("Wrong command  : %s\n", command);
+        sprintf(retbuf,"404 wrong command sent");
+    }
+    SendReply(rq, retbuf);
+}
+
+/*
+Map objects of a slave node in a transmit PDO and keep their values in the shadow image
+command: pdom#<nodeid>,<pdo 1-4>,<transmission type>[,<index>:<subindex>:<size>...]
+*/
+void MapDevicePDO(s_REQUESTER* rq, char* command)
+{
+    int ret, n = 0, nodeid, pdo, transtype, index, subindex, size, count = 0;
+    UNS16 indexes[SHADOW_MAX_OBJECTS];
+    UNS8 subindexes[SHADOW_MAX_OBJECTS];
+    UNS8 sizes[SHADOW_MAX_OBJECTS];
+    char* obj;
+    char retbuf[100];
+
+    ret = sscanf(command, "pdom#%2x,%x,%2x%n", &nodeid, &pdo, &transtype, &n);
+    for(obj = ret == 3 ? strtok(command + n, ",\r\n") : NULL; obj != NULL; obj = strtok(NULL, ",\r\n"))
+    {
+        if(count == SHADOW_MAX_OBJECTS || sscanf(obj, "%4x:%2x:%2x", &index, &subindex, &size) != 3)
+        {
+            ret = 0;
+            break;
+        }
+        indexes[count] = (UNS16)index;
+        subindexes[count] = (UNS8)subindex;
+        sizes[count] = (UNS8)size;
+        count++;
+    }
+
+    if(ret != 3)
+    {
+        printf("Wrong command  : %s\n", command);
+        sprintf(retbuf,"404 wrong command sent");
+        SendReply(rq, retbuf);
+        return;
+    }
+
+    ret = ShadowConfigure(CANOpenShellOD_Data, rq, (UNS8)nodeid, (UNS8)pdo, (UNS8)transtype, count,
+                          indexes, subindexes, sizes);
+    if(ret == -1)
+    {
+        sprintf(retbuf,"404 pdom invalid mapping for node %d",nodeid);
+        SendReply(rq, retbuf);
+    }
+    else if(ret == -2)
+    {
+        sprintf(retbuf,"404 pdom node %d gateway busy",nodeid);
+        SendReply(rq, retbuf);
+    }
+}
+
+/*
+Subscribe to the changes of a slave node object or cancel the subscription
+command: subscribe#<nodeid>,<index>,<subindex>[,<minimum change>[,<maximum rate>]], unsubscribe#<nodeid>,<index>,<subindex>
+*/
+void SubscribeEntry(s_REQUESTER* rq, char* command)
+{
+    int ret, nodeid, index, subindex, mindelta = 0, maxrate = 0;
+    char* args = strchr(command, '#');
+    char retbuf[100];
+
+    ret = args ? sscanf(args, "#%2x,%4x,%2x,%x,%d", &nodeid, &index, &subindex, &mindelta, &maxrate) : 0;
+    if(ret < 3 || maxrate < 0)
+    {
+        printf("Wrong command  : %s\n", command);
+        sprintf(retbuf,"404 wrong command sent");
+    }
+    else if(command[0] == 'u')
+    {
+        if(SubsRemove(CANOpenShellOD_Data, rq->session, (UNS8)nodeid, (UNS16)index, (UNS8)subindex) < 0)
+            sprintf(retbuf,"404 subs node %d %4.4x,%2.2x not subscribed",nodeid,index,subindex);
+        else
+            sprintf(retbuf,"000 subs node %d %4.4x,%2.2x unsubscribed",nodeid,index,subindex);
+    }
+    else
+    {
+        /* The module reply, then send the values */
+        ret = SubsAdd(CANOpenShellOD_Data, rq, (UNS8)nodeid, (UNS16)index, (UNS8)subindex, (UNS32)mindelta, (UNS32)maxrate);
+        if(ret == 0) return;
+        if(ret == -1) sprintf(retbuf,"404 subs invalid node %d",nodeid);
+        else sprintf(retbuf,"404 subs node %d gateway busy",nodeid);
+    }
+    SendReply(rq, retbuf);
+}
+
+/*
+Move a CiA 402 drive in profile position mode or halt it, the reply is sent
+when the drive has acknowledged the set-point or stand still
+command: move#<nodeid>,<position>,<velocity>[,r], halt#<nodeid>
+*/
+void MotionCommand(s_REQUESTER* rq, char* command)
+{
+    int ret, nodeid, position, velocity;
+    char relative = 0;
+    char retbuf[100];
+
+    if(command[0] == 'h')
+        ret = sscanf(command, "halt#%2x", &nodeid) == 1 ? MotionHalt(CANOpenShellOD_Data, rq, (UNS8)nodeid) : 1;
+    else if(sscanf(command, "move#%2x,%x,%x,%c", &nodeid, &position, &velocity, &relative) >= 3 &&
+            (relative == 0 || relative == 'r'))
+        ret = MotionMove(CANOpenShellOD_Data, rq, (UNS8)nodeid, (UNS32)position, (UNS32)velocity, relative == 'r');
+    else
+        ret = 1;
+
+    if(ret == 0) return;
+    if(ret == 1)
+    {
+        printf("Wrong command  : %s\n", command);
+        sprintf(retbuf,"404 wrong command sent");
+    }
+    else if(ret == -1)
+        sprintf(retbuf,"404 %.4s invalid node %d",command,nodeid);
+    else
+        sprintf(retbuf,"404 %.4s node %d busy",command,nodeid);
+    SendReply(rq, retbuf);
+}
+
+/*
+This function check or queue the set-points of a strm#sp command, the
+set-points of a node are a group and the groups are separated by ';'.
+A node has one group at most: the room of its stream is checked for the group.
+input: set-points (nodeid,position[:velocity],...[;nodeid,...]), 1 to queue them,
+pointer receiving the node of the last group
+return: number of set-points, -1 if the syntax is wrong, -2 if a node has
+no stream, -3 if a stream has not enough room or -4 if a node has two groups
+*/
+int StreamSetpoints(char* p, int push, int* nodeid)
+{
+    int total = 0, count, n, position, velocity, room;
+    UNS8 seen[MAX_NODES + 1];
+
+    memset(seen, 0, sizeof seen);
+    while(1)
+    {
+        if(sscanf(p, "%2x%n", nodeid, &n) != 1) return -1;
+        if(*nodeid > MAX_NODES) return -2;
+        if(seen[*nodeid]++) return -4;
+        p += n;
+        for(count = 0; *p == ','; count++)
+        {
+            velocity = 0;
+            if(sscanf(p, ",%x%n", &position, &n) != 1) return -1;
+            p += n;
+            if(*p == ':' && sscanf(p, ":%x%n", &velocity, &n) == 1) p += n;
+            if(push && StrmPush(CANOpenShellOD_Data, (UNS8)*nodeid, (UNS32)position, (UNS32)velocity) < 0) return -3;
+        }
+        if(count == 0) return -1;
+        if(!push && (room = StrmRoom(CANOpenShellOD_Data, (UNS8)*nodeid)) < count) return room < 0 ? -2 : -3;
+        total += count;
+        if(*p != ';') break;
+        p++;
+    }
+    if(*p != 0 && *p != '\r' && *p != '\n') return -1;
+    return total;
+}
+
+/*
+Stream the set-points of drives, one set-point per node is sent in its receive PDO after each SYNC
+command: strm#sync,<period in us>, strm#open,<nodeid>,<rpdo>,<size>, strm#sp,<nodeid>,<position>[:<velocity>]...[;<nodeid>...],
+strm#close,<nodeid>, strm#stat
+*/
+void StreamCommand(s_REQUESTER* rq, char* command)
+{
+    int ret, nodeid, pdo, size, period;
+    char retbuf[1000];
+
+    if(!strncmp(command + 5, "sp,", 3))
+    {
+        /* All the set-points are checked first: the axes stay in step */
+        if((ret = StreamSetpoints(command + 8, 0, &nodeid)) > 0)
+            StreamSetpoints(command + 8, 1, &nodeid);
+        if(ret > 0)
+            sprintf(retbuf,"000 strm queued %d room %d",ret,StrmRoom(CANOpenShellOD_Data, (UNS8)nodeid));
+        else if(ret == -2)
+            sprintf(retbuf,"404 strm node %d not opened",nodeid);
+        else if(ret == -3)
+            sprintf(retbuf,"404 strm node %d full, nothing queued",nodeid);
+        else if(ret == -4)
+            sprintf(retbuf,"404 strm node %d given twice, nothing queued",nodeid);
+        else
+            sprintf(retbuf,"404 wrong command sent");
+    }
+    else if(sscanf(command, "strm#sync,%d", &period) == 1 && period >= 0)
+    {
+        if(StrmSetSync(CANOpenShellOD_Data, (UNS32)period) < 0)
+            sprintf(retbuf,"404 strm sync period %d us refused",period);
+        else
+            sprintf(retbuf,"000 strm sync period %d us",period);
+    }
+    else if(sscanf(command, "strm#open,%2x,%x,%x", &nodeid, &pdo, &size) == 3)
+    {
+        ret = StrmOpen(CANOpenShellOD_Data, rq->session, (UNS8)nodeid, (UNS8)pdo, (UNS8)size);
+        if(ret == -1) sprintf(retbuf,"404 strm invalid stream for node %d",nodeid);
+        else if(ret == -2) sprintf(retbuf,"404 strm node %d gateway busy",nodeid);
+        else sprintf(retbuf,"000 strm node %d opened, room %d",nodeid,STRM_DEPTH);
+    }
+    else if(sscanf(command, "strm#close,%2x", &nodeid) == 1)
+    {
+        if(StrmClose(CANOpenShellOD_Data, (UNS8)nodeid) < 0)
+            sprintf(retbuf,"404 strm node %d not opened",nodeid);
+        else
+            sprintf(retbuf,"000 strm node %d closed",nodeid);
+    }
+    else if(!strncmp(command + 5, "stat", 4))
+    {
+        strcpy(retbuf, "000 strm ");
+        StrmStats(CANOpenShellOD_Data, retbuf + 9, sizeof retbuf - 9);
+    }
+    else
+    {
+        printf("Wrong command  : %s\n", command);
+        sprintf(retbuf,"404 wrong command sent");
+    }
+    SendReply(rq, retbuf);
+}
+
+/*
+Real-time profile of the CAN threads and jitter self-test of the stack timer
+command: rt#stat, rt#test,<period in us>,<cycles>
+*/
+void RtCommand(s_REQUESTER* rq, char* command)
+{
+    int ret, period, count;
+    char retbuf[300];
+
+    if(sscanf(command, "rt#test,%d,%d", &period, &count) == 2)
+    {
+        ret = period > 0 ? RtTest(CANOpenShellOD_Data, rq, (UNS32)period, count) : -1;
+        if(ret == 0) return;    /* replied when the test is completed */
+        if(ret == -1) sprintf(retbuf,"404 rt test needs a period and 1 to %d cycles",RT_TEST_MAX);
+        else sprintf(retbuf,"404 rt test already running");
+    }
+    else if(!strncmp(command + 3, "stat", 4))
+    {
+        strcpy(retbuf, "000 rt ");
+        RtStats(retbuf + 7, sizeof retbuf - 7);
+    }
+    else
+    {
+        printf("Wrong command  : %s\n", command);
+        sprintf(retbuf,"404 wrong command sent");
+    }
+    SendReply(rq, retbuf);
+}
+
+/*
+Raw frame tunnel of the session, the frames are exchanged in binary batches (tunnel.h)
+command: raw#open,<flush ms>[,<id>[:<mask>]...], raw#close, raw#stat
+*/
+void RawCommand(s_REQUESTER* rq, char* command)
+{
+    s_SESSION* s = FindSession(rq->session);
+    UNS16 id[TUN_MAX_FILTERS], mask[TUN_MAX_FILTERS];
+    int ret, flush, n;
+    unsigned int i, m;
+    char retbuf[300];
+    char* p;
+
+    if(sscanf(command, "raw#open,%d", &flush) == 1 && flush >= 0)
+    {
+        /* Filters: identifier and mask in hex, the mask is 7FF by default */
+        strtok(command + 9, ",\r\n");
+        for(n=0, ret=0; ret == 0 && (p = strtok(NULL, ",\r\n")) != NULL; n++)
+        {
+            m = 0x7FF;
+            if(n == TUN_MAX_FILTERS || sscanf(p, "%x:%x", &i, &m) < 1) ret = -1;
+            else
+            {
+                id[n] = (UNS16)i;
+                mask[n] = (UNS16)m;
+            }
+        }
+        if(s == NULL || s->mode != NET_FRAMED)
+            sprintf(retbuf,"404 raw needs the framed protocol (prot#frame)");
+        else if(ret < 0 || (ret = TunOpen(CANOpenShellOD_Data, rq->session, (UNS32)flush, n, id, mask)) == -1)
+            sprintf(retbuf,"404 raw invalid flush interval or filters");
+        else if(ret == -2)
+            sprintf(retbuf,"404 raw tunnel already open or gateway busy");
+        else
+            sprintf(retbuf,"000 raw open flush %d ms filters %d",flush,n);
+    }
+    else if(!strncmp(command + 4, "close", 5))
+    {
+        if(TunClose(rq->session) < 0) sprintf(retbuf,"404 raw no tunnel");
+        else sprintf(retbuf,"000 raw closed");
+    }
+    else if(!strncmp(command + 4, "stat", 4))
+    {
+        strcpy(retbuf, "000 raw ");
+        if(TunStats(rq->session, retbuf + 8, sizeof retbuf - 40) < 0) sprintf(retbuf,"404 raw no tunnel");
+        else sprintf(retbuf + strlen(retbuf),", lost %lu",s ? __atomic_load_n(&s->lost, __ATOMIC_RELAXED) : 0UL);
+    }
+    else
+    {
+        printf("Wrong command  : %s\n", command);
+        sprintf(retbuf,"404 wrong command sent");
+    }
+    SendReply(rq, retbuf);
+}
+
+/*
+Counters of the built-in SocketCAN driver on the current bus
+command: can#stat
+*/
+void CanCommand(s_REQUESTER* rq, char* command)
+{
+    char retbuf[200];
+
+    if(strncmp(command + 4, "stat", 4))
+    {
+        printf("Wrong command  : %s\n", command);
+        sprintf(retbuf,"404 wrong command sent");
+    }
+    else if(SockCanStats(BusIndex(CANOpenShellOD_Data), retbuf + 8, sizeof retbuf - 8) < 0)
+        sprintf(retbuf,"404 can bus not served by %s",SOCKCAN_LIBRARY);
+    else
+        memcpy(retbuf, "000 can ", 8);
+    SendReply(rq, retbuf);
+}
+
+/*
+Bus trace recorder, the frames are recorded in a ring mapped from a file (trace.h)
+command: trace#start[,<records>[,<file>]], trace#stop, trace#dump[,<count>], trace#stat
+*/
+void TraceCommand(s_REQUESTER* rq, char* command)
+{
+    unsigned int records = TRC_RECORDS;
+    int ret, i, n, count = 20;
+    char path[256] = TRC_FILE;
+    char retbuf[300];
+    s_TRCRECORD* r;
+
+    if(!strncmp(command + 6, "start", 5))
+    {
+        sscanf(command + 11, ",%u,%255[^\r\n]", &records, path);
+        if((ret = TrcStart(path, records)) == -1)
+            sprintf(retbuf,"404 trace needs 1 to %d records",TRC_MAX_RECORDS);
+        else if(ret == -2)
+            sprintf(retbuf,"404 trace already running");
+        else if(ret < 0)
+            sprintf(retbuf,"404 trace cannot create the file");
+        else
+            sprintf(retbuf,"000 trace started %u records",records);
+    }
+    else if(!strncmp(command + 6, "stop", 4))
+    {
+        if(TrcStop() < 0) sprintf(retbuf,"404 trace not running");
+        else sprintf(retbuf,"000 trace stopped");
+    }
+    else if(!strncmp(command + 6, "dump", 4))
+    {
+        /* The last frames, oldest first, one reply each */
+        sscanf(command + 10, ",%d", &count);
+        if(count < 1 || count > TRC_DUMP_MAX) count = TRC_DUMP_MAX;
+        for(i=count-1, ret=0; i>=0; i--)
+        {
+            if((r = TrcFrameAt((UNS32)i)) == NULL) continue;
+            sprintf(retbuf,"000 trace %lu.%06lu %d %s %03x%s %d",(unsigned long)r->sec,
+                    (unsigned long)r->nsec / 1000,r->bus,r->cobid & TRC_TX ? "tx" : "rx",
+                    r->cobid & 0x7FF,r->cobid & TRC_RTR ? " r" : "",r->len);
+            if(r->len) strcat(retbuf, " ");
+            for(n=0; n<r->len; n++) sprintf(retbuf + strlen(retbuf), "%02x", r->data[n]);
+            SendReply(rq, retbuf);
+            ret++;
+        }
+        sprintf(retbuf,"000 trace dump %d frames",ret);
+    }
+    else if(!strncmp(command + 6, "stat", 4))
+    {
+        strcpy(retbuf, "000 trace ");
+        if(TrcStats(retbuf + 10, sizeof retbuf - 10) < 0) sprintf(retbuf,"404 trace not started");
+    }
+    else
+    {
+        printf("Wrong command  : %s\n", command);
+        sprintf(retbuf,"404 wrong command sent");
+    }
+    SendReply(rq, retbuf);
+}
+
+/*
+Virtual slaves of the current bus when it is simulated (simbus.h)
+command: sim#stat, sim#lat,<us>, sim#on,<nodeid>, sim#off,<nodeid>,
+sim#set,<nodeid>,<index>,<subindex>,<value>
+*/
+void SimCommand(s_REQUESTER* rq, char* command)
+{
+    int ret, bus = BusIndex(CANOpenShellOD_Data);
+    unsigned int nodeid, index, subindex, value;
+    char retbuf[300];
+
+    if(sscanf(command, "sim#set,%2x,%4x,%2x,%x", &nodeid, &index, &subindex, &value) == 4)
+    {
+        if((ret = SimSet(bus, (UNS8)nodeid, (UNS16)index, (UNS8)subindex, (UNS32)value)) == -2)
+            sprintf(retbuf,"404 sim node %x not simulated",nodeid);
+        else if(ret == -3)
+            sprintf(retbuf,"404 sim no entry %4.4x,%2.2x",index,subindex);
+        else
+            sprintf(retbuf,"000 sim %4.4x,%2.2x set to %x",index,subindex,value);
+    }
+    else if(sscanf(command, "sim#lat,%u", &value) == 1)
+    {
+        ret = SimLatency(bus, (UNS32)value);
+        sprintf(retbuf,"000 sim latency %u us",value);
+    }
+    else if(sscanf(command, "sim#on,%2x", &nodeid) == 1 || sscanf(command, "sim#off,%2x", &nodeid) == 1)
+    {
+        if((ret = SimPower(bus, (UNS8)nodeid, command[5] == 'n')) == -2)
+            sprintf(retbuf,"404 sim node %x not simulated",nodeid);
+        else
+            sprintf(retbuf,"000 sim node %x %s",nodeid,command[5] == 'n' ? "on" : "off");
+    }
+    else if(!strncmp(command + 4, "stat", 4))
+    {
+        strcpy(retbuf, "000 sim ");
+        ret = SimStats(bus, retbuf + 8, sizeof retbuf - 8);
     }
     else
     {
-        printf("Wrong command  : %s\n", sdo);
-        strcpy(retbuf,"404");
-        sprintf(retbuf,"%s wrong command sent",retbuf);
-        sendData(gstaticSocketCanGateway, retbuf);
-
+        printf("Wrong command  : %s\n", command);
+        sprintf(retbuf,"404 wrong command sent");
+        ret = 0;
     }
+    if(ret == -1) sprintf(retbuf,"404 sim bus not served by %s",SIM_LIBRARY);
+    SendReply(rq, retbuf);
 }
 
 void CANOpenShellOD_post_SlaveBootup(CO_Data* d, UNS8 nodeid)
 {
     printf("Slave %x boot up\n", nodeid);
+    OdCacheFlushNode(d, nodeid);
+    ShadowNodeBootup(d, nodeid);
+    InvNodeBootup(d, nodeid);
+}
+
+void CANOpenShellOD_heartbeatError(CO_Data* d, UNS8 heartbeatID)
+{
+    printf("Slave %x heartbeat lost\n", heartbeatID);
+    /* The values of a silent node are read again with SDO */
+    ShadowInvalidateNode(d, heartbeatID);
 }
 
 /***************************  CALLBACK FUNCTIONS  *****************************************/
@@ -410,6 +1636,7 @@ void CANOpenShellOD_stopped(CO_Data* d)
 void CANOpenShellOD_post_sync(CO_Data* d)
 {
     //printf("Master_post_sync\n");
+    StrmSync(d);
 }
 
 void CANOpenShellOD_post_TPDO(CO_Data* d)
@@ -420,71 +1647,257 @@ void CANOpenShellOD_post_TPDO(CO_Data* d)
 /***************************  INITIALISATION  **********************************/
 void Init(CO_Data* d, UNS32 id)
 {
-    if(Board.baudrate)
-    {
-        /* Init node state*/
-        setState(CANOpenShellOD_Data, Initialisation);
-    }
+    int i;
+
+    /* Init node state of the buses opened before the timer thread */
+    for(i=0; i<BusCount; i++) setState(Buses[i].d, Initialisation);
 }
 
 /***************************  CLEANUP  *****************************************/
 void Exit(CO_Data* d, UNS32 nodeid)
 {
-    if(strcmp(Board.baudrate, "none"))
+    int i;
+
+    for(i=0; i<BusCount; i++)
     {
+        if(!strcmp(Buses[i].baudRate, "none")) continue;
+
         /* Reset all nodes on the network */
-        masterSendNMTstateChange(CANOpenShellOD_Data, 0 , NMT_Reset_Node);
+        masterSendNMTstateChange(Buses[i].d, 0 , NMT_Reset_Node);
 
         /* Stop master */
-        setState(CANOpenShellOD_Data, Stopped);
+        setState(Buses[i].d, Stopped);
     }
 }
 
+/*
+This function return the index of the bus of a CO_Data structure
+input: CO_Data structure
+return: bus index, 0 to MAX_BUSES - 1
+*/
+
+int BusIndex(CO_Data* d)
+{
+    int i;
+
+    for(i=1; i<BusCount; i++) if(Buses[i].d == d) return i;
+    return 0;
+}
+
+/*
+This function return the CO_Data structure of a bus
+input: bus index
+return: CO_Data structure or NULL if the bus is not loaded
+*/
+
+CO_Data* BusData(int bus)
+{
+    return bus >= 0 && bus < BusCount ? Buses[bus].d : NULL;
+}
+
+/*
+This function look for a bus by its name
+input: name
+return: bus or NULL if no bus has this name
+*/
+
+s_BUS* FindBus(const char* name)
+{
+    int i;
+
+    for(i=0; i<BusCount; i++) if(!strcmp(Buses[i].name, name)) return &Buses[i];
+    return NULL;
+}
+
+/*
+This function remove the "name:" prefix of the arguments of a command and
+select the bus it address, the first bus when there is no prefix
+input: command string
+return: 0 or -1 if the bus is unknown (its name is then left in the command)
+*/
+
+int SelectBus(char* command)
+{
+    char* args = strchr(command, '#');
+    char* p;
+    s_BUS* bus;
+    int n;
+
+    CANOpenShellOD_Data = BusCount ? Buses[0].d : NULL;
+    if(args == NULL || !((args[1] >= 'a' && args[1] <= 'z') || (args[1] >= 'A' && args[1] <= 'Z'))) return 0;
+
+    /* A bus name is made of letters and digits, the arguments never start like that */
+    for(p = args + 1; (*p >= 'a' && *p <= 'z') || (*p >= 'A' && *p <= 'Z') || (*p >= '0' && *p <= '9'); p++) {}
+    n = p - args - 1;
+    if(*p != ':' || n >= BUS_NAME_MAX) return 0;
+
+    *p = 0;
+    bus = FindBus(args + 1);
+    if(bus == NULL) return -1;
+    CANOpenShellOD_Data = bus->d;
+    memmove(args + 1, p + 1, strlen(p + 1) + 1);
+    return 0;
+}
+
+
+/*
+This function copy the generated CO_Data structure for a bus after the first,
+the copy point to its own PDO, heartbeat consumer and SYNC state
+input: bus
+return: 0 or -1 if the dictionary has more PDO or heartbeat consumers than a copy can hold
+*/
+
+int BusCopy(s_BUS* bus)
+{
+    CO_Data* d = &bus->data;
+    int i, tpdo, rpdo;
+
+    *d = gstaticPristineData;
+    tpdo = d->firstIndex->PDO_TRS ? d->lastIndex->PDO_TRS - d->firstIndex->PDO_TRS + 1 : 0;
+    rpdo = d->firstIndex->PDO_RCV ? d->lastIndex->PDO_RCV - d->firstIndex->PDO_RCV + 1 : 0;
+    if(tpdo > BUS_PDO_MAX || rpdo > BUS_PDO_MAX || *d->ConsumerHeartbeatCount > BUS_HB_MAX) return -1;
+
+    memset(bus->pdoStatus, 0, sizeof bus->pdoStatus);
+    for(i=0; i<BUS_PDO_MAX; i++)
+    {
+        bus->pdoStatus[i].event_timer = TIMER_NONE;
+        bus->pdoStatus[i].inhibit_timer = TIMER_NONE;
+        bus->rpdoTimers[i] = TIMER_NONE;
+    }
+    for(i=0; i<BUS_HB_MAX; i++) bus->heartbeatTimers[i] = TIMER_NONE;
+    bus->heartbeatCount = *d->ConsumerHeartbeatCount;
+    bus->syncCobId = gstaticPristineSync[0];
+    bus->syncPeriod = gstaticPristineSync[1];
+
+    d->PDO_status = bus->pdoStatus;
+    if(d->RxPDO_EventTimers != NULL) d->RxPDO_EventTimers = bus->rpdoTimers;
+    d->ConsumerHeartbeatCount = &bus->heartbeatCount;
+    d->ConsumerHeartBeatTimers = bus->heartbeatTimers;
+    d->COB_ID_Sync = &bus->syncCobId;
+    d->Sync_Cycle_Period = &bus->syncPeriod;
+    return 0;
+}
 
 /*
-This fuction initialise the node
+This fuction initialise the node on a new bus.
+The buses share the driver library, the node id and the type of the first one.
+input: requester, library path, channel, baudrate, node identifier, node type (0:slave, 1:master),
+bus name (empty for the default name)
 */
 
-int NodeInit(int NodeID, int NodeType)
+int NodeInit(s_REQUESTER* rq, char* library, char* busName, char* baudRate, int NodeID, int NodeType, char* name)
 {
     char retbuf[100];
+    s_BUS* bus = &Buses[BusCount];
+    CO_Data* d;
+    s_RTSAVED saved;
+    int ret;
 
-    if(NodeType)
-        CANOpenShellOD_Data = &CANOpenShellMasterOD_Data;
-    else
-        CANOpenShellOD_Data = &CANOpenShellSlaveOD_Data;
+    if(BusCount == MAX_BUSES)
+    {
+        sprintf(retbuf,"404 load no more bus can be served");
+        SendReply(rq, retbuf);
+        return 0;
+    }
+    if(name[0] == 0) sprintf(name, "bus%d", BusCount);
+    if(FindBus(name) != NULL)
+    {
+        sprintf(retbuf,"404 load bus %s already loaded",name);
+        SendReply(rq, retbuf);
+        return 0;
+    }
+    if(BusCount > 0 && (strcmp(library, LibraryPath) || NodeID != getNodeId(Buses[0].d) || NodeType != gstaticNodeType))
+    {
+        sprintf(retbuf,"404 load bus %s must use the library, node id and type of %s",name,Buses[0].name);
+        SendReply(rq, retbuf);
+        return 0;
+    }
+
+    if(BusCount == 0)
+    {
+        d = NodeType ? &CANOpenShellMasterOD_Data : &CANOpenShellSlaveOD_Data;
+        gstaticNodeType = NodeType;
+
+        /* Load can library */
+        strcpy(LibraryPath, library);
+        if(!strcmp(LibraryPath, SOCKCAN_LIBRARY)) SockCanInstall();
+        else if(!strcmp(LibraryPath, SIM_LIBRARY)) SimInstall();
+        else LoadCanDriver(LibraryPath);
+        CanTapInstall();
+
+        /* Define callback functions */
+        d->initialisation = CANOpenShellOD_initialisation;
+        d->preOperational = CANOpenShellOD_preOperational;
+        d->operational = CANOpenShellOD_operational;
+        d->stopped = CANOpenShellOD_stopped;
+        d->post_sync = CANOpenShellOD_post_sync;
+        d->post_TPDO = CANOpenShellOD_post_TPDO;
+        d->post_SlaveBootup=CANOpenShellOD_post_SlaveBootup;
+        d->heartbeatError=CANOpenShellOD_heartbeatError;
+        gstaticPristineData = *d;
+        gstaticPristineSync[0] = *d->COB_ID_Sync;
+        gstaticPristineSync[1] = *d->Sync_Cycle_Period;
+    }
+    else if(BusCopy(bus) < 0)
+    {
+        sprintf(retbuf,"404 load the dictionary has too many PDO or heartbeat consumers for bus %s",name);
+        SendReply(rq, retbuf);
+        return 0;
+    }
+    else d = &bus->data;
 
-    /* Load can library */
-    LoadCanDriver(LibraryPath);
+    strcpy(bus->name, name);
+    strcpy(bus->busName, busName);
+    strcpy(bus->baudRate, baudRate);
+    bus->board.busname = bus->busName;
+    bus->board.baudrate = bus->baudRate;
+    bus->d = d;
 
-    /* Define callback functions */
-    CANOpenShellOD_Data->initialisation = CANOpenShellOD_initialisation;
-    CANOpenShellOD_Data->preOperational = CANOpenShellOD_preOperational;
-    CANOpenShellOD_Data->operational = CANOpenShellOD_operational;
-    CANOpenShellOD_Data->stopped = CANOpenShellOD_stopped;
-    CANOpenShellOD_Data->post_sync = CANOpenShellOD_post_sync;
-    CANOpenShellOD_Data->post_TPDO = CANOpenShellOD_post_TPDO;
-    CANOpenShellOD_Data->post_SlaveBootup=CANOpenShellOD_post_SlaveBootup;
+    /* The bus is known before its first frame is received */
+    EnterMutex();
+    BusCount++;
+    LeaveMutex();
 
     /* Open the Peak CANOpen device */
-    if(!canOpen(&Board,CANOpenShellOD_Data))
+    CanTapBus(BusCount - 1);
+    SockCanBus(BusCount - 1);
+    SimBus(BusCount - 1);
+    RtEnter(RT_RECEIVE, &saved);
+    ret = canOpen(&bus->board,d) != NULL;
+    RtLeave(&saved);
+    if(!ret)
     {
+        EnterMutex();
+        BusCount--;
+        LeaveMutex();
         strcpy(retbuf,"404");
         sprintf(retbuf,"%s Error creating node %d ",retbuf,NodeID);
-        sendData(gstaticSocketCanGateway, retbuf);
+        SendReply(rq, retbuf);
         return INIT_ERR;
     }
 
     /* Defining the node Id */
-    setNodeId(CANOpenShellOD_Data, NodeID);
+    setNodeId(d, NodeID);
 
-    /* Start Timer thread */
-    StartTimerLoop(&Init);
+    if(BusCount == 1)
+    {
+        /* Start Timer thread */
+        RtEnter(RT_TIMER, &saved);
+        StartTimerLoop(&Init);
+        RtLeave(&saved);
+    }
+    else
+    {
+        /* The timer thread is running, the node is started like Init does */
+        EnterMutex();
+        setState(d, Initialisation);
+        LeaveMutex();
+    }
 
     strcpy(retbuf,"000");
-    sprintf(retbuf,"%s Node %d creation ok\n",retbuf,NodeID);
+    sprintf(retbuf,"%s Node %d creation ok on %s\n",retbuf,NodeID,name);
     printf("sent msg %s",retbuf);
-    sendData(gstaticSocketCanGateway, retbuf);
+    SendReply(rq, retbuf);
 
     return 0;
 }
@@ -497,21 +1910,85 @@ This fuction display command line help
 void help_menu(void)
 {
     printf("   MANDATORY COMMAND (must be the first command):\n");
-    printf("     load#CanLibraryPath,channel,baudrate,nodeid,type (0:slave, 1:master)\n");
+    printf("     load#CanLibraryPath,channel,baudrate,nodeid,type (0:slave, 1:master)[,name]\n");
+    printf("        CanLibraryPath socketcan : built-in Linux driver, channel is the interface (can0, vcan0)\n");
+    printf("        and its bit rate is set with ip link, can#stat : frame and system call counters\n");
+    printf("        CanLibraryPath simbus : simulated bus, channel is first[-last][:latency[:heartbeat]], the\n");
+    printf("        virtual slaves first to last answer after latency us (decimal, default %d) and send their\n", SIM_LATENCY);
+    printf("        heartbeat every heartbeat ms (decimal, default %d), ex : load#simbus,2-21:500,1M,1,1\n", SIM_HEARTBEAT);
+    printf("        load again with another channel to serve one more bus (same library, nodeid and type)\n");
+    printf("        the buses are named bus0, bus1... unless a name is given\n");
+    printf("\n");
+    printf("   BUS: the commands address the first bus unless a bus name is put after the #\n");
+    printf("        ex : rsdo#bus1:6,1018,01\n");
     printf("\n");
     printf("   NETWORK: (if nodeid=0x00 : broadcast)\n");
     printf("     ssta#nodeid : Start a node\n");
     printf("     ssto#nodeid : Stop a node\n");
     printf("     srst#nodeid : Reset a node\n");
-    printf("     scan : Reset all nodes and print message when bootup\n");
+    printf("     scan : List the nodes with their identity (nodeid=type,vendor,product,revision;...)\n");
     printf("     wait#seconds : Sleep for n seconds\n");
+    printf("     prot#frame|text : Select the length prefixed or the legacy wire protocol\n");
     printf("\n");
     printf("   SDO: (size in bytes)\n");
-    printf("     info#nodeid\n");
-    printf("     rsdo#nodeid,index,subindex : read sdo\n");
+    printf("     info#nodeid[,nodeid...] : identity of nodes, one reply per node, from the inventory file when it is recorded\n");
+    printf("     rsdo#nodeid,index,subindex[,x|b64] : read sdo, x or b64: value of any length in hex or base64\n");
     printf("        ex : rsdo#42,1018,01\n");
-    printf("     wsdo#nodeid,index,subindex,size,data : write sdo\n");
+    printf("        ex : rsdo#42,1008,00,x\n");
+    printf("     wsdo#nodeid,index,subindex,size,data : write sdo, data in hex bytes when size > 4\n");
     printf("        ex : wsdo#42,6200,01,01,FF\n");
+    printf("        ex : wsdo#42,2000,00,06,48656C6C6F21\n");
+    printf("     wsdo#nodeid,index,subindex,b64,data : write sdo, data in base64\n");
+    printf("        ex : wsdo#42,2000,00,b64,SGVsbG8h\n");
+    printf("     dl#nodeid,index,subindex,size : download a file of size bytes sent in the next frames\n");
+    printf("        (framed protocol), progress and result are replied with the tag of the command\n");
+    printf("     bsdo#rnodeid,index,subindex;wnodeid,index,subindex,size,data;... : batch of sdo\n");
+    printf("        ex : bsdo#r6,6041,00;w6,6040,00,02,0F;r7,6064,00\n");
+    printf("     pdom#nodeid,pdo,transtype,index:subindex:size,... : map objects in a transmit pdo (1-4)\n");
+    printf("        and answer their reads from the received pdo (node must be started), no object: disable\n");
+    printf("        ex : pdom#6,1,FF,6041:00:02,6064:00:04\n");
+    printf("     subscribe#nodeid,index,subindex[,mindelta[,maxrate]] : send the value at each change\n");
+    printf("        of at least mindelta, up to maxrate messages per second (decimal)\n");
+    printf("        ex : subscribe#6,6064,00,10,20\n");
+    printf("     unsubscribe#nodeid,index,subindex : stop sending the changes\n");
+    printf("     cach#ttl,first,last,ms : cache the reads of an index range (ms in decimal, 0: not cached)\n");
+    printf("        ex : cach#ttl,6060,6060,500\n");
+    printf("     cach#stat : cache hits, misses and entries\n");
+    printf("     cach#flush[,nodeid] : forget the cached values\n");
+    printf("\n");
+    printf("   MOTION: (CiA 402 drives, profile position mode)\n");
+    printf("     move#nodeid,position,velocity[,r] : enable the drive, give the set-point and reply\n");
+    printf("        when the drive acknowledge it, r: position relative to the current target\n");
+    printf("        ex : move#6,1000,200\n");
+    printf("     halt#nodeid : halt the drive and reply when it stand still\n");
+    printf("     strm#sync,period : produce the SYNC every period us (decimal), 0: stop\n");
+    printf("     strm#open,nodeid,rpdo,size : stream set-points to a receive pdo (1-4) of 4 bytes (position)\n");
+    printf("        or 8 bytes (position, velocity), one set-point is sent after each SYNC\n");
+    printf("     strm#sp,nodeid,position[:velocity],...[;nodeid,...] : queue set-points, the first ones\n");
+    printf("        of several nodes (one group each) are sent after the same SYNC, the reply give the room left\n");
+    printf("        ex : strm#sp,6,100:20,200:20;7,100:20,200:20\n");
+    printf("     strm#close,nodeid : stop a stream, strm#stat : SYNC timing and stream counters\n");
+    printf("   RAW FRAMES: (framed protocol only)\n");
+    printf("     raw#open,flush[,id[:mask],...] : receive the frames of the buses in binary batches, each\n");
+    printf("        flush ms (decimal, 0: each frame), only the frames where cobid & mask == id (hex)\n");
+    printf("        ex : raw#open,10,180:780,80\n");
+    printf("     raw#close : stop the batches, raw#stat : counters of the tunnel\n");
+    printf("        the messages that start with the byte CA are batches of frames to send\n");
+    printf("   SIMULATION: (simbus driver)\n");
+    printf("     sim#stat : virtual slaves and frame counters, sim#lat,us : answer latency (decimal)\n");
+    printf("     sim#off,nodeid : the node stay silent, sim#on,nodeid : the node boot up (0: all the nodes)\n");
+    printf("     sim#set,nodeid,index,subindex,value : change an entry of the dictionary of the nodes,\n");
+    printf("        ex : sim#set,0,1017,00,64 (heartbeat every 100 ms)\n");
+    printf("   TRACE:\n");
+    printf("     trace#start[,records[,file]] : record the frames of the buses in a ring of records\n");
+    printf("        (decimal, default %d) mapped from the file (default %s), the commands of the\n", TRC_RECORDS, TRC_FILE);
+    printf("        hosts are written to the file%s, canopenreplay play both again\n", TRC_CMD_SUFFIX);
+    printf("     trace#stop : stop the recording, the file keep the last frames\n");
+    printf("     trace#dump[,count] : reply the last count frames (at most %d), trace#stat : state\n", TRC_DUMP_MAX);
+    printf("   REAL-TIME: (profile given by the -r option of the server)\n");
+    printf("     rt#stat : scheduling of the CAN threads and memory lock\n");
+    printf("     rt#test,period,count : measure count cycles of a timer of period us (decimal),\n");
+    printf("        the reply give the percentiles of the cycle time and the longest delay\n");
     printf("\n");
     printf("   Note: All numbers are hex\n");
     printf("\n");
@@ -536,69 +2013,179 @@ int ExtractNodeId(char *command)
 }
 
 
+/*
+This function delay the reply of a wait# command without blocking the other sessions
+input: CO_Data structure, alarm id: session identifier * MAX_WAITS + entry of the wait
+*/
+
+void WaitElapsed(CO_Data* d, UNS32 id)
+{
+    char retbuf[30];
+    s_SESSION* s = FindSession(id / MAX_WAITS);
+    int k = id % MAX_WAITS;
+    s_REQUESTER rq;
+
+    if(s == NULL || !s->waitused[k]) return;
+    s->waitused[k] = 0;
+    rq.session = id / MAX_WAITS;
+    rq.tag = s->waittag[k];
+    sprintf(retbuf,"wait#%d",s->waitsec[k]);
+    SendReply(&rq, retbuf);
+}
+
+
 /*
 This function compare the 4 first characters of command string and call the correponding sub-function
-input: command strig pointer
+A "@id " prefix tag the command with a correlation identifier echoed in its reply
+input: session identifier (0 for the init file), command strig pointer
 output: 0 or node identifier if a new node is created
 */
 
-int ProcessCommand(char* command)
+int ProcessCommand(int session, char* command)
 {
     int ret = 0;
     int sec = 0;
     int NodeID;
     int NodeType;
-    char retbuf[30];
+    int n = 0;
+    int i;
+    s_SESSION* s;
+    char retbuf[60];
+    char library[101], busName[31], baudRate[5], name[BUS_NAME_MAX];
+    s_REQUESTER requester = {session, 0};
+    s_REQUESTER* rq = &requester;
+
+    if(command[0] == '@' && sscanf(command, "@%u %n", &requester.tag, &n) == 1 && n > 0)
+        command += n;
 
     EnterMutex();
+    TrcCommand(session, command);
+
+    /* The load command name its bus, the other ones may address one */
+    if(strncmp(command, "load", 4) && SelectBus(command) < 0)
+    {
+        sprintf(retbuf,"404 unknown bus %.*s",BUS_NAME_MAX,strchr(command, '#') + 1);
+        SendReply(rq, retbuf);
+        LeaveMutex();
+        return 0;
+    }
+
+    /* The commands of two letters */
+    if(!strncmp(command, "dl#", 3))
+    {
+        DownloadEntry(rq, command);
+        LeaveMutex();
+        return 0;
+    }
+    if(!strncmp(command, "rt#", 3))
+    {
+        RtCommand(rq, command);
+        LeaveMutex();
+        return 0;
+    }
+
     switch(cst_str4(command[0], command[1], command[2], command[3]))
     {
     case cst_str4('h', 'e', 'l', 'p') : /* Display Help*/
         help_menu();
         break;
     case cst_str4('s', 's', 't', 'a') : /* Slave Start*/
-        StartNode(ExtractNodeId(command + 5));
+        StartNode(rq, ExtractNodeId(command + 5));
         break;
     case cst_str4('s', 's', 't', 'o') : /* Slave Stop */
-        StopNode(ExtractNodeId(command + 5));
+        StopNode(rq, ExtractNodeId(command + 5));
         break;
     case cst_str4('s', 'r', 's', 't') : /* Slave Reset */
-        ResetNode(ExtractNodeId(command + 5));
+        ResetNode(rq, ExtractNodeId(command + 5));
         break;
     case cst_str4('i', 'n', 'f', 'o') : /* Retrieve node informations */
-        GetSlaveNodeInfo(ExtractNodeId(command + 5));
+        NodeInfo(rq, command);
         break;
     case cst_str4('r', 's', 'd', 'o') : /* Read device entry */
-        ReadDeviceEntry(command);
+        ReadDeviceEntry(rq, command);
         break;
     case cst_str4('w', 's', 'd', 'o') : /* Write device entry */
-        WriteDeviceEntry(command);
+        WriteDeviceEntry(rq, command);
+        break;
+    case cst_str4('b', 's', 'd', 'o') : /* Read and write several device entries */
+        BatchDeviceEntries(rq, command);
+        break;
+    case cst_str4('s', 'u', 'b', 's') : /* Subscribe to the changes of an object */
+    case cst_str4('u', 'n', 's', 'u') : /* Cancel a subscription */
+        SubscribeEntry(rq, command);
+        break;
+    case cst_str4('p', 'd', 'o', 'm') : /* Shadow objects mapped in a PDO */
+        MapDevicePDO(rq, command);
+        break;
+    case cst_str4('c', 'a', 'c', 'h') : /* Object dictionary read cache */
+        CacheCommand(rq, command);
         break;
-    case cst_str4('s', 'c', 'a', 'n') : /* Display master node state */
-        DiscoverNodes();
+    case cst_str4('m', 'o', 'v', 'e') : /* Move a drive to a position */
+    case cst_str4('h', 'a', 'l', 't') : /* Halt a drive */
+        MotionCommand(rq, command);
+        break;
+    case cst_str4('s', 't', 'r', 'm') : /* Cyclic set-points sent after each SYNC */
+        StreamCommand(rq, command);
+        break;
+    case cst_str4('r', 'a', 'w', '#') : /* Raw frame tunnel */
+        RawCommand(rq, command);
+        break;
+    case cst_str4('c', 'a', 'n', '#') : /* Counters of the SocketCAN driver */
+        CanCommand(rq, command);
+        break;
+    case cst_str4('s', 'i', 'm', '#') : /* Virtual slaves of the simulated bus */
+        SimCommand(rq, command);
+        break;
+    case cst_str4('t', 'r', 'a', 'c') : /* Bus trace recorder */
+        TraceCommand(rq, command);
+        break;
+    case cst_str4('s', 'c', 'a', 'n') : /* Inventory of the nodes */
+        DiscoverNodes(rq);
         break;
     case cst_str4('w', 'a', 'i', 't') : /* Display master node state */
         ret = sscanf(command, "wait#%d", &sec);
         if(ret == 1)
         {
+            if((s = FindSession(session)) != NULL)
+            {
+                /* Other hosts keep being served while this one waits, each wait has its own entry */
+                for(i=0; i<MAX_WAITS && s->waitused[i]; i++) {}
+                if(i == MAX_WAITS)
+                {
+                    sprintf(retbuf,"404 wait too many pending waits (%d)",MAX_WAITS);
+                    SendReply(rq, retbuf);
+                    LeaveMutex();
+                    return 0;
+                }
+                s->waitused[i] = 1;
+                s->waitsec[i] = sec;
+                s->waittag[i] = requester.tag;
+                SetAlarm(CANOpenShellOD_Data, session * MAX_WAITS + i, WaitElapsed, MS_TO_TIMEVAL(sec * 1000), 0);
+                LeaveMutex();
+                return 0;
+            }
             LeaveMutex();
             strcpy(retbuf,command);
-            sendData(gstaticSocketCanGateway, retbuf);
+            SendReply(rq, retbuf);
             SleepFunction(sec);
             return 0;
         }
         break;
+    case cst_str4('p', 'r', 'o', 't') : /* Negotiate the wire protocol */
+        SetProtocol(rq, command);
+        break;
     case cst_str4('q', 'u', 'i', 't') : /* Quit application */
         LeaveMutex();
         return QUIT;
     case cst_str4('l', 'o', 'a', 'd') : /* Library Interface*/
-        ret = sscanf(command, "load#%100[^,],%30[^,],%4[^,],%d,%d",LibraryPath,BoardBusName,BoardBaudRate,
-                     &NodeID,&NodeType);
+        name[0] = 0;
+        ret = sscanf(command, "load#%100[^,],%30[^,],%4[^,],%d,%d,%15[a-zA-Z0-9]",library,busName,baudRate,
+                     &NodeID,&NodeType,name);
 
-        if(ret == 5)
+        if(ret == 5 || ret == 6)
         {
             LeaveMutex();
-            ret = NodeInit(NodeID, NodeType);
+            ret = NodeInit(rq, library, busName, baudRate, NodeID, NodeType, name);
             return ret;
         }
         else
@@ -619,16 +2206,18 @@ int ProcessCommand(char* command)
 
 
 /*
-This fuction process commands from init file
+This fuction process commands from init file.
+Each line is processed when the previous one is completed (its reply is sent),
+a "timeout#seconds" line change the time allowed to the following lines
 input: file name, socket
 */
 
 int processServerInitFile(char* fileName)
 {
-    int i,n;
-    char psrcbuf[128];
-    char ptarbuf[128];
-    char ptmpobuf[128];
+    int i,n=0,ret;
+    int timeout=SCRIPT_LINE_TIMEOUT;
+    char psrcbuf[MAXMSG+16];
+    char ptmpobuf[MAXMSG];
     FILE* pPFile;
 
     if((pPFile=fopen(fileName,"r"))==NULL)
@@ -641,19 +2230,345 @@ int processServerInitFile(char* fileName)
         printf("\nProcessing init file %s",fileName);
         while (fgets(ptmpobuf,MAXMSG,pPFile)!=NULL)
         {
-
+            n++;
             for(i=0; ptmpobuf[i]==' '; i++) {}
-            strcpy(psrcbuf,ptmpobuf+i);
-            if (strlen(psrcbuf)>=2 && psrcbuf[0]!='#')
+            if (strlen(ptmpobuf+i)<2 || ptmpobuf[i]=='#') continue;
+            if (sscanf(ptmpobuf+i,"timeout#%d",&timeout)==1) continue;
+
+            /* The line number tag the reply that complete the line */
+            sprintf(psrcbuf,"@%d %s",n,ptmpobuf+i);
+            pthread_mutex_lock(&gstaticScriptMutex);
+            gstaticScriptTag = n;
+            gstaticScriptLeft = ScriptReplies(ptmpobuf+i);
+            pthread_mutex_unlock(&gstaticScriptMutex);
+
+            ret = ProcessCommand(0, psrcbuf);
+
+            /* help, quit and the unknown commands have no reply */
+            if (ret < 0 || ret == QUIT || !strncmp(ptmpobuf+i,"help",4)) continue;
+            if (ScriptWait(timeout) < 0)
+                printf("\nLine %d not completed after %d s: %s",n,timeout,ptmpobuf+i);
+        }
+        fclose(pPFile);
+    }
+    return 0;
+}
+
+/*
+This function accept a new host and register its socket in the event loop
+input: epoll descriptor, server socket
+return: session identifier or -1 if no slot is free
+*/
+
+int OpenSession(int epfd, int sfd)
+{
+    int i, fd;
+    char cl[MAXBUF];
+    struct epoll_event ev;
+    s_SESSION* s;
+
+    if((fd=acceptServ(sfd, cl)) < 0) return -1;
+
+    for(i=0; i<MAX_SESSIONS && __atomic_load_n(&Sessions[i].id, __ATOMIC_ACQUIRE)!=0; i++) {}
+    if(i == MAX_SESSIONS)
+    {
+        printf("\nConnection from %s refused: too many hosts", cl);
+        disconnect(fd);
+        return -1;
+    }
+    s = &Sessions[i];
+    setNonBlocking(fd);
+    s->fd = fd;
+    memset(s->waitused, 0, sizeof s->waitused);
+    s->paused = 0;
+    s->throttled = 0;
+    s->closed = 0;
+    s->quit = 0;
+    s->lost = 0;
+    s->overflow = 0;
+    s->mode = NET_TEXT;
+    initNetBuf(&s->nb, NET_TEXT);
+    initNetOut(&s->out);
+    CmdRingReset(&s->cmds);
+    strcpy(s->host, cl);
+
+    /* The slot is given to the command thread with its identifier */
+    __atomic_store_n(&s->id, ++gstaticLastSessionId, __ATOMIC_RELEASE);
+
+    ev.events = EPOLLIN;
+    ev.data.u32 = i;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+    printf("\nConnection with the host %s established", cl);
+    return s->id;
+}
+
+/*
+This function unregister a session from the event loop and disconnect its host,
+the command thread free the slot
+input: epoll descriptor, session slot
+*/
+
+void CloseSession(int epfd, s_SESSION* s)
+{
+    if(s->fd < 0) return;
+    epoll_ctl(epfd, EPOLL_CTL_DEL, s->fd, NULL);
+    disconnect(s->fd);
+    printf("\nDisconnected from the host %s", s->host);
+    s->fd = -1;
+    s->paused = 0;
+    __atomic_store_n(&s->closed, 1, __ATOMIC_RELEASE);
+    sem_post(&gstaticCmdSem);
+}
+
+/*
+This function register the events of a session: it is read while its command
+ring has room and its replies are below the watermark, and written while
+replies are queued
+input: epoll descriptor, session slot
+*/
+
+void UpdateSession(int epfd, s_SESSION* s)
+{
+    struct epoll_event ev;
+
+    ev.events = 0;
+    if (!s->paused && !s->throttled) ev.events |= EPOLLIN;
+    if (s->out.len > 0) ev.events |= EPOLLOUT;
+    ev.data.u32 = s - Sessions;
+    epoll_ctl(epfd, EPOLL_CTL_MOD, s->fd, &ev);
+}
+
+/*
+This function write the replies of a session that the socket accept, the
+host is not read while its replies are above the high watermark
+input: epoll descriptor, session slot
+return: 0 or -1 if the host is disconnected
+*/
+
+int FlushSession(int epfd, s_SESSION* s)
+{
+    int left, throttled;
+
+    if ((left=flushNetOut(s->fd, &s->out))<0)
+    {
+        CloseSession(epfd, s);
+        return -1;
+    }
+    throttled = s->throttled ? left > NET_OUT_LOW : left > NET_OUT_HIGH;
+    if (throttled != s->throttled)
+    {
+        s->throttled = throttled;
+        printf("\nHost %s %s", s->host, throttled ? "throttled, replies not read" : "resumed");
+    }
+    UpdateSession(epfd, s);
+
+        /*the messages buffered while the host was throttled*/
+    if (!throttled && !s->paused && ReadSession(epfd, s) < 0) return -1;
+    return 0;
+}
+
+/*
+This function move the messages buffered for a session to its command ring.
+The session is not read while the ring is full, and closed when the framing
+of its messages is lost.
+input: epoll descriptor, session slot
+return: 0 or -1 if the host is disconnected
+*/
+
+int ReadSession(int epfd, s_SESSION* s)
+{
+    int rlen = -1, queued = 0;
+    s_NQMSG* m;
+
+    while ((m=CmdRingSlot(&s->cmds)) != NULL)
+    {
+        if ((rlen=extractMessage(&s->nb, m->data, sizeof m->data))<0) break;
+        m->len = rlen;
+        CmdRingPush(&s->cmds);
+        queued = 1;
+    }
+    if (queued) sem_post(&gstaticCmdSem);
+    if (rlen == -2)
+    {
+            /*the next bytes cannot be trusted as a message*/
+        printf("\nHost %s sent an invalid frame length", s->host);
+        CloseSession(epfd, s);
+        return -1;
+    }
+    if (m != NULL) return 0;
+
+        /*resumed by WakeNetwork when the command thread took a message*/
+    __atomic_store_n(&s->paused, 1, __ATOMIC_SEQ_CST);
+    UpdateSession(epfd, s);
+    if (CmdRingSlot(&s->cmds) != NULL) WakeNetwork();
+    return 0;
+}
+
+/*
+This function move the queued replies to the send buffers of the sessions,
+and read again the sessions paused by a full command ring that has room now
+input: epoll descriptor
+*/
+
+void ResumeSessions(int epfd)
+{
+    int i;
+    char c;
+    char written[MAX_SESSIONS];
+    s_NQREPLY* r;
+    s_SESSION* s;
+
+    memset(written, 0, sizeof written);
+    /* The pipe is emptied first: a wake up after the flag is cleared leave its byte */
+    while (read(gstaticWakePipe[0], &c, 1) > 0) {}
+    __atomic_store_n(&gstaticWakePending, 0, __ATOMIC_SEQ_CST);
+
+    /* The replies are only queued here, then each session is written once */
+    while ((r=ReplyFront()) != NULL)
+    {
+        for(i=0; i<MAX_SESSIONS && (Sessions[i].id!=r->session || Sessions[i].fd<0); i++) {}
+        if (i < MAX_SESSIONS)
+        {
+            s = &Sessions[i];
+            if (r->kind == NQ_CLOSE)
+            {
+                flushNetOut(s->fd, &s->out);
+                CloseSession(epfd, s);
+            }
+            else if (r->kind == NQ_DATA)
+            {
+                    /*a stream the host read too slowly lose messages, the host stay connected*/
+                if (s->nb.mode != NET_FRAMED || queueFrame(&s->out, &s->nb, r->data, r->arg) < 0)
+                    __atomic_add_fetch(&s->lost, 1, __ATOMIC_RELAXED);
+                else written[i] = 1;
+            }
+            else if (queueMessage(&s->out, &s->nb, r->data) < 0)
             {
-                ProcessCommand(psrcbuf);
-                usleep(999999);
+                    /*a host that do not read its replies is dropped*/
+                printf("\nHost %s does not read its replies", s->host);
+                CloseSession(epfd, s);
             }
+            else
+            {
+                if (r->kind == NQ_MODE) s->nb.mode = r->arg;
+                written[i] = 1;
+            }
+        }
+        ReplyRelease();
+    }
+    if (__atomic_exchange_n(&gstaticRoomWait, 0, __ATOMIC_SEQ_CST)) sem_post(&gstaticRoomSem);
 
+    for(i=0; i<MAX_SESSIONS; i++)
+    {
+        s = &Sessions[i];
+        if (s->fd < 0) continue;
+        if (__atomic_load_n(&s->overflow, __ATOMIC_ACQUIRE))
+        {
+                /*a reply of the host was dropped, like a send buffer overflow*/
+            printf("\nHost %s lost a reply, the reply queue was full", s->host);
+            flushNetOut(s->fd, &s->out);
+            CloseSession(epfd, s);
+            continue;
         }
-        fclose(pPFile);
+        if (written[i] && FlushSession(epfd, s) < 0) continue;
+        if (!__atomic_load_n(&s->paused, __ATOMIC_ACQUIRE) || CmdRingSlot(&s->cmds) == NULL) continue;
+        s->paused = 0;
+        UpdateSession(epfd, s);
+        if (!s->throttled) ReadSession(epfd, s);
     }
-    return 0;
+}
+
+/*
+This function wait until the reply queue has room for the replies of a
+command, the network thread empty it. It is called without the stack mutex.
+*/
+
+void WaitReplyRoom(void)
+{
+    while (ReplyRoom() < NQ_COMMAND_ROOM)
+    {
+        __atomic_store_n(&gstaticRoomWait, 1, __ATOMIC_SEQ_CST);
+        if (ReplyRoom() >= NQ_COMMAND_ROOM) break;
+        WakeNetwork();
+        while (sem_wait(&gstaticRoomSem) < 0) {}
+    }
+}
+
+/*
+This function process the messages of a session in its command ring. The
+messages that follow an accepted dl# command are the bytes of the file: they
+stay in the ring while the download has no room for them. The binary
+messages of a raw tunnel are frames to send.
+input: session slot
+*/
+
+void ServeSession(s_SESSION* s)
+{
+    int ret, data, ready, id = __atomic_load_n(&s->id, __ATOMIC_ACQUIRE);
+    s_NQMSG* m;
+
+    if (id == 0) return;
+    while (!s->quit && !__atomic_load_n(&s->closed, __ATOMIC_ACQUIRE) && (m=CmdRingPeek(&s->cmds)) != NULL)
+    {
+        EnterMutex();
+        data = DlExpected(id);
+        ready = !data || DlReady(id);
+        if (data && ready) DlFeed(id, m->data, m->len);
+        LeaveMutex();
+
+            /*served again from WakeSessions when the node acknowledged enough bytes*/
+        if (!ready) break;
+        if (!data && TunIsBatch(m->data, m->len))
+        {
+                /*frames of the raw tunnel, sent on the buses*/
+            EnterMutex();
+            TunFeed(id, m->data, m->len);
+            LeaveMutex();
+        }
+        else if (!data)
+        {
+            printf("\nReceived command from %s: %s\n",s->host,m->data);
+
+                /* the host is disconnected when "quit" or an erroneous command is received */
+            WaitReplyRoom();
+            if ((ret=ProcessCommand(id, m->data)) != 0)
+            {
+                s->quit = 1;
+                if (ReplyPush(id, NQ_CLOSE, 0, NULL) < 0) __atomic_store_n(&s->overflow, 1, __ATOMIC_RELEASE);
+                WakeNetwork();
+            }
+        }
+        CmdRingPop(&s->cmds);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&s->paused, __ATOMIC_ACQUIRE)) WakeNetwork();
+    }
+
+    if (!__atomic_load_n(&s->closed, __ATOMIC_ACQUIRE)) return;
+    EnterMutex();
+    SubsDropSession(id);
+    DlDropSession(id);
+    StrmDropSession(id);
+    TunDropSession(id);
+    LeaveMutex();
+    __atomic_store_n(&s->id, 0, __ATOMIC_RELEASE);
+}
+
+/*
+This function is the command thread: it run the commands of the sessions
+with the stack mutex, their replies are sent by the network thread
+input: not used
+*/
+
+void* CommandThread(void* arg)
+{
+    int i;
+
+    for(;;)
+    {
+        while (sem_wait(&gstaticCmdSem) < 0) {}
+        for(i=0; i<MAX_SESSIONS; i++) ServeSession(&Sessions[i]);
+    }
+    return NULL;
 }
 
 /****************************************************************************/
@@ -663,6 +2578,7 @@ int processServerInitFile(char* fileName)
 int main(int argc, char** argv)
 {
     extern char *optarg;
+    extern int optind;
     char command[200];
     char* res;
     int ret=0;
@@ -671,14 +2587,40 @@ int main(int argc, char** argv)
 
     //*********** TCP Server declarations
 
-    int sfd,rlen;
-    char cl[MAXBUF];
-    char tbuf[MAXBUF];
+    int sfd;
     FILE* pf;
 
+    //*********** Event loop declarations
+
+    int epfd,nev,rlen;
+    struct epoll_event ev;
+    struct epoll_event events[MAX_SESSIONS + 2];
+    s_SESSION* s;
+    pthread_t cmdThread;
+    s_RTSAVED saved;
+
+		/* Real-time profile of the CAN threads: -r timerprio,rxprio[,cpumask] */
+    while ((ret=getopt(argc, argv, "r:"))!=-1)
+    {
+        if (ret=='r' && RtConfigure(optarg)==0) continue;
+        printf("usage: %s [-r timerprio,rxprio[,cpumask]] [init file [inventory file]]\n", argv[0]);
+        return 0;
+    }
+    ret=0;
+    RtStart();
 
 		/* Init stack timer */
+    RtEnter(RT_TIMER, &saved);
     TimerInit();			        //-------REMOVE TAGS IF CAN INTERFACE IS PRESENT
+    RtLeave(&saved);
+
+		/* Queues between the network thread and the command thread */
+    NqInit();
+    sem_init(&gstaticCmdSem, 0, 0);
+    sem_init(&gstaticRoomSem, 0, 0);
+
+		/* Map the node inventory of the previous runs, named by the second param token */
+    InvOpen(argc>optind+1 ? argv[optind+1] : INV_FILE);
 
     //goto init_fail; INIT_ERR		//------- USE THIS LINE INSTRUCTION FOR EMERGENCY EXIT
 
@@ -689,36 +2631,79 @@ int main(int argc, char** argv)
 	if ((sfd=socketServ(NPORT))<0) return 0;
 
 		/*Process init file if required param token*/
-	if (argc>1)
+	if (argc>optind)
     {
-        processServerInitFile(argv[1]);
+        processServerInitFile(argv[optind]);
     }
 
-    while (1)
+		/*register the server socket in the event loop, the slot index identify the other events*/
+    if ((epfd=epoll_create(MAX_SESSIONS + 1))<0)
+    {
+        perror("epoll_create");
+        return 0;
+    }
+    ev.events = EPOLLIN;
+    ev.data.u32 = MAX_SESSIONS;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, sfd, &ev);
+
+		/*the replies and the room in the command rings wake the event loop*/
+    if (pipe(gstaticWakePipe)<0)
+    {
+        perror("pipe");
+        return 0;
+    }
+    fcntl(gstaticWakePipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(gstaticWakePipe[1], F_SETFL, O_NONBLOCK);
+    ev.events = EPOLLIN;
+    ev.data.u32 = MAX_SESSIONS + 1;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, gstaticWakePipe[0], &ev);
+
+    for(i=0; i<MAX_SESSIONS; i++) Sessions[i].fd = -1;
+
+		/*the commands run in their own thread, this one only do the network I/O*/
+    if (pthread_create(&cmdThread, NULL, CommandThread, NULL) != 0)
     {
+        perror("pthread_create");
+        return 0;
+    }
 
-			/*establish connection with a host*/
-        gstaticSocketCanGateway=acceptServ(sfd, cl);
+    while (1)
+    {
+        if ((nev=epoll_wait(epfd, events, MAX_SESSIONS + 2, -1))<0) continue;
 
-        if (gstaticSocketCanGateway>0)
+        for(i=0; i<nev; i++)
         {
-            printf("\nConnection with the host established");
-            ret=0;
-            while(ret==0)
+            if (events[i].data.u32 == MAX_SESSIONS)
+            {
+					/*establish connection with a new host*/
+                OpenSession(epfd, sfd);
+                continue;
+            }
+            if (events[i].data.u32 == MAX_SESSIONS + 1)
             {
+                ResumeSessions(epfd);
+                continue;
+            }
 
-					/*receive data command line from the host*/
-                if ((rlen=receiveData(gstaticSocketCanGateway, tbuf, MAXBUF))<0) break;
-                else {
-                    tbuf[rlen]='\0';
-                    printf("\nReceived command: %s\n",tbuf);
+            s = &Sessions[events[i].data.u32];
+            if (s->fd < 0) continue;
 
-					/* Enter in a loop to read stdin command until "quit" is called */
-                    ret = ProcessCommand(tbuf);						//-------REMOVE COMMENT TAGS IF CAN INTERFACE IS PRESENT
-                }
+					/*send the replies the socket did not accept yet*/
+            if ((events[i].events & EPOLLOUT) && FlushSession(epfd, s) < 0) continue;
+            if (!(events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))) continue;
+
+					/*receive data from the host, TCP may merge or split the messages*/
+					/*an interrupted or empty read is retried at the next event*/
+            if ((s->paused || s->throttled) && !(events[i].events & (EPOLLHUP | EPOLLERR))) continue;
+            if (s->paused || s->throttled || (rlen=fillNetBuf(s->fd, &s->nb))==0 || rlen==-2 ||
+                (rlen<0 && errno!=EINTR && errno!=EAGAIN && errno!=EWOULDBLOCK))
+            {
+                CloseSession(epfd, s);
+                continue;
             }
-            disconnect(gstaticSocketCanGateway);
-            printf("\nDisconnected from the host");
+
+					/*queue every complete command line buffered for the command thread*/
+            ReadSession(epfd, s);
         }
     }
     disconnect(sfd);
@@ -729,11 +2714,14 @@ int main(int argc, char** argv)
     // Stop timer thread
     StopTimerLoop(&Exit);					//-------REMOVE COMMENT TAGS IF CAN INTERFACE IS PRESENT
 
-    /* Close CAN board */
-    canClose(CANOpenShellOD_Data);			//-------REMOVE COMMENT TAGS IF CAN INTERFACE IS PRESENT
+    /* Close CAN boards */
+    for(i=0; i<BusCount; i++)
+        canClose(Buses[i].d);				//-------REMOVE COMMENT TAGS IF CAN INTERFACE IS PRESENT
 
 init_fail:
 
+    TrcClose();
+    InvClose();
     TimerCleanup();							//-------REMOVE COMMENT TAGS IF CAN INTERFACE IS PRESENT
     return 0;
 }
@@ -0,0 +1,51 @@
+#ifndef CANOPENSHELL_H_INCLUDED
+#define CANOPENSHELL_H_INCLUDED
+
+/*
+Prototypes of the CANOpenShell server.
+This header replace the one of the CanFestival CANOpenShell example:
+the command handlers take the requester of the command to address their reply.
+*/
+
+#include "canfestival.h"
+#include "gateway.h"
+#include "sdosched.h"
+
+void SleepFunction(int);
+void StartNode(s_REQUESTER*, UNS8);
+void StopNode(s_REQUESTER*, UNS8);
+void ResetNode(s_REQUESTER*, UNS8);
+void DiscoverNodes(s_REQUESTER*);
+void NodeInfo(s_REQUESTER*, char*);
+void CheckReadSDO(CO_Data*, s_SDOREQ*);
+int HexDigit(char);
+void HexEncode(const UNS8*, int, char*);
+int HexDecode(const char*, UNS8*, int);
+void Base64Encode(const UNS8*, int, char*);
+int Base64Decode(const char*, UNS8*, int);
+void CheckReadBuffer(CO_Data*, s_SDOREQ*);
+void ReadDeviceEntry(s_REQUESTER*, char*);
+void CheckWriteSDO(CO_Data*, s_SDOREQ*);
+void WriteDeviceBuffer(s_REQUESTER*, int, int, int, int, char*);
+void WriteDeviceEntry(s_REQUESTER*, char*);
+void DownloadEntry(s_REQUESTER*, char*);
+void CheckBatchSDO(CO_Data*, s_SDOREQ*);
+void BatchDeviceEntries(s_REQUESTER*, char*);
+void CacheCommand(s_REQUESTER*, char*);
+int ReadGatewayImage(CO_Data*, UNS8, UNS16, UNS8, UNS32*);
+void MapDevicePDO(s_REQUESTER*, char*);
+void SubscribeEntry(s_REQUESTER*, char*);
+void CANOpenShellOD_post_SlaveBootup(CO_Data*, UNS8);
+void CANOpenShellOD_heartbeatError(CO_Data*, UNS8);
+int SelectBus(char*);
+int NodeInit(s_REQUESTER*, char*, char*, char*, int, int, char*);
+void help_menu(void);
+int ExtractNodeId(char*);
+int ProcessCommand(int, char*);
+int processServerInitFile(char*);
+void ScriptReplied(unsigned int);
+void WakeNetwork(void);
+void* CommandThread(void*);
+int ScriptWait(int);
+
+#endif // CANOPENSHELL_H_INCLUDED
@@ -0,0 +1,155 @@
+/*
+Module: cantap.c
+Description: frame tap of the CANOpenShell server.
+The driver entry points are the function pointers resolved by LoadCanDriver
+(CanFestival drivers/unix/unix.c). canfestival.h declare them as functions
+for the other modules, so only the CAN message definition is included here.
+*/
+
+#include "applicfg.h"
+#include "can.h"
+#include "cantap.h"
+
+//****************************************************************************
+// DRIVER ENTRY POINTS
+
+extern UNS8 (*canReceive_driver)(void*, Message*);
+extern UNS8 (*canSend_driver)(void*, Message*);
+extern void* (*canOpen_driver)(void*);
+
+void EnterMutex(void);
+void LeaveMutex(void);
+
+//****************************************************************************
+// GLOBALS
+
+static UNS8 (*gstaticReceive)(void*, Message*);
+static UNS8 (*gstaticSend)(void*, Message*);
+static void* (*gstaticOpen)(void*);
+
+/* Driver handle of each bus, and bus of the next opened handle */
+static void* gstaticHandles[CANTAP_MAX_BUSES];
+static int gstaticOpening;
+
+static CanTapListener_t gstaticListeners[CANTAP_MAX_LISTENERS];
+static int gstaticListenerCount;
+
+
+/*
+This function return the bus of a driver handle
+input: driver handle
+return: bus index, 0 if the handle is unknown
+*/
+
+static int CanTapHandleBus(void* handle)
+{
+    int i;
+
+    for(i=1; i<CANTAP_MAX_BUSES; i++) if(gstaticHandles[i] == handle) return i;
+    return 0;
+}
+
+/*
+This function give a frame to the listeners
+input: driver handle, direction, frame
+return: 1 if a listener consumed the frame
+*/
+
+static int CanTapNotify(void* handle, int dir, Message* m)
+{
+    int i, consumed = 0, bus = CanTapHandleBus(handle);
+
+    for(i=0; i<gstaticListenerCount && !consumed; i++) consumed = gstaticListeners[i](bus, dir, m);
+    return consumed;
+}
+
+/* Receive entry point called by the receive thread of the stack */
+static UNS8 CanTapReceive(void* handle, Message* m)
+{
+    UNS8 ret;
+    int consumed;
+
+    /* The consumed frames are not returned to the stack */
+    do
+    {
+        ret = gstaticReceive(handle, m);
+        consumed = 0;
+        if(ret == 0 && gstaticListenerCount > 0)
+        {
+            EnterMutex();
+            consumed = CanTapNotify(handle, CANTAP_RX, m);
+            LeaveMutex();
+        }
+    }
+    while(consumed);
+    return ret;
+}
+
+/* Send entry point called by canSend */
+static UNS8 CanTapSend(void* handle, Message* m)
+{
+    UNS8 ret = gstaticSend(handle, m);
+
+    if(ret == 0) CanTapNotify(handle, CANTAP_TX, m);
+    return ret;
+}
+
+/* Open entry point called by canOpen, the handle is given to the bus being opened */
+static void* CanTapOpen(void* board)
+{
+    void* handle = gstaticOpen(board);
+
+    if(handle) gstaticHandles[gstaticOpening] = handle;
+    return handle;
+}
+
+/*
+This function wrap the entry points of the CAN driver, it must be called after
+LoadCanDriver and before canOpen
+*/
+
+void CanTapInstall(void)
+{
+    /* A driver loaded again replace the wrappers */
+    if(canReceive_driver != CanTapReceive)
+    {
+        gstaticReceive = canReceive_driver;
+        canReceive_driver = CanTapReceive;
+    }
+    if(canSend_driver != CanTapSend)
+    {
+        gstaticSend = canSend_driver;
+        canSend_driver = CanTapSend;
+    }
+    if(canOpen_driver != CanTapOpen)
+    {
+        gstaticOpen = canOpen_driver;
+        canOpen_driver = CanTapOpen;
+    }
+}
+
+/*
+This function set the bus of the next driver handle opened by canOpen
+input: bus index
+*/
+
+void CanTapBus(int bus)
+{
+    if(bus >= 0 && bus < CANTAP_MAX_BUSES) gstaticOpening = bus;
+}
+
+/*
+This function add a listener of the frames
+input: function called with the direction (CANTAP_RX or CANTAP_TX) and the frame
+return: 0 or -1 if too many listeners are registered
+*/
+
+int CanTapRegister(CanTapListener_t listener)
+{
+    int i;
+
+    for(i=0; i<gstaticListenerCount; i++) if(gstaticListeners[i] == listener) return 0;
+    if(gstaticListenerCount == CANTAP_MAX_LISTENERS) return -1;
+    gstaticListeners[gstaticListenerCount++] = listener;
+    return 0;
+}
@@ -0,0 +1,47 @@
+#ifndef CANTAP_H_INCLUDED
+#define CANTAP_H_INCLUDED
+
+/*
+Frame tap of the CANOpenShell server.
+The receive and send entry points of the loaded CAN driver library are wrapped
+so the gateway modules see every frame exchanged on the buses. The driver
+handle returned by canOpen tell the bus of a frame.
+Received frames are given to the listeners in the CanFestival receive thread
+with the stack mutex held, before the stack dispatch them. A listener may
+consume a received frame, the stack then never see it. Sent frames are
+given in the context of the sender, which hold the stack mutex.
+*/
+
+#define CANTAP_RX 0
+#define CANTAP_TX 1
+
+/* Number of buses told apart by their driver handle */
+#define CANTAP_MAX_BUSES 4
+
+/* Number of modules listening to the frames */
+#define CANTAP_MAX_LISTENERS 8
+
+/* Called with the bus index, the direction and the frame.
+Return 1 to consume a received frame, 0 to let the stack dispatch it */
+typedef int (*CanTapListener_t)(int, int, Message*);
+
+/*
+This function wrap the entry points of the CAN driver, it must be called after
+LoadCanDriver and before canOpen
+*/
+void CanTapInstall(void);
+
+/*
+This function set the bus of the next driver handle opened by canOpen
+input: bus index
+*/
+void CanTapBus(int);
+
+/*
+This function add a listener of the frames
+input: function called with the bus, the direction (CANTAP_RX or CANTAP_TX) and the frame
+return: 0 or -1 if too many listeners are registered
+*/
+int CanTapRegister(CanTapListener_t);
+
+#endif // CANTAP_H_INCLUDED
@@ -0,0 +1,248 @@
+/*
+Module: download.c
+Description: streamed download of files to slave node objects. The bytes
+received from the session are written in a ring buffer read by the block SDO
+download of sdoxfer.c, their place is reused once acknowledged by the node.
+*/
+
+#include <stdio.h>
+#include <string.h>
+
+#include "canfestival.h"
+#include "gateway.h"
+#include "../../../netSocket/netSocket.h"
+#include "sdosched.h"
+#include "sdoxfer.h"
+#include "download.h"
+
+//****************************************************************************
+// TYPES
+
+typedef struct
+{
+    UNS8 used;
+    UNS8 running;               /* the SDO transfer is not completed */
+    UNS8 receiving;             /* the session send the bytes of the file */
+    UNS8 waiting;               /* the session wait for room in the ring */
+    s_REQUESTER rq;
+    CO_Data* d;                 /* bus of the node */
+    UNS8 nodeid;
+    UNS32 size;
+    UNS32 received;
+    unsigned long start;
+    unsigned long lastProgress;
+    s_SDOSTREAM stream;
+    UNS8 ring[DL_RING_SIZE];
+} s_DOWNLOAD;
+
+//****************************************************************************
+// GLOBALS
+
+static s_DOWNLOAD gstaticDownloads[DL_MAX];
+
+
+/*
+This function find the download receiving the messages of a session
+input: session identifier
+return: download or NULL
+*/
+
+static s_DOWNLOAD* DlFind(int session)
+{
+    int i;
+
+    for(i=0; i<DL_MAX; i++)
+    {
+        if(gstaticDownloads[i].used && gstaticDownloads[i].receiving && gstaticDownloads[i].rq.session == session)
+            return &gstaticDownloads[i];
+    }
+    return NULL;
+}
+
+/*
+This function release a download when its transfer and its reception are over
+input: download
+*/
+
+static void DlRelease(s_DOWNLOAD* dl)
+{
+    if(!dl->running && !dl->receiving) dl->used = 0;
+}
+
+/*
+This function return the room of the ring buffer, a failed transfer drop the bytes
+input: download
+*/
+
+static UNS32 DlRoom(s_DOWNLOAD* dl)
+{
+    if(!dl->running) return DL_RING_SIZE;
+    return DL_RING_SIZE - (dl->stream.head - dl->stream.tail);
+}
+
+/* Callback function of the bytes acknowledged by the node */
+static void DlReleased(CO_Data* d, s_SDOREQ* req)
+{
+    s_DOWNLOAD* dl = req->context;
+    unsigned long now = GatewayTime();
+    char retbuf[80];
+
+    if(now - dl->lastProgress >= DL_PROGRESS_MS)
+    {
+        dl->lastProgress = now;
+        sprintf(retbuf,"000 dl node %d progress %lu/%lu bytes",dl->nodeid,(unsigned long)dl->stream.tail,(unsigned long)dl->size);
+        SendReply(&dl->rq, retbuf);
+    }
+    if(dl->waiting && DlRoom(dl) >= NET_FRAME_MAX)
+    {
+        dl->waiting = 0;
+        WakeSessions();
+    }
+}
+
+/* Callback function of the completion of a download */
+static void DlDone(CO_Data* d, s_SDOREQ* req)
+{
+    s_DOWNLOAD* dl = req->context;
+    char retbuf[100];
+
+    dl->running = 0;
+    if(req->result == SDO_FINISHED)
+        sprintf(retbuf,"000 dl node %d ok with %lu bytes in %lu ms",dl->nodeid,(unsigned long)dl->size,GatewayTime() - dl->start);
+    else
+        sprintf(retbuf,"404 dl node %d failed after %lu bytes with abort code %x",dl->nodeid,(unsigned long)dl->stream.tail,req->abortCode);
+    SendReply(&dl->rq, retbuf);
+
+    /* The rest of the file is dropped, without waiting */
+    if(dl->waiting)
+    {
+        dl->waiting = 0;
+        WakeSessions();
+    }
+    DlRelease(dl);
+}
+
+/*
+This function start the download of a file received from a session
+input: CO_Data structure, requester, node identifier, index, subindex, size in bytes
+return: 0, -1 if the node is invalid or -2 if no more download is possible
+*/
+
+int DlStart(CO_Data* d, s_REQUESTER* rq, UNS8 nodeid, UNS16 index, UNS8 subindex, UNS32 size)
+{
+    int i;
+    s_DOWNLOAD* dl = NULL;
+    s_SDOREQ* req;
+
+    if(nodeid == 0 || nodeid > MAX_NODES) return -1;
+    for(i=0; i<DL_MAX && dl == NULL; i++) if(!gstaticDownloads[i].used) dl = &gstaticDownloads[i];
+    if(dl == NULL || (req = SdoAlloc()) == NULL) return -2;
+
+    dl->used = 1;
+    dl->running = 1;
+    dl->receiving = 1;
+    dl->waiting = 0;
+    dl->rq = *rq;
+    dl->d = d;
+    dl->nodeid = nodeid;
+    dl->size = size;
+    dl->received = 0;
+    dl->start = dl->lastProgress = GatewayTime();
+    dl->stream.ring = dl->ring;
+    dl->stream.ringSize = DL_RING_SIZE;
+    dl->stream.head = 0;
+    dl->stream.tail = 0;
+    dl->stream.released = DlReleased;
+
+    req->type = SDO_WRITE;
+    req->nodeid = nodeid;
+    req->index = index;
+    req->subindex = subindex;
+    req->size = size;
+    req->stream = &dl->stream;
+    req->rq = *rq;
+    req->context = dl;
+    req->done = DlDone;
+    SdoSubmit(d, req);
+    return 0;
+}
+
+/*
+This function tell if the next messages of a session are bytes of a download
+input: session identifier
+return: 1 if a download wait for bytes, 0 otherwise
+*/
+
+int DlExpected(int session)
+{
+    return DlFind(session) != NULL;
+}
+
+/*
+This function tell if a message of a session can be given to its download,
+the command thread is woken by WakeSessions when it can
+input: session identifier
+return: 1 if the ring has room for a message, 0 otherwise
+*/
+
+int DlReady(int session)
+{
+    s_DOWNLOAD* dl = DlFind(session);
+
+    if(dl == NULL || DlRoom(dl) >= NET_FRAME_MAX) return 1;
+    dl->waiting = 1;
+    return 0;
+}
+
+/*
+This function give bytes received from a session to its download
+input: session identifier, bytes, number of bytes
+*/
+
+void DlFeed(int session, char* data, int len)
+{
+    s_DOWNLOAD* dl = DlFind(session);
+    UNS32 n, pos, first;
+
+    if(dl == NULL) return;
+
+    /* Bytes beyond the announced size are ignored */
+    n = dl->size - dl->received < (UNS32)len ? dl->size - dl->received : (UNS32)len;
+    dl->received += n;
+    if(dl->running)
+    {
+        if(n > DlRoom(dl)) n = DlRoom(dl);
+        pos = dl->stream.head % DL_RING_SIZE;
+        first = DL_RING_SIZE - pos < n ? DL_RING_SIZE - pos : n;
+        memcpy(dl->ring + pos, data, first);
+        memcpy(dl->ring, data + first, n - first);
+        dl->stream.head += n;
+        SdoxStreamed(dl->d, dl->nodeid);
+    }
+    if(dl->received == dl->size)
+    {
+        dl->receiving = 0;
+        DlRelease(dl);
+    }
+}
+
+/*
+This function forget the host of the downloads of a closed session, a
+transfer that miss bytes end with a timeout
+input: session identifier
+*/
+
+void DlDropSession(int session)
+{
+    int i;
+
+    for(i=0; i<DL_MAX; i++)
+    {
+        if(gstaticDownloads[i].used && gstaticDownloads[i].rq.session == session)
+        {
+            gstaticDownloads[i].receiving = 0;
+            gstaticDownloads[i].waiting = 0;
+            DlRelease(&gstaticDownloads[i]);
+        }
+    }
+}
@@ -0,0 +1,61 @@
+#ifndef DOWNLOAD_H_INCLUDED
+#define DOWNLOAD_H_INCLUDED
+
+/*
+Streamed download of a file to a slave node object (firmware, program).
+After the dl# command is accepted, the messages of the session are the bytes
+of the file until the announced size is received. They go through a ring
+buffer to a block SDO download (sdoxfer.c) and the file is never held whole.
+The messages wait in the command ring of the session while the ring has no
+room for them, and the host is not read while the command ring is full: the TCP
+flow control slow down the host to the speed of the bus.
+A progress message is sent each DL_PROGRESS_MS and a last message tell the
+result of the transfer.
+All the functions must be called with the stack mutex held (EnterMutex).
+*/
+
+/* Downloads running at the same time */
+#define DL_MAX 4
+
+/* Bytes of the ring buffer of a download, at least a message and a block */
+#define DL_RING_SIZE 16384
+
+/* Period of the progress messages */
+#define DL_PROGRESS_MS 1000
+
+/*
+This function start the download of a file received from a session
+input: CO_Data structure, requester, node identifier, index, subindex, size in bytes
+return: 0, -1 if the node is invalid or -2 if no more download is possible
+*/
+int DlStart(CO_Data*, s_REQUESTER*, UNS8, UNS16, UNS8, UNS32);
+
+/*
+This function tell if the next messages of a session are bytes of a download
+input: session identifier
+return: 1 if a download wait for bytes, 0 otherwise
+*/
+int DlExpected(int);
+
+/*
+This function tell if a message of a session can be given to its download,
+the command thread is woken by WakeSessions when it can
+input: session identifier
+return: 1 if the ring has room for a message, 0 otherwise
+*/
+int DlReady(int);
+
+/*
+This function give bytes received from a session to its download
+input: session identifier, bytes, number of bytes
+*/
+void DlFeed(int, char*, int);
+
+/*
+This function forget the host of the downloads of a closed session, a
+transfer that miss bytes end with a timeout
+input: session identifier
+*/
+void DlDropSession(int);
+
+#endif // DOWNLOAD_H_INCLUDED
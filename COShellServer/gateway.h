@@ -0,0 +1,64 @@
+#ifndef GATEWAY_H_INCLUDED
+#define GATEWAY_H_INCLUDED
+
+/*
+Declarations shared by the modules of the CANOpenShell server.
+The gateway serve up to MAX_BUSES CAN buses, each one with its CO_Data
+structure: the modules keep the state of a node for the bus of the CO_Data
+structure they are given.
+*/
+
+#define MAX_NODES 127
+#define MAX_BUSES 4
+
+/*
+Origin of a command, used to address its reply.
+A host may prefix a command with "@id " to keep several commands in flight,
+the reply then carry the same prefix and may arrive out of order.
+*/
+typedef struct
+{
+    int session;            /* session identifier, 0 for the init file */
+    unsigned int tag;       /* correlation identifier, 0 when the command is not tagged */
+} s_REQUESTER;
+
+/*
+This function send a reply string to the host of a session
+input: requester, reply string
+*/
+void SendReply(s_REQUESTER*, char*);
+
+/*
+This function send a binary message to the host of a session in the framed
+protocol, it is dropped when the host is disconnected
+input: session identifier, message, number of bytes (NET_FRAME_MAX at most)
+return: 0 or -1 if the reply queue is full
+*/
+int SendData(int, char*, int);
+
+/*
+This function return the index of the bus of a CO_Data structure
+input: CO_Data structure
+return: bus index, 0 to MAX_BUSES - 1
+*/
+int BusIndex(CO_Data*);
+
+/*
+This function return the CO_Data structure of a bus
+input: bus index
+return: CO_Data structure or NULL if the bus is not loaded
+*/
+CO_Data* BusData(int);
+
+/*
+This function return a monotonic time in milliseconds
+*/
+unsigned long GatewayTime(void);
+
+/*
+This function make the command thread serve again the sessions that wait for
+room in a download, it may be called from any thread
+*/
+void WakeSessions(void);
+
+#endif // GATEWAY_H_INCLUDED
@@ -0,0 +1,355 @@
+/*
+Module: inventory.c
+Description: persistent node inventory of the CANOpenShell server.
+The file hold a header and the records of all the node ids of MAX_BUSES
+buses. It is mapped shared, so a record is written to the file by the kernel
+when it is changed, msync only schedule the write earlier.
+The reads of a check are queued on the SDO scheduler with a short timeout,
+all at once: they run in order on the node, the checks of several nodes
+run concurrently. Each node has its own check, the requesters of info# that
+arrive while it runs are answered together when it completes.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+
+#include "canfestival.h"
+#include "gateway.h"
+#include "sdosched.h"
+#include "inventory.h"
+
+//****************************************************************************
+// DEFINES
+
+#define INV_MAGIC 0x564E4943            /* "CINV" */
+#define INV_VERSION 1
+
+//****************************************************************************
+// TYPES
+
+typedef struct
+{
+    UNS32 magic;
+    UNS16 version;
+    UNS16 recordSize;
+    UNS16 buses;
+    UNS16 nodes;
+} s_INVHEADER;
+
+typedef struct
+{
+    s_INVHEADER header;
+    s_NODEIDENTITY records[MAX_BUSES][MAX_NODES + 1];
+} s_INVFILE;
+
+typedef struct
+{
+    UNS8 running;
+    UNS8 replaced;              /* the identity differ from the record, the device type is read */
+    int waiting;                /* requesters waiting for the result */
+    s_REQUESTER rq[INV_WAITERS];
+    int pending;                /* reads queued and not completed */
+    UNS8 queued;                /* bit of each value read: 0 device type, 1 to 3 identity */
+    UNS8 answered;              /* bit of each read that got a response, even an abort */
+    UNS32 abortCode;            /* abort code of the first failed read */
+    UNS32 value[4];             /* device type, vendor id, product code, revision number */
+} s_INVCHECK;
+
+//****************************************************************************
+// GLOBALS
+
+static s_INVFILE gstaticMemory;                 /* inventory when the file cannot be mapped */
+static s_INVFILE* gstaticInv = &gstaticMemory;
+static int gstaticMapped;
+static s_INVCHECK gstaticChecks[MAX_BUSES][MAX_NODES + 1];
+
+static void InvReadDone(CO_Data* d, s_SDOREQ* req);
+
+
+/*
+This function map the inventory file in memory, the file is created or
+cleared when it does not match the inventory of this gateway
+input: file name
+return: 0 or -1 if the file cannot be mapped, the inventory is then kept in memory only
+*/
+
+int InvOpen(char* path)
+{
+    s_INVFILE* inv;
+    int fd, b, i, n;
+
+    if((fd = open(path, O_RDWR | O_CREAT, 0644)) < 0)
+    {
+        perror(path);
+        return -1;
+    }
+    if(ftruncate(fd, sizeof(s_INVFILE)) < 0)
+    {
+        perror(path);
+        close(fd);
+        return -1;
+    }
+    inv = mmap(NULL, sizeof(s_INVFILE), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if(inv == MAP_FAILED)
+    {
+        perror(path);
+        return -1;
+    }
+
+    /* A new file is filled with zeroes, a file of another build of the gateway is cleared */
+    if(inv->header.magic != INV_MAGIC || inv->header.version != INV_VERSION ||
+       inv->header.recordSize != sizeof(s_NODEIDENTITY) || inv->header.buses != MAX_BUSES ||
+       inv->header.nodes != MAX_NODES)
+    {
+        memset(inv, 0, sizeof(s_INVFILE));
+        inv->header.magic = INV_MAGIC;
+        inv->header.version = INV_VERSION;
+        inv->header.recordSize = sizeof(s_NODEIDENTITY);
+        inv->header.buses = MAX_BUSES;
+        inv->header.nodes = MAX_NODES;
+    }
+
+    /* The records are trusted until the nodes are checked again */
+    for(b=0, n=0; b<MAX_BUSES; b++)
+    {
+        for(i=1; i<=MAX_NODES; i++)
+        {
+            inv->records[b][i].verified = 0;
+            if(inv->records[b][i].present) n++;
+        }
+    }
+    gstaticInv = inv;
+    gstaticMapped = 1;
+    printf("Inventory %s: %d nodes recorded\n", path, n);
+    return 0;
+}
+
+/*
+This function write the inventory to its file and unmap it
+*/
+
+void InvClose(void)
+{
+    if(!gstaticMapped) return;
+    msync(gstaticInv, sizeof(s_INVFILE), MS_SYNC);
+    munmap(gstaticInv, sizeof(s_INVFILE));
+    gstaticInv = &gstaticMemory;
+    gstaticMapped = 0;
+}
+
+/*
+This function schedule the write of the changed records to the file
+*/
+
+void InvFlush(void)
+{
+    if(gstaticMapped) msync(gstaticInv, sizeof(s_INVFILE), MS_ASYNC);
+}
+
+/*
+This function return the record of a node
+input: CO_Data structure of the bus, node identifier (1 to MAX_NODES)
+return: record
+*/
+
+s_NODEIDENTITY* InvNode(CO_Data* d, UNS8 nodeid)
+{
+    return &gstaticInv->records[BusIndex(d)][nodeid];
+}
+
+/*
+This function return the identity of a node recorded in the inventory
+input: CO_Data structure of the bus, node identifier
+return: identity or NULL if the node is not recorded
+*/
+
+s_NODEIDENTITY* InvLookup(CO_Data* d, UNS8 nodeid)
+{
+    s_NODEIDENTITY* id;
+
+    if(nodeid == 0 || nodeid > MAX_NODES) return NULL;
+    id = InvNode(d, nodeid);
+    return id->present ? id : NULL;
+}
+
+/*
+This function replace the records of a bus, as found by a scan
+input: CO_Data structure of the bus, records of the node identifiers 0 to MAX_NODES
+*/
+
+void InvStoreBus(CO_Data* d, s_NODEIDENTITY* records)
+{
+    memcpy(gstaticInv->records[BusIndex(d)], records, sizeof gstaticInv->records[0]);
+}
+
+/*
+This function queue a read of a check
+input: CO_Data structure, check, node identifier, index, subindex
+return: 0 or -1 if no request is available
+*/
+
+static int InvRead(CO_Data* d, s_INVCHECK* c, UNS8 nodeid, UNS16 index, UNS8 subindex)
+{
+    s_SDOREQ* req = SdoAlloc();
+
+    if(req == NULL) return -1;
+    req->type = SDO_READ;
+    req->nodeid = nodeid;
+    req->index = index;
+    req->subindex = subindex;
+    req->timeout = INV_TIMEOUT_MS;
+    req->context = c;
+    req->done = InvReadDone;
+    c->pending++;
+    c->queued |= 1 << (index == 0x1000 ? 0 : subindex);
+    SdoSubmit(d, req);
+    return 0;
+}
+
+/*
+This function send the identity of a node to a requester of info#
+input: node identifier, record or NULL when the check is incomplete, abort code of the check, requester
+*/
+
+static void InvReply(UNS8 nodeid, s_NODEIDENTITY* id, UNS32 abortCode, s_REQUESTER* rq)
+{
+    char retbuf[100];
+
+    if(id != NULL && id->present)
+        sprintf(retbuf,"000 info node %d type %x vendor %x product %x revision %x",nodeid,
+                id->deviceType,id->vendorId,id->productCode,id->revision);
+    else
+        sprintf(retbuf,"404 info node %d failed with abort code %x",nodeid,abortCode);
+    SendReply(rq, retbuf);
+}
+
+/*
+This function update the record of a checked node and answer its requesters.
+A check with a read left without response (timeout on a busy bus) change
+nothing, the node stay unchecked.
+input: CO_Data structure, check, node identifier
+*/
+
+static void InvFinish(CO_Data* d, s_INVCHECK* c, UNS8 nodeid)
+{
+    s_NODEIDENTITY* id = InvNode(d, nodeid);
+    int i, complete = c->answered == c->queued;
+
+    c->running = 0;
+    if(c->answered == 0)
+    {
+        /* The node is gone */
+        if(id->present) printf("Inventory: node %d not found\n", nodeid);
+        id->present = 0;
+    }
+    else if(!complete)
+    {
+        printf("Inventory: node %d not checked, a read timed out\n", nodeid);
+    }
+    else if(c->replaced)
+    {
+        printf("Inventory: node %d recorded\n", nodeid);
+        id->present = 1;
+        id->deviceType = c->value[0];
+        id->vendorId = c->value[1];
+        id->productCode = c->value[2];
+        id->revision = c->value[3];
+    }
+    if(complete || c->answered == 0) id->verified = 1;
+    if((complete && c->replaced) || c->answered == 0) InvFlush();
+
+    for(i=0; i<c->waiting; i++) InvReply(nodeid, complete || c->answered == 0 ? id : NULL, c->abortCode, &c->rq[i]);
+    c->waiting = 0;
+}
+
+/* Callback function of the reads of a check */
+static void InvReadDone(CO_Data* d, s_SDOREQ* req)
+{
+    s_INVCHECK* c = req->context;
+    s_NODEIDENTITY* id = InvNode(d, req->nodeid);
+    int k = req->index == 0x1000 ? 0 : req->subindex;
+
+    c->pending--;
+    if(req->result == SDO_FINISHED || req->result == SDO_ABORTED_RCV) c->answered |= 1 << k;
+    if(req->result == SDO_FINISHED) c->value[k] = req->data;
+    else if(c->abortCode == 0) c->abortCode = req->abortCode;
+    if(c->pending) return;
+
+    /* The device type of a recorded node is read only when it was replaced,
+    the identity is compared only when every read got a response */
+    if(!c->replaced && c->answered != 0 && c->answered == c->queued &&
+       (id->vendorId != c->value[1] || id->productCode != c->value[2] || id->revision != c->value[3]))
+    {
+        c->replaced = 1;
+        if(InvRead(d, c, req->nodeid, 0x1000, 0) == 0) return;
+    }
+    InvFinish(d, c, req->nodeid);
+}
+
+/*
+This function send the identity of a node to a requester, from its record
+when the node was checked since the start of the gateway, otherwise when the
+check started here or already running is completed.
+An unknown node get its four identity entries read at once, a recorded
+node only its identity 0x1018.
+input: CO_Data structure, node identifier, requester or NULL to check the node only
+return: 0, -1 if the node identifier is invalid or -2 if the node has too
+many requesters or no read can be queued
+*/
+
+int InvQuery(CO_Data* d, UNS8 nodeid, s_REQUESTER* rq)
+{
+    s_NODEIDENTITY* id;
+    s_INVCHECK* c;
+    int i;
+
+    if(nodeid == 0 || nodeid > MAX_NODES) return -1;
+    id = InvNode(d, nodeid);
+    c = &gstaticChecks[BusIndex(d)][nodeid];
+
+    if(!c->running && id->verified && rq != NULL)
+    {
+        InvReply(nodeid, id, 0, rq);
+        return 0;
+    }
+    if(rq != NULL)
+    {
+        if(c->waiting == INV_WAITERS) return -2;
+        c->rq[c->waiting++] = *rq;
+    }
+    if(c->running) return 0;
+
+    c->running = 1;
+    c->replaced = !id->present;
+    c->pending = 0;
+    c->queued = 0;
+    c->answered = 0;
+    c->abortCode = 0;
+    memset(c->value, 0, sizeof c->value);
+    if(c->replaced) InvRead(d, c, nodeid, 0x1000, 0);
+    for(i=1; i<=3; i++) InvRead(d, c, nodeid, 0x1018, (UNS8)i);
+    if(c->pending == 0)
+    {
+        /* No read could be queued, the record is left unchecked */
+        c->running = 0;
+        c->waiting = 0;
+        return -2;
+    }
+    return 0;
+}
+
+/*
+This function check the identity of a node that boot up
+input: CO_Data structure, node identifier
+*/
+
+void InvNodeBootup(CO_Data* d, UNS8 nodeid)
+{
+    if(nodeid == 0 || nodeid > MAX_NODES) return;
+    InvNode(d, nodeid)->verified = 0;
+    InvQuery(d, nodeid, NULL);
+}
@@ -0,0 +1,95 @@
+#ifndef INVENTORY_H_INCLUDED
+#define INVENTORY_H_INCLUDED
+
+/*
+Persistent node inventory.
+The identity of the nodes of every bus (device type 0x1000 and identity
+0x1018 subindexes 1 to 3) is kept in a small file mapped in memory, so a
+restarted gateway know the nodes of its buses without reading them again.
+The records of the file are trusted until the node is checked: when a node
+boot up, or on the first info# after a restart, only the identity 0x1018 is
+read and compared with its record, the device type is read again when the
+node was replaced. The checks also serve info#: they run for many nodes
+at a time, with their state kept per node.
+The buses are recorded by index, in the order of their load# command.
+All the functions must be called with the stack mutex held (EnterMutex),
+except InvOpen and InvClose.
+*/
+
+/* Default inventory file, in the working directory of the server */
+#define INV_FILE "canopenshell.inv"
+
+/* Time allowed to a node to answer a read of a check, in ms */
+#define INV_TIMEOUT_MS 100
+
+/* info# requesters waiting for the check of one node */
+#define INV_WAITERS 4
+
+/* Identity of a node */
+typedef struct
+{
+    UNS8 present;
+    UNS8 verified;              /* checked since the start of the gateway */
+    UNS32 deviceType;           /* 0x1000 */
+    UNS32 vendorId;             /* 0x1018,01 */
+    UNS32 productCode;          /* 0x1018,02, 0 if not implemented */
+    UNS32 revision;             /* 0x1018,03, 0 if not implemented */
+} s_NODEIDENTITY;
+
+/*
+This function map the inventory file in memory, the file is created or
+cleared when it does not match the inventory of this gateway
+input: file name
+return: 0 or -1 if the file cannot be mapped, the inventory is then kept in memory only
+*/
+int InvOpen(char*);
+
+/*
+This function write the inventory to its file and unmap it
+*/
+void InvClose(void);
+
+/*
+This function schedule the write of the changed records to the file
+*/
+void InvFlush(void);
+
+/*
+This function return the record of a node
+input: CO_Data structure of the bus, node identifier (1 to MAX_NODES)
+return: record
+*/
+s_NODEIDENTITY* InvNode(CO_Data*, UNS8);
+
+/*
+This function return the identity of a node recorded in the inventory
+input: CO_Data structure of the bus, node identifier
+return: identity or NULL if the node is not recorded
+*/
+s_NODEIDENTITY* InvLookup(CO_Data*, UNS8);
+
+/*
+This function replace the records of a bus, as found by a scan
+input: CO_Data structure of the bus, records of the node identifiers 0 to MAX_NODES
+*/
+void InvStoreBus(CO_Data*, s_NODEIDENTITY*);
+
+/*
+This function send the identity of a node to a requester, from its record
+when the node was checked since the start of the gateway, otherwise when the
+check started here or already running is completed.
+An unknown node get its four identity entries read at once, a recorded
+node only its identity 0x1018.
+input: CO_Data structure, node identifier, requester or NULL to check the node only
+return: 0, -1 if the node identifier is invalid or -2 if the node has too
+many requesters or no read can be queued
+*/
+int InvQuery(CO_Data*, UNS8, s_REQUESTER*);
+
+/*
+This function check the identity of a node that boot up
+input: CO_Data structure, node identifier
+*/
+void InvNodeBootup(CO_Data*, UNS8);
+
+#endif // INVENTORY_H_INCLUDED
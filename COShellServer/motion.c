@@ -0,0 +1,363 @@
+/*
+Module: motion.c
+Description: move# and halt# commands of the CANOpenShell server for CiA 402
+drives. A command is a chain of SDO transfers on one node: each completion
+callback look at the step reached and the last statusword read, and queue
+the next transfer. Only one transfer of a command is queued at a time, so a
+halt# can take the place of a move# between two of its steps.
+*/
+
+#include <stdio.h>
+#include <string.h>
+
+#include "canfestival.h"
+#include "gateway.h"
+#include "sdosched.h"
+#include "odcache.h"
+#include "motion.h"
+
+//****************************************************************************
+// DEFINES
+
+/* Objects of the drive profile */
+#define OBJ_CONTROLWORD 0x6040
+#define OBJ_STATUSWORD 0x6041
+#define OBJ_MODE 0x6060
+#define OBJ_TARGET_POSITION 0x607A
+#define OBJ_PROFILE_VELOCITY 0x6081
+
+#define MODE_PROFILE_POSITION 1
+
+/* Controlword commands and bits */
+#define CW_DISABLE_VOLTAGE 0x0000
+#define CW_SHUTDOWN 0x0006
+#define CW_SWITCH_ON 0x0007
+#define CW_ENABLE_OPERATION 0x000F
+#define CW_NEW_SETPOINT 0x0010
+#define CW_IMMEDIATE 0x0020
+#define CW_RELATIVE 0x0040
+#define CW_FAULT_RESET 0x0080
+#define CW_HALT 0x0100
+
+/* States of the statusword, compared under SW_MASK or SW_MASK_QS */
+#define SW_MASK 0x004F
+#define SW_MASK_QS 0x006F
+#define SW_NOT_READY 0x0000
+#define SW_SWITCH_ON_DISABLED 0x0040
+#define SW_READY_TO_SWITCH_ON 0x0021
+#define SW_SWITCHED_ON 0x0023
+#define SW_OPERATION_ENABLED 0x0027
+#define SW_QUICK_STOP_ACTIVE 0x0007
+#define SW_FAULT_REACTION 0x000F
+#define SW_FAULT 0x0008
+
+/* Statusword bits of the profile position mode */
+#define SW_TARGET_REACHED 0x0400
+#define SW_SETPOINT_ACK 0x1000
+
+/* Steps of a command, named by the transfer queued */
+#define MV_IDLE 0
+#define MV_STATUS 1             /* statusword read, the state machine is followed */
+#define MV_TRANSITION 2         /* controlword written toward operation enabled */
+#define MV_MODE 3
+#define MV_VELOCITY 4
+#define MV_TARGET 5
+#define MV_SETPOINT 6           /* controlword with the new set-point bit */
+#define MV_ACK 7                /* statusword read until the set-point is acknowledged */
+#define MV_RELEASE 8            /* controlword without the new set-point bit */
+#define MV_HALT 9               /* statusword read, only an enabled drive is halted */
+#define MV_HALTING 10           /* controlword with the halt bit */
+#define MV_STOPPING 11          /* statusword read until the drive stand still */
+
+//****************************************************************************
+// TYPES
+
+typedef struct
+{
+    UNS8 step;
+    UNS8 halting;               /* a halt# wait for the end of the running move# */
+    s_REQUESTER rq;             /* host of the running command */
+    s_REQUESTER haltRq;         /* host of the waiting halt# */
+    UNS32 position;
+    UNS32 velocity;
+    UNS16 setpoint;             /* controlword giving the set-point */
+    UNS16 control;              /* last controlword written */
+    UNS16 status;               /* last statusword read */
+    unsigned long deadline;
+} s_MOTION;
+
+//****************************************************************************
+// GLOBALS
+
+static s_MOTION gstaticMotions[MAX_BUSES][MAX_NODES + 1];
+
+static void MotionDone(CO_Data* d, s_SDOREQ* req);
+
+
+/*
+This function queue the next transfer of a command
+input: CO_Data structure, motion, node identifier, step, type, index, size in bytes, value
+return: 0 or -1 if no request is available
+*/
+
+static int MotionSubmit(CO_Data* d, s_MOTION* m, UNS8 nodeid, UNS8 step, UNS8 type, UNS16 index,
+                        UNS32 size, UNS32 data)
+{
+    s_SDOREQ* req = SdoAlloc();
+
+    if(req == NULL) return -1;
+    req->type = type;
+    req->nodeid = nodeid;
+    req->index = index;
+    req->size = size;
+    req->data = data;
+    req->context = m;
+    req->done = MotionDone;
+    if(index == OBJ_CONTROLWORD) m->control = (UNS16)data;
+    m->step = step;
+    SdoSubmit(d, req);
+    return 0;
+}
+
+/*
+This function return the controlword that bring the drive one state closer
+to operation enabled
+input: motion, statusword
+return: controlword, -1 when the operation is enabled or -2 to read the statusword again
+*/
+
+static int MotionTransition(s_MOTION* m, UNS16 status)
+{
+    if((status & SW_MASK_QS) == SW_OPERATION_ENABLED) return -1;
+    if((status & SW_MASK) == SW_FAULT)
+    {
+        /* The fault reset is done on the rising edge of its bit */
+        return m->control == CW_FAULT_RESET ? CW_DISABLE_VOLTAGE : CW_FAULT_RESET;
+    }
+    if((status & SW_MASK) == SW_SWITCH_ON_DISABLED) return CW_SHUTDOWN;
+    if((status & SW_MASK_QS) == SW_READY_TO_SWITCH_ON) return CW_SWITCH_ON;
+    if((status & SW_MASK_QS) == SW_SWITCHED_ON || (status & SW_MASK_QS) == SW_QUICK_STOP_ACTIVE)
+        return CW_ENABLE_OPERATION;
+    return -2;      /* not ready to switch on or fault reaction active */
+}
+
+/*
+This function start the halt of a drive
+input: CO_Data structure, motion, node identifier
+return: 0 or -1 if no request is available
+*/
+
+static int MotionStartHalt(CO_Data* d, s_MOTION* m, UNS8 nodeid)
+{
+    m->halting = 0;
+    m->rq = m->haltRq;
+    m->deadline = GatewayTime() + MOTION_HALT_TIMEOUT_MS;
+    if(MotionSubmit(d, m, nodeid, MV_HALT, SDO_READ, OBJ_STATUSWORD, 0, 0) == 0) return 0;
+    m->step = MV_IDLE;
+    return -1;
+}
+
+/*
+This function end the running command with its reply, and start the halt
+that waited for it
+input: CO_Data structure, motion, node identifier, reply string
+*/
+
+static void MotionFinish(CO_Data* d, s_MOTION* m, UNS8 nodeid, char* reply)
+{
+    char retbuf[60];
+
+    m->step = MV_IDLE;
+    SendReply(&m->rq, reply);
+    if(m->halting && MotionStartHalt(d, m, nodeid) < 0)
+    {
+        sprintf(retbuf,"404 halt node %d gateway busy",nodeid);
+        SendReply(&m->rq, retbuf);
+    }
+}
+
+/* Timer of the polls: read the statusword of the node given by the alarm id */
+static void MotionPollElapsed(CO_Data* d, UNS32 nodeid)
+{
+    s_MOTION* m = &gstaticMotions[BusIndex(d)][nodeid];
+    char retbuf[80];
+
+    if(MotionSubmit(d, m, (UNS8)nodeid, m->step, SDO_READ, OBJ_STATUSWORD, 0, 0) == 0) return;
+    sprintf(retbuf,"404 %s node %d gateway busy",m->step >= MV_HALT ? "halt" : "move",nodeid);
+    MotionFinish(d, m, (UNS8)nodeid, retbuf);
+}
+
+/*
+This function read the statusword again after MOTION_POLL_MS while the
+deadline of the command is not reached
+input: CO_Data structure, motion, node identifier, name of the command
+*/
+
+static void MotionPoll(CO_Data* d, s_MOTION* m, UNS8 nodeid, char* name)
+{
+    char retbuf[80];
+
+    if((long)(GatewayTime() - m->deadline) > 0)
+        sprintf(retbuf,"404 %s node %d timeout with statusword %4.4x",name,nodeid,m->status);
+    else if(SetAlarm(d, nodeid, MotionPollElapsed, MS_TO_TIMEVAL(MOTION_POLL_MS), 0) != TIMER_NONE)
+        return;
+    else
+        sprintf(retbuf,"404 %s node %d gateway busy",name,nodeid);
+    MotionFinish(d, m, nodeid, retbuf);
+}
+
+/* Callback function of the transfers of a command */
+static void MotionDone(CO_Data* d, s_SDOREQ* req)
+{
+    s_MOTION* m = req->context;
+    UNS8 nodeid = req->nodeid;
+    char* name = m->step >= MV_HALT ? "halt" : "move";
+    char retbuf[80];
+    int control, ret = 0;
+
+    if(req->result != SDO_FINISHED)
+    {
+        sprintf(retbuf,"404 %s node %d failed on %4.4x with abort code %x",name,nodeid,req->index,req->abortCode);
+        MotionFinish(d, m, nodeid, retbuf);
+        return;
+    }
+    if(req->type == SDO_WRITE) OdCacheInvalidate(d, nodeid, req->index, 0);
+    else m->status = (UNS16)req->data;
+
+    /* A halt end the move, the drive stop on the set-point given or not */
+    if(m->halting && m->step < MV_RELEASE)
+    {
+        sprintf(retbuf,"404 move node %d halted",nodeid);
+        MotionFinish(d, m, nodeid, retbuf);
+        return;
+    }
+
+    switch(m->step)
+    {
+    case MV_STATUS:
+        control = MotionTransition(m, m->status);
+        if(control == -1)
+            ret = MotionSubmit(d, m, nodeid, MV_MODE, SDO_WRITE, OBJ_MODE, 1, MODE_PROFILE_POSITION);
+        else if(control >= 0)
+            ret = MotionSubmit(d, m, nodeid, MV_TRANSITION, SDO_WRITE, OBJ_CONTROLWORD, 2, (UNS32)control);
+        else
+            MotionPoll(d, m, nodeid, name);
+        break;
+    case MV_TRANSITION:
+        m->step = MV_STATUS;
+        MotionPoll(d, m, nodeid, name);
+        break;
+    case MV_MODE:
+        ret = MotionSubmit(d, m, nodeid, MV_VELOCITY, SDO_WRITE, OBJ_PROFILE_VELOCITY, 4, m->velocity);
+        break;
+    case MV_VELOCITY:
+        ret = MotionSubmit(d, m, nodeid, MV_TARGET, SDO_WRITE, OBJ_TARGET_POSITION, 4, m->position);
+        break;
+    case MV_TARGET:
+        ret = MotionSubmit(d, m, nodeid, MV_SETPOINT, SDO_WRITE, OBJ_CONTROLWORD, 2, m->setpoint);
+        break;
+    case MV_SETPOINT:
+        m->step = MV_ACK;
+        MotionPoll(d, m, nodeid, name);
+        break;
+    case MV_ACK:
+        if((m->status & SW_MASK) == SW_FAULT)
+        {
+            sprintf(retbuf,"404 move node %d fault with statusword %4.4x",nodeid,m->status);
+            MotionFinish(d, m, nodeid, retbuf);
+        }
+        else if(m->status & SW_SETPOINT_ACK)
+            ret = MotionSubmit(d, m, nodeid, MV_RELEASE, SDO_WRITE, OBJ_CONTROLWORD, 2, CW_ENABLE_OPERATION);
+        else
+            MotionPoll(d, m, nodeid, name);
+        break;
+    case MV_RELEASE:
+        sprintf(retbuf,"000 move node %d started",nodeid);
+        MotionFinish(d, m, nodeid, retbuf);
+        break;
+    case MV_HALT:
+        if((m->status & SW_MASK_QS) == SW_OPERATION_ENABLED)
+            ret = MotionSubmit(d, m, nodeid, MV_HALTING, SDO_WRITE, OBJ_CONTROLWORD, 2, CW_ENABLE_OPERATION | CW_HALT);
+        else
+        {
+            /* The halt bit would enable a switched on drive, a disabled drive does not move */
+            sprintf(retbuf,"000 halt node %d stopped, statusword %4.4x",nodeid,m->status);
+            MotionFinish(d, m, nodeid, retbuf);
+        }
+        break;
+    case MV_HALTING:
+        m->step = MV_STOPPING;
+        MotionPoll(d, m, nodeid, name);
+        break;
+    case MV_STOPPING:
+        if(m->status & SW_TARGET_REACHED)
+        {
+            sprintf(retbuf,"000 halt node %d stopped",nodeid);
+            MotionFinish(d, m, nodeid, retbuf);
+        }
+        else
+            MotionPoll(d, m, nodeid, name);
+        break;
+    }
+
+    if(ret < 0)
+    {
+        sprintf(retbuf,"404 %s node %d gateway busy",name,nodeid);
+        MotionFinish(d, m, nodeid, retbuf);
+    }
+}
+
+/*
+This function move a drive to a position in profile position mode
+input: CO_Data structure, requester, node identifier, target position,
+profile velocity, 1 for a position relative to the current target
+return: 0, -1 if the node identifier is invalid or -2 if a command is
+running on the node or no SDO request is available
+*/
+
+int MotionMove(CO_Data* d, s_REQUESTER* rq, UNS8 nodeid, UNS32 position, UNS32 velocity, int relative)
+{
+    s_MOTION* m;
+
+    if(nodeid == 0 || nodeid > MAX_NODES) return -1;
+    m = &gstaticMotions[BusIndex(d)][nodeid];
+    if(m->step != MV_IDLE) return -2;
+
+    m->rq = *rq;
+    m->position = position;
+    m->velocity = velocity;
+    m->setpoint = CW_ENABLE_OPERATION | CW_NEW_SETPOINT | CW_IMMEDIATE | (relative ? CW_RELATIVE : 0);
+    m->control = 0;
+    m->deadline = GatewayTime() + MOTION_TIMEOUT_MS;
+    if(MotionSubmit(d, m, nodeid, MV_STATUS, SDO_READ, OBJ_STATUSWORD, 0, 0) < 0)
+    {
+        m->step = MV_IDLE;
+        return -2;
+    }
+    return 0;
+}
+
+/*
+This function halt a drive, a move running on the node is ended first
+input: CO_Data structure, requester, node identifier
+return: 0, -1 if the node identifier is invalid or -2 if a halt is already
+waiting or no SDO request is available
+*/
+
+int MotionHalt(CO_Data* d, s_REQUESTER* rq, UNS8 nodeid)
+{
+    s_MOTION* m;
+
+    if(nodeid == 0 || nodeid > MAX_NODES) return -1;
+    m = &gstaticMotions[BusIndex(d)][nodeid];
+    if(m->halting || m->step >= MV_HALT) return -2;
+
+    m->haltRq = *rq;
+    if(m->step != MV_IDLE)
+    {
+        /* Started by the completion of the running transfer of the move */
+        m->halting = 1;
+        return 0;
+    }
+    return MotionStartHalt(d, m, nodeid) < 0 ? -2 : 0;
+}
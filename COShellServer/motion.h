@@ -0,0 +1,44 @@
+#ifndef MOTION_H_INCLUDED
+#define MOTION_H_INCLUDED
+
+/*
+Motion commands of CiA 402 drives.
+A move# bring the drive to the operation enabled state, write the profile
+position mode, the profile velocity and the target position, then give the
+new set-point with the controlword and wait for its acknowledge in the
+statusword 0x6041. A halt# set the halt bit of the controlword of an enabled
+drive and wait for it to stand still (target reached).
+The handshake run in the gateway, each step is started from the completion
+of the previous SDO transfer: the host get one reply when the drive has
+taken the command. The statusword is read again every MOTION_POLL_MS while
+a step waits for the drive.
+All the functions must be called with the stack mutex held (EnterMutex).
+*/
+
+/* Time allowed to a move# to complete its handshake, in ms */
+#define MOTION_TIMEOUT_MS 1000
+
+/* Time allowed to a halt# for the drive to stand still, in ms */
+#define MOTION_HALT_TIMEOUT_MS 10000
+
+/* Interval between two reads of the statusword, in ms */
+#define MOTION_POLL_MS 10
+
+/*
+This function move a drive to a position in profile position mode
+input: CO_Data structure, requester, node identifier, target position,
+profile velocity, 1 for a position relative to the current target
+return: 0, -1 if the node identifier is invalid or -2 if a command is
+running on the node or no SDO request is available
+*/
+int MotionMove(CO_Data*, s_REQUESTER*, UNS8, UNS32, UNS32, int);
+
+/*
+This function halt a drive, a move running on the node is ended first
+input: CO_Data structure, requester, node identifier
+return: 0, -1 if the node identifier is invalid or -2 if a halt is already
+waiting or no SDO request is available
+*/
+int MotionHalt(CO_Data*, s_REQUESTER*, UNS8);
+
+#endif // MOTION_H_INCLUDED
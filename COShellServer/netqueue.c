@@ -0,0 +1,180 @@
+/*
+Module: netqueue.c
+Description: lock free queues between the network thread and the threads of
+the CANOpenShell server stack.
+The command rings count their messages with free running indexes, published
+with release stores. The reply queue is a bounded queue with a sequence
+number in each entry: a producer reserve its position with a compare and
+swap, fill the entry and publish it by its sequence number. The binary messages
+leave NQ_REPLY_RESERVE entries to the replies, a stream cannot fill the queue.
+*/
+
+#include <string.h>
+
+#include "netqueue.h"
+
+//****************************************************************************
+// GLOBALS
+
+static s_NQREPLY gstaticReplies[NQ_REPLY_SLOTS];
+static unsigned int gstaticReplyHead;           /* next position reserved by a producer */
+static unsigned int gstaticReplyTail;           /* next position read by the network thread */
+
+
+/*
+This function empty a command ring, when no thread use it
+input: command ring
+*/
+
+void CmdRingReset(s_CMDRING* r)
+{
+    r->head = 0;
+    r->tail = 0;
+}
+
+/*
+This function return the free slot of a command ring, filled by the network thread
+input: command ring
+return: message or NULL if the ring is full
+*/
+
+s_NQMSG* CmdRingSlot(s_CMDRING* r)
+{
+    unsigned int tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+
+    if(r->head - tail == NQ_CMD_SLOTS) return NULL;
+    return &r->slots[r->head % NQ_CMD_SLOTS];
+}
+
+/*
+This function give the slot returned by CmdRingSlot to the command thread
+input: command ring
+*/
+
+void CmdRingPush(s_CMDRING* r)
+{
+    __atomic_store_n(&r->head, r->head + 1, __ATOMIC_RELEASE);
+}
+
+/*
+This function return the oldest message of a command ring, for the command thread
+input: command ring
+return: message or NULL if the ring is empty
+*/
+
+s_NQMSG* CmdRingPeek(s_CMDRING* r)
+{
+    unsigned int head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+
+    if(head == r->tail) return NULL;
+    return &r->slots[r->tail % NQ_CMD_SLOTS];
+}
+
+/*
+This function give the message returned by CmdRingPeek back to the network thread
+input: command ring
+*/
+
+void CmdRingPop(s_CMDRING* r)
+{
+    __atomic_store_n(&r->tail, r->tail + 1, __ATOMIC_RELEASE);
+}
+
+/*
+This function number the entries of the reply queue, before the threads of
+the server are started
+*/
+
+void NqInit(void)
+{
+    unsigned int i;
+
+    for(i=0; i<NQ_REPLY_SLOTS; i++) gstaticReplies[i].seq = i;
+    gstaticReplyHead = 0;
+    gstaticReplyTail = 0;
+}
+
+/*
+This function queue a reply for the network thread, from any thread
+input: session identifier, kind, argument, null terminated message or NULL
+(arg bytes for NQ_DATA)
+return: 0 or -1 if the queue is full, for NQ_DATA when only the reserved entries are free
+*/
+
+int ReplyPush(int session, int kind, int arg, char* data)
+{
+    s_NQREPLY* e;
+    unsigned int pos, seq;
+    int len;
+
+    pos = __atomic_load_n(&gstaticReplyHead, __ATOMIC_RELAXED);
+    for(;;)
+    {
+        e = &gstaticReplies[pos % NQ_REPLY_SLOTS];
+        seq = __atomic_load_n(&e->seq, __ATOMIC_ACQUIRE);
+        if(seq == pos)
+        {
+            if(kind == NQ_DATA && pos - __atomic_load_n(&gstaticReplyTail, __ATOMIC_ACQUIRE) >= NQ_REPLY_SLOTS - NQ_REPLY_RESERVE)
+                return -1;
+
+            /* The entry is free, reserve it unless another producer did */
+            if(__atomic_compare_exchange_n(&gstaticReplyHead, &pos, pos + 1, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) break;
+        }
+        else if((int)(seq - pos) < 0) return -1;   /* not yet released by the network thread */
+        else pos = __atomic_load_n(&gstaticReplyHead, __ATOMIC_RELAXED);
+    }
+
+    e->session = session;
+    e->kind = kind;
+    e->arg = arg;
+    len = 0;
+    if(data != NULL)
+    {
+        len = kind == NQ_DATA ? arg : (int)strlen(data);
+        if(len > NET_FRAME_MAX) len = NET_FRAME_MAX;
+        memcpy(e->data, data, len);
+    }
+    e->data[len] = 0;
+    __atomic_store_n(&e->seq, pos + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/*
+This function return the oldest reply, for the network thread
+return: reply or NULL if the queue is empty
+*/
+
+s_NQREPLY* ReplyFront(void)
+{
+    s_NQREPLY* e = &gstaticReplies[gstaticReplyTail % NQ_REPLY_SLOTS];
+
+    if(__atomic_load_n(&e->seq, __ATOMIC_ACQUIRE) != gstaticReplyTail + 1) return NULL;
+    return e;
+}
+
+/*
+This function release the reply returned by ReplyFront
+*/
+
+void ReplyRelease(void)
+{
+    s_NQREPLY* e = &gstaticReplies[gstaticReplyTail % NQ_REPLY_SLOTS];
+
+    __atomic_store_n(&e->seq, gstaticReplyTail + NQ_REPLY_SLOTS, __ATOMIC_RELEASE);
+    __atomic_store_n(&gstaticReplyTail, gstaticReplyTail + 1, __ATOMIC_RELEASE);
+}
+
+/*
+This function return the number of free entries of the reply queue, from any thread
+return: free entries
+*/
+
+int ReplyRoom(void)
+{
+    unsigned int tail = __atomic_load_n(&gstaticReplyTail, __ATOMIC_ACQUIRE);
+    unsigned int head = __atomic_load_n(&gstaticReplyHead, __ATOMIC_ACQUIRE);
+    int used = (int)(head - tail);
+
+    /* The tail may move between the two loads */
+    return used > NQ_REPLY_SLOTS ? 0 : used < 0 ? NQ_REPLY_SLOTS : NQ_REPLY_SLOTS - used;
+}
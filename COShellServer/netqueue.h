@@ -0,0 +1,122 @@
+#ifndef NETQUEUE_H_INCLUDED
+#define NETQUEUE_H_INCLUDED
+
+/*
+Queues between the network thread and the threads of the CAN stack.
+The network thread is the only one that call the socket functions. It push
+the messages received from a host in the command ring of its session, read
+by the command thread (single producer, single consumer). The replies are
+pushed by the command thread and the timer thread of the stack in one reply
+queue read by the network thread (multiple producers, single consumer).
+The queues are lock free: they never block a thread holding the stack mutex.
+*/
+
+#include "../../../netSocket/netSocket.h"
+
+/* Messages buffered for each session, the host is not read when they are all used */
+#define NQ_CMD_SLOTS 8
+
+/* Replies waiting for the network thread */
+#define NQ_REPLY_SLOTS 256
+
+/* Entries of the reply queue never used by the binary messages (NQ_DATA), kept for the replies */
+#define NQ_REPLY_RESERVE 64
+
+/* Free entries the command thread wait for before it run a command */
+#define NQ_COMMAND_ROOM 16
+
+/* Kinds of the entries of the reply queue */
+#define NQ_REPLY 0                  /* message to send */
+#define NQ_MODE 1                   /* message to send, then change the wire protocol to the mode in arg */
+#define NQ_CLOSE 2                  /* disconnect the host */
+#define NQ_DATA 3                   /* binary message of arg bytes, dropped when the host or the queue has no room */
+
+/* Message received from a host */
+typedef struct
+{
+    int len;
+    char data[NET_FRAME_MAX + 1];
+} s_NQMSG;
+
+/* Command ring of a session */
+typedef struct
+{
+    unsigned int head;              /* written by the network thread */
+    unsigned int tail;              /* written by the command thread */
+    s_NQMSG slots[NQ_CMD_SLOTS];
+} s_CMDRING;
+
+/* Entry of the reply queue */
+typedef struct
+{
+    unsigned int seq;               /* position of the entry when it is filled */
+    int session;
+    int kind;
+    int arg;
+    char data[NET_FRAME_MAX + 1];   /* null terminated message */
+} s_NQREPLY;
+
+/*
+This function number the entries of the reply queue, before the threads of
+the server are started
+*/
+void NqInit(void);
+
+/*
+This function empty a command ring, when no thread use it
+input: command ring
+*/
+void CmdRingReset(s_CMDRING*);
+
+/*
+This function return the free slot of a command ring, filled by the network thread
+input: command ring
+return: message or NULL if the ring is full
+*/
+s_NQMSG* CmdRingSlot(s_CMDRING*);
+
+/*
+This function give the slot returned by CmdRingSlot to the command thread
+input: command ring
+*/
+void CmdRingPush(s_CMDRING*);
+
+/*
+This function return the oldest message of a command ring, for the command thread
+input: command ring
+return: message or NULL if the ring is empty
+*/
+s_NQMSG* CmdRingPeek(s_CMDRING*);
+
+/*
+This function give the message returned by CmdRingPeek back to the network thread
+input: command ring
+*/
+void CmdRingPop(s_CMDRING*);
+
+/*
+This function queue a reply for the network thread, from any thread
+input: session identifier, kind, argument, null terminated message or NULL
+(arg bytes for NQ_DATA)
+return: 0 or -1 if the queue is full, for NQ_DATA when only the reserved entries are free
+*/
+int ReplyPush(int, int, int, char*);
+
+/*
+This function return the number of free entries of the reply queue, from any thread
+return: free entries
+*/
+int ReplyRoom(void);
+
+/*
+This function return the oldest reply, for the network thread
+return: reply or NULL if the queue is empty
+*/
+s_NQREPLY* ReplyFront(void);
+
+/*
+This function release the reply returned by ReplyFront
+*/
+void ReplyRelease(void);
+
+#endif // NETQUEUE_H_INCLUDED
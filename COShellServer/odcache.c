@@ -0,0 +1,200 @@
+/*
+Module: odcache.c
+Description: object dictionary read cache of the CANOpenShell server.
+Slow changing entries polled by the hosts (device type, identity...) are
+answered from memory instead of an SDO transfer on the bus.
+*/
+
+#include <string.h>
+
+#include "canfestival.h"
+#include "gateway.h"
+#include "odcache.h"
+
+//****************************************************************************
+// TYPES
+
+typedef struct
+{
+    UNS8 valid;
+    UNS8 bus;
+    UNS8 nodeid;
+    UNS16 index;
+    UNS8 subindex;
+    UNS32 data;
+    unsigned long expiry;   /* monotonic time in ms after which the value is stale */
+} s_ODCACHEENTRY;
+
+typedef struct
+{
+    UNS16 first;
+    UNS16 last;
+    UNS32 ttl;              /* time to live in ms, 0: not cached */
+} s_ODCACHERULE;
+
+//****************************************************************************
+// GLOBALS
+
+static s_ODCACHEENTRY gstaticEntries[ODCACHE_SIZE];
+
+/* Device type, manufacturer names and versions, identity: only changed by a boot up */
+static s_ODCACHERULE gstaticRules[ODCACHE_RULES] =
+{
+    {0x1000, 0x1000, 3600000},
+    {0x1008, 0x100A, 3600000},
+    {0x1018, 0x1018, 3600000},
+};
+static int gstaticRuleCount = 3;
+
+static unsigned long gstaticHits;
+static unsigned long gstaticMisses;
+
+
+/*
+This function return the time to live of an index, the last defined range win
+input: index
+*/
+
+static UNS32 OdCacheTTL(UNS16 index)
+{
+    int i;
+
+    for(i=gstaticRuleCount - 1; i>=0; i--)
+    {
+        if(index >= gstaticRules[i].first && index <= gstaticRules[i].last) return gstaticRules[i].ttl;
+    }
+    return 0;
+}
+
+/*
+This function return the cache slot of an object
+input: bus index, node identifier, index, subindex
+*/
+
+static s_ODCACHEENTRY* OdCacheSlot(UNS8 bus, UNS8 nodeid, UNS16 index, UNS8 subindex)
+{
+    unsigned int h = (((unsigned int)bus << 7 | nodeid) * 40503u) ^ ((unsigned int)index * 31u) ^ subindex;
+
+    return &gstaticEntries[(h ^ (h >> 11)) % ODCACHE_SIZE];
+}
+
+/*
+This function look for a valid cached value
+input: CO_Data structure of the bus, node identifier, index, subindex, pointer receiving the value
+return: 1 when the value is cached, 0 otherwise
+*/
+
+int OdCacheLookup(CO_Data* d, UNS8 nodeid, UNS16 index, UNS8 subindex, UNS32* data)
+{
+    UNS8 bus = BusIndex(d);
+    s_ODCACHEENTRY* e;
+
+    if(OdCacheTTL(index) == 0) return 0;
+
+    e = OdCacheSlot(bus, nodeid, index, subindex);
+    if(e->valid && e->bus == bus && e->nodeid == nodeid && e->index == index && e->subindex == subindex &&
+       (long)(e->expiry - GatewayTime()) > 0)
+    {
+        gstaticHits++;
+        *data = e->data;
+        return 1;
+    }
+    gstaticMisses++;
+    return 0;
+}
+
+/*
+This function store a value read on a node if its index range is cached
+input: CO_Data structure of the bus, node identifier, index, subindex, value
+*/
+
+void OdCacheStore(CO_Data* d, UNS8 nodeid, UNS16 index, UNS8 subindex, UNS32 data)
+{
+    UNS32 ttl = OdCacheTTL(index);
+    UNS8 bus = BusIndex(d);
+    s_ODCACHEENTRY* e;
+
+    if(ttl == 0) return;
+
+    e = OdCacheSlot(bus, nodeid, index, subindex);
+    e->valid = 1;
+    e->bus = bus;
+    e->nodeid = nodeid;
+    e->index = index;
+    e->subindex = subindex;
+    e->data = data;
+    e->expiry = GatewayTime() + ttl;
+}
+
+/*
+This function invalidate a cached object
+input: CO_Data structure of the bus, node identifier, index, subindex
+*/
+
+void OdCacheInvalidate(CO_Data* d, UNS8 nodeid, UNS16 index, UNS8 subindex)
+{
+    UNS8 bus = BusIndex(d);
+    s_ODCACHEENTRY* e = OdCacheSlot(bus, nodeid, index, subindex);
+
+    if(e->bus == bus && e->nodeid == nodeid && e->index == index && e->subindex == subindex) e->valid = 0;
+}
+
+/*
+This function invalidate all the cached objects of a node
+input: CO_Data structure of the bus (NULL for all the buses), node identifier (0 for all the nodes)
+*/
+
+void OdCacheFlushNode(CO_Data* d, UNS8 nodeid)
+{
+    int i, bus = d ? BusIndex(d) : -1;
+
+    for(i=0; i<ODCACHE_SIZE; i++)
+    {
+        if((bus < 0 || gstaticEntries[i].bus == bus) && (nodeid == 0 || gstaticEntries[i].nodeid == nodeid))
+            gstaticEntries[i].valid = 0;
+    }
+}
+
+/*
+This function set the time to live of an index range, the cache is flushed
+input: first index, last index, time to live in milliseconds (0: not cached)
+return: 0 or -1 if no more range can be defined
+*/
+
+int OdCacheSetTTL(UNS16 first, UNS16 last, UNS32 ttl)
+{
+    int i;
+
+    /* Redefining an existing range replace it */
+    for(i=0; i<gstaticRuleCount; i++)
+    {
+        if(gstaticRules[i].first == first && gstaticRules[i].last == last) break;
+    }
+    if(i == ODCACHE_RULES) return -1;
+    if(i == gstaticRuleCount) gstaticRuleCount++;
+
+    gstaticRules[i].first = first;
+    gstaticRules[i].last = last;
+    gstaticRules[i].ttl = ttl;
+    OdCacheFlushNode(NULL, 0);
+    return 0;
+}
+
+/*
+This function give the cache counters
+input: pointers receiving the hit count, the miss count and the number of valid entries
+*/
+
+void OdCacheStats(unsigned long* hits, unsigned long* misses, int* entries)
+{
+    int i;
+    unsigned long now = GatewayTime();
+
+    *hits = gstaticHits;
+    *misses = gstaticMisses;
+    *entries = 0;
+    for(i=0; i<ODCACHE_SIZE; i++)
+    {
+        if(gstaticEntries[i].valid && (long)(gstaticEntries[i].expiry - now) > 0) (*entries)++;
+    }
+}
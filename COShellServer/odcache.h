@@ -0,0 +1,57 @@
+#ifndef ODCACHE_H_INCLUDED
+#define ODCACHE_H_INCLUDED
+
+/*
+Object dictionary read cache.
+Values read from the slave nodes are kept for a time to live configured for
+ranges of indexes, a range with a null time to live is never cached.
+An entry is invalidated by a successful write of the same object, and all the
+entries of a node when the node boot up or is reset.
+All the functions must be called with the stack mutex held (EnterMutex).
+*/
+
+/* Number of cached objects (direct mapped, a colliding object replace the previous one) */
+#define ODCACHE_SIZE 2048
+
+/* Number of index ranges with a time to live */
+#define ODCACHE_RULES 16
+
+/*
+This function look for a valid cached value
+input: CO_Data structure of the bus, node identifier, index, subindex, pointer receiving the value
+return: 1 when the value is cached, 0 otherwise
+*/
+int OdCacheLookup(CO_Data*, UNS8, UNS16, UNS8, UNS32*);
+
+/*
+This function store a value read on a node if its index range is cached
+input: CO_Data structure of the bus, node identifier, index, subindex, value
+*/
+void OdCacheStore(CO_Data*, UNS8, UNS16, UNS8, UNS32);
+
+/*
+This function invalidate a cached object
+input: CO_Data structure of the bus, node identifier, index, subindex
+*/
+void OdCacheInvalidate(CO_Data*, UNS8, UNS16, UNS8);
+
+/*
+This function invalidate all the cached objects of a node
+input: CO_Data structure of the bus (NULL for all the buses), node identifier (0 for all the nodes)
+*/
+void OdCacheFlushNode(CO_Data*, UNS8);
+
+/*
+This function set the time to live of an index range, the cache is flushed
+input: first index, last index, time to live in milliseconds (0: not cached)
+return: 0 or -1 if no more range can be defined
+*/
+int OdCacheSetTTL(UNS16, UNS16, UNS32);
+
+/*
+This function give the cache counters
+input: pointers receiving the hit count, the miss count and the number of valid entries
+*/
+void OdCacheStats(unsigned long*, unsigned long*, int*);
+
+#endif // ODCACHE_H_INCLUDED
@@ -0,0 +1,320 @@
+/*
+Module: pdoshadow.c
+Description: PDO shadow image of the CANOpenShell server.
+The mapping of a transmit PDO is written on the slave node with the SDO
+scheduler (communication and mapping parameters 0x1800 and 0x1A00), then the
+frames of the PDO are decoded from the frame tap.
+*/
+
+#include <stdio.h>
+#include <string.h>
+
+#include "canfestival.h"
+#include "gateway.h"
+#include "sdosched.h"
+#include "cantap.h"
+#include "pdoshadow.h"
+#include "subscribe.h"
+
+//****************************************************************************
+// TYPES
+
+typedef struct
+{
+    UNS8 used;
+    UNS8 bus;
+    UNS8 nodeid;
+    UNS8 pdo;                                   /* transmit PDO number, 1 to 4 */
+    UNS8 transtype;
+    UNS16 cobid;
+    int count;                                  /* number of mapped objects */
+    UNS16 index[SHADOW_MAX_OBJECTS];
+    UNS8 subindex[SHADOW_MAX_OBJECTS];
+    UNS8 size[SHADOW_MAX_OBJECTS];              /* bytes */
+    UNS32 value[SHADOW_MAX_OBJECTS];
+    UNS8 active;                                /* mapping written, the PDO update the values */
+    UNS8 valid;                                 /* a PDO was received since the mapping or the last invalidation */
+    unsigned long received;                     /* GatewayTime of the last PDO */
+    int pending;                                /* SDO writes of the mapping not completed */
+    UNS8 failed;
+    UNS16 failIndex;
+    UNS8 failSubindex;
+    UNS32 abortCode;
+    s_REQUESTER rq;
+} s_SHADOWPDO;
+
+//****************************************************************************
+// GLOBALS
+
+static s_SHADOWPDO gstaticPdos[SHADOW_MAX_PDOS];
+static s_SHADOWPDO* gstaticByCob[MAX_BUSES][0x800];    /* active PDOs by bus and COB-ID */
+static int gstaticTapRegistered;
+
+
+/*
+This function send the result of a mapping to its requester
+input: shadowed PDO
+*/
+
+static void ShadowFinish(s_SHADOWPDO* p)
+{
+    char retbuf[100];
+
+    if(p->failed)
+    {
+        sprintf(retbuf,"404 pdom node %d pdo %d failed on %4.4x,%2.2x with abort code %x",
+                p->nodeid,p->pdo,p->failIndex,p->failSubindex,p->abortCode);
+        p->used = 0;
+    }
+    else if(p->count == 0)
+    {
+        sprintf(retbuf,"000 pdom node %d pdo %d disabled",p->nodeid,p->pdo);
+        p->used = 0;
+    }
+    else
+    {
+        sprintf(retbuf,"000 pdom node %d pdo %d cob %x shadow %d objects",p->nodeid,p->pdo,p->cobid,p->count);
+        p->active = 1;
+        gstaticByCob[p->bus][p->cobid] = p;
+    }
+    SendReply(&p->rq, retbuf);
+}
+
+/* Callback function of the SDO writes of a mapping */
+static void ShadowWriteDone(CO_Data* d, s_SDOREQ* req)
+{
+    s_SHADOWPDO* p = req->context;
+
+    if(req->result != SDO_FINISHED && !p->failed)
+    {
+        p->failed = 1;
+        p->failIndex = req->index;
+        p->failSubindex = req->subindex;
+        p->abortCode = req->abortCode;
+    }
+    if(--p->pending == 0) ShadowFinish(p);
+}
+
+/*
+This function queue the SDO write of one parameter of a mapping
+input: CO_Data structure, shadowed PDO, index, subindex, size, value
+*/
+
+static void ShadowWrite(CO_Data* d, s_SHADOWPDO* p, UNS16 index, UNS8 subindex, UNS32 size, UNS32 data)
+{
+    s_SDOREQ* req;
+
+    p->pending++;
+    if((req = SdoAlloc()) == NULL)
+    {
+        if(!p->failed)
+        {
+            p->failed = 1;
+            p->failIndex = index;
+            p->failSubindex = subindex;
+            p->abortCode = 0;
+        }
+        p->pending--;
+        return;
+    }
+    req->type = SDO_WRITE;
+    req->nodeid = p->nodeid;
+    req->index = index;
+    req->subindex = subindex;
+    req->size = size;
+    req->data = data;
+    req->rq = p->rq;
+    req->context = p;
+    req->done = ShadowWriteDone;
+    SdoSubmit(d, req);
+}
+
+/*
+This function write the mapping of a PDO on its node.
+The writes are queued at once and run in order on the node.
+input: CO_Data structure, shadowed PDO
+*/
+
+static void ShadowStart(CO_Data* d, s_SHADOWPDO* p)
+{
+    UNS16 comm = 0x1800 + p->pdo - 1;
+    UNS16 map = 0x1A00 + p->pdo - 1;
+    int i;
+
+    if(gstaticByCob[p->bus][p->cobid] == p) gstaticByCob[p->bus][p->cobid] = NULL;
+    p->active = 0;
+    p->valid = 0;
+    p->failed = 0;
+
+    /* The PDO is disabled while its mapping is changed */
+    p->pending = 1;
+    ShadowWrite(d, p, comm, 1, 4, 0x80000000 | p->cobid);
+    if(p->count > 0)
+    {
+        ShadowWrite(d, p, comm, 2, 1, p->transtype);
+        ShadowWrite(d, p, map, 0, 1, 0);
+        for(i=0; i<p->count; i++)
+            ShadowWrite(d, p, map, i + 1, 4, ((UNS32)p->index[i] << 16) | ((UNS32)p->subindex[i] << 8) | (p->size[i] * 8));
+        ShadowWrite(d, p, map, 0, 1, p->count);
+        ShadowWrite(d, p, comm, 1, 4, p->cobid);
+    }
+    if(--p->pending == 0) ShadowFinish(p);
+}
+
+/*
+This function update the values of a shadowed PDO from a received frame
+input: bus, direction, frame
+return: 0, the stack also receive the PDO
+*/
+
+static int ShadowFrame(int bus, int dir, Message* m)
+{
+    s_SHADOWPDO* p;
+    int i, k, off;
+    UNS32 v;
+
+    if(dir != CANTAP_RX || m->rtr || m->cob_id >= 0x800 || bus >= MAX_BUSES) return 0;
+    if((p = gstaticByCob[bus][m->cob_id]) == NULL) return 0;
+
+    for(i=0, off=0; i<p->count; i++) off += p->size[i];
+    if(m->len < off) return 0;
+
+    for(i=0, off=0; i<p->count; i++)
+    {
+        /* PDO data are little endian */
+        for(k=p->size[i] - 1, v=0; k>=0; k--) v = (v << 8) | m->data[off + k];
+        p->value[i] = v;
+        off += p->size[i];
+    }
+    p->received = GatewayTime();
+    p->valid = 1;
+
+    for(i=0; i<p->count; i++) SubsNotify(BusData(bus), p->nodeid, p->index[i], p->subindex[i], p->value[i]);
+    return 0;
+}
+
+/*
+This function map objects in a transmit PDO of a node and shadow them, the
+requester get the reply when the mapping is written.
+An empty list of objects disable the PDO and its shadow.
+input: CO_Data structure, requester, node identifier, PDO number (1 to 4),
+transmission type, number of objects, indexes, subindexes, sizes in bytes (1 to 4)
+return: 0, -1 if a parameter is invalid or -2 if the PDO is being configured
+or no more PDO can be shadowed
+*/
+
+int ShadowConfigure(CO_Data* d, s_REQUESTER* rq, UNS8 nodeid, UNS8 pdo, UNS8 transtype, int count,
+                    UNS16* index, UNS8* subindex, UNS8* size)
+{
+    s_SHADOWPDO* p = NULL;
+    int i, bytes = 0, bus = BusIndex(d);
+
+    if(nodeid == 0 || nodeid > MAX_NODES || pdo < 1 || pdo > 4 || count < 0 || count > SHADOW_MAX_OBJECTS) return -1;
+    for(i=0; i<count; i++)
+    {
+        if(size[i] < 1 || size[i] > 4) return -1;
+        bytes += size[i];
+    }
+    if(bytes > 8) return -1;
+
+    for(i=0; i<SHADOW_MAX_PDOS; i++)
+    {
+        if(gstaticPdos[i].used && gstaticPdos[i].bus == bus && gstaticPdos[i].nodeid == nodeid && gstaticPdos[i].pdo == pdo)
+        {
+            p = &gstaticPdos[i];
+            break;
+        }
+    }
+    if(p != NULL && p->pending) return -2;
+    for(i=0; p == NULL && i<SHADOW_MAX_PDOS; i++)
+    {
+        if(!gstaticPdos[i].used) p = &gstaticPdos[i];
+    }
+    if(p == NULL) return -2;
+
+    if(!gstaticTapRegistered && CanTapRegister(ShadowFrame) == 0) gstaticTapRegistered = 1;
+
+    p->used = 1;
+    p->bus = bus;
+    p->nodeid = nodeid;
+    p->pdo = pdo;
+    p->transtype = transtype;
+    p->cobid = 0x180 + 0x100 * (pdo - 1) + nodeid;
+    p->count = count;
+    for(i=0; i<count; i++)
+    {
+        p->index[i] = index[i];
+        p->subindex[i] = subindex[i];
+        p->size[i] = size[i];
+    }
+    p->rq = *rq;
+    ShadowStart(d, p);
+    return 0;
+}
+
+/*
+This function look for the last value of an object received in a PDO
+input: CO_Data structure of the bus, node identifier, index, subindex, pointer receiving the value
+return: 1 when the value is shadowed and younger than SHADOW_MAX_AGE_MS, 0 otherwise
+*/
+
+int ShadowLookup(CO_Data* d, UNS8 nodeid, UNS16 index, UNS8 subindex, UNS32* data)
+{
+    int i, k, bus = BusIndex(d);
+    unsigned long now = GatewayTime();
+    s_SHADOWPDO* p;
+
+    for(i=0; i<SHADOW_MAX_PDOS; i++)
+    {
+        p = &gstaticPdos[i];
+        if(!p->used || !p->valid || p->bus != bus || p->nodeid != nodeid) continue;
+        for(k=0; k<p->count; k++)
+        {
+            if(p->index[k] == index && p->subindex[k] == subindex)
+            {
+                /* A value the node stopped sending is read again */
+                if(now - p->received > SHADOW_MAX_AGE_MS) return 0;
+                *data = p->value[k];
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+/*
+This function forget the values of a node until its next PDO (node stopped or silent)
+input: CO_Data structure of the bus, node identifier (0 for all the nodes)
+*/
+
+void ShadowInvalidateNode(CO_Data* d, UNS8 nodeid)
+{
+    int i, bus = BusIndex(d);
+
+    for(i=0; i<SHADOW_MAX_PDOS; i++)
+    {
+        if(gstaticPdos[i].bus == bus && (nodeid == 0 || gstaticPdos[i].nodeid == nodeid)) gstaticPdos[i].valid = 0;
+    }
+}
+
+/*
+This function write again the mappings of a node that boot up
+input: CO_Data structure, node identifier
+*/
+
+void ShadowNodeBootup(CO_Data* d, UNS8 nodeid)
+{
+    int i, bus = BusIndex(d);
+    s_SHADOWPDO* p;
+
+    for(i=0; i<SHADOW_MAX_PDOS; i++)
+    {
+        p = &gstaticPdos[i];
+        if(!p->used || p->bus != bus || p->nodeid != nodeid || p->pending) continue;
+
+        /* The node lost the mapping, the result is only logged */
+        p->rq.session = 0;
+        p->rq.tag = 0;
+        ShadowStart(d, p);
+    }
+}
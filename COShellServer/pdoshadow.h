@@ -0,0 +1,54 @@
+#ifndef PDOSHADOW_H_INCLUDED
+#define PDOSHADOW_H_INCLUDED
+
+/*
+PDO shadow image.
+The gateway map hot objects of a slave node (status word, actual position...)
+in one of its transmit PDOs with SDO writes, then keep the last value of each
+mapped object from the received PDOs. Reads of these objects are answered
+from the image without SDO transfer.
+The mapping is written again when the node boot up.
+All the functions must be called with the stack mutex held (EnterMutex).
+*/
+
+/* Number of shadowed PDOs on all the nodes of all the buses */
+#define SHADOW_MAX_PDOS 64
+
+/* Objects mapped in one PDO (8 bytes of data) */
+#define SHADOW_MAX_OBJECTS 8
+
+/* Age of a shadowed value after which it is read again with SDO, a PDO sent
+   on change only need an event timer below this age to stay shadowed */
+#define SHADOW_MAX_AGE_MS 1000
+
+/*
+This function map objects in a transmit PDO of a node and shadow them, the
+requester get the reply when the mapping is written.
+An empty list of objects disable the PDO and its shadow.
+input: CO_Data structure, requester, node identifier, PDO number (1 to 4),
+transmission type, number of objects, indexes, subindexes, sizes in bytes (1 to 4)
+return: 0, -1 if a parameter is invalid or -2 if the PDO is being configured
+or no more PDO can be shadowed
+*/
+int ShadowConfigure(CO_Data*, s_REQUESTER*, UNS8, UNS8, UNS8, int, UNS16*, UNS8*, UNS8*);
+
+/*
+This function look for the last value of an object received in a PDO
+input: CO_Data structure of the bus, node identifier, index, subindex, pointer receiving the value
+return: 1 when the value is shadowed and younger than SHADOW_MAX_AGE_MS, 0 otherwise
+*/
+int ShadowLookup(CO_Data*, UNS8, UNS16, UNS8, UNS32*);
+
+/*
+This function forget the values of a node until its next PDO (node stopped or silent)
+input: CO_Data structure of the bus, node identifier (0 for all the nodes)
+*/
+void ShadowInvalidateNode(CO_Data*, UNS8);
+
+/*
+This function write again the mappings of a node that boot up
+input: CO_Data structure, node identifier
+*/
+void ShadowNodeBootup(CO_Data*, UNS8);
+
+#endif // PDOSHADOW_H_INCLUDED
@@ -0,0 +1,299 @@
+/*
+Module: rtprofile.c
+Description: real-time profile of the CAN threads of the CANOpenShell server.
+The threads created by pthread_create inherit the policy, the priority and
+the affinity of their creator: RtEnter switch the calling thread to the
+profile of a stack thread before CanFestival create it, RtLeave switch it
+back. With the memory locked, the stack of a new thread is allocated when
+the thread is created and never paged out.
+The self-test run a periodic alarm of the stack and keep the time between
+its calls, the percentiles are computed once the test is completed.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+
+#include "canfestival.h"
+#include "gateway.h"
+#include "rtprofile.h"
+
+//****************************************************************************
+// DEFINES
+
+/* Bytes of stack touched by RtStart, so the stack of the main thread is locked */
+#define RT_PREFAULT (64 * 1024)
+
+//****************************************************************************
+// TYPES
+
+typedef struct
+{
+    int configured;
+    int priority[2];            /* SCHED_FIFO priority of the timer and receive threads, 0: not changed */
+    unsigned long cpus;         /* CPUs of the stack threads, 0: not pinned */
+    int locked;                 /* mlockall succeeded */
+    int failed[2];              /* error of the last RtEnter of each thread, 0 if applied */
+} s_RTPROFILE;
+
+typedef struct
+{
+    UNS8 running;
+    s_REQUESTER rq;
+    TIMER_HANDLE timer;
+    UNS32 period;               /* us */
+    int count;                  /* cycles to measure */
+    int n;                      /* cycles measured */
+    unsigned long long start;
+    unsigned long long last;
+    long maxLate;               /* longest delay after the ideal time of a call, us */
+} s_RTTEST;
+
+//****************************************************************************
+// GLOBALS
+
+static s_RTPROFILE gstaticProfile;
+static s_RTTEST gstaticTest;                 /* the timer is set by RtTest, read only while the test is running */
+static unsigned int gstaticCycles[RT_TEST_MAX];
+
+
+/*
+This function return a monotonic time in microseconds
+*/
+
+static unsigned long long RtTime(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+This function read the real-time profile given on the command line
+input: timer priority,receive priority[,CPU mask in hex] (priority 0: no SCHED_FIFO)
+return: 0 or -1 if the profile is invalid
+*/
+
+int RtConfigure(char* spec)
+{
+    int max = sched_get_priority_max(SCHED_FIFO);
+    s_RTPROFILE* p = &gstaticProfile;
+
+    p->cpus = 0;
+    if(sscanf(spec, "%d,%d,%lx", &p->priority[RT_TIMER], &p->priority[RT_RECEIVE], &p->cpus) < 2) return -1;
+    if(p->priority[RT_TIMER] < 0 || p->priority[RT_TIMER] > max ||
+       p->priority[RT_RECEIVE] < 0 || p->priority[RT_RECEIVE] > max) return -1;
+    p->configured = 1;
+    return 0;
+}
+
+/*
+This function touch the stack of the calling thread
+*/
+
+static void RtPrefault(void)
+{
+    volatile char stack[RT_PREFAULT];
+
+    memset((char*)stack, 0, sizeof stack);
+}
+
+/*
+This function lock the memory of the process and set the stack of the
+threads created after it, when a profile is configured
+*/
+
+void RtStart(void)
+{
+    pthread_attr_t attr;
+
+    if(!gstaticProfile.configured) return;
+
+    if(mlockall(MCL_CURRENT | MCL_FUTURE) < 0) perror("mlockall");
+    else gstaticProfile.locked = 1;
+
+    /* A locked stack is allocated whole, the default one is too large */
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, RT_STACK_SIZE);
+    pthread_setattr_default_np(&attr);
+    pthread_attr_destroy(&attr);
+    RtPrefault();
+}
+
+/*
+This function give the profile of a stack thread to the calling thread, so
+that the thread it create inherit it
+input: RT_TIMER or RT_RECEIVE, scheduling to restore
+*/
+
+void RtEnter(int role, s_RTSAVED* saved)
+{
+    s_RTPROFILE* p = &gstaticProfile;
+    struct sched_param sp;
+    cpu_set_t set;
+    unsigned int i;
+
+    saved->pinned = 0;
+    pthread_getschedparam(pthread_self(), &saved->policy, &sp);
+    saved->priority = sp.sched_priority;
+    if(!p->configured) return;
+
+    p->failed[role] = 0;
+    if(p->priority[role] > 0)
+    {
+        sp.sched_priority = p->priority[role];
+        p->failed[role] = pthread_setschedparam(pthread_self(), SCHED_FIFO, &sp);
+    }
+    if(p->cpus && pthread_getaffinity_np(pthread_self(), sizeof set, &set) == 0)
+    {
+        for(i=0, saved->cpus=0; i<sizeof saved->cpus * 8; i++)
+            if(CPU_ISSET(i, &set)) saved->cpus |= 1UL << i;
+        CPU_ZERO(&set);
+        for(i=0; i<sizeof p->cpus * 8; i++)
+            if(p->cpus & (1UL << i)) CPU_SET(i, &set);
+        if(pthread_setaffinity_np(pthread_self(), sizeof set, &set) == 0) saved->pinned = 1;
+        else if(p->failed[role] == 0) p->failed[role] = -1;
+    }
+}
+
+/*
+This function restore the scheduling of the calling thread
+input: scheduling saved by RtEnter
+*/
+
+void RtLeave(s_RTSAVED* saved)
+{
+    struct sched_param sp;
+    cpu_set_t set;
+    unsigned int i;
+
+    if(!gstaticProfile.configured) return;
+    sp.sched_priority = saved->priority;
+    pthread_setschedparam(pthread_self(), saved->policy, &sp);
+    if(saved->pinned)
+    {
+        CPU_ZERO(&set);
+        for(i=0; i<sizeof saved->cpus * 8; i++)
+            if(saved->cpus & (1UL << i)) CPU_SET(i, &set);
+        pthread_setaffinity_np(pthread_self(), sizeof set, &set);
+    }
+}
+
+/* Sort function of the cycle times */
+static int RtCompare(const void* a, const void* b)
+{
+    unsigned int x = *(const unsigned int*)a, y = *(const unsigned int*)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/*
+This function send the percentiles of the cycle times of the completed test
+*/
+
+static void RtReport(void)
+{
+    s_RTTEST* t = &gstaticTest;
+    unsigned int* c = gstaticCycles;
+    int n = t->n;
+    char retbuf[200];
+
+    qsort(c, n, sizeof c[0], RtCompare);
+    sprintf(retbuf,"000 rt test period %u us cycles %d min %u p50 %u p90 %u p99 %u p999 %u max %u us late %ld us",
+            t->period,n,c[0],c[(n - 1) * 500 / 1000],c[(n - 1) * 900 / 1000],c[(n - 1) * 990 / 1000],
+            c[(n - 1) * 999 / 1000],c[n - 1],t->maxLate);
+    SendReply(&t->rq, retbuf);
+}
+
+/* Alarm function of the self-test */
+static void RtTick(CO_Data* d, UNS32 id)
+{
+    s_RTTEST* t = &gstaticTest;
+    unsigned long long now = RtTime();
+    long late;
+
+    if(!t->running) return;
+    gstaticCycles[t->n++] = (unsigned int)(now - t->last);
+    t->last = now;
+    late = (long)(now - (t->start + (unsigned long long)t->n * t->period));
+    if(late > t->maxLate) t->maxLate = late;
+    if(t->n < t->count) return;
+
+    DelAlarm(t->timer);
+    t->timer = TIMER_NONE;
+    t->running = 0;
+    RtReport();
+}
+
+/*
+This function start a jitter self-test on the timer of the stack, the
+requester get the cycle time percentiles when it is completed
+input: CO_Data structure, requester, period in us, number of cycles
+return: 0, -1 if a parameter is invalid or -2 if a test is running
+*/
+
+int RtTest(CO_Data* d, s_REQUESTER* rq, UNS32 period, int count)
+{
+    s_RTTEST* t = &gstaticTest;
+
+    if(period == 0 || count < 1 || count > RT_TEST_MAX) return -1;
+    if(t->running) return -2;
+
+    t->rq = *rq;
+    t->period = period;
+    t->count = count;
+    t->n = 0;
+    t->maxLate = 0;
+    t->start = t->last = RtTime();
+    t->timer = SetAlarm(d, 0, RtTick, US_TO_TIMEVAL(period), US_TO_TIMEVAL(period));
+    if(t->timer == TIMER_NONE) return -2;
+    t->running = 1;
+    return 0;
+}
+
+/*
+This function print the state of a stack thread of the profile
+input: string buffer, size of the buffer, name, thread
+return: number of characters printed
+*/
+
+static int RtThreadState(char* buf, int len, char* name, int role)
+{
+    s_RTPROFILE* p = &gstaticProfile;
+
+    if(p->failed[role] > 0)
+        return snprintf(buf, len, "%s fifo %d refused (%s)",name,p->priority[role],strerror(p->failed[role]));
+    if(p->failed[role] < 0)
+        return snprintf(buf, len, "%s fifo %d, affinity refused",name,p->priority[role]);
+    if(p->priority[role] == 0)
+        return snprintf(buf, len, "%s default",name);
+    return snprintf(buf, len, "%s fifo %d",name,p->priority[role]);
+}
+
+/*
+This function print the profile and its state
+input: string buffer, size of the buffer
+*/
+
+void RtStats(char* buf, int len)
+{
+    s_RTPROFILE* p = &gstaticProfile;
+    int n;
+
+    if(!p->configured)
+    {
+        snprintf(buf, len, "no profile");
+        return;
+    }
+    n = RtThreadState(buf, len, "timer", RT_TIMER);
+    n += snprintf(buf + n, len - n, ", ");
+    n += RtThreadState(buf + n, len - n, "receive", RT_RECEIVE);
+    snprintf(buf + n, len - n, ", cpus %lx, memory %s",p->cpus,p->locked ? "locked" : "not locked");
+}
@@ -0,0 +1,77 @@
+#ifndef RTPROFILE_H_INCLUDED
+#define RTPROFILE_H_INCLUDED
+
+/*
+Real-time profile of the CAN threads.
+The timer thread and the receive thread of the stack are created by
+CanFestival (TimerInit, canOpen), with the scheduling policy and the CPU
+affinity of the thread that create them. The gateway give its real-time
+profile to the calling thread for these calls only: the stack threads are
+run by SCHED_FIFO at their priority on the chosen CPUs. The memory of the
+process is locked, and the threads created after RtStart get a smaller stack
+that is allocated and locked when they are created.
+A jitter self-test measure the cycle time of a periodic timer of the stack.
+RtConfigure, RtStart, RtEnter and RtLeave are called without the stack mutex,
+RtTest and RtStats with the stack mutex held (EnterMutex).
+*/
+
+/* Threads of the profile */
+#define RT_TIMER 0
+#define RT_RECEIVE 1
+
+/* Stack of the threads created once the profile is started */
+#define RT_STACK_SIZE (256 * 1024)
+
+/* Samples of a jitter self-test */
+#define RT_TEST_MAX 100000
+
+/* Scheduling of the calling thread saved by RtEnter */
+typedef struct
+{
+    int policy;
+    int priority;
+    int pinned;             /* the affinity was changed */
+    unsigned long cpus;     /* affinity before RtEnter, first CPUs only */
+} s_RTSAVED;
+
+/*
+This function read the real-time profile given on the command line
+input: timer priority,receive priority[,CPU mask in hex] (priority 0: no SCHED_FIFO)
+return: 0 or -1 if the profile is invalid
+*/
+int RtConfigure(char*);
+
+/*
+This function lock the memory of the process and set the stack of the
+threads created after it, when a profile is configured
+*/
+void RtStart(void);
+
+/*
+This function give the profile of a stack thread to the calling thread, so
+that the thread it create inherit it
+input: RT_TIMER or RT_RECEIVE, scheduling to restore
+*/
+void RtEnter(int, s_RTSAVED*);
+
+/*
+This function restore the scheduling of the calling thread
+input: scheduling saved by RtEnter
+*/
+void RtLeave(s_RTSAVED*);
+
+/*
+This function start a jitter self-test on the timer of the stack, the
+requester get the cycle time percentiles when it is completed
+input: CO_Data structure, requester, period in us, number of cycles
+return: 0, -1 if a parameter is invalid or -2 if a test is running
+*/
+int RtTest(CO_Data*, s_REQUESTER*, UNS32, int);
+
+/*
+This function print the profile and its state
+input: string buffer, size of the buffer
+*/
+void RtStats(char*, int);
+
+#endif // RTPROFILE_H_INCLUDED
@@ -0,0 +1,200 @@
+/*
+Module: scan.c
+Description: network scan of the CANOpenShell server. The reads of the scan
+are queued on the SDO scheduler with a short timeout, so they are transferred
+by sdoxfer.c and an absent node does not hold a line of the stack for
+SDO_TIMEOUT_MS. The nodes found are kept by the scan and replace the
+inventory of the bus only when the scan is completed.
+*/
+
+#include <stdio.h>
+#include <string.h>
+
+#include "canfestival.h"
+#include "gateway.h"
+#include "../../../netSocket/netSocket.h"
+#include "sdosched.h"
+#include "inventory.h"
+#include "scan.h"
+
+//****************************************************************************
+// TYPES
+
+typedef struct
+{
+    UNS8 running;
+    UNS8 failed;                /* a read could not be queued */
+    s_REQUESTER rq;
+    int next;                   /* next node id whose device type is read */
+    int pending;                /* reads queued and not completed */
+    int found;
+    unsigned long start;
+    s_NODEIDENTITY nodes[MAX_NODES + 1];   /* inventory of the bus being built */
+    UNS8 queued[MAX_NODES + 1];         /* reads of each node, bit 0 device type, bits 1-3 identity */
+    UNS8 answered[MAX_NODES + 1];       /* reads of each node that got a response */
+} s_SCAN;
+
+//****************************************************************************
+// GLOBALS
+
+static s_SCAN gstaticScans[MAX_BUSES];
+
+static void ScanReadDone(CO_Data* d, s_SDOREQ* req);
+
+
+/*
+This function queue a read of the scan
+input: CO_Data structure, scan, node identifier, index, subindex
+return: 0 or -1 if no request is available
+*/
+
+static int ScanRead(CO_Data* d, s_SCAN* sc, UNS8 nodeid, UNS16 index, UNS8 subindex)
+{
+    s_SDOREQ* req = SdoAlloc();
+
+    sc->queued[nodeid] |= 1 << (index == 0x1000 ? 0 : subindex);
+    if(req == NULL) return -1;
+    req->type = SDO_READ;
+    req->nodeid = nodeid;
+    req->index = index;
+    req->subindex = subindex;
+    req->timeout = SCAN_TIMEOUT_MS;
+    req->rq = sc->rq;
+    req->context = sc;
+    req->done = ScanReadDone;
+    sc->pending++;
+    SdoSubmit(d, req);
+    return 0;
+}
+
+/*
+This function store the inventory of a bus and send it to the requester of
+its scan, the inventory of a failed scan is dropped. A node found whose
+identity was not read completely keep its previous record, or is recorded
+as not verified when it had none.
+input: CO_Data structure, scan
+*/
+
+static void ScanFinish(CO_Data* d, s_SCAN* sc)
+{
+    char retbuf[NET_FRAME_MAX - 16];
+    s_NODEIDENTITY* id;
+    s_NODEIDENTITY* prev;
+    int i, n, listed = 0;
+
+    sc->running = 0;
+    if(sc->failed)
+    {
+        sprintf(retbuf,"404 scan gateway busy after %d nodes",sc->next - 1);
+        SendReply(&sc->rq, retbuf);
+        return;
+    }
+    for(i=1; i<=MAX_NODES; i++)
+    {
+        id = &sc->nodes[i];
+        if(!id->present) continue;
+        if(sc->answered[i] == sc->queued[i])
+        {
+            id->verified = 1;
+            continue;
+        }
+        printf("Scan: node %d identity not read, a read timed out\n", i);
+        prev = InvNode(d, (UNS8)i);
+        if(prev->present) *id = *prev;
+    }
+    InvStoreBus(d, sc->nodes);
+    InvFlush();
+
+    /* The list is cut if it does not fit in a message, info# give the identity of the other nodes */
+    n = sprintf(retbuf,"000 scan %d nodes in %lu ms",sc->found,GatewayTime() - sc->start);
+    for(i=1; i<=MAX_NODES && n < (int)sizeof retbuf - 48; i++)
+    {
+        id = &sc->nodes[i];
+        if(!id->present) continue;
+        n += sprintf(retbuf + n, "%c%x=%x,%x,%x,%x", listed++ ? ';' : ':', i,
+                     id->deviceType, id->vendorId, id->productCode, id->revision);
+    }
+    SendReply(&sc->rq, retbuf);
+}
+
+/*
+This function read the device type of the next nodes while fewer than
+SCAN_PARALLEL reads are running, and end the scan after the last read
+input: CO_Data structure, scan
+*/
+
+static void ScanNext(CO_Data* d, s_SCAN* sc)
+{
+    if(!sc->running) return;
+
+    while(sc->pending < SCAN_PARALLEL && sc->next <= MAX_NODES)
+    {
+        if(ScanRead(d, sc, (UNS8)sc->next, 0x1000, 0) < 0)
+        {
+            /* Retried when a read of the scan complete */
+            if(sc->pending == 0) sc->failed = 1;
+            break;
+        }
+        sc->next++;
+    }
+    if(sc->pending == 0 && (sc->next > MAX_NODES || sc->failed)) ScanFinish(d, sc);
+}
+
+/* Callback function of the reads of a scan */
+static void ScanReadDone(CO_Data* d, s_SDOREQ* req)
+{
+    s_SCAN* sc = req->context;
+    s_NODEIDENTITY* id = &sc->nodes[req->nodeid];
+
+    sc->pending--;
+    if(req->result == SDO_FINISHED || req->result == SDO_ABORTED_RCV)
+        sc->answered[req->nodeid] |= 1 << (req->index == 0x1000 ? 0 : req->subindex);
+    if(req->index == 0x1000)
+    {
+        /* A node that abort the read exist too, a read of its identity that
+           cannot be queued stay unanswered and the node is not verified */
+        if(req->result == SDO_FINISHED || req->result == SDO_ABORTED_RCV)
+        {
+            id->present = 1;
+            sc->found++;
+            if(req->result == SDO_FINISHED) id->deviceType = req->data;
+            ScanRead(d, sc, req->nodeid, 0x1018, 1);
+            ScanRead(d, sc, req->nodeid, 0x1018, 2);
+            ScanRead(d, sc, req->nodeid, 0x1018, 3);
+        }
+    }
+    else if(req->result == SDO_FINISHED)
+    {
+        if(req->subindex == 1) id->vendorId = req->data;
+        else if(req->subindex == 2) id->productCode = req->data;
+        else id->revision = req->data;
+    }
+    ScanNext(d, sc);
+}
+
+/*
+This function start the scan of a bus, the requester get the inventory when it is completed
+input: CO_Data structure, requester
+return: 0 or -2 if the bus is being scanned
+*/
+
+int ScanStart(CO_Data* d, s_REQUESTER* rq)
+{
+    int bus = BusIndex(d);
+    s_SCAN* sc = &gstaticScans[bus];
+
+    if(sc->running) return -2;
+
+    memset(sc->nodes, 0, sizeof sc->nodes);
+    memset(sc->queued, 0, sizeof sc->queued);
+    memset(sc->answered, 0, sizeof sc->answered);
+    sc->running = 1;
+    sc->failed = 0;
+    sc->rq = *rq;
+    sc->next = 1;
+    sc->pending = 0;
+    sc->found = 0;
+    sc->start = GatewayTime();
+    ScanNext(d, sc);
+    return 0;
+}
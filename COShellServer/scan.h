@@ -0,0 +1,27 @@
+#ifndef SCAN_H_INCLUDED
+#define SCAN_H_INCLUDED
+
+/*
+Network scan.
+The device type (0x1000) of every node id is read with a short timeout, up to
+SCAN_PARALLEL reads at a time, and the identity (0x1018 subindexes 1 to 3) of
+the nodes that answered is read next. The nodes found replace the nodes of
+the bus in the inventory (inventory.h) and the requester get one reply listing them.
+Any response, even an abort, tell that the node exist.
+All the functions must be called with the stack mutex held (EnterMutex).
+*/
+
+/* SDO reads running at the same time during a scan */
+#define SCAN_PARALLEL 32
+
+/* Time allowed to a node to answer a read of the scan, in ms */
+#define SCAN_TIMEOUT_MS 25
+
+/*
+This function start the scan of a bus, the requester get the inventory when it is completed
+input: CO_Data structure, requester
+return: 0 or -2 if the bus is being scanned
+*/
+int ScanStart(CO_Data*, s_REQUESTER*);
+
+#endif // SCAN_H_INCLUDED
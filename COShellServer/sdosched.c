@@ -0,0 +1,302 @@
+/*
+Module: sdosched.c
+Description: SDO transaction scheduler of the CANOpenShell server.
+Requests are queued in a FIFO for each node of each bus. Transfers with
+different nodes run concurrently, the transfers with one node are serialized
+and the next one is started from the completion callback of the previous one.
+Each bus has its own CO_Data structure, hence its own SDO lines.
+*/
+
+#include <string.h>
+
+#include "canfestival.h"
+#include "sdosched.h"
+#include "sdoxfer.h"
+
+//****************************************************************************
+// DEFINES
+
+/* Requests transferred by sdoxfer.c, without line of the stack */
+#define SDO_RAW(req) ((req)->buffer != NULL || (req)->stream != NULL || (req)->timeout != 0)
+
+//****************************************************************************
+// TYPES
+
+/* FIFO of the requests addressed to one node, the head is the running request */
+typedef struct
+{
+    s_SDOREQ* head;
+    s_SDOREQ* tail;
+    UNS8 running;           /* the head request is being transferred */
+} s_SDOQUEUE;
+
+//****************************************************************************
+// GLOBALS
+
+static s_SDOREQ gstaticPool[SDO_POOL_SIZE];
+static s_SDOREQ* gstaticFree;
+static int gstaticPoolInit;
+
+static s_SDOQUEUE gstaticQueues[MAX_BUSES][MAX_NODES + 1];
+static int gstaticRunning[MAX_BUSES];   /* transfers in progress on the lines of the stack */
+static int gstaticCursor[MAX_BUSES];    /* first node examined when a line is free, for fairness */
+
+static UNS8 gstaticBuffers[SDO_BUFFERS][SDO_DATA_MAX];
+static UNS8 gstaticBufferUsed[SDO_BUFFERS];
+
+static void SdoReadCallback(CO_Data* d, UNS8 nodeid);
+static void SdoWriteCallback(CO_Data* d, UNS8 nodeid);
+static void SdoStartWaiting(CO_Data* d);
+
+
+/*
+This function take a request from the pool
+return: cleared request or NULL if the pool is exhausted
+*/
+
+s_SDOREQ* SdoAlloc(void)
+{
+    int i;
+    s_SDOREQ* req;
+
+    if(!gstaticPoolInit)
+    {
+        for(i=0; i<SDO_POOL_SIZE - 1; i++) gstaticPool[i].next = &gstaticPool[i + 1];
+        gstaticPool[SDO_POOL_SIZE - 1].next = NULL;
+        gstaticFree = gstaticPool;
+        gstaticPoolInit = 1;
+    }
+
+    if((req = gstaticFree) == NULL) return NULL;
+    gstaticFree = req->next;
+    memset(req, 0, sizeof *req);
+    return req;
+}
+
+/*
+This function give a request back to the pool, with its buffer
+input: request
+*/
+
+void SdoRelease(s_SDOREQ* req)
+{
+    if(req->buffer) gstaticBufferUsed[(req->buffer - gstaticBuffers[0]) / SDO_DATA_MAX] = 0;
+    req->next = gstaticFree;
+    gstaticFree = req;
+}
+
+/*
+This function attach a buffer to a request for a variable length value,
+the buffer is released with the request
+input: request
+return: 0 or -1 if all the buffers are used
+*/
+
+int SdoAllocBuffer(s_SDOREQ* req)
+{
+    int i;
+
+    for(i=0; i<SDO_BUFFERS; i++)
+    {
+        if(!gstaticBufferUsed[i])
+        {
+            gstaticBufferUsed[i] = 1;
+            req->buffer = gstaticBuffers[i];
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/*
+This function remove the head request of a node queue, call its completion callback and release it
+input: CO_Data structure, node identifier
+*/
+
+static void SdoFinish(CO_Data* d, UNS8 nodeid)
+{
+    s_SDOQUEUE* q = &gstaticQueues[BusIndex(d)][nodeid];
+    s_SDOREQ* req = q->head;
+
+    q->head = req->next;
+    if(q->head == NULL) q->tail = NULL;
+
+    if(req->done) req->done(d, req);
+    SdoRelease(req);
+}
+
+/*
+This function start the head request of a node queue.
+Requests that cannot be sent to the node are completed with an error.
+input: CO_Data structure, node identifier
+return: 0 or -1 when no SDO line is free (the request stay queued)
+*/
+
+static int SdoStart(CO_Data* d, UNS8 nodeid)
+{
+    int bus = BusIndex(d);
+    s_SDOQUEUE* q = &gstaticQueues[bus][nodeid];
+    s_SDOREQ* req;
+    UNS8 err;
+
+    while((req = q->head) != NULL && !q->running)
+    {
+        /* Variable length values do not need a line of the stack */
+        if(SDO_RAW(req))
+        {
+            q->running = 1;
+            SdoxStart(d, req);
+            return 0;
+        }
+
+        if(req->type == SDO_READ)
+            err = readNetworkDictCallback(d, nodeid, req->index, req->subindex, 0, SdoReadCallback);
+        else
+            err = writeNetworkDictCallBack(d, nodeid, req->index, req->subindex, req->size, 0, &req->data, SdoWriteCallback);
+
+        if(err == 0)
+        {
+            q->running = 1;
+            gstaticRunning[bus]++;
+            return 0;
+        }
+
+        /* All the lines are used: wait for a completion, unless nothing is running */
+        if(err == 0xFF && gstaticRunning[bus] > 0) return -1;
+
+        req->result = SDO_ABORTED_INTERNAL;
+        req->abortCode = 0;
+        SdoFinish(d, nodeid);
+    }
+    return 0;
+}
+
+/*
+This function start the waiting requests of the idle nodes while SDO lines are free
+input: CO_Data structure
+*/
+
+static void SdoStartWaiting(CO_Data* d)
+{
+    int bus = BusIndex(d);
+    s_SDOQUEUE* queues = gstaticQueues[bus];
+    int i, n, full = gstaticRunning[bus] >= SDO_MAX_SIMULTANEOUS_TRANSFERS;
+
+    for(i=0; i<=MAX_NODES; i++)
+    {
+        n = (gstaticCursor[bus] + i) % (MAX_NODES + 1);
+        if(queues[n].head == NULL || queues[n].running) continue;
+        if(full && !SDO_RAW(queues[n].head)) continue;
+        if(SdoStart(d, n) < 0 || gstaticRunning[bus] >= SDO_MAX_SIMULTANEOUS_TRANSFERS) full = 1;
+    }
+    gstaticCursor[bus] = (gstaticCursor[bus] + 1) % (MAX_NODES + 1);
+}
+
+/*
+This function terminate the running transfer of a node and start the next requests
+input: CO_Data structure, node identifier
+*/
+
+static void SdoCompleted(CO_Data* d, UNS8 nodeid)
+{
+    /* Finalize last SDO transfer with this node */
+    closeSDOtransfer(d, nodeid, SDO_CLIENT);
+
+    gstaticQueues[BusIndex(d)][nodeid].running = 0;
+    gstaticRunning[BusIndex(d)]--;
+
+    SdoFinish(d, nodeid);
+    SdoStartWaiting(d);
+}
+
+/*
+This function complete the running request of a node transferred by sdoxfer.c
+input: CO_Data structure, node identifier
+*/
+
+void SdoRawCompleted(CO_Data* d, UNS8 nodeid)
+{
+    gstaticQueues[BusIndex(d)][nodeid].running = 0;
+    SdoFinish(d, nodeid);
+    SdoStartWaiting(d);
+}
+
+/* Callback function of a read request */
+static void SdoReadCallback(CO_Data* d, UNS8 nodeid)
+{
+    s_SDOREQ* req = gstaticQueues[BusIndex(d)][nodeid].head;
+
+    req->size = sizeof req->data;
+    req->result = getReadResultNetworkDict(d, nodeid, &req->data, &req->size, &req->abortCode);
+    SdoCompleted(d, nodeid);
+}
+
+/* Callback function of a write request */
+static void SdoWriteCallback(CO_Data* d, UNS8 nodeid)
+{
+    s_SDOREQ* req = gstaticQueues[BusIndex(d)][nodeid].head;
+
+    req->result = getWriteResultNetworkDict(d, nodeid, &req->abortCode);
+    SdoCompleted(d, nodeid);
+}
+
+/*
+This function queue a request on its node and start it if the node is idle.
+The completion callback may be called before this function return.
+input: CO_Data structure, request
+return: 0 or -1 if the node id is invalid (the request is then released)
+*/
+
+int SdoSubmit(CO_Data* d, s_SDOREQ* req)
+{
+    int bus = BusIndex(d);
+    s_SDOQUEUE* q;
+
+    if(req->nodeid == 0 || req->nodeid > MAX_NODES)
+    {
+        SdoRelease(req);
+        return -1;
+    }
+
+    q = &gstaticQueues[bus][req->nodeid];
+    req->next = NULL;
+    if(q->tail) q->tail->next = req;
+    else q->head = req;
+    q->tail = req;
+
+    if(!q->running && (SDO_RAW(req) || gstaticRunning[bus] < SDO_MAX_SIMULTANEOUS_TRANSFERS)) SdoStart(d, req->nodeid);
+    return 0;
+}
+
+/*
+This function return the number of requests queued or running on a node
+input: CO_Data structure of the bus, node identifier
+*/
+
+int SdoPending(CO_Data* d, UNS8 nodeid)
+{
+    int n = 0;
+    s_SDOREQ* req;
+
+    if(nodeid > MAX_NODES) return 0;
+    for(req = gstaticQueues[BusIndex(d)][nodeid].head; req != NULL; req = req->next) n++;
+    return n;
+}
+
+/*
+This function tell if a write of an object is queued or running
+input: CO_Data structure of the bus, node identifier, index, subindex
+return: 1 if a write is pending, 0 otherwise
+*/
+
+int SdoWritePending(CO_Data* d, UNS8 nodeid, UNS16 index, UNS8 subindex)
+{
+    s_SDOREQ* req;
+
+    if(nodeid > MAX_NODES) return 0;
+    for(req = gstaticQueues[BusIndex(d)][nodeid].head; req != NULL; req = req->next)
+    {
+        if(req->type == SDO_WRITE && req->index == index && req->subindex == subindex) return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,115 @@
+#ifndef SDOSCHED_H_INCLUDED
+#define SDOSCHED_H_INCLUDED
+
+/*
+SDO transaction scheduler.
+CanFestival allow only one client SDO transfer with a given node. Requests are
+queued in a FIFO for each node of each bus: transfers with different nodes run concurrently
+(up to SDO_MAX_SIMULTANEOUS_TRANSFERS on a bus) while the transfers with a node are
+serialized, the next one being started from the completion callback of the previous.
+Requests with a buffer or a stream transfer a variable length value with the
+SDO client of sdoxfer.c (segmented or block transfer), without using a line of
+the stack. So do the requests with a timeout, whose node may be absent: the
+timeout of the stack lines is fixed (SDO_TIMEOUT_MS).
+All the functions must be called with the stack mutex held (EnterMutex).
+*/
+
+#include "gateway.h"
+
+/* Number of requests that may be waiting or running on all the nodes */
+#define SDO_POOL_SIZE 256
+
+/* Buffers of the variable length transfers and their size in bytes */
+#define SDO_BUFFERS 16
+#define SDO_DATA_MAX 1536
+
+#define SDO_READ 0
+#define SDO_WRITE 1
+
+typedef struct s_SDOREQ s_SDOREQ;
+
+/* Completion callback of a request, the request is released when it returns */
+typedef void (*SdoDone_t)(CO_Data*, s_SDOREQ*);
+
+/*
+Ring buffer of a value written while it is received (download of a file).
+The owner add bytes at head and call SdoxStreamed, the bytes acknowledged by
+the node are released by moving tail and calling the released callback.
+Offsets count the bytes from the start of the value.
+*/
+typedef struct
+{
+    UNS8* ring;
+    UNS32 ringSize;
+    UNS32 head;             /* bytes given by the owner */
+    UNS32 tail;             /* bytes acknowledged by the node */
+    SdoDone_t released;     /* called when tail moved, NULL if not needed */
+} s_SDOSTREAM;
+
+struct s_SDOREQ
+{
+    UNS8 type;              /* SDO_READ or SDO_WRITE */
+    UNS8 nodeid;
+    UNS16 index;
+    UNS8 subindex;
+    UNS32 size;             /* bytes to write, bytes read when completed */
+    UNS32 data;             /* value to write, value read when completed */
+    UNS8* buffer;           /* variable length value (SDO_DATA_MAX bytes), NULL to use data */
+    s_SDOSTREAM* stream;    /* value of size bytes written from a ring buffer, NULL if not streamed */
+    UNS32 timeout;          /* ms allowed to each response of the node, 0 for SDO_TIMEOUT_MS */
+    UNS8 result;            /* SDO_FINISHED when the transfer succeeded */
+    UNS32 abortCode;        /* abort code when the transfer failed */
+    s_REQUESTER rq;         /* host waiting for the result */
+    void* context;          /* owner data passed to the completion callback */
+    SdoDone_t done;         /* completion callback */
+    s_SDOREQ* next;         /* next request in the node queue or in the free list */
+};
+
+/*
+This function take a request from the pool
+return: cleared request or NULL if the pool is exhausted
+*/
+s_SDOREQ* SdoAlloc(void);
+
+/*
+This function give a request back to the pool, with its buffer, a submitted
+request is released by the scheduler
+input: request
+*/
+void SdoRelease(s_SDOREQ*);
+
+/*
+This function attach a buffer to a request for a variable length value,
+the buffer is released with the request
+input: request
+return: 0 or -1 if all the buffers are used
+*/
+int SdoAllocBuffer(s_SDOREQ*);
+
+/*
+This function queue a request on its node and start it if the node is idle
+input: CO_Data structure, request (node id must be lower or equal to MAX_NODES)
+return: 0 or -1 if the node id is invalid (the request is then released)
+*/
+int SdoSubmit(CO_Data*, s_SDOREQ*);
+
+/*
+This function complete the running request of a node transferred by sdoxfer.c
+input: CO_Data structure, node identifier
+*/
+void SdoRawCompleted(CO_Data*, UNS8);
+
+/*
+This function return the number of requests queued or running on a node
+input: CO_Data structure of the bus, node identifier
+*/
+int SdoPending(CO_Data*, UNS8);
+
+/*
+This function tell if a write of an object is queued or running
+input: CO_Data structure of the bus, node identifier, index, subindex
+return: 1 if a write is pending, 0 otherwise
+*/
+int SdoWritePending(CO_Data*, UNS8, UNS16, UNS8);
+
+#endif // SDOSCHED_H_INCLUDED
@@ -0,0 +1,761 @@
+/*
+Module: sdoxfer.c
+Description: SDO client of the CANOpenShell server for variable length values.
+The client transfers of the CanFestival stack use a fixed line buffer and have
+no block transfer, so the expedited, segmented and block protocols (CiA 301)
+are made here with raw frames. The responses of the node are taken from the
+frame tap while a transfer is running with it.
+*/
+
+#include <string.h>
+#include <time.h>
+
+#include "canfestival.h"
+#include "gateway.h"
+#include "sdosched.h"
+#include "cantap.h"
+#include "socketcan.h"
+#include "sdoxfer.h"
+
+//****************************************************************************
+// DEFINES
+
+/* Transfer states, the frame expected from the node */
+#define SDOX_IDLE 0
+#define SDOX_UP_INIT 1          /* upload initiate response (normal or block) */
+#define SDOX_UP_SEGMENT 2       /* upload segment */
+#define SDOX_UP_BLOCK 3         /* segments of an upload block */
+#define SDOX_UP_END 4           /* end of the block upload */
+#define SDOX_DN_INIT 5          /* download initiate response */
+#define SDOX_DN_SEGMENT 6       /* download segment response */
+#define SDOX_DN_BLOCK_INIT 7    /* block download initiate response */
+#define SDOX_DN_BLOCK 8         /* acknowledge of a download block */
+#define SDOX_DN_END 9           /* end of the block download */
+
+/* Abort codes sent by the gateway */
+#define SDOX_ABORT_TOGGLE 0x05030000
+#define SDOX_ABORT_TIMEOUT 0x05040000
+#define SDOX_ABORT_COMMAND 0x05040001
+#define SDOX_ABORT_BLKSIZE 0x05040002
+#define SDOX_ABORT_SEQNO 0x05040003
+#define SDOX_ABORT_CRC 0x05040004
+#define SDOX_ABORT_MEMORY 0x05040005
+
+/* Delay before sending the rest of a block when the transmit queue is full */
+#define SDOX_RESUME_MS 1
+
+//****************************************************************************
+// TYPES
+
+typedef struct
+{
+    s_SDOREQ* req;
+    UNS8 state;
+    UNS8 block;             /* the running initiate is a block transfer */
+    UNS8 toggle;
+    UNS8 crc;               /* the node check the CRC of the block transfer */
+    UNS8 blksize;           /* segments of a block */
+    UNS8 seqno;             /* segments sent or received in the current block */
+    UNS8 resume;            /* the timer resume the sending of a block */
+    UNS8 starved;           /* a streamed download wait for the bytes of its owner */
+    UNS32 offset;           /* bytes transferred */
+    UNS32 total;            /* bytes of the value */
+    UNS32 blockStart;       /* offset of the first segment of the current download block */
+    UNS32 acked;            /* bytes of a download acknowledged by the node */
+    UNS16 crcValue;         /* CRC of the acknowledged bytes */
+    UNS8* buffer;           /* value: buffer of the request, or value for a request without buffer */
+    UNS32 max;              /* bytes of the buffer */
+    UNS8 value[4];
+    UNS32 timeout;          /* ms allowed for each response of the node */
+    TIMER_HANDLE timer;
+} s_SDOXFER;
+
+//****************************************************************************
+// GLOBALS
+
+static s_SDOXFER gstaticXfers[MAX_BUSES][MAX_NODES + 1];
+static UNS8 gstaticNoBlock[MAX_BUSES][MAX_NODES + 1];  /* the node refused a block transfer */
+static int gstaticTapRegistered;
+
+static void SdoxAlarm(CO_Data* d, UNS32 nodeid);
+static void SdoxBegin(CO_Data* d, UNS8 nodeid);
+
+
+/*
+This function update the CRC of a block transfer (CRC-16-CCITT, initial value 0)
+input: CRC of the previous bytes, data, number of bytes
+return: CRC
+*/
+
+static UNS16 SdoxCrc(UNS16 crc, const UNS8* p, UNS32 n)
+{
+    int i;
+
+    while(n--)
+    {
+        crc ^= (UNS16)*p++ << 8;
+        for(i=0; i<8; i++) crc = crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1;
+    }
+    return crc;
+}
+
+/*
+This function restart the timeout of the transfer with a node
+input: CO_Data structure, node identifier, delay in ms
+*/
+
+static void SdoxArm(CO_Data* d, UNS8 nodeid, UNS32 ms)
+{
+    s_SDOXFER* x = &gstaticXfers[BusIndex(d)][nodeid];
+
+    if(x->timer != TIMER_NONE) DelAlarm(x->timer);
+    x->timer = SetAlarm(d, nodeid, SdoxAlarm, MS_TO_TIMEVAL(ms), 0);
+}
+
+/*
+This function send a request frame to a node
+input: CO_Data structure, node identifier, 8 data bytes
+return: 0 or the error of canSend
+*/
+
+static UNS8 SdoxSend(CO_Data* d, UNS8 nodeid, const UNS8* data)
+{
+    Message m;
+
+    m.cob_id = 0x600 + nodeid;
+    m.rtr = 0;
+    m.len = 8;
+    memcpy(m.data, data, 8);
+    return canSend(d->canHandle, &m);
+}
+
+/*
+This function send a frame with the multiplexer of the transfer
+input: CO_Data structure, node identifier, command byte, value of bytes 4 to 7
+*/
+
+static void SdoxSendMux(CO_Data* d, UNS8 nodeid, UNS8 command, UNS32 value)
+{
+    s_SDOREQ* req = gstaticXfers[BusIndex(d)][nodeid].req;
+    UNS8 buf[8];
+
+    buf[0] = command;
+    buf[1] = req->index & 0xFF;
+    buf[2] = req->index >> 8;
+    buf[3] = req->subindex;
+    buf[4] = value & 0xFF;
+    buf[5] = (value >> 8) & 0xFF;
+    buf[6] = (value >> 16) & 0xFF;
+    buf[7] = value >> 24;
+    SdoxSend(d, nodeid, buf);
+}
+
+/*
+This function copy bytes of a value written to a node from its buffer or its stream
+input: transfer, offset in the value, destination, number of bytes
+*/
+
+static void SdoxCopy(s_SDOXFER* x, UNS32 pos, UNS8* dst, UNS32 n)
+{
+    s_SDOSTREAM* st = x->req->stream;
+    UNS32 i;
+
+    if(st == NULL)
+        memcpy(dst, x->buffer + pos, n);
+    else
+        for(i=0; i<n; i++) dst[i] = st->ring[(pos + i) % st->ringSize];
+}
+
+/*
+This function tell if the bytes of a segment can be sent, a streamed download
+wait for them otherwise until SdoxStreamed or the timeout
+input: CO_Data structure, node identifier, offset in the value, number of bytes
+return: 1 if the bytes are available, 0 otherwise
+*/
+
+static int SdoxAvailable(CO_Data* d, UNS8 nodeid, UNS32 pos, UNS32 n)
+{
+    s_SDOXFER* x = &gstaticXfers[BusIndex(d)][nodeid];
+
+    if(x->req->stream == NULL || x->req->stream->head >= pos + n) return 1;
+    x->starved = 1;
+    SdoxArm(d, nodeid, x->timeout);
+    return 0;
+}
+
+/*
+This function account the bytes of a download acknowledged by the node, their
+place in a stream is given back to the owner
+input: CO_Data structure, node identifier, offset acknowledged
+*/
+
+static void SdoxAcknowledged(CO_Data* d, UNS8 nodeid, UNS32 offset)
+{
+    s_SDOXFER* x = &gstaticXfers[BusIndex(d)][nodeid];
+    s_SDOSTREAM* st = x->req->stream;
+    UNS8 buf[8];
+    UNS32 n;
+
+    while(x->acked < offset)
+    {
+        n = offset - x->acked > 8 ? 8 : offset - x->acked;
+        SdoxCopy(x, x->acked, buf, n);
+        x->crcValue = SdoxCrc(x->crcValue, buf, n);
+        x->acked += n;
+    }
+    if(st != NULL)
+    {
+        st->tail = offset;
+        if(st->released) st->released(d, x->req);
+    }
+}
+
+/*
+This function end the transfer with a node and give the result to the scheduler
+input: CO_Data structure, node identifier, result, abort code
+*/
+
+static void SdoxComplete(CO_Data* d, UNS8 nodeid, UNS8 result, UNS32 abortCode)
+{
+    s_SDOXFER* x = &gstaticXfers[BusIndex(d)][nodeid];
+    s_SDOREQ* req = x->req;
+    UNS32 i;
+
+    if(x->timer != TIMER_NONE) x->timer = DelAlarm(x->timer);
+    x->req = NULL;
+    x->state = SDOX_IDLE;
+
+    req->result = result;
+    req->abortCode = abortCode;
+    if(result == SDO_FINISHED && req->type == SDO_READ)
+    {
+        /* Small values are also given like the transfers of the stack */
+        req->size = x->total;
+        req->data = 0;
+        for(i=0; i<4 && i<x->total; i++) req->data |= (UNS32)x->buffer[i] << (8 * i);
+    }
+    SdoRawCompleted(d, nodeid);
+}
+
+/*
+This function abort the transfer with a node
+input: CO_Data structure, node identifier, abort code
+*/
+
+static void SdoxAbort(CO_Data* d, UNS8 nodeid, UNS32 abortCode)
+{
+    SdoxSendMux(d, nodeid, 0x80, abortCode);
+    SdoxComplete(d, nodeid, SDO_ABORTED_INTERNAL, abortCode);
+}
+
+/*
+This function send the next segment of a segmented download
+input: CO_Data structure, node identifier
+*/
+
+static void SdoxSendSegment(CO_Data* d, UNS8 nodeid)
+{
+    s_SDOXFER* x = &gstaticXfers[BusIndex(d)][nodeid];
+    UNS8 buf[8];
+    UNS32 n = x->total - x->offset;
+
+    if(n > 7) n = 7;
+    x->state = SDOX_DN_SEGMENT;
+    if(!SdoxAvailable(d, nodeid, x->offset, n)) return;
+    memset(buf, 0, 8);
+    buf[0] = (x->toggle << 4) | ((7 - n) << 1) | (x->offset + n >= x->total);
+    SdoxCopy(x, x->offset, buf + 1, n);
+    x->offset += n;
+    SdoxSend(d, nodeid, buf);
+    SdoxArm(d, nodeid, x->timeout);
+}
+
+/*
+This function send the segments of the current download block, the sending is
+resumed by the timer when the transmit queue is full
+input: CO_Data structure, node identifier
+*/
+
+static void SdoxSendBlock(CO_Data* d, UNS8 nodeid)
+{
+    s_SDOXFER* x = &gstaticXfers[BusIndex(d)][nodeid];
+    UNS8 buf[8];
+    UNS32 pos, n;
+    int full = 0, waiting = 0, refused;
+
+    /* The segments are sent in batches with the SocketCAN driver */
+    SockCanHold(BusIndex(d));
+    x->state = SDOX_DN_BLOCK;
+    while(x->seqno < x->blksize)
+    {
+        pos = x->blockStart + 7 * x->seqno;
+        n = x->total - pos;
+        if(n > 7) n = 7;
+        if(!SdoxAvailable(d, nodeid, pos, n))
+        {
+            waiting = 1;
+            break;
+        }
+        memset(buf, 0, 8);
+        buf[0] = (x->seqno + 1) | (pos + n >= x->total ? 0x80 : 0);
+        SdoxCopy(x, pos, buf + 1, n);
+        if(SdoxSend(d, nodeid, buf) != 0)
+        {
+            full = 1;
+            break;
+        }
+        x->seqno++;
+        if(buf[0] & 0x80) break;
+    }
+
+    /* The segments refused by the interface are the last ones */
+    refused = SockCanFlush(BusIndex(d));
+    x->seqno -= refused;
+    if(full || refused > 0)
+    {
+        x->resume = 1;
+        SdoxArm(d, nodeid, SDOX_RESUME_MS);
+        return;
+    }
+    if(waiting) return;
+    x->resume = 0;
+    SdoxArm(d, nodeid, x->timeout);
+}
+
+/* Timer of the transfers: timeout or resume of a block */
+static void SdoxAlarm(CO_Data* d, UNS32 nodeid)
+{
+    s_SDOXFER* x = &gstaticXfers[BusIndex(d)][nodeid];
+
+    x->timer = TIMER_NONE;
+    if(x->req == NULL) return;
+    if(x->resume) SdoxSendBlock(d, nodeid);
+    else SdoxAbort(d, nodeid, SDOX_ABORT_TIMEOUT);
+}
+
+/*
+This function send the initiate request of the running transfer with a node
+input: CO_Data structure, node identifier
+*/
+
+static void SdoxBegin(CO_Data* d, UNS8 nodeid)
+{
+    s_SDOXFER* x = &gstaticXfers[BusIndex(d)][nodeid];
+    s_SDOREQ* req = x->req;
+    UNS32 value = 0, i;
+
+    x->offset = 0;
+    x->toggle = 0;
+    x->seqno = 0;
+    x->resume = 0;
+    x->starved = 0;
+    x->block = 0;
+    x->acked = 0;
+    x->crcValue = 0;
+
+    if(req->type == SDO_READ)
+    {
+        x->total = 0;
+        x->state = SDOX_UP_INIT;
+        /* A value read without buffer fit in an expedited upload */
+        if(gstaticNoBlock[BusIndex(d)][nodeid] || req->buffer == NULL)
+            SdoxSendMux(d, nodeid, 0x40, 0);
+        else
+        {
+            /* The node may switch to a normal upload for a value up to SDOX_BLOCK_MIN bytes */
+            x->block = 1;
+            SdoxSendMux(d, nodeid, 0xA4, SDOX_BLKSIZE | (SDOX_BLOCK_MIN << 8));
+        }
+    }
+    else
+    {
+        x->total = req->size;
+        if(req->size <= 4 && req->stream == NULL)
+        {
+            for(i=0; i<req->size; i++) value |= (UNS32)x->buffer[i] << (8 * i);
+            x->state = SDOX_DN_INIT;
+            SdoxSendMux(d, nodeid, 0x23 | ((4 - req->size) << 2), value);
+        }
+        else if(req->size > SDOX_BLOCK_MIN && !gstaticNoBlock[BusIndex(d)][nodeid])
+        {
+            x->block = 1;
+            x->state = SDOX_DN_BLOCK_INIT;
+            SdoxSendMux(d, nodeid, 0xC6, req->size);
+        }
+        else
+        {
+            x->state = SDOX_DN_INIT;
+            SdoxSendMux(d, nodeid, 0x21, req->size);
+        }
+    }
+    SdoxArm(d, nodeid, x->timeout);
+}
+
+/*
+This function store the data of an upload segment
+input: transfer, data, number of bytes
+return: 0 or -1 if the value is larger than the buffer
+*/
+
+static int SdoxStore(s_SDOXFER* x, const UNS8* data, UNS32 n)
+{
+    if(x->offset + n > x->max) return -1;
+    memcpy(x->buffer + x->offset, data, n);
+    x->offset += n;
+    return 0;
+}
+
+/*
+This function process the response of the upload initiate
+input: CO_Data structure, node identifier, frame data
+*/
+
+static void SdoxUploadInit(CO_Data* d, UNS8 nodeid, const UNS8* b)
+{
+    s_SDOXFER* x = &gstaticXfers[BusIndex(d)][nodeid];
+    UNS32 size = b[4] | (b[5] << 8) | (b[6] << 16) | ((UNS32)b[7] << 24);
+
+    if((b[0] & 0xE0) == 0x40 && (b[0] & 0x02))
+    {
+        /* Expedited, the size is 4 bytes when not indicated */
+        x->total = b[0] & 0x01 ? 4 - ((b[0] >> 2) & 3) : 4;
+        memcpy(x->buffer, b + 4, x->total);
+        SdoxComplete(d, nodeid, SDO_FINISHED, 0);
+    }
+    else if((b[0] & 0xE0) == 0x40)
+    {
+        if((b[0] & 0x01) && size > x->max)
+        {
+            SdoxAbort(d, nodeid, SDOX_ABORT_MEMORY);
+            return;
+        }
+        x->state = SDOX_UP_SEGMENT;
+        SdoxSendMux(d, nodeid, 0x60, 0);
+        SdoxArm(d, nodeid, x->timeout);
+    }
+    else if((b[0] & 0xE1) == 0xC0 && x->block)
+    {
+        if((b[0] & 0x02) && size > x->max)
+        {
+            SdoxAbort(d, nodeid, SDOX_ABORT_MEMORY);
+            return;
+        }
+        x->crc = (b[0] & 0x04) != 0;
+        x->blksize = SDOX_BLKSIZE;
+        x->state = SDOX_UP_BLOCK;
+        SdoxSendMux(d, nodeid, 0xA3, 0);
+        SdoxArm(d, nodeid, x->timeout);
+    }
+    else SdoxAbort(d, nodeid, SDOX_ABORT_COMMAND);
+}
+
+/*
+This function process a segment of an upload block
+input: CO_Data structure, node identifier, frame data
+*/
+
+static void SdoxUploadBlock(CO_Data* d, UNS8 nodeid, const UNS8* b)
+{
+    s_SDOXFER* x = &gstaticXfers[BusIndex(d)][nodeid];
+    UNS8 ack[8];
+    UNS8 seqno = b[0] & 0x7F;
+    int last = 0;
+
+    /* Segments out of sequence are ignored, the acknowledge ask for their retransmission */
+    if(seqno == x->seqno + 1)
+    {
+        if(x->offset >= x->max)
+        {
+            SdoxAbort(d, nodeid, SDOX_ABORT_MEMORY);
+            return;
+        }
+        /* The padding of the last segment is removed by the end of the transfer */
+        memcpy(x->buffer + x->offset, b + 1, x->offset + 7 > x->max ? x->max - x->offset : 7);
+        x->offset += 7;
+        x->seqno = seqno;
+        last = (b[0] & 0x80) != 0;
+    }
+    if(seqno < x->blksize && !(b[0] & 0x80))
+    {
+        SdoxArm(d, nodeid, x->timeout);
+        return;
+    }
+
+    memset(ack, 0, 8);
+    ack[0] = 0xA2;
+    ack[1] = x->seqno;
+    ack[2] = x->blksize;
+    x->seqno = 0;
+    if(last) x->state = SDOX_UP_END;
+    SdoxSend(d, nodeid, ack);
+    SdoxArm(d, nodeid, x->timeout);
+}
+
+/*
+This function process the end of a block upload
+input: CO_Data structure, node identifier, frame data
+*/
+
+static void SdoxUploadEnd(CO_Data* d, UNS8 nodeid, const UNS8* b)
+{
+    s_SDOXFER* x = &gstaticXfers[BusIndex(d)][nodeid];
+    UNS8 buf[8];
+    UNS32 unused = (b[0] >> 2) & 7;
+
+    if((b[0] & 0xE3) != 0xC1 || unused > x->offset)
+    {
+        SdoxAbort(d, nodeid, SDOX_ABORT_COMMAND);
+        return;
+    }
+    x->total = x->offset - unused;
+    if(x->total > x->max)
+    {
+        SdoxAbort(d, nodeid, SDOX_ABORT_MEMORY);
+        return;
+    }
+    if(x->crc && SdoxCrc(0, x->buffer, x->total) != (b[1] | (b[2] << 8)))
+    {
+        SdoxAbort(d, nodeid, SDOX_ABORT_CRC);
+        return;
+    }
+    memset(buf, 0, 8);
+    buf[0] = 0xA1;
+    SdoxSend(d, nodeid, buf);
+    SdoxComplete(d, nodeid, SDO_FINISHED, 0);
+}
+
+/*
+This function process the acknowledge of a download block
+input: CO_Data structure, node identifier, frame data
+*/
+
+static void SdoxDownloadAck(CO_Data* d, UNS8 nodeid, const UNS8* b)
+{
+    s_SDOXFER* x = &gstaticXfers[BusIndex(d)][nodeid];
+    UNS8 buf[8];
+    UNS16 crc;
+    UNS32 unused;
+
+    if((b[0] & 0xE3) != 0xA2)
+    {
+        SdoxAbort(d, nodeid, SDOX_ABORT_COMMAND);
+        return;
+    }
+    if(b[1] > x->seqno)
+    {
+        SdoxAbort(d, nodeid, SDOX_ABORT_SEQNO);
+        return;
+    }
+    if(b[2] == 0 || b[2] > 127)
+    {
+        SdoxAbort(d, nodeid, SDOX_ABORT_BLKSIZE);
+        return;
+    }
+
+    /* The next block start after the last segment received by the node */
+    x->offset = x->blockStart + 7 * b[1];
+    if(x->offset > x->total) x->offset = x->total;
+    x->blockStart = x->offset;
+    SdoxAcknowledged(d, nodeid, x->offset);
+    x->blksize = b[2];
+    x->seqno = 0;
+    if(x->offset < x->total)
+    {
+        SdoxSendBlock(d, nodeid);
+        return;
+    }
+
+    unused = (7 - x->total % 7) % 7;
+    crc = x->crc ? x->crcValue : 0;
+    memset(buf, 0, 8);
+    buf[0] = 0xC1 | (unused << 2);
+    buf[1] = crc & 0xFF;
+    buf[2] = crc >> 8;
+    x->state = SDOX_DN_END;
+    SdoxSend(d, nodeid, buf);
+    SdoxArm(d, nodeid, x->timeout);
+}
+
+/*
+This function process a response of a node to the running transfer
+input: CO_Data structure, node identifier, frame data
+*/
+
+static void SdoxReceive(CO_Data* d, UNS8 nodeid, const UNS8* b)
+{
+    s_SDOXFER* x = &gstaticXfers[BusIndex(d)][nodeid];
+    UNS32 code;
+
+    if(b[0] == 0x80 && x->state != SDOX_UP_BLOCK)
+    {
+        code = b[4] | (b[5] << 8) | (b[6] << 16) | ((UNS32)b[7] << 24);
+        /* A node without block transfer is asked again with the normal protocol */
+        if(x->block && code == SDOX_ABORT_COMMAND && (x->state == SDOX_UP_INIT || x->state == SDOX_DN_BLOCK_INIT))
+        {
+            gstaticNoBlock[BusIndex(d)][nodeid] = 1;
+            SdoxBegin(d, nodeid);
+            return;
+        }
+        SdoxComplete(d, nodeid, SDO_ABORTED_RCV, code);
+        return;
+    }
+
+    switch(x->state)
+    {
+        case SDOX_UP_INIT:
+            SdoxUploadInit(d, nodeid, b);
+            break;
+
+        case SDOX_UP_SEGMENT:
+            if((b[0] & 0xE0) != 0x00)
+                SdoxAbort(d, nodeid, SDOX_ABORT_COMMAND);
+            else if(((b[0] >> 4) & 1) != x->toggle)
+                SdoxAbort(d, nodeid, SDOX_ABORT_TOGGLE);
+            else if(SdoxStore(x, b + 1, 7 - ((b[0] >> 1) & 7)) < 0)
+                SdoxAbort(d, nodeid, SDOX_ABORT_MEMORY);
+            else if(b[0] & 0x01)
+            {
+                x->total = x->offset;
+                SdoxComplete(d, nodeid, SDO_FINISHED, 0);
+            }
+            else
+            {
+                x->toggle ^= 1;
+                SdoxSendMux(d, nodeid, 0x60 | (x->toggle << 4), 0);
+                SdoxArm(d, nodeid, x->timeout);
+            }
+            break;
+
+        case SDOX_UP_BLOCK:
+            /* An abort has the value of a last segment 0, which is not a valid sequence number */
+            if(b[0] == 0x80)
+                SdoxComplete(d, nodeid, SDO_ABORTED_RCV, b[4] | (b[5] << 8) | (b[6] << 16) | ((UNS32)b[7] << 24));
+            else
+                SdoxUploadBlock(d, nodeid, b);
+            break;
+
+        case SDOX_UP_END:
+            SdoxUploadEnd(d, nodeid, b);
+            break;
+
+        case SDOX_DN_INIT:
+            if(b[0] != 0x60)
+                SdoxAbort(d, nodeid, SDOX_ABORT_COMMAND);
+            else if(x->total <= 4)
+                SdoxComplete(d, nodeid, SDO_FINISHED, 0);
+            else
+                SdoxSendSegment(d, nodeid);
+            break;
+
+        case SDOX_DN_SEGMENT:
+            if((b[0] & 0xEF) != 0x20)
+                SdoxAbort(d, nodeid, SDOX_ABORT_COMMAND);
+            else if(((b[0] >> 4) & 1) != x->toggle)
+                SdoxAbort(d, nodeid, SDOX_ABORT_TOGGLE);
+            else if(x->offset >= x->total)
+                SdoxComplete(d, nodeid, SDO_FINISHED, 0);
+            else
+            {
+                SdoxAcknowledged(d, nodeid, x->offset);
+                x->toggle ^= 1;
+                SdoxSendSegment(d, nodeid);
+            }
+            break;
+
+        case SDOX_DN_BLOCK_INIT:
+            if((b[0] & 0xFB) != 0xA0)
+                SdoxAbort(d, nodeid, SDOX_ABORT_COMMAND);
+            else if(b[4] == 0 || b[4] > 127)
+                SdoxAbort(d, nodeid, SDOX_ABORT_BLKSIZE);
+            else
+            {
+                x->crc = (b[0] & 0x04) != 0;
+                x->blksize = b[4];
+                x->blockStart = 0;
+                x->seqno = 0;
+                SdoxSendBlock(d, nodeid);
+            }
+            break;
+
+        case SDOX_DN_BLOCK:
+            /* An acknowledge before the end of the block stop its sending */
+            x->resume = 0;
+            x->starved = 0;
+            SdoxDownloadAck(d, nodeid, b);
+            break;
+
+        case SDOX_DN_END:
+            if((b[0] & 0xE3) != 0xA1)
+                SdoxAbort(d, nodeid, SDOX_ABORT_COMMAND);
+            else
+                SdoxComplete(d, nodeid, SDO_FINISHED, 0);
+            break;
+    }
+}
+
+/* Frame tap listener: responses of the nodes with a running transfer */
+static int SdoxFrame(int bus, int dir, Message* m)
+{
+    UNS8 nodeid, b[8];
+
+    if(dir != CANTAP_RX || m->rtr || m->cob_id <= 0x580 || m->cob_id > 0x580 + MAX_NODES) return 0;
+    nodeid = m->cob_id - 0x580;
+    if(bus >= MAX_BUSES || gstaticXfers[bus][nodeid].req == NULL) return 0;
+
+    memset(b, 0, 8);
+    memcpy(b, m->data, m->len < 8 ? m->len : 8);
+    SdoxReceive(BusData(bus), nodeid, b);
+    return 1;
+}
+
+/*
+This function start the transfer of a request with a buffer, the scheduler
+is told of the completion with SdoRawCompleted
+input: CO_Data structure, request
+*/
+
+void SdoxStart(CO_Data* d, s_SDOREQ* req)
+{
+    s_SDOXFER* x;
+    int bus, i;
+
+    if(!gstaticTapRegistered)
+    {
+        gstaticTapRegistered = 1;
+        CanTapRegister(SdoxFrame);
+        memset(gstaticXfers, 0, sizeof(gstaticXfers));
+        for(bus=0; bus<MAX_BUSES; bus++)
+            for(i=0; i<=MAX_NODES; i++) gstaticXfers[bus][i].timer = TIMER_NONE;
+    }
+    x = &gstaticXfers[BusIndex(d)][req->nodeid];
+    x->req = req;
+    x->timeout = req->timeout ? req->timeout : SDO_TIMEOUT_MS;
+    if(req->buffer != NULL)
+    {
+        x->buffer = req->buffer;
+        x->max = SDO_DATA_MAX;
+    }
+    else
+    {
+        /* Small value given and returned in data, like the transfers of the stack */
+        for(i=0; i<4; i++) x->value[i] = (UNS8)(req->data >> (8 * i));
+        x->buffer = x->value;
+        x->max = 4;
+    }
+    SdoxBegin(d, req->nodeid);
+}
+
+/*
+This function continue a streamed download waiting for the bytes of its owner
+input: CO_Data structure, node identifier
+*/
+
+void SdoxStreamed(CO_Data* d, UNS8 nodeid)
+{
+    s_SDOXFER* x = &gstaticXfers[BusIndex(d)][nodeid];
+
+    if(x->req == NULL || !x->starved) return;
+    x->starved = 0;
+    if(x->state == SDOX_DN_BLOCK) SdoxSendBlock(d, nodeid);
+    else SdoxSendSegment(d, nodeid);
+}
@@ -0,0 +1,39 @@
+#ifndef SDOXFER_H_INCLUDED
+#define SDOXFER_H_INCLUDED
+
+/*
+SDO client for variable length values.
+The transfers are made with raw frames on the default SDO channel of the node
+(0x600 + node id, 0x580 + node id) and the responses are taken from the frame
+tap before the stack see them. Values up to 4 bytes are expedited, larger ones
+use a block transfer, or a segmented transfer if the node does not support it.
+A streamed value is sent while its owner fill the ring buffer, the transfer
+wait for the bytes that are not yet available.
+Reads start as block uploads with a protocol switch threshold, so a node with
+a small value answer with an expedited or segmented upload.
+A request without buffer nor stream (a request with a timeout) transfer up to
+4 bytes in its data field, like the transfers of the stack.
+The scheduler run at most one transfer with a node.
+All the functions must be called with the stack mutex held (EnterMutex).
+*/
+
+/* Smallest value written with a block transfer */
+#define SDOX_BLOCK_MIN 32
+
+/* Number of segments of a block requested by the gateway (1 to 127) */
+#define SDOX_BLKSIZE 127
+
+/*
+This function start the transfer of a request with a buffer, a stream or a timeout, the scheduler
+is told of the completion with SdoRawCompleted
+input: CO_Data structure, request
+*/
+void SdoxStart(CO_Data*, s_SDOREQ*);
+
+/*
+This function continue a streamed download waiting for the bytes of its owner
+input: CO_Data structure, node identifier
+*/
+void SdoxStreamed(CO_Data*, UNS8);
+
+#endif // SDOXFER_H_INCLUDED
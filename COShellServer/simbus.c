@@ -0,0 +1,654 @@
+/*
+Module: simbus.c
+Description: simulated CAN bus of the CANOpenShell server.
+The entry points have the prototypes of a CanFestival driver library:
+canSend_driver give a frame of the gateway to the virtual slaves, that
+queue their answers with the time they are due, and canReceive_driver wait
+for the first frame due, an answer or a heartbeat. The answers keep the
+order of the frames of the gateway, as on a real bus.
+Each port has its own lock: the frames are sent with the stack mutex held
+and received by the receive thread without it.
+As in socketcan.c, canfestival.h is not included: it declare the entry
+points as functions.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "applicfg.h"
+#include "can.h"
+#include "simbus.h"
+
+//****************************************************************************
+// DRIVER ENTRY POINTS
+
+extern UNS8 (*canReceive_driver)(void*, Message*);
+extern UNS8 (*canSend_driver)(void*, Message*);
+extern void* (*canOpen_driver)(void*);
+extern int (*canClose_driver)(void*);
+extern UNS8 (*canChangeBaudRate_driver)(void*, char*);
+
+/* Board given to canOpen (canfestival.h) */
+typedef struct
+{
+    char* busname;
+    char* baudrate;
+} s_SIMBOARD;
+
+//****************************************************************************
+// DEFINES
+
+#define SIM_MAX_NODE 0x7F
+#define SIM_ENTRIES 18
+#define SIM_NAME_ENTRY 2                /* entry of the device name, a string */
+
+/* NMT states as sent in the heartbeat */
+#define SIM_BOOTUP 0x00
+#define SIM_STOPPED 0x04
+#define SIM_OPERATIONAL 0x05
+#define SIM_PREOPERATIONAL 0x7F
+
+/* SDO abort codes */
+#define SIM_ABORT_TOGGLE 0x05030000
+#define SIM_ABORT_COMMAND 0x05040001
+#define SIM_ABORT_READONLY 0x06010002
+#define SIM_ABORT_OBJECT 0x06020000
+#define SIM_ABORT_LENGTH 0x06070010
+#define SIM_ABORT_SUBINDEX 0x06090011
+
+//****************************************************************************
+// TYPES
+
+typedef struct
+{
+    UNS16 index;
+    UNS8 subindex;
+    UNS8 size;                  /* bytes, 0 for the device name */
+    UNS8 writable;
+    UNS32 value;                /* default value */
+} s_SIMENTRY;
+
+typedef struct
+{
+    UNS8 present;               /* node simulated on the bus */
+    UNS8 powered;               /* 0: the node stay silent */
+    UNS8 state;                 /* NMT state */
+    UNS8 guardToggle;
+    long long heartbeat;        /* time of the next heartbeat in ns, 0: none */
+    UNS32 value[SIM_ENTRIES];
+    char name[16];
+
+    /* Segmented upload in progress */
+    int upload;                 /* entry, -1: none */
+    UNS32 offset;
+    UNS8 toggle;
+} s_SIMSLAVE;
+
+typedef struct
+{
+    Message m;
+    long long due;              /* ns, monotonic clock */
+} s_SIMFRAME;
+
+typedef struct
+{
+    int used;
+    int closed;
+    int bus;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    UNS8 first;
+    UNS8 last;
+    long long latency;          /* ns */
+    UNS16 heartbeat;            /* ms, default of 1017h */
+    s_SIMSLAVE slaves[SIM_MAX_NODE + 1];
+
+    /* Frames of the slaves in the order they are due */
+    s_SIMFRAME queue[SIM_QUEUE];
+    int head;
+    int count;
+
+    /* Counters */
+    unsigned long txFrames;     /* frames of the gateway */
+    unsigned long sdo;
+    unsigned long nmt;
+    unsigned long rxFrames;     /* frames of the slaves */
+    unsigned long heartbeats;
+    unsigned long lost;         /* answers dropped, the queue was full */
+} s_SIMPORT;
+
+//****************************************************************************
+// GLOBALS
+
+static const s_SIMENTRY gstaticDictionary[SIM_ENTRIES] =
+{
+    {0x1000, 0, 4, 0, SIM_DEVICE_TYPE},
+    {0x1001, 0, 1, 0, 0},
+    {0x1008, 0, 0, 0, 0},
+    {0x1017, 0, 2, 1, 0},       /* heartbeat time of the channel */
+    {0x1018, 0, 1, 0, 4},
+    {0x1018, 1, 4, 0, SIM_VENDOR},
+    {0x1018, 2, 4, 0, SIM_PRODUCT},
+    {0x1018, 3, 4, 0, SIM_REVISION},
+    {0x1018, 4, 4, 0, 0},       /* serial number: node id */
+    {0x2000, 0, 1, 0, 8},
+    {0x2000, 1, 4, 1, 0},
+    {0x2000, 2, 4, 1, 0},
+    {0x2000, 3, 4, 1, 0},
+    {0x2000, 4, 4, 1, 0},
+    {0x2000, 5, 4, 1, 0},
+    {0x2000, 6, 4, 1, 0},
+    {0x2000, 7, 4, 1, 0},
+    {0x2000, 8, 4, 1, 0},
+};
+
+static s_SIMPORT gstaticPorts[SIM_MAX_BUSES];
+static s_SIMPORT* gstaticByBus[SIM_MAX_BUSES];
+static int gstaticOpening;
+
+
+/*
+This function return the time of the monotonic clock
+return: time in ns
+*/
+
+static long long SimNow(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/*
+This function return the port serving a bus
+input: bus index
+return: port or NULL if the bus is not simulated
+*/
+
+static s_SIMPORT* SimPort(int bus)
+{
+    if(bus < 0 || bus >= SIM_MAX_BUSES) return NULL;
+    return gstaticByBus[bus];
+}
+
+/*
+This function return an entry of the dictionary
+input: index, subindex, abort code receiving the reason when the entry does not exist
+return: entry or -1
+*/
+
+static int SimEntry(UNS16 index, UNS8 subindex, UNS32* abortCode)
+{
+    int i, found = 0;
+
+    for(i=0; i<SIM_ENTRIES; i++)
+    {
+        if(gstaticDictionary[i].index != index) continue;
+        if(gstaticDictionary[i].subindex == subindex) return i;
+        found = 1;
+    }
+    *abortCode = found ? SIM_ABORT_SUBINDEX : SIM_ABORT_OBJECT;
+    return -1;
+}
+
+/*
+This function queue a frame of a slave, the port lock is held
+input: port, COB-ID, length, data, time the frame is due
+*/
+
+static void SimQueue(s_SIMPORT* p, UNS16 cobid, UNS8 len, UNS8* data, long long due)
+{
+    s_SIMFRAME* f;
+
+    if(p->count == SIM_QUEUE)
+    {
+        p->lost++;
+        return;
+    }
+    f = &p->queue[(p->head + p->count++) % SIM_QUEUE];
+    memset(f, 0, sizeof *f);
+    f->m.cob_id = cobid;
+    f->m.len = len;
+    memcpy(f->m.data, data, len);
+    f->due = due;
+    pthread_cond_signal(&p->wake);
+}
+
+/*
+This function set when the next heartbeat of a slave is sent
+input: port, slave, time of the last heartbeat or boot-up
+*/
+
+static void SimHeartbeat(s_SIMPORT* p, s_SIMSLAVE* s, long long last)
+{
+    UNS32 period = s->value[3];
+
+    s->heartbeat = period ? last + (long long)period * 1000000 : 0;
+    pthread_cond_signal(&p->wake);
+}
+
+/*
+This function boot a slave: it send its boot-up and enter the pre-operational
+state, the reset of the node restore its dictionary
+input: port, node id, 1: reset of the node, 0: reset of the communication
+*/
+
+static void SimBoot(s_SIMPORT* p, UNS8 nodeid, int resetNode)
+{
+    s_SIMSLAVE* s = &p->slaves[nodeid];
+    UNS8 bootup = SIM_BOOTUP;
+    long long due = SimNow() + p->latency;
+    int i;
+
+    if(resetNode)
+    {
+        for(i=0; i<SIM_ENTRIES; i++) s->value[i] = gstaticDictionary[i].value;
+        s->value[3] = p->heartbeat;
+        s->value[8] = nodeid;
+        sprintf(s->name, "SIM node %02X", nodeid);
+    }
+    s->state = SIM_PREOPERATIONAL;
+    s->guardToggle = 0;
+    s->upload = -1;
+    SimQueue(p, 0x700 + nodeid, 1, &bootup, due);
+    SimHeartbeat(p, s, due);
+}
+
+/*
+This function answer a SDO request, segmented downloads and block transfers
+are aborted
+input: port, node id, request
+*/
+
+static void SimSdo(s_SIMPORT* p, UNS8 nodeid, UNS8* q)
+{
+    s_SIMSLAVE* s = &p->slaves[nodeid];
+    UNS16 index = q[1] | (q[2] << 8);
+    UNS32 abortCode = 0, v;
+    UNS8 r[8];
+    int e, n;
+
+    memset(r, 0, sizeof r);
+    switch(q[0] >> 5)
+    {
+    case 2 :    /* initiate upload */
+        s->upload = -1;
+        if((e = SimEntry(index, q[3], &abortCode)) < 0) break;
+        memcpy(r + 1, q + 1, 3);
+        if(e == SIM_NAME_ENTRY)
+        {
+            /* The name is sent in segments, its size is given first */
+            r[0] = 0x41;
+            r[4] = (UNS8)strlen(s->name);
+            s->upload = e;
+            s->offset = 0;
+            s->toggle = 0;
+            break;
+        }
+        r[0] = 0x43 | ((4 - gstaticDictionary[e].size) << 2);
+        for(n=0, v=s->value[e]; n<gstaticDictionary[e].size; n++, v>>=8) r[4 + n] = (UNS8)v;
+        break;
+
+    case 3 :    /* upload segment */
+        if(s->upload < 0)
+        {
+            abortCode = SIM_ABORT_COMMAND;
+            break;
+        }
+        if(((q[0] >> 4) & 1) != s->toggle)
+        {
+            abortCode = SIM_ABORT_TOGGLE;
+            break;
+        }
+        n = strlen(s->name) - s->offset;
+        if(n > 7) n = 7;
+        r[0] = (s->toggle << 4) | ((7 - n) << 1);
+        memcpy(r + 1, s->name + s->offset, n);
+        s->offset += n;
+        s->toggle ^= 1;
+        if(s->offset == strlen(s->name))
+        {
+            r[0] |= 1;
+            s->upload = -1;
+        }
+        break;
+
+    case 1 :    /* initiate download, expedited only */
+        s->upload = -1;
+        if((e = SimEntry(index, q[3], &abortCode)) < 0) break;
+        n = q[0] & 1 ? 4 - ((q[0] >> 2) & 3) : 4;
+        if(!gstaticDictionary[e].writable) abortCode = SIM_ABORT_READONLY;
+        else if(!(q[0] & 2) || ((q[0] & 1) && n != gstaticDictionary[e].size)) abortCode = SIM_ABORT_LENGTH;
+        if(abortCode) break;
+        v = q[4] | (q[5] << 8) | (q[6] << 16) | ((UNS32)q[7] << 24);
+        if(gstaticDictionary[e].size < 4) v &= (1UL << (8 * gstaticDictionary[e].size)) - 1;
+        s->value[e] = v;
+        if(e == 3) SimHeartbeat(p, s, SimNow());
+        r[0] = 0x60;
+        memcpy(r + 1, q + 1, 3);
+        break;
+
+    case 4 :    /* abort from the gateway */
+        s->upload = -1;
+        return;
+
+    default :
+        s->upload = -1;
+        abortCode = SIM_ABORT_COMMAND;
+    }
+
+    if(abortCode)
+    {
+        r[0] = 0x80;
+        memcpy(r + 1, q + 1, 3);
+        for(n=0; n<4; n++) r[4 + n] = (UNS8)(abortCode >> (8 * n));
+    }
+    SimQueue(p, 0x580 + nodeid, 8, r, SimNow() + p->latency);
+}
+
+/*
+This function give a frame of the gateway to the slaves, the port lock is held
+input: port, frame
+*/
+
+static void SimProcess(s_SIMPORT* p, Message* m)
+{
+    s_SIMSLAVE* s;
+    UNS8 nodeid, state;
+    int i;
+
+    if(m->cob_id == 0x000 && m->len >= 2)
+    {
+        /* NMT command, node 0: all the slaves */
+        p->nmt++;
+        for(i=p->first; i<=p->last; i++)
+        {
+            s = &p->slaves[i];
+            if(!s->powered || (m->data[1] != 0 && m->data[1] != i)) continue;
+            switch(m->data[0])
+            {
+            case 0x01 : s->state = SIM_OPERATIONAL; break;
+            case 0x02 : s->state = SIM_STOPPED; break;
+            case 0x80 : s->state = SIM_PREOPERATIONAL; break;
+            case 0x81 : SimBoot(p, (UNS8)i, 1); break;
+            case 0x82 : SimBoot(p, (UNS8)i, 0); break;
+            }
+        }
+        return;
+    }
+
+    nodeid = m->cob_id & 0x7F;
+    s = &p->slaves[nodeid];
+    if(nodeid < p->first || nodeid > p->last || !s->powered) return;
+
+    if((m->cob_id & 0x780) == 0x700 && m->rtr)
+    {
+        /* Node guarding */
+        state = s->state | (s->guardToggle << 7);
+        s->guardToggle ^= 1;
+        SimQueue(p, m->cob_id, 1, &state, SimNow() + p->latency);
+    }
+    else if((m->cob_id & 0x780) == 0x600 && m->len == 8 && s->state != SIM_STOPPED)
+    {
+        p->sdo++;
+        SimSdo(p, nodeid, m->data);
+    }
+}
+
+/* Receive entry point called by the receive thread of the stack */
+static UNS8 SimReceive(void* handle, Message* m)
+{
+    s_SIMPORT* p = handle;
+    s_SIMSLAVE* s;
+    long long now, next;
+    struct timespec ts;
+    int i;
+
+    pthread_mutex_lock(&p->lock);
+    while(!p->closed)
+    {
+        now = SimNow();
+        next = p->count ? p->queue[p->head].due : 0;
+
+        /* The heartbeats late are sent again from now */
+        for(i=p->first; i<=p->last; i++)
+        {
+            s = &p->slaves[i];
+            if(!s->powered || s->heartbeat == 0) continue;
+            if(s->heartbeat > now)
+            {
+                if(next == 0 || s->heartbeat < next) next = s->heartbeat;
+                continue;
+            }
+            memset(m, 0, sizeof *m);
+            m->cob_id = 0x700 + i;
+            m->len = 1;
+            m->data[0] = s->state;
+            SimHeartbeat(p, s, s->heartbeat + (long long)s->value[3] * 1000000 > now ? s->heartbeat : now);
+            p->heartbeats++;
+            p->rxFrames++;
+            pthread_mutex_unlock(&p->lock);
+            return 0;
+        }
+
+        if(p->count && p->queue[p->head].due <= now)
+        {
+            *m = p->queue[p->head].m;
+            p->head = (p->head + 1) % SIM_QUEUE;
+            p->count--;
+            p->rxFrames++;
+            pthread_mutex_unlock(&p->lock);
+            return 0;
+        }
+
+        if(next == 0) pthread_cond_wait(&p->wake, &p->lock);
+        else
+        {
+            ts.tv_sec = next / 1000000000LL;
+            ts.tv_nsec = next % 1000000000LL;
+            pthread_cond_timedwait(&p->wake, &p->lock, &ts);
+        }
+    }
+    pthread_mutex_unlock(&p->lock);
+    return 1;
+}
+
+/* Send entry point called by canSend */
+static UNS8 SimSend(void* handle, Message* m)
+{
+    s_SIMPORT* p = handle;
+
+    pthread_mutex_lock(&p->lock);
+    p->txFrames++;
+    SimProcess(p, m);
+    pthread_mutex_unlock(&p->lock);
+    return 0;
+}
+
+/* Open entry point called by canOpen */
+static void* SimOpen(void* board)
+{
+    s_SIMBOARD* b = board;
+    s_SIMPORT* p;
+    pthread_condattr_t attr;
+    unsigned int first, last, latency = SIM_LATENCY, heartbeat = SIM_HEARTBEAT;
+    char* c;
+    int i;
+
+    /* <first>[-<last>][:<latency us>[:<heartbeat ms>]] */
+    i = sscanf(b->busname, "%x-%x", &first, &last);
+    if(i == 1) last = first;
+    if((c = strchr(b->busname, ':')) != NULL) sscanf(c, ":%u:%u", &latency, &heartbeat);
+    if(i < 1 || first < 1 || first > last || last > SIM_MAX_NODE || heartbeat > 0xFFFF)
+    {
+        fprintf(stderr, "simbus %s: the channel is first[-last][:latency us[:heartbeat ms]]\n", b->busname);
+        return NULL;
+    }
+
+    for(i=0; i<SIM_MAX_BUSES && gstaticPorts[i].used; i++) {}
+    if(i == SIM_MAX_BUSES) return NULL;
+    p = &gstaticPorts[i];
+    memset(p, 0, sizeof *p);
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&p->wake, &attr);
+    pthread_condattr_destroy(&attr);
+    p->first = (UNS8)first;
+    p->last = (UNS8)last;
+    p->latency = (long long)latency * 1000;
+    p->heartbeat = (UNS16)heartbeat;
+
+    /* The slaves boot when the bus is opened */
+    for(i=first; i<=(int)last; i++)
+    {
+        p->slaves[i].present = 1;
+        p->slaves[i].powered = 1;
+        SimBoot(p, (UNS8)i, 1);
+    }
+    printf("simbus: slaves %X to %X, latency %u us, heartbeat %u ms\n", first, last, latency, heartbeat);
+
+    p->used = 1;
+    p->bus = gstaticOpening;
+    gstaticByBus[p->bus] = p;
+    return p;
+}
+
+/* Close entry point called by canClose */
+static int SimClose(void* handle)
+{
+    s_SIMPORT* p = handle;
+
+    if(gstaticByBus[p->bus] == p) gstaticByBus[p->bus] = NULL;
+    pthread_mutex_lock(&p->lock);
+    p->closed = 1;
+    pthread_cond_broadcast(&p->wake);
+    pthread_mutex_unlock(&p->lock);
+    p->used = 0;
+    return 0;
+}
+
+/* The simulated bus has no bit rate */
+static UNS8 SimBaudRate(void* handle, char* baudrate)
+{
+    return 0;
+}
+
+/*
+This function install the entry points of the driver in place of a driver library
+*/
+
+void SimInstall(void)
+{
+    canReceive_driver = SimReceive;
+    canSend_driver = SimSend;
+    canOpen_driver = SimOpen;
+    canClose_driver = SimClose;
+    canChangeBaudRate_driver = SimBaudRate;
+}
+
+/*
+This function set the bus of the next simulated bus opened by canOpen
+input: bus index
+*/
+
+void SimBus(int bus)
+{
+    if(bus >= 0 && bus < SIM_MAX_BUSES) gstaticOpening = bus;
+}
+
+/*
+This function change an entry of the dictionary of slaves, read-only
+entries included
+input: bus index, node id (0: all the slaves), index, subindex, value
+return: 0, -1 if the bus is not simulated, -2 if the node is not simulated
+or -3 if the entry does not exist or is a string
+*/
+
+int SimSet(int bus, UNS8 nodeid, UNS16 index, UNS8 subindex, UNS32 value)
+{
+    s_SIMPORT* p = SimPort(bus);
+    UNS32 abortCode;
+    int i, e;
+
+    if(p == NULL) return -1;
+    if(nodeid != 0 && (nodeid > SIM_MAX_NODE || !p->slaves[nodeid].present)) return -2;
+    if((e = SimEntry(index, subindex, &abortCode)) < 0 || e == SIM_NAME_ENTRY) return -3;
+
+    pthread_mutex_lock(&p->lock);
+    for(i=p->first; i<=p->last; i++)
+    {
+        if(nodeid != 0 && nodeid != i) continue;
+        p->slaves[i].value[e] = value;
+        if(e == 3) SimHeartbeat(p, &p->slaves[i], SimNow());
+    }
+    pthread_mutex_unlock(&p->lock);
+    return 0;
+}
+
+/*
+This function switch slaves off (they stay silent) or on (they boot up)
+input: bus index, node id (0: all the slaves), 1: on, 0: off
+return: 0, -1 if the bus is not simulated or -2 if the node is not simulated
+*/
+
+int SimPower(int bus, UNS8 nodeid, int on)
+{
+    s_SIMPORT* p = SimPort(bus);
+    int i;
+
+    if(p == NULL) return -1;
+    if(nodeid != 0 && (nodeid > SIM_MAX_NODE || !p->slaves[nodeid].present)) return -2;
+
+    pthread_mutex_lock(&p->lock);
+    for(i=p->first; i<=p->last; i++)
+    {
+        if((nodeid != 0 && nodeid != i) || p->slaves[i].powered == on) continue;
+        p->slaves[i].powered = (UNS8)on;
+        if(on) SimBoot(p, (UNS8)i, 1);
+    }
+    pthread_mutex_unlock(&p->lock);
+    return 0;
+}
+
+/*
+This function change the answer latency of the slaves of a bus
+input: bus index, latency in us
+return: 0 or -1 if the bus is not simulated
+*/
+
+int SimLatency(int bus, UNS32 us)
+{
+    s_SIMPORT* p = SimPort(bus);
+
+    if(p == NULL) return -1;
+    pthread_mutex_lock(&p->lock);
+    p->latency = (long long)us * 1000;
+    pthread_mutex_unlock(&p->lock);
+    return 0;
+}
+
+/*
+This function print the state and the counters of a simulated bus
+input: bus index, string buffer, size of the buffer
+return: 0 or -1 if the bus is not simulated
+*/
+
+int SimStats(int bus, char* buf, int len)
+{
+    s_SIMPORT* p = SimPort(bus);
+    int i, on = 0;
+
+    if(p == NULL) return -1;
+    pthread_mutex_lock(&p->lock);
+    for(i=p->first; i<=p->last; i++) on += p->slaves[i].powered;
+    snprintf(buf, len, "slaves %X-%X on %d latency %lu us, from gateway %lu frames (sdo %lu nmt %lu), "
+             "to gateway %lu frames (heartbeats %lu) lost %lu",
+             p->first,p->last,on,(unsigned long)(p->latency / 1000),p->txFrames,p->sdo,p->nmt,
+             p->rxFrames,p->heartbeats,p->lost);
+    pthread_mutex_unlock(&p->lock);
+    return 0;
+}
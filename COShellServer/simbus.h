@@ -0,0 +1,81 @@
+#ifndef SIMBUS_H_INCLUDED
+#define SIMBUS_H_INCLUDED
+
+/*
+Simulated CAN bus of the CANOpenShell server.
+The driver is built in the gateway and is chosen by the library name
+SIM_LIBRARY in the load# command, like the socketcan driver: the gateway run
+without CAN board. The channel give the virtual slaves of the bus and their
+timing: <first>[-<last>][:<SDO latency us>[:<heartbeat ms>]], node ids in
+hex, times in decimal (ex: 2-21:500:1000).
+Each slave has a small object dictionary (device type, error register,
+device name, heartbeat time, identity and 8 words at 2000h), a NMT state
+and a SDO server (expedited transfers and segmented upload). It send its
+boot-up when the bus is opened and when it is reset, its heartbeat every
+1017h ms and answer node guarding. The answers to the frames of the gateway
+are given to the receive thread of the stack after the latency, in order.
+SimInstall and SimBus are called before canOpen, the other functions with
+the stack mutex held (EnterMutex).
+*/
+
+/* Library name of the built-in driver */
+#define SIM_LIBRARY "simbus"
+
+/* Buses served by the driver */
+#define SIM_MAX_BUSES 4
+
+/* Default answer latency (us) and heartbeat time (ms) of the slaves */
+#define SIM_LATENCY 200
+#define SIM_HEARTBEAT 1000
+
+/* Frames of the slaves waiting for their time */
+#define SIM_QUEUE 1024
+
+/* Identity of the slaves, the serial number is the node id */
+#define SIM_DEVICE_TYPE 0x00000191
+#define SIM_VENDOR 0x0053494D
+#define SIM_PRODUCT 0x00000001
+#define SIM_REVISION 0x00010000
+
+/*
+This function install the entry points of the driver in place of a driver library
+*/
+void SimInstall(void);
+
+/*
+This function set the bus of the next simulated bus opened by canOpen
+input: bus index
+*/
+void SimBus(int);
+
+/*
+This function change an entry of the dictionary of slaves, read-only
+entries included
+input: bus index, node id (0: all the slaves), index, subindex, value
+return: 0, -1 if the bus is not simulated, -2 if the node is not simulated
+or -3 if the entry does not exist or is a string
+*/
+int SimSet(int, UNS8, UNS16, UNS8, UNS32);
+
+/*
+This function switch slaves off (they stay silent) or on (they boot up)
+input: bus index, node id (0: all the slaves), 1: on, 0: off
+return: 0, -1 if the bus is not simulated or -2 if the node is not simulated
+*/
+int SimPower(int, UNS8, int);
+
+/*
+This function change the answer latency of the slaves of a bus
+input: bus index, latency in us
+return: 0 or -1 if the bus is not simulated
+*/
+int SimLatency(int, UNS32);
+
+/*
+This function print the state and the counters of a simulated bus
+input: bus index, string buffer, size of the buffer
+return: 0 or -1 if the bus is not simulated
+*/
+int SimStats(int, char*, int);
+
+#endif // SIMBUS_H_INCLUDED
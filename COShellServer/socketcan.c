@@ -0,0 +1,392 @@
+/*
+Module: socketcan.c
+Description: Linux SocketCAN driver of the CANOpenShell server.
+The entry points have the prototypes of a CanFestival driver library
+(drivers/can_socket): canOpen_driver return the port of the interface,
+canReceive_driver give one frame to the receive thread of the stack and
+canSend_driver send one frame. A receive call read up to SOCKCAN_BATCH
+frames at once with recvmmsg, the next calls return the frames read. The
+kernel stamp each frame when it is received (SO_TIMESTAMPNS).
+As in cantap.c, canfestival.h is not included: it declare the entry points
+as functions.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <net/if.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <linux/can.h>
+#include <linux/can/raw.h>
+
+#include "applicfg.h"
+#include "can.h"
+#include "socketcan.h"
+
+//****************************************************************************
+// DRIVER ENTRY POINTS
+
+extern UNS8 (*canReceive_driver)(void*, Message*);
+extern UNS8 (*canSend_driver)(void*, Message*);
+extern void* (*canOpen_driver)(void*);
+extern int (*canClose_driver)(void*);
+extern UNS8 (*canChangeBaudRate_driver)(void*, char*);
+
+/* Board given to canOpen (canfestival.h) */
+typedef struct
+{
+    char* busname;
+    char* baudrate;
+} s_SOCKCANBOARD;
+
+//****************************************************************************
+// TYPES
+
+typedef struct
+{
+    int used;
+    int fd;
+    int bus;
+
+    /* Frames read by the last recvmmsg, and the next one to return */
+    struct can_frame rxFrame[SOCKCAN_BATCH];
+    struct iovec rxIov[SOCKCAN_BATCH];
+    struct mmsghdr rxMsg[SOCKCAN_BATCH];
+    char rxCtrl[SOCKCAN_BATCH][CMSG_SPACE(sizeof(struct timespec))];
+    int rxCount;
+    int rxNext;
+    struct timespec stamp;      /* receive time of the last frame returned */
+
+    /* Frames held until the flush */
+    struct can_frame txFrame[SOCKCAN_BATCH];
+    struct iovec txIov[SOCKCAN_BATCH];
+    struct mmsghdr txMsg[SOCKCAN_BATCH];
+    int txCount;
+    int held;
+
+    /* Counters */
+    unsigned long rxFrames;
+    unsigned long rxCalls;
+    unsigned long txFrames;
+    unsigned long txCalls;
+    unsigned long txLost;
+    unsigned long long delaySum; /* us between the kernel stamp and the return to the stack */
+    unsigned long delayMax;
+} s_SOCKCAN;
+
+//****************************************************************************
+// GLOBALS
+
+static s_SOCKCAN gstaticPorts[SOCKCAN_MAX_BUSES];
+static s_SOCKCAN* gstaticByBus[SOCKCAN_MAX_BUSES];
+static int gstaticOpening;
+
+
+/*
+This function return the port serving a bus
+input: bus index
+return: port or NULL if the bus is not served by the driver
+*/
+
+static s_SOCKCAN* SockCanPort(int bus)
+{
+    if(bus < 0 || bus >= SOCKCAN_MAX_BUSES) return NULL;
+    return gstaticByBus[bus];
+}
+
+/*
+This function read the next batch of frames, it wait for the first one
+input: port
+return: 0 or -1 if the socket is closed
+*/
+
+static int SockCanRead(s_SOCKCAN* p)
+{
+    int i, n;
+
+    for(i=0; i<SOCKCAN_BATCH; i++)
+    {
+        /* The kernel overwrite the sizes */
+        p->rxMsg[i].msg_hdr.msg_controllen = sizeof p->rxCtrl[i];
+        p->rxMsg[i].msg_hdr.msg_flags = 0;
+    }
+    while((n = recvmmsg(p->fd, p->rxMsg, SOCKCAN_BATCH, MSG_WAITFORONE, NULL)) < 0)
+        if(errno != EINTR) return -1;
+    p->rxCount = n;
+    p->rxNext = 0;
+    p->rxCalls++;
+    return 0;
+}
+
+/*
+This function keep the kernel receive time of a frame read
+input: port, index of the frame in the batch
+*/
+
+static void SockCanStamp(s_SOCKCAN* p, int i)
+{
+    struct msghdr* h = &p->rxMsg[i].msg_hdr;
+    struct cmsghdr* c;
+    struct timespec now;
+    unsigned long delay;
+
+    for(c=CMSG_FIRSTHDR(h); c!=NULL; c=CMSG_NXTHDR(h, c))
+        if(c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_TIMESTAMPNS) break;
+    clock_gettime(CLOCK_REALTIME, &now);
+    if(c == NULL)
+    {
+        p->stamp = now;
+        return;
+    }
+    memcpy(&p->stamp, CMSG_DATA(c), sizeof p->stamp);
+    delay = (unsigned long)((now.tv_sec - p->stamp.tv_sec) * 1000000 + (now.tv_nsec - p->stamp.tv_nsec) / 1000);
+    p->delaySum += delay;
+    if(delay > p->delayMax) p->delayMax = delay;
+}
+
+/* Receive entry point called by the receive thread of the stack */
+static UNS8 SockCanReceive(void* handle, Message* m)
+{
+    s_SOCKCAN* p = handle;
+    struct can_frame* f;
+
+    for(;;)
+    {
+        if(p->rxNext == p->rxCount && SockCanRead(p) < 0) return 1;
+        f = &p->rxFrame[p->rxNext++];
+
+        /* CANopen use the standard identifiers only */
+        if(f->can_id & (CAN_EFF_FLAG | CAN_ERR_FLAG)) continue;
+        SockCanStamp(p, p->rxNext - 1);
+        m->cob_id = (UNS16)(f->can_id & CAN_SFF_MASK);
+        m->rtr = f->can_id & CAN_RTR_FLAG ? 1 : 0;
+        m->len = f->can_dlc > 8 ? 8 : f->can_dlc;
+        memcpy(m->data, f->data, m->len);
+        p->rxFrames++;
+        return 0;
+    }
+}
+
+/*
+This function send the frames held on a port, the frames refused by the
+interface stay first in the queue
+input: port
+return: number of frames left in the queue
+*/
+
+static int SockCanSendHeld(s_SOCKCAN* p)
+{
+    int n, done = 0;
+
+    while(done < p->txCount)
+    {
+        n = sendmmsg(p->fd, p->txMsg + done, p->txCount - done, 0);
+        if(n < 0 && errno == EINTR) continue;
+        p->txCalls++;
+        if(n <= 0) break;
+        done += n;
+    }
+    p->txFrames += done;
+    p->txCount -= done;
+    memmove(p->txFrame, p->txFrame + done, p->txCount * sizeof p->txFrame[0]);
+    return p->txCount;
+}
+
+/* Send entry point called by canSend */
+static UNS8 SockCanSend(void* handle, Message* m)
+{
+    s_SOCKCAN* p = handle;
+    struct can_frame* f;
+    struct can_frame one;
+
+    /* A full queue is sent, the frame is refused if the interface take none */
+    if(p->held && p->txCount == SOCKCAN_BATCH && SockCanSendHeld(p) == SOCKCAN_BATCH) return 1;
+
+    f = p->held ? &p->txFrame[p->txCount] : &one;
+    memset(f, 0, sizeof *f);
+    f->can_id = m->cob_id & CAN_SFF_MASK;
+    if(m->rtr) f->can_id |= CAN_RTR_FLAG;
+    f->can_dlc = m->len > 8 ? 8 : m->len;
+    memcpy(f->data, m->data, f->can_dlc);
+
+    if(p->held)
+    {
+        p->txCount++;
+        return 0;
+    }
+
+    p->txCalls++;
+    while(send(p->fd, f, sizeof *f, 0) < 0)
+    {
+        if(errno == EINTR) continue;
+        p->txLost++;
+        return 1;
+    }
+    p->txFrames++;
+    return 0;
+}
+
+/* Open entry point called by canOpen */
+static void* SockCanOpen(void* board)
+{
+    s_SOCKCANBOARD* b = board;
+    s_SOCKCAN* p;
+    struct sockaddr_can addr;
+    struct ifreq ifr;
+    int i, on = 1;
+
+    for(i=0; i<SOCKCAN_MAX_BUSES && gstaticPorts[i].used; i++) {}
+    if(i == SOCKCAN_MAX_BUSES) return NULL;
+    p = &gstaticPorts[i];
+    memset(p, 0, sizeof *p);
+
+    /* A channel number is the interface can<n>, like the CanFestival driver */
+    memset(&ifr, 0, sizeof ifr);
+    if(b->busname[0] >= '0' && b->busname[0] <= '9') snprintf(ifr.ifr_name, IFNAMSIZ, "can%s", b->busname);
+    else snprintf(ifr.ifr_name, IFNAMSIZ, "%s", b->busname);
+
+    if((p->fd = socket(PF_CAN, SOCK_RAW, CAN_RAW)) < 0)
+    {
+        perror("socketcan socket");
+        return NULL;
+    }
+    memset(&addr, 0, sizeof addr);
+    addr.can_family = AF_CAN;
+    if(ioctl(p->fd, SIOCGIFINDEX, &ifr) < 0 ||
+       (addr.can_ifindex = ifr.ifr_ifindex, bind(p->fd, (struct sockaddr*)&addr, sizeof addr) < 0))
+    {
+        fprintf(stderr, "socketcan %s: %s\n", ifr.ifr_name, strerror(errno));
+        close(p->fd);
+        return NULL;
+    }
+    if(setsockopt(p->fd, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof on) < 0) perror("socketcan SO_TIMESTAMPNS");
+
+    for(i=0; i<SOCKCAN_BATCH; i++)
+    {
+        p->rxIov[i].iov_base = &p->rxFrame[i];
+        p->rxIov[i].iov_len = sizeof p->rxFrame[i];
+        p->rxMsg[i].msg_hdr.msg_iov = &p->rxIov[i];
+        p->rxMsg[i].msg_hdr.msg_iovlen = 1;
+        p->rxMsg[i].msg_hdr.msg_control = p->rxCtrl[i];
+        p->txIov[i].iov_base = &p->txFrame[i];
+        p->txIov[i].iov_len = sizeof p->txFrame[i];
+        p->txMsg[i].msg_hdr.msg_iov = &p->txIov[i];
+        p->txMsg[i].msg_hdr.msg_iovlen = 1;
+    }
+    p->used = 1;
+    p->bus = gstaticOpening;
+    gstaticByBus[p->bus] = p;
+    return p;
+}
+
+/* Close entry point called by canClose */
+static int SockCanClose(void* handle)
+{
+    s_SOCKCAN* p = handle;
+
+    if(gstaticByBus[p->bus] == p) gstaticByBus[p->bus] = NULL;
+    close(p->fd);
+    p->used = 0;
+    return 0;
+}
+
+/* The bit rate belong to the interface (ip link set canX type can bitrate N) */
+static UNS8 SockCanBaudRate(void* handle, char* baudrate)
+{
+    return 0;
+}
+
+/*
+This function install the entry points of the driver in place of a driver library
+*/
+
+void SockCanInstall(void)
+{
+    canReceive_driver = SockCanReceive;
+    canSend_driver = SockCanSend;
+    canOpen_driver = SockCanOpen;
+    canClose_driver = SockCanClose;
+    canChangeBaudRate_driver = SockCanBaudRate;
+}
+
+/*
+This function set the bus of the next interface opened by canOpen
+input: bus index
+*/
+
+void SockCanBus(int bus)
+{
+    if(bus >= 0 && bus < SOCKCAN_MAX_BUSES) gstaticOpening = bus;
+}
+
+/*
+This function return the kernel receive time of the frame being dispatched
+on a bus, to be called by the frame listeners in the receive thread
+input: bus index, time receiving the stamp (CLOCK_REALTIME)
+return: 0 or -1 if the bus is not served by the driver
+*/
+
+int SockCanRxTime(int bus, struct timespec* ts)
+{
+    s_SOCKCAN* p = SockCanPort(bus);
+
+    if(p == NULL) return -1;
+    *ts = p->stamp;
+    return 0;
+}
+
+/*
+This function queue the frames sent on a bus until SockCanFlush. A frame
+sent to a full queue send the queue first, it is refused if the interface
+take no frame
+input: bus index
+*/
+
+void SockCanHold(int bus)
+{
+    s_SOCKCAN* p = SockCanPort(bus);
+
+    if(p != NULL) p->held = 1;
+}
+
+/*
+This function send the frames queued on a bus with one system call
+input: bus index
+return: number of frames refused by the interface, the last ones queued, they are dropped
+*/
+
+int SockCanFlush(int bus)
+{
+    s_SOCKCAN* p = SockCanPort(bus);
+    int n;
+
+    if(p == NULL) return 0;
+    p->held = 0;
+    n = SockCanSendHeld(p);
+    p->txLost += n;
+    p->txCount = 0;
+    return n;
+}
+
+/*
+This function print the counters of the driver on a bus
+input: bus index, string buffer, size of the buffer
+return: 0 or -1 if the bus is not served by the driver
+*/
+
+int SockCanStats(int bus, char* buf, int len)
+{
+    s_SOCKCAN* p = SockCanPort(bus);
+
+    if(p == NULL) return -1;
+    snprintf(buf, len, "rx %lu frames %lu calls delay avg %lu max %lu us, tx %lu frames %lu calls lost %lu",
+             p->rxFrames,p->rxCalls,p->rxFrames ? (unsigned long)(p->delaySum / p->rxFrames) : 0UL,p->delayMax,
+             p->txFrames,p->txCalls,p->txLost);
+    return 0;
+}
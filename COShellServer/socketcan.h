@@ -0,0 +1,67 @@
+#ifndef SOCKETCAN_H_INCLUDED
+#define SOCKETCAN_H_INCLUDED
+
+/*
+Linux SocketCAN driver of the CANOpenShell server.
+The driver is built in the gateway and is chosen by the library name
+SOCKCAN_LIBRARY in the load# command: its entry points replace the ones of a
+CanFestival driver library. The channel is the network interface (can0,
+vcan0, or a number n for can<n>), its bit rate is set with ip link.
+The receive thread of the stack read the frames in batches with recvmmsg,
+each frame get the receive time of the kernel. The frames sent between
+SockCanHold and SockCanFlush are sent together with sendmmsg.
+SockCanInstall and SockCanBus are called before canOpen, SockCanRxTime in
+the receive thread, the other functions with the stack mutex held (EnterMutex).
+*/
+
+/* Library name of the built-in driver */
+#define SOCKCAN_LIBRARY "socketcan"
+
+/* Buses served by the driver */
+#define SOCKCAN_MAX_BUSES 4
+
+/* Frames read or sent by one system call */
+#define SOCKCAN_BATCH 32
+
+/*
+This function install the entry points of the driver in place of a driver library
+*/
+void SockCanInstall(void);
+
+/*
+This function set the bus of the next interface opened by canOpen
+input: bus index
+*/
+void SockCanBus(int);
+
+/*
+This function return the kernel receive time of the frame being dispatched
+on a bus, to be called by the frame listeners in the receive thread
+input: bus index, time receiving the stamp (CLOCK_REALTIME)
+return: 0 or -1 if the bus is not served by the driver
+*/
+int SockCanRxTime(int, struct timespec*);
+
+/*
+This function queue the frames sent on a bus until SockCanFlush. A frame
+sent to a full queue send the queue first, it is refused if the interface
+take no frame
+input: bus index
+*/
+void SockCanHold(int);
+
+/*
+This function send the frames queued on a bus with one system call
+input: bus index
+return: number of frames refused by the interface, the last ones queued, they are dropped
+*/
+int SockCanFlush(int);
+
+/*
+This function print the counters of the driver on a bus
+input: bus index, string buffer, size of the buffer
+return: 0 or -1 if the bus is not served by the driver
+*/
+int SockCanStats(int, char*, int);
+
+#endif // SOCKETCAN_H_INCLUDED
@@ -0,0 +1,288 @@
+/*
+Module: stream.c
+Description: cyclic set-point streaming of the CANOpenShell server.
+Each stream is a ring of set-points addressed to the receive PDO of one
+node. The post_sync callback of a bus take one set-point of each of its
+streams and send it right after the SYNC, so the frames keep the period of
+the SYNC timer whatever the load of the hosts. A drive apply a synchronous
+RPDO received after a SYNC at the next one: all the axes fed by the same
+SYNC move together.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "canfestival.h"
+#include "gateway.h"
+#include "stream.h"
+#include "socketcan.h"
+
+//****************************************************************************
+// DEFINES
+
+/* Bit of the SYNC COB-ID (0x1005) that make the node produce the SYNC */
+#define SYNC_PRODUCER 0x40000000
+
+//****************************************************************************
+// TYPES
+
+typedef struct
+{
+    UNS32 position;
+    UNS32 velocity;
+} s_SETPOINT;
+
+typedef struct
+{
+    UNS8 used;
+    UNS8 bus;
+    UNS8 nodeid;
+    UNS16 cobid;                /* receive PDO of the node */
+    UNS8 size;                  /* bytes of the frame */
+    int session;                /* owner of the stream */
+    unsigned int head;          /* set-points queued, free running */
+    unsigned int tail;          /* set-points sent, free running */
+    unsigned long sent;
+    unsigned long underruns;    /* SYNC periods without set-point since the first one sent */
+    s_SETPOINT ring[STRM_DEPTH];
+} s_STREAM;
+
+typedef struct
+{
+    UNS32 period;               /* us, 0 when the SYNC is not produced */
+    unsigned long syncs;
+    unsigned long long last;    /* time of the last SYNC in us */
+    unsigned long minGap;       /* shortest and longest time between two SYNC in us */
+    unsigned long maxGap;
+} s_SYNCSTAT;
+
+//****************************************************************************
+// GLOBALS
+
+static s_STREAM gstaticStreams[STRM_MAX];
+static s_STREAM* gstaticByNode[MAX_BUSES][MAX_NODES + 1];
+static s_SYNCSTAT gstaticSync[MAX_BUSES];
+
+
+/*
+This function return a monotonic time in microseconds
+*/
+
+static unsigned long long StrmTime(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+This function start or stop the production of the SYNC on a bus. The COB-ID
+and the period are written through the CO_Data structure: the buses after the
+first have their own copy of them, not the objects 1005h and 1006h of the
+dictionary.
+input: CO_Data structure, period in microseconds (0 to stop)
+return: 0 or -1 if the object dictionary has no SYNC objects
+*/
+
+int StrmSetSync(CO_Data* d, UNS32 period)
+{
+    s_SYNCSTAT* st = &gstaticSync[BusIndex(d)];
+    UNS32 value, size = sizeof value;
+    UNS8 type;
+
+    if(readLocalDict(d, 0x1005, 0, &value, &size, &type, 0) != OD_SUCCESSFUL) return -1;
+    size = sizeof value;
+    if(readLocalDict(d, 0x1006, 0, &value, &size, &type, 0) != OD_SUCCESSFUL) return -1;
+    if(period) *d->Sync_Cycle_Period = period;
+    *d->COB_ID_Sync = period ? *d->COB_ID_Sync | SYNC_PRODUCER : *d->COB_ID_Sync & ~SYNC_PRODUCER;
+
+    memset(st, 0, sizeof *st);
+    st->period = period;
+    if(period) startSYNC(d);
+    else stopSYNC(d);
+    return 0;
+}
+
+/*
+This function open the stream of a node
+input: CO_Data structure, session identifier, node identifier,
+receive PDO number (1 to 4), bytes of a set-point (4: position, 8: position and velocity)
+return: 0, -1 if a parameter is invalid or -2 if the node has a stream or
+no more stream can be opened
+*/
+
+int StrmOpen(CO_Data* d, int session, UNS8 nodeid, UNS8 pdo, UNS8 size)
+{
+    int i, bus = BusIndex(d);
+    s_STREAM* s;
+
+    if(nodeid == 0 || nodeid > MAX_NODES || pdo < 1 || pdo > 4 || (size != 4 && size != 8)) return -1;
+    if(gstaticByNode[bus][nodeid] != NULL) return -2;
+    for(i=0; i<STRM_MAX && gstaticStreams[i].used; i++) {}
+    if(i == STRM_MAX) return -2;
+
+    s = &gstaticStreams[i];
+    memset(s, 0, sizeof *s);
+    s->used = 1;
+    s->bus = (UNS8)bus;
+    s->nodeid = nodeid;
+    s->cobid = 0x200 + 0x100 * (pdo - 1) + nodeid;
+    s->size = size;
+    s->session = session;
+    gstaticByNode[bus][nodeid] = s;
+    return 0;
+}
+
+/*
+This function close the stream of a node, the set-points not sent are dropped
+input: CO_Data structure, node identifier
+return: 0 or -1 if the node has no stream
+*/
+
+int StrmClose(CO_Data* d, UNS8 nodeid)
+{
+    s_STREAM* s;
+
+    if(nodeid == 0 || nodeid > MAX_NODES || (s = gstaticByNode[BusIndex(d)][nodeid]) == NULL) return -1;
+    gstaticByNode[s->bus][nodeid] = NULL;
+    s->used = 0;
+    return 0;
+}
+
+/*
+This function close the streams of a closed session
+input: session identifier
+*/
+
+void StrmDropSession(int session)
+{
+    int i;
+    s_STREAM* s;
+
+    for(i=0; i<STRM_MAX; i++)
+    {
+        s = &gstaticStreams[i];
+        if(!s->used || s->session != session) continue;
+        gstaticByNode[s->bus][s->nodeid] = NULL;
+        s->used = 0;
+    }
+}
+
+/*
+This function return the room left in the stream of a node
+input: CO_Data structure, node identifier
+return: number of set-points that can be queued or -1 if the node has no stream
+*/
+
+int StrmRoom(CO_Data* d, UNS8 nodeid)
+{
+    s_STREAM* s;
+
+    if(nodeid == 0 || nodeid > MAX_NODES || (s = gstaticByNode[BusIndex(d)][nodeid]) == NULL) return -1;
+    return STRM_DEPTH - (int)(s->head - s->tail);
+}
+
+/*
+This function queue a set-point
+input: CO_Data structure, node identifier, position, velocity
+return: 0 or -1 if the node has no stream or its stream is full
+*/
+
+int StrmPush(CO_Data* d, UNS8 nodeid, UNS32 position, UNS32 velocity)
+{
+    s_STREAM* s;
+    s_SETPOINT* sp;
+
+    if(StrmRoom(d, nodeid) <= 0) return -1;
+    s = gstaticByNode[BusIndex(d)][nodeid];
+    sp = &s->ring[s->head % STRM_DEPTH];
+    sp->position = position;
+    sp->velocity = velocity;
+    s->head++;
+    return 0;
+}
+
+/*
+This function copy a value in a frame, least significant byte first
+input: frame data, value
+*/
+
+static void StrmPut(UNS8* p, UNS32 v)
+{
+    p[0] = (UNS8)v;
+    p[1] = (UNS8)(v >> 8);
+    p[2] = (UNS8)(v >> 16);
+    p[3] = (UNS8)(v >> 24);
+}
+
+/*
+This function send the next set-point of the streams of a bus, called after each SYNC
+input: CO_Data structure
+*/
+
+void StrmSync(CO_Data* d)
+{
+    int i, bus = BusIndex(d);
+    s_SYNCSTAT* st = &gstaticSync[bus];
+    unsigned long long now = StrmTime();
+    unsigned long gap;
+    s_STREAM* s;
+    s_SETPOINT* sp;
+    Message m;
+
+    if(st->syncs > 0)
+    {
+        gap = (unsigned long)(now - st->last);
+        if(st->syncs == 1 || gap < st->minGap) st->minGap = gap;
+        if(gap > st->maxGap) st->maxGap = gap;
+    }
+    st->last = now;
+    st->syncs++;
+
+    /* The set-points of all the axes leave in one system call */
+    SockCanHold(bus);
+    for(i=0; i<STRM_MAX; i++)
+    {
+        s = &gstaticStreams[i];
+        if(!s->used || s->bus != bus) continue;
+        if(s->head == s->tail)
+        {
+            if(s->sent) s->underruns++;
+            continue;
+        }
+        sp = &s->ring[s->tail % STRM_DEPTH];
+        m.cob_id = s->cobid;
+        m.rtr = 0;
+        m.len = s->size;
+        StrmPut(m.data, sp->position);
+        StrmPut(m.data + 4, sp->velocity);
+        canSend(d->canHandle, &m);
+        s->tail++;
+        s->sent++;
+    }
+    SockCanFlush(bus);
+}
+
+/*
+This function print the SYNC timing and the counters of the streams of a bus
+input: CO_Data structure, string buffer, size of the buffer
+*/
+
+void StrmStats(CO_Data* d, char* buf, int len)
+{
+    int i, n, bus = BusIndex(d);
+    s_SYNCSTAT* st = &gstaticSync[bus];
+    s_STREAM* s;
+
+    n = snprintf(buf, len, "sync %lu us count %lu gap %lu-%lu us",(unsigned long)st->period,st->syncs,
+                 st->minGap,st->maxGap);
+    for(i=0; i<STRM_MAX && n < len; i++)
+    {
+        s = &gstaticStreams[i];
+        if(!s->used || s->bus != bus) continue;
+        n += snprintf(buf + n, len - n, ";node %d queued %u sent %lu underruns %lu",s->nodeid,
+                      s->head - s->tail,s->sent,s->underruns);
+    }
+}
@@ -0,0 +1,81 @@
+#ifndef STREAM_H_INCLUDED
+#define STREAM_H_INCLUDED
+
+/*
+Cyclic set-point streaming.
+A host stream the set-points of drives in interpolated position or cyclic
+synchronous position mode: a position and optionally a velocity for each
+SYNC period. The set-points are buffered for each node, and after each SYNC
+(produced by the gateway or received) one set-point of every stream is sent
+in a receive PDO of its node, from the post_sync callback of the stack. The set-points
+given to several nodes by one command are sent after the same SYNC, for the
+coordinated moves of several axes.
+The mode and the RPDO mapping of the drive (position, then velocity) are
+configured by the host, with SDO writes or the init file.
+A stream belong to the session that opened it, and is closed with it.
+All the functions must be called with the stack mutex held (EnterMutex).
+*/
+
+/* Streams on all the buses */
+#define STRM_MAX 16
+
+/* Set-points buffered for each stream */
+#define STRM_DEPTH 256
+
+/*
+This function start or stop the production of the SYNC on a bus, each bus
+has its own SYNC COB-ID and period
+input: CO_Data structure, period in microseconds (0 to stop)
+return: 0 or -1 if the object dictionary has no SYNC objects
+*/
+int StrmSetSync(CO_Data*, UNS32);
+
+/*
+This function open the stream of a node
+input: CO_Data structure, session identifier, node identifier,
+receive PDO number (1 to 4), bytes of a set-point (4: position, 8: position and velocity)
+return: 0, -1 if a parameter is invalid or -2 if the node has a stream or
+no more stream can be opened
+*/
+int StrmOpen(CO_Data*, int, UNS8, UNS8, UNS8);
+
+/*
+This function close the stream of a node, the set-points not sent are dropped
+input: CO_Data structure, node identifier
+return: 0 or -1 if the node has no stream
+*/
+int StrmClose(CO_Data*, UNS8);
+
+/*
+This function close the streams of a closed session
+input: session identifier
+*/
+void StrmDropSession(int);
+
+/*
+This function return the room left in the stream of a node
+input: CO_Data structure, node identifier
+return: number of set-points that can be queued or -1 if the node has no stream
+*/
+int StrmRoom(CO_Data*, UNS8);
+
+/*
+This function queue a set-point
+input: CO_Data structure, node identifier, position, velocity
+return: 0 or -1 if the node has no stream or its stream is full
+*/
+int StrmPush(CO_Data*, UNS8, UNS32, UNS32);
+
+/*
+This function send the next set-point of the streams of a bus, called after each SYNC
+input: CO_Data structure
+*/
+void StrmSync(CO_Data*);
+
+/*
+This function print the SYNC timing and the counters of the streams of a bus
+input: CO_Data structure, string buffer, size of the buffer
+*/
+void StrmStats(CO_Data*, char*, int);
+
+#endif // STREAM_H_INCLUDED
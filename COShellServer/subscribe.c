@@ -0,0 +1,295 @@
+/*
+Module: subscribe.c
+Description: subscriptions of the CANOpenShell server sessions to the changes
+of slave node objects. A periodic timer send the changes delayed by the rate
+limit and poll the objects that are not updated by a PDO.
+*/
+
+#include <stdio.h>
+#include <string.h>
+
+#include "canfestival.h"
+#include "gateway.h"
+#include "sdosched.h"
+#include "pdoshadow.h"
+#include "subscribe.h"
+
+//****************************************************************************
+// TYPES
+
+typedef struct
+{
+    UNS8 used;
+    UNS8 polling;               /* an SDO read is running, the slot is not reused before its completion */
+    s_REQUESTER rq;             /* subscriber, tag of the subscribe command */
+    CO_Data* d;                 /* bus of the node */
+    UNS8 nodeid;
+    UNS16 index;
+    UNS8 subindex;
+    UNS32 mindelta;
+    unsigned long interval;     /* ms between two messages, 0: no limit */
+    unsigned long pollPeriod;
+    unsigned long nextPoll;     /* pushed back by each new value */
+    UNS8 known;                 /* a value was sent */
+    UNS32 last;                 /* last value sent */
+    unsigned long lastTime;
+    UNS8 held;                  /* a change is delayed by the rate limit */
+    UNS32 heldValue;
+    UNS8 failed;                /* the last poll failed, reported once */
+} s_SUBSCRIPTION;
+
+//****************************************************************************
+// GLOBALS
+
+static s_SUBSCRIPTION gstaticSubs[SUBS_MAX];
+static int gstaticCount;
+static TIMER_HANDLE gstaticTimer = TIMER_NONE;
+
+static void SubsTick(CO_Data* d, UNS32 id);
+
+
+/*
+This function send a value to a subscriber
+input: subscription, value, time
+*/
+
+static void SubsSend(s_SUBSCRIPTION* s, UNS32 value, unsigned long now)
+{
+    char retbuf[60];
+
+    sprintf(retbuf,"000 subs node %d %4.4x,%2.2x=%x",s->nodeid,s->index,s->subindex,value);
+    SendReply(&s->rq, retbuf);
+    s->known = 1;
+    s->last = value;
+    s->lastTime = now;
+    s->held = 0;
+}
+
+/*
+This function send a value to a subscriber if it changed enough and the rate allow it
+input: subscription, value, time
+*/
+
+static void SubsOffer(s_SUBSCRIPTION* s, UNS32 value, unsigned long now)
+{
+    INTEGER32 delta = (INTEGER32)(value - s->last);
+
+    if(delta < 0) delta = -delta;
+    if(s->known && (s->mindelta == 0 ? value == s->last : (UNS32)delta < s->mindelta))
+    {
+        /* Back to the value sent: the delayed change is obsolete */
+        s->held = 0;
+        return;
+    }
+
+    if(!s->known || s->interval == 0 || now - s->lastTime >= s->interval)
+        SubsSend(s, value, now);
+    else
+    {
+        s->held = 1;
+        s->heldValue = value;
+    }
+}
+
+/*
+This function give a new value of an object to its subscribers
+input: CO_Data structure of the bus, node identifier, index, subindex, value
+*/
+
+void SubsNotify(CO_Data* d, UNS8 nodeid, UNS16 index, UNS8 subindex, UNS32 value)
+{
+    int i;
+    unsigned long now;
+    s_SUBSCRIPTION* s;
+
+    if(gstaticCount == 0) return;
+
+    now = GatewayTime();
+    for(i=0; i<SUBS_MAX; i++)
+    {
+        s = &gstaticSubs[i];
+        if(!s->used || s->d != d || s->nodeid != nodeid || s->index != index || s->subindex != subindex) continue;
+        s->nextPoll = now + s->pollPeriod;
+        SubsOffer(s, value, now);
+    }
+}
+
+/* Callback function of a background read */
+static void SubsPollDone(CO_Data* d, s_SDOREQ* req)
+{
+    s_SUBSCRIPTION* s = req->context;
+    char retbuf[80];
+
+    s->polling = 0;
+    if(!s->used) return;
+
+    s->nextPoll = GatewayTime() + s->pollPeriod;
+    if(req->result == SDO_FINISHED)
+    {
+        s->failed = 0;
+        SubsNotify(d, req->nodeid, req->index, req->subindex, req->data);
+    }
+    else if(!s->failed)
+    {
+        s->failed = 1;
+        sprintf(retbuf,"404 subs node %d %4.4x,%2.2x with abort code %x",s->nodeid,s->index,s->subindex,req->abortCode);
+        SendReply(&s->rq, retbuf);
+    }
+}
+
+/*
+This function read the value of a subscribed object in the background
+input: CO_Data structure, subscription, time
+*/
+
+static void SubsPoll(CO_Data* d, s_SUBSCRIPTION* s, unsigned long now)
+{
+    s_SDOREQ* req;
+
+    if((req = SdoAlloc()) == NULL)
+    {
+        s->nextPoll = now + s->pollPeriod;
+        return;
+    }
+    req->type = SDO_READ;
+    req->nodeid = s->nodeid;
+    req->index = s->index;
+    req->subindex = s->subindex;
+    req->rq = s->rq;
+    req->context = s;
+    req->done = SubsPollDone;
+    s->polling = 1;
+    SdoSubmit(d, req);
+}
+
+/* Periodic timer of the subscriptions, each object is polled on its bus */
+static void SubsTick(CO_Data* d, UNS32 id)
+{
+    int i;
+    unsigned long now = GatewayTime();
+    s_SUBSCRIPTION* s;
+
+    for(i=0; i<SUBS_MAX; i++)
+    {
+        s = &gstaticSubs[i];
+        if(!s->used) continue;
+        if(s->held && now - s->lastTime >= s->interval) SubsSend(s, s->heldValue, now);
+        if(!s->polling && (long)(now - s->nextPoll) >= 0) SubsPoll(s->d, s, now);
+    }
+}
+
+/*
+This function subscribe a session to the changes of an object, a subscription
+of the session to the same object is replaced
+input: CO_Data structure, requester, node identifier, index, subindex,
+minimum change (0: any change), maximum messages per second (0: no limit)
+return: 0, -1 if the node is invalid or -2 if no more subscription is possible
+*/
+
+int SubsAdd(CO_Data* d, s_REQUESTER* rq, UNS8 nodeid, UNS16 index, UNS8 subindex, UNS32 mindelta, UNS32 maxrate)
+{
+    int i;
+    s_SUBSCRIPTION* s = NULL;
+    UNS32 value;
+    unsigned long now = GatewayTime();
+    char retbuf[60];
+
+    if(nodeid == 0 || nodeid > MAX_NODES) return -1;
+
+    for(i=0; i<SUBS_MAX; i++)
+    {
+        if(gstaticSubs[i].used && gstaticSubs[i].rq.session == rq->session && gstaticSubs[i].d == d && gstaticSubs[i].nodeid == nodeid &&
+           gstaticSubs[i].index == index && gstaticSubs[i].subindex == subindex)
+        {
+            s = &gstaticSubs[i];
+            break;
+        }
+    }
+    for(i=0; s == NULL && i<SUBS_MAX; i++)
+    {
+        if(!gstaticSubs[i].used && !gstaticSubs[i].polling)
+        {
+            s = &gstaticSubs[i];
+            s->used = 1;
+            gstaticCount++;
+        }
+    }
+    if(s == NULL) return -2;
+
+    s->rq = *rq;
+    s->d = d;
+    s->nodeid = nodeid;
+    s->index = index;
+    s->subindex = subindex;
+    s->mindelta = mindelta;
+    s->interval = maxrate ? 1000 / maxrate : 0;
+    s->pollPeriod = maxrate ? (s->interval > SUBS_POLL_MIN_MS ? s->interval : SUBS_POLL_MIN_MS) : SUBS_POLL_MS;
+    s->nextPoll = now;
+    s->known = 0;
+    s->held = 0;
+    s->failed = 0;
+
+    if(gstaticTimer == TIMER_NONE)
+        gstaticTimer = SetAlarm(d, 0, SubsTick, MS_TO_TIMEVAL(SUBS_TICK_MS), MS_TO_TIMEVAL(SUBS_TICK_MS));
+
+    sprintf(retbuf,"000 subs node %d %4.4x,%2.2x subscribed",nodeid,index,subindex);
+    SendReply(rq, retbuf);
+
+    /* A shadowed object has a current value, the others get one from the first poll */
+    if(ShadowLookup(d, nodeid, index, subindex, &value))
+    {
+        s->nextPoll = now + s->pollPeriod;
+        SubsSend(s, value, now);
+    }
+    return 0;
+}
+
+/*
+This function release a subscription and stop the timer after the last one
+input: subscription
+*/
+
+static void SubsRelease(s_SUBSCRIPTION* s)
+{
+    s->used = 0;
+    if(--gstaticCount == 0 && gstaticTimer != TIMER_NONE)
+        gstaticTimer = DelAlarm(gstaticTimer);
+}
+
+/*
+This function cancel the subscription of a session to an object
+input: CO_Data structure of the bus, session identifier, node identifier, index, subindex
+return: 0 or -1 if the session is not subscribed to the object
+*/
+
+int SubsRemove(CO_Data* d, int session, UNS8 nodeid, UNS16 index, UNS8 subindex)
+{
+    int i;
+    s_SUBSCRIPTION* s;
+
+    for(i=0; i<SUBS_MAX; i++)
+    {
+        s = &gstaticSubs[i];
+        if(s->used && s->rq.session == session && s->d == d && s->nodeid == nodeid && s->index == index && s->subindex == subindex)
+        {
+            SubsRelease(s);
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/*
+This function cancel all the subscriptions of a session
+input: session identifier
+*/
+
+void SubsDropSession(int session)
+{
+    int i;
+
+    for(i=0; i<SUBS_MAX; i++)
+    {
+        if(gstaticSubs[i].used && gstaticSubs[i].rq.session == session) SubsRelease(&gstaticSubs[i]);
+    }
+}
@@ -0,0 +1,51 @@
+#ifndef SUBSCRIBE_H_INCLUDED
+#define SUBSCRIBE_H_INCLUDED
+
+/*
+Subscriptions to the changes of slave node objects.
+A session subscribed to an object receive a message, tagged like the
+subscribe command, each time the value change. Values come from the PDO
+shadow image or from SDO reads polled in the background for the objects
+that are not shadowed. A minimum change and a maximum rate limit the messages.
+All the functions must be called with the stack mutex held (EnterMutex).
+*/
+
+/* Number of subscriptions of all the sessions */
+#define SUBS_MAX 128
+
+/* Period of the subscription timer in ms */
+#define SUBS_TICK_MS 10
+
+/* Polling period of an object that is not shadowed, without and with a rate limit */
+#define SUBS_POLL_MS 100
+#define SUBS_POLL_MIN_MS 20
+
+/*
+This function subscribe a session to the changes of an object, a subscription
+of the session to the same object is replaced
+input: CO_Data structure, requester, node identifier, index, subindex,
+minimum change (0: any change), maximum messages per second (0: no limit)
+return: 0, -1 if the node is invalid or -2 if no more subscription is possible
+*/
+int SubsAdd(CO_Data*, s_REQUESTER*, UNS8, UNS16, UNS8, UNS32, UNS32);
+
+/*
+This function cancel the subscription of a session to an object
+input: CO_Data structure of the bus, session identifier, node identifier, index, subindex
+return: 0 or -1 if the session is not subscribed to the object
+*/
+int SubsRemove(CO_Data*, int, UNS8, UNS16, UNS8);
+
+/*
+This function cancel all the subscriptions of a session
+input: session identifier
+*/
+void SubsDropSession(int);
+
+/*
+This function give a new value of an object to its subscribers
+input: CO_Data structure of the bus, node identifier, index, subindex, value
+*/
+void SubsNotify(CO_Data*, UNS8, UNS16, UNS8, UNS32);
+
+#endif // SUBSCRIBE_H_INCLUDED
@@ -0,0 +1,219 @@
+/*
+Module: trace.c
+Description: bus trace recorder of the CANOpenShell server.
+The frame tap give every frame of the buses to the recorder, that copy it
+in the next record of the ring mapped from the trace file. The file blocks
+are allocated and the pages loaded (and locked) when the trace start: a
+record is written without system call, allocation or page fault, the
+kernel write the pages to the file in the background.
+The number of frames recorded is updated in the header after the record, a
+reader of the file never see a record being written as the last one.
+The commands are written to their file by the buffers of stdio, they are
+in the file when the trace is stopped.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+
+#include "canfestival.h"
+#include "gateway.h"
+#include "cantap.h"
+#include "socketcan.h"
+#include "trace.h"
+
+//****************************************************************************
+// TYPES
+
+typedef struct
+{
+    s_TRCHEADER header;
+    s_TRCRECORD records[1];     /* header.records records */
+} s_TRCFILE;
+
+//****************************************************************************
+// GLOBALS
+
+static s_TRCFILE* gstaticTrace;                 /* mapped file, NULL before the first start */
+static size_t gstaticSize;
+static char gstaticPath[256];
+static FILE* gstaticCmd;                        /* command file, NULL when it cannot be created */
+static int gstaticTapRegistered;
+
+
+/* Frame tap listener: every frame of the buses */
+static int TrcFrame(int bus, int dir, Message* m)
+{
+    s_TRCFILE* t = gstaticTrace;
+    s_TRCRECORD* r;
+    struct timespec ts;
+    unsigned long long head;
+
+    if(t == NULL || !t->header.running) return 0;
+
+    /* The kernel receive time is known with the socketcan driver */
+    if(dir != CANTAP_RX || SockCanRxTime(bus, &ts) < 0) clock_gettime(CLOCK_REALTIME, &ts);
+
+    head = t->header.head;
+    r = &t->records[head % t->header.records];
+    r->sec = (UNS32)ts.tv_sec;
+    r->nsec = (UNS32)ts.tv_nsec;
+    r->cobid = (m->cob_id & 0x7FF) | (m->rtr ? TRC_RTR : 0) | (dir == CANTAP_TX ? TRC_TX : 0);
+    r->len = m->len > 8 ? 8 : m->len;
+    r->bus = (UNS8)bus;
+    memcpy(r->data, m->data, 8);
+    __atomic_store_n(&t->header.head, head + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/*
+This function create the trace file and start the recording, the previous
+trace is lost
+input: file name, number of records of the ring
+return: 0, -1 if the number of records is invalid, -2 if the trace is
+already running or -3 if the file cannot be created
+*/
+
+int TrcStart(char* path, UNS32 records)
+{
+    s_TRCFILE* t;
+    size_t size;
+    char name[sizeof gstaticPath + sizeof TRC_CMD_SUFFIX];
+    int fd, err;
+
+    if(records == 0 || records > TRC_MAX_RECORDS || strlen(path) >= sizeof gstaticPath) return -1;
+    if(gstaticTrace != NULL && gstaticTrace->header.running) return -2;
+    if(!gstaticTapRegistered && CanTapRegister(TrcFrame) == 0) gstaticTapRegistered = 1;
+    if(!gstaticTapRegistered) return -2;
+    TrcClose();
+
+    /* The blocks are allocated now: a full disk fail here, not when a record is written */
+    size = TRC_HEADER + (size_t)records * sizeof(s_TRCRECORD);
+    if((fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0)
+    {
+        perror(path);
+        return -3;
+    }
+    if((err = posix_fallocate(fd, 0, size)) != 0)
+    {
+        errno = err;
+        perror(path);
+        close(fd);
+        return -3;
+    }
+    t = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if(t == MAP_FAILED)
+    {
+        perror(path);
+        return -3;
+    }
+
+    /* Load and lock the pages, the locking is only a hint when the limit is too low */
+    memset(t, 0, size);
+    mlock(t, size);
+
+    t->header.magic = TRC_MAGIC;
+    t->header.version = TRC_VERSION;
+    t->header.recordSize = sizeof(s_TRCRECORD);
+    t->header.records = records;
+    t->header.start = (UNS32)time(NULL);
+    t->header.running = 1;
+
+    /* The frames are recorded without the commands when their file cannot be created */
+    sprintf(name, "%s%s", path, TRC_CMD_SUFFIX);
+    if((gstaticCmd = fopen(name, "w")) == NULL) perror(name);
+    gstaticTrace = t;
+    gstaticSize = size;
+    strcpy(gstaticPath, path);
+    printf("Trace %s: %lu records\n", path, (unsigned long)records);
+    return 0;
+}
+
+/*
+This function record a command received from a host
+input: session identifier, command
+*/
+
+void TrcCommand(int session, char* command)
+{
+    struct timespec ts;
+
+    if(gstaticTrace == NULL || !gstaticTrace->header.running || gstaticCmd == NULL) return;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    fprintf(gstaticCmd, "%lu.%06lu %d %.*s\n", (unsigned long)ts.tv_sec, (unsigned long)ts.tv_nsec / 1000,
+            session, (int)strcspn(command, "\r\n"), command);
+}
+
+/*
+This function stop the recording, the trace stay readable
+return: 0 or -1 if the trace is not running
+*/
+
+int TrcStop(void)
+{
+    if(gstaticTrace == NULL || !gstaticTrace->header.running) return -1;
+    gstaticTrace->header.running = 0;
+    msync(gstaticTrace, gstaticSize, MS_ASYNC);
+    if(gstaticCmd != NULL) fflush(gstaticCmd);
+    return 0;
+}
+
+/*
+This function write the trace to its file and unmap it
+*/
+
+void TrcClose(void)
+{
+    if(gstaticTrace == NULL) return;
+    gstaticTrace->header.running = 0;
+    msync(gstaticTrace, gstaticSize, MS_SYNC);
+    munmap(gstaticTrace, gstaticSize);
+    gstaticTrace = NULL;
+    if(gstaticCmd != NULL) fclose(gstaticCmd);
+    gstaticCmd = NULL;
+}
+
+/*
+This function return a frame of the trace
+input: age of the frame (0: the last one recorded)
+return: record or NULL if the trace hold no such frame
+*/
+
+s_TRCRECORD* TrcFrameAt(UNS32 age)
+{
+    s_TRCFILE* t = gstaticTrace;
+
+    if(t == NULL || age >= t->header.records || age >= t->header.head) return NULL;
+    return &t->records[(t->header.head - 1 - age) % t->header.records];
+}
+
+/*
+This function print the state of the trace
+input: string buffer, size of the buffer
+return: 0 or -1 if no trace was started
+*/
+
+int TrcStats(char* buf, int len)
+{
+    s_TRCFILE* t = gstaticTrace;
+    unsigned long long head;
+    s_TRCRECORD* oldest;
+    s_TRCRECORD* last;
+    double span = 0;
+
+    if(t == NULL) return -1;
+    head = t->header.head;
+    last = TrcFrameAt(0);
+    oldest = TrcFrameAt(head < t->header.records ? (UNS32)head - 1 : t->header.records - 1);
+    if(last != NULL) span = (last->sec - oldest->sec) + ((double)last->nsec - oldest->nsec) / 1e9;
+    snprintf(buf, len, "%s %s, %llu frames recorded, %lu records of %lu, span %.3f s",
+             t->header.running ? "running" : "stopped",gstaticPath,head,
+             (unsigned long)(head < t->header.records ? head : t->header.records),
+             (unsigned long)t->header.records,span);
+    return 0;
+}
@@ -0,0 +1,104 @@
+#ifndef TRACE_H_INCLUDED
+#define TRACE_H_INCLUDED
+
+/*
+Bus trace recorder.
+Every frame received or sent on the buses is written in a ring of records
+mapped from a file: a header of TRC_HEADER bytes followed by the records,
+numbers in the byte order of the gateway. The frame i since the start is the
+record i % records, the header give the number of frames recorded so the
+oldest frame is known. The file is created at its full size and its pages
+are loaded when the trace start, writing a record never allocate or wait.
+The file is mapped shared: the frames are in the file even when the gateway
+stop without closing it.
+The commands of the hosts are written with the same time in a text file,
+the name of the trace file followed by TRC_CMD_SUFFIX, one line for each
+command: "<s>.<us> <session> <command>". The replay tool send them again.
+All the functions must be called with the stack mutex held (EnterMutex).
+*/
+
+/* Default file and number of records of the ring */
+#define TRC_FILE "canopenshell.trc"
+#define TRC_RECORDS (1024 * 1024)
+
+/* Name of the command file: name of the trace file followed by the suffix */
+#define TRC_CMD_SUFFIX ".cmd"
+
+/* Largest ring */
+#define TRC_MAX_RECORDS (16 * 1024 * 1024)
+
+/* Frames replied by a dump */
+#define TRC_DUMP_MAX 100
+
+/* Format of the file */
+#define TRC_MAGIC 0x43525443            /* "CTRC" */
+#define TRC_VERSION 1
+#define TRC_HEADER 64
+
+/* Bits of the COB-ID of a record */
+#define TRC_RTR 0x4000
+#define TRC_TX 0x8000
+
+typedef struct
+{
+    UNS32 magic;
+    UNS16 version;
+    UNS16 recordSize;
+    UNS32 records;              /* records of the ring */
+    UNS32 running;              /* 1 while the gateway record */
+    unsigned long long head;    /* frames recorded since the start */
+    UNS32 start;                /* real time of the start, s */
+    UNS32 reserved[9];
+} s_TRCHEADER;
+
+typedef struct
+{
+    UNS32 sec;                  /* real time of the frame, kernel receive time with the socketcan driver */
+    UNS32 nsec;
+    UNS16 cobid;                /* bits 0-10 identifier, bit 14 RTR, bit 15 frame sent by the gateway */
+    UNS8 len;
+    UNS8 bus;
+    UNS8 data[8];
+} s_TRCRECORD;
+
+/*
+This function create the trace file and start the recording, the previous
+trace is lost
+input: file name, number of records of the ring
+return: 0, -1 if the number of records is invalid, -2 if the trace is
+already running or -3 if the file cannot be created
+*/
+int TrcStart(char*, UNS32);
+
+/*
+This function record a command received from a host
+input: session identifier, command
+*/
+void TrcCommand(int, char*);
+
+/*
+This function stop the recording, the trace stay readable
+return: 0 or -1 if the trace is not running
+*/
+int TrcStop(void);
+
+/*
+This function write the trace to its file and unmap it
+*/
+void TrcClose(void);
+
+/*
+This function return a frame of the trace
+input: age of the frame (0: the last one recorded)
+return: record or NULL if the trace hold no such frame
+*/
+s_TRCRECORD* TrcFrameAt(UNS32);
+
+/*
+This function print the state of the trace
+input: string buffer, size of the buffer
+return: 0 or -1 if no trace was started
+*/
+int TrcStats(char*, int);
+
+#endif // TRACE_H_INCLUDED
@@ -0,0 +1,316 @@
+/*
+Module: tunnel.c
+Description: raw CAN frame tunnel of the CANOpenShell server.
+The frame tap give every frame of the buses to the tunnels, each one copy
+the frames that pass its filters in its batch. A full batch, or the batch
+of a flush interval, is given to the network thread as one binary message
+of the framed protocol: the frames never go through the text replies.
+The frames of the host are sent with one system call for each batch with
+the socketcan driver.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "../../../netSocket/netSocket.h"
+#include "canfestival.h"
+#include "gateway.h"
+#include "cantap.h"
+#include "socketcan.h"
+#include "tunnel.h"
+
+//****************************************************************************
+// DEFINES
+
+/* Records of a batch */
+#define TUN_BATCH ((NET_FRAME_MAX - TUN_HEADER) / TUN_RECORD)
+
+//****************************************************************************
+// TYPES
+
+typedef struct
+{
+    UNS8 used;
+    int session;                /* owner of the tunnel */
+    UNS32 flush;                /* ms, 0: a batch for each frame */
+    TIMER_HANDLE timer;
+    int nfilters;
+    UNS16 id[TUN_MAX_FILTERS];
+    UNS16 mask[TUN_MAX_FILTERS];
+    int count;                  /* records in the batch */
+    unsigned long frames;       /* frames given to the network thread */
+    unsigned long dropped;      /* frames lost, the reply queue was full */
+    unsigned long batches;
+    unsigned long sent;         /* frames of the host sent on the buses */
+    unsigned long refused;      /* frames of the host refused by the driver or malformed */
+    char batch[TUN_HEADER + TUN_BATCH * TUN_RECORD];
+} s_TUNNEL;
+
+//****************************************************************************
+// GLOBALS
+
+static s_TUNNEL gstaticTunnels[TUN_MAX];
+static int gstaticTapRegistered;
+
+
+/*
+This function copy a number in a batch, most significant byte first
+input: destination, value, number of bytes
+*/
+
+static void TunPut(char* p, UNS32 v, int n)
+{
+    while(n-- > 0)
+    {
+        p[n] = (char)v;
+        v >>= 8;
+    }
+}
+
+/*
+This function read a number of a batch, most significant byte first
+input: source, number of bytes
+return: value
+*/
+
+static UNS32 TunGet(const char* p, int n)
+{
+    UNS32 v = 0;
+
+    while(n-- > 0) v = (v << 8) | (UNS8)*p++;
+    return v;
+}
+
+/*
+This function return the tunnel of a session
+input: session identifier
+return: tunnel or NULL if the session has no tunnel
+*/
+
+static s_TUNNEL* TunFind(int session)
+{
+    int i;
+
+    for(i=0; i<TUN_MAX; i++)
+        if(gstaticTunnels[i].used && gstaticTunnels[i].session == session) return &gstaticTunnels[i];
+    return NULL;
+}
+
+/*
+This function give the batch of a tunnel to the network thread
+input: tunnel
+*/
+
+static void TunPush(s_TUNNEL* t)
+{
+    if(t->count == 0) return;
+    t->batch[0] = (char)TUN_MAGIC;
+    t->batch[1] = TUN_VERSION;
+    TunPut(t->batch + 2, t->count, 2);
+    TunPut(t->batch + 4, (UNS32)t->dropped, 4);
+    if(SendData(t->session, t->batch, TUN_HEADER + t->count * TUN_RECORD) < 0) t->dropped += t->count;
+    else
+    {
+        t->frames += t->count;
+        t->batches++;
+    }
+    t->count = 0;
+}
+
+/* Flush timer of a tunnel */
+static void TunAlarm(CO_Data* d, UNS32 index)
+{
+    TunPush(&gstaticTunnels[index]);
+}
+
+/*
+This function tell if a frame pass the filters of a tunnel
+input: tunnel, COB-ID
+return: 1 if the frame is kept
+*/
+
+static int TunMatch(s_TUNNEL* t, UNS16 cobid)
+{
+    int i;
+
+    if(t->nfilters == 0) return 1;
+    for(i=0; i<t->nfilters; i++) if((cobid & t->mask[i]) == t->id[i]) return 1;
+    return 0;
+}
+
+/* Frame tap listener: every frame of the buses */
+static int TunFrame(int bus, int dir, Message* m)
+{
+    struct timespec ts;
+    unsigned long long us;
+    UNS16 cobid = m->cob_id & 0x7FF;
+    s_TUNNEL* t;
+    char* r;
+    int i;
+
+    /* The kernel receive time is known with the socketcan driver */
+    if(dir != CANTAP_RX || SockCanRxTime(bus, &ts) < 0) clock_gettime(CLOCK_REALTIME, &ts);
+    us = (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+
+    for(i=0; i<TUN_MAX; i++)
+    {
+        t = &gstaticTunnels[i];
+        if(!t->used || !TunMatch(t, cobid)) continue;
+
+        r = t->batch + TUN_HEADER + t->count * TUN_RECORD;
+        TunPut(r, (UNS32)us, 4);
+        TunPut(r + 4, cobid | (m->rtr ? TUN_RTR : 0) | (dir == CANTAP_TX ? TUN_TX : 0), 2);
+        r[6] = m->len > 8 ? 8 : m->len;
+        r[7] = (char)bus;
+        memset(r + 8, 0, 8);
+        memcpy(r + 8, m->data, r[6]);
+        if(++t->count == TUN_BATCH || t->flush == 0) TunPush(t);
+    }
+    return 0;
+}
+
+/*
+This function open the tunnel of a session
+input: CO_Data structure, session identifier, flush interval in ms, number
+of filters (0: all the frames), identifiers, masks
+return: 0, -1 if a parameter is invalid or -2 if the session has a tunnel
+or no more tunnel can be opened
+*/
+
+int TunOpen(CO_Data* d, int session, UNS32 flush, int nfilters, UNS16* id, UNS16* mask)
+{
+    int i;
+    s_TUNNEL* t;
+
+    if(session <= 0 || flush > TUN_FLUSH_MAX || nfilters < 0 || nfilters > TUN_MAX_FILTERS) return -1;
+    if(TunFind(session) != NULL) return -2;
+    for(i=0; i<TUN_MAX && gstaticTunnels[i].used; i++) {}
+    if(i == TUN_MAX) return -2;
+    if(!gstaticTapRegistered && CanTapRegister(TunFrame) == 0) gstaticTapRegistered = 1;
+    if(!gstaticTapRegistered) return -2;
+
+    t = &gstaticTunnels[i];
+    memset(t, 0, sizeof *t);
+    t->session = session;
+    t->flush = flush;
+    t->nfilters = nfilters;
+    for(i=0; i<nfilters; i++)
+    {
+        t->mask[i] = mask[i] & 0x7FF;
+        t->id[i] = id[i] & t->mask[i];
+    }
+    t->timer = flush ? SetAlarm(d, t - gstaticTunnels, TunAlarm, MS_TO_TIMEVAL(flush), MS_TO_TIMEVAL(flush)) : TIMER_NONE;
+    t->used = 1;
+    return 0;
+}
+
+/*
+This function close the tunnel of a session, the frames not sent are dropped
+input: session identifier
+return: 0 or -1 if the session has no tunnel
+*/
+
+int TunClose(int session)
+{
+    s_TUNNEL* t = TunFind(session);
+
+    if(t == NULL) return -1;
+    if(t->timer != TIMER_NONE) DelAlarm(t->timer);
+    t->timer = TIMER_NONE;
+    t->used = 0;
+    return 0;
+}
+
+/*
+This function close the tunnel of a closed session
+input: session identifier
+*/
+
+void TunDropSession(int session)
+{
+    TunClose(session);
+}
+
+/*
+This function tell if a message received from a host is a batch of frames
+input: message, length
+return: 1 if the message is a batch, 0 if it is a command
+*/
+
+int TunIsBatch(char* msg, int len)
+{
+    return len > 0 && (UNS8)msg[0] == TUN_MAGIC;
+}
+
+/*
+This function send on the buses the frames of a batch received from a session
+input: session identifier, message, length
+return: number of frames sent, -1 if the batch is malformed or -2 if the
+session has no tunnel
+*/
+
+int TunFeed(int session, char* msg, int len)
+{
+    s_TUNNEL* t = TunFind(session);
+    int i, n, bus, held[MAX_BUSES], sent = 0;
+    CO_Data* d;
+    Message m;
+    char* r;
+
+    if(t == NULL) return -2;
+    n = len >= TUN_HEADER ? (int)TunGet(msg + 2, 2) : -1;
+    if(n < 0 || msg[1] != TUN_VERSION || len != TUN_HEADER + n * TUN_RECORD)
+    {
+        t->refused++;
+        return -1;
+    }
+
+    /* The frames of a bus leave in one system call */
+    memset(held, 0, sizeof held);
+    for(i=0, r=msg + TUN_HEADER; i<n; i++, r+=TUN_RECORD)
+    {
+        bus = (UNS8)r[7];
+        m.cob_id = (UNS16)(TunGet(r + 4, 2) & 0x7FF);
+        m.rtr = TunGet(r + 4, 2) & TUN_RTR ? 1 : 0;
+        m.len = (UNS8)r[6];
+        if(bus >= MAX_BUSES || (d = BusData(bus)) == NULL || m.len > 8)
+        {
+            t->refused++;
+            continue;
+        }
+        if(!held[bus])
+        {
+            SockCanHold(bus);
+            held[bus] = 1;
+        }
+        memcpy(m.data, r + 8, 8);
+        if(canSend(d->canHandle, &m) == 0) sent++;
+        else t->refused++;
+    }
+    for(bus=0; bus<MAX_BUSES; bus++)
+    {
+        if(!held[bus]) continue;
+        i = SockCanFlush(bus);
+        sent -= i;
+        t->refused += i;
+    }
+    t->sent += sent;
+    return sent;
+}
+
+/*
+This function print the counters of the tunnel of a session
+input: session identifier, string buffer, size of the buffer
+return: 0 or -1 if the session has no tunnel
+*/
+
+int TunStats(int session, char* buf, int len)
+{
+    s_TUNNEL* t = TunFind(session);
+
+    if(t == NULL) return -1;
+    snprintf(buf, len, "flush %lu ms filters %d, to host %lu frames %lu batches dropped %lu, from host %lu frames refused %lu",
+             (unsigned long)t->flush,t->nfilters,t->frames,t->batches,t->dropped,t->sent,t->refused);
+    return 0;
+}
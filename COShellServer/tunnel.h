@@ -0,0 +1,88 @@
+#ifndef TUNNEL_H_INCLUDED
+#define TUNNEL_H_INCLUDED
+
+/*
+Raw CAN frame tunnel.
+A session in the framed protocol open a tunnel to receive the frames of the
+buses, received and sent by the gateway, in binary batches: a header of
+TUN_HEADER bytes followed by records of TUN_RECORD bytes, numbers in network
+byte order.
+  header: magic TUN_MAGIC, version TUN_VERSION, number of records (2 bytes),
+          frames dropped since the tunnel was opened (4 bytes)
+  record: time in us (4 bytes, low bits of the real time, kernel receive
+          time with the socketcan driver), COB-ID (2 bytes: bits 0-10
+          identifier, bit 14 RTR, bit 15 frame sent by the gateway), data
+          length, bus index, 8 data bytes
+The frames are kept when they match one of the filters of the tunnel
+(COB-ID & mask == identifier). A batch is sent when it is full or each
+flush interval, or for each frame with an interval of 0.
+The host send frames on the buses with messages in the same format: a
+message that start with TUN_MAGIC is a batch, the other ones are commands.
+A tunnel belong to the session that opened it, and is closed with it.
+All the functions must be called with the stack mutex held (EnterMutex).
+*/
+
+/* Tunnels open at the same time */
+#define TUN_MAX 4
+
+/* Filters of a tunnel */
+#define TUN_MAX_FILTERS 8
+
+/* Format of the batches */
+#define TUN_MAGIC 0xCA
+#define TUN_VERSION 1
+#define TUN_HEADER 8
+#define TUN_RECORD 16
+
+/* Bits of the COB-ID of a record */
+#define TUN_RTR 0x4000
+#define TUN_TX 0x8000
+
+/* Longest flush interval, in ms */
+#define TUN_FLUSH_MAX 10000
+
+/*
+This function open the tunnel of a session
+input: CO_Data structure, session identifier, flush interval in ms, number
+of filters (0: all the frames), identifiers, masks
+return: 0, -1 if a parameter is invalid or -2 if the session has a tunnel
+or no more tunnel can be opened
+*/
+int TunOpen(CO_Data*, int, UNS32, int, UNS16*, UNS16*);
+
+/*
+This function close the tunnel of a session, the frames not sent are dropped
+input: session identifier
+return: 0 or -1 if the session has no tunnel
+*/
+int TunClose(int);
+
+/*
+This function close the tunnel of a closed session
+input: session identifier
+*/
+void TunDropSession(int);
+
+/*
+This function tell if a message received from a host is a batch of frames
+input: message, length
+return: 1 if the message is a batch, 0 if it is a command
+*/
+int TunIsBatch(char*, int);
+
+/*
+This function send on the buses the frames of a batch received from a session
+input: session identifier, message, length
+return: number of frames sent, -1 if the batch is malformed or -2 if the
+session has no tunnel
+*/
+int TunFeed(int, char*, int);
+
+/*
+This function print the counters of the tunnel of a session
+input: session identifier, string buffer, size of the buffer
+return: 0 or -1 if the session has no tunnel
+*/
+int TunStats(int, char*, int);
+
+#endif // TUNNEL_H_INCLUDED
@@ -10,13 +10,18 @@ to send predifined command to a stepper-engine by modifying it velocity and posi
 #include <stdio.h>
 #include <stdlib.h>
 #include <sysexits.h>
+#include <string.h>
 #include <strings.h>
 #include <conio.h>
 #include <unistd.h>
+#include <sys/select.h>
+#include <time.h>
 
 #define USAGE "Usage: %s server_name [init_file_name]"
 #define NPORT 5000
-#define MAXMSG 1024
+#define MAXMSG 4096
+#define MAXINFLIGHT 32              //commands sent ahead of their reply by the pipe command
+#define LINE_TIMEOUT 10             //seconds to wait for the reply of an init file line
 #define cst_str4(c1, c2, c3, c4) ((((unsigned int)0 | \
                                     (char)c4 << 8) | \
                                    (char)c3) << 8 | \
@@ -26,10 +31,20 @@ to send predifined command to a stepper-engine by modifying it velocity and posi
 void help_menu(void);
 void enterStatusMachine(int);
 int processInitFile(char*, int);
+int connectServer(char*);
+int sendCommand(int, char*);
+int receiveReply(int, int, char*, int);
+int receiveReplyTimeout(int, int, char*, int, int);
+int processPipeFile(char*, int);
+int receiveUpdates(int, int);
+int downloadFile(int, char*);
+
+s_NETBUF ServerBuf;                 //receive buffer and protocol mode of the server connection
+int LastTag;                        //last correlation identifier sent to the server
 
 int main (int argc, char*argv[])
 {
-    int n, sfd,ret=0;
+    int n, sfd,ret=0,tag;
     char bufs[MAXMSG];              //source buffer
     char bufc[MAXMSG];              //target buffet
     char command[MAXMSG];
@@ -48,7 +63,7 @@ int main (int argc, char*argv[])
         }
     }
 
-    if((sfd=connectClient(argv[1],NPORT))<0)
+    if((sfd=connectServer(argv[1]))<0)
     {
         exit(EX_OSERR);
     }
@@ -60,6 +75,11 @@ int main (int argc, char*argv[])
         fflush(stdin);
         printf("\n$> ");
         fgets(command,MAXMSG,stdin);
+        if(!strncmp(command,"dl#",3)) /* Download a file to a node */
+        {
+            downloadFile(sfd,command);
+            continue;
+        }
         switch(cst_str4(command[0], command[1], command[2], command[3]))
         {
         case cst_str4('s', 's', 't', 'a') : /* Slave Start*/
@@ -73,8 +93,8 @@ int main (int argc, char*argv[])
         case cst_str4('l', 'o', 'a', 'd') : /* Library Interface*/
             sscanf(command,"%s", bufs);    //
             bufs[strlen(bufs)]='\0';
-            if (sendData(sfd,bufs)<0) exit(EX_OSERR);
-            if ((n=receiveData(sfd,bufc,MAXMSG)) < 0) exit(EX_OSERR);
+            if ((tag=sendCommand(sfd,bufs))<0) exit(EX_OSERR);
+            if ((n=receiveReply(sfd,tag,bufc,MAXMSG)) < 0) exit(EX_OSERR);
             printf("\nReceived : %s",bufc);
             break;
 
@@ -85,12 +105,19 @@ int main (int argc, char*argv[])
             else
             {
                 bufs[strlen(bufs)]='\0';
-                if (sendData(sfd,bufs)<0) exit(EX_OSERR);
-                if ((n=receiveData(sfd,bufc,MAXMSG)) < 0) exit(EX_OSERR);
+                if ((tag=sendCommand(sfd,bufs))<0) exit(EX_OSERR);
+                if ((n=receiveReply(sfd,tag,bufc,MAXMSG)) < 0) exit(EX_OSERR);
                 printf("\nReceived : %s",bufc);
             }
             break;
 
+        case cst_str4('p', 'i', 'p', 'e') : /* Send a command file without waiting for each reply*/
+            bufs[0]='\0';
+            sscanf(command,"%*s %s", bufs);
+            if(!strlen(bufs)) printf("Error: pipe command require a file name");
+            else processPipeFile(bufs,sfd);
+            break;
+
         case cst_str4('h', 'e', 'l', 'p') : /* Display Help*/
             help_menu();
             break;
@@ -114,18 +141,292 @@ int main (int argc, char*argv[])
 }
 
 
+/*
+This function connect to the server and negotiate the framed protocol.
+A server that does not know the "prot#" command drop the connection,
+the client then reconnect and keep the legacy text protocol.
+input: server name
+return: socket or a negative value if the connection failed
+*/
+
+int connectServer(char* server)
+{
+    int sfd;
+    char buf[MAXMSG];
+
+    if((sfd=connectClient(server,NPORT))<0) return sfd;
+
+    initNetBuf(&ServerBuf,NET_TEXT);
+    if (sendMessage(sfd,&ServerBuf,"prot#frame")>0 &&
+        receiveMessage(sfd,&ServerBuf,buf,MAXMSG)>=0 && !strncmp(buf,"000",3))
+    {
+        ServerBuf.mode=NET_FRAMED;
+        return sfd;
+    }
+
+    disconnect(sfd);
+    printf("\nServer does not support the framed protocol, using text protocol");
+    if((sfd=connectClient(server,NPORT))<0) return sfd;
+    initNetBuf(&ServerBuf,NET_TEXT);
+    return sfd;
+}
+
+
+/*
+This function send a command to the server.
+With the framed protocol the command is tagged with a new correlation identifier
+input: socket, command string
+return: correlation identifier (0 if the command is not tagged) or -1 if an error occure
+*/
+
+int sendCommand(int sfd, char* command)
+{
+    char buf[MAXMSG];
+
+    if(ServerBuf.mode==NET_TEXT)
+        return sendMessage(sfd,&ServerBuf,command)<0 ? -1 : 0;
+
+    if(++LastTag<=0) LastTag=1;
+    snprintf(buf,sizeof buf,"@%d %s",LastTag,command);
+    return sendMessage(sfd,&ServerBuf,buf)<0 ? -1 : LastTag;
+}
+
+
+/*
+This function wait for the reply of a command, the correlation identifier is removed from the reply.
+Replies of other commands received meanwhile are displayed
+input: socket, correlation identifier, reply buffer, buffer length
+return: reply length or -1 if an error occure
+*/
+
+int receiveReply(int sfd, int tag, char* buf, int len)
+{
+    return receiveReplyTimeout(sfd,tag,buf,len,-1);
+}
+
+
+/*
+This function wait for the reply of a command during a limited time
+input: socket, correlation identifier, reply buffer, buffer length, timeout in seconds (-1: no limit)
+return: reply length, -1 if an error occure or -2 after the timeout
+*/
+
+int receiveReplyTimeout(int sfd, int tag, char* buf, int len, int timeout)
+{
+    int n,rtag,off;
+    time_t deadline=time(NULL)+timeout;
+    fd_set fds;
+    struct timeval tv;
+
+    while(1)
+    {
+        while((n=extractMessage(&ServerBuf,buf,len))<0)
+        {
+            if(n==-2) return -1;            //framing lost
+            if(timeout>=0)
+            {
+                FD_ZERO(&fds);
+                FD_SET(sfd,&fds);
+                tv.tv_sec=deadline-time(NULL);
+                tv.tv_usec=0;
+                if(tv.tv_sec<0 || select(sfd+1,&fds,NULL,NULL,&tv)==0) return -2;
+            }
+            if(fillNetBuf(sfd,&ServerBuf)<=0) return -1;
+        }
+        rtag=off=0;
+        if(buf[0]=='@' && sscanf(buf,"@%d %n",&rtag,&off)<1) rtag=off=0;
+        if(rtag==tag)
+        {
+            memmove(buf,buf+off,n-off+1);
+            return n-off;
+        }
+        printf("\nReceived @%d : %s",rtag,buf+off);
+    }
+}
+
+
+/*
+This function display the messages received during a delay without waiting for a reply,
+as the values sent by the subscriptions
+input: socket, delay in ms
+return: number of messages or -1 if an error occure
+*/
+
+int receiveUpdates(int sfd, int ms)
+{
+    int n=0,off;
+    char buf[MAXMSG];
+    fd_set fds;
+    struct timeval tv;
+
+    while(1)
+    {
+        if((off=extractMessage(&ServerBuf,buf,sizeof buf))==-2) return -1;
+        if(off>=0)
+        {
+            off=0;
+            if(buf[0]=='@') sscanf(buf,"@%*d %n",&off);
+            printf("\n%s",buf+off);
+            n++;
+            continue;
+        }
+
+        FD_ZERO(&fds);
+        FD_SET(sfd,&fds);
+        tv.tv_sec=0;
+        tv.tv_usec=ms*1000;
+        if(select(sfd+1,&fds,NULL,NULL,&tv)<=0) return n;
+        if(fillNetBuf(sfd,&ServerBuf)<=0) return -1;
+        ms=0;
+    }
+}
+
+
+/*
+This function download a file to a slave node entry: the file is streamed to the
+server once it accepted the dl# command, then the progress is displayed until
+the result of the transfer. The server stop reading while the bus is behind.
+input: socket, command "dl#nodeid,index,subindex,file name"
+return: 0 or -1 if an error occure
+*/
+
+int downloadFile(int sfd, char* command)
+{
+    int node,index,subindex,tag,n;
+    long size;
+    char name[MAXMSG];
+    char buf[MAXMSG];
+    FILE* pFile;
+
+    if(sscanf(command,"dl#%x,%x,%x,%s",&node,&index,&subindex,name)!=4)
+    {
+        printf("Error: dl# require nodeid,index,subindex,file");
+        return -1;
+    }
+    if(ServerBuf.mode!=NET_FRAMED)
+    {
+        printf("Error: the server does not support the framed protocol");
+        return -1;
+    }
+    if((pFile=fopen(name,"rb"))==NULL)
+    {
+        printf("\nError while opening file %s",name);
+        return -1;
+    }
+    fseek(pFile,0,SEEK_END);
+    size=ftell(pFile);
+    rewind(pFile);
+
+    sprintf(buf,"dl#%x,%x,%x,%lx",node,index,subindex,size);
+    if((tag=sendCommand(sfd,buf))<0 || receiveReply(sfd,tag,buf,MAXMSG)<0) exit(EX_OSERR);
+    printf("\nReceived : %s",buf);
+    if(strncmp(buf,"000",3))
+    {
+        fclose(pFile);
+        return -1;
+    }
+
+    while((n=fread(buf,1,NET_FRAME_MAX,pFile))>0)
+    {
+        if(sendFrame(sfd,&ServerBuf,buf,n)<0) exit(EX_OSERR);
+    }
+    fclose(pFile);
+
+    do
+    {
+        if(receiveReply(sfd,tag,buf,MAXMSG)<0) exit(EX_OSERR);
+        printf("\nReceived : %s",buf);
+    }
+    while(strstr(buf," progress ")!=NULL);
+    return strncmp(buf,"000",3) ? -1 : 0;
+}
+
+
+/*
+This fuction send the commands of a file keeping up to MAXINFLIGHT commands in flight.
+Replies are matched to their command with the correlation identifier and may arrive out of order.
+The text protocol does not allow pipelining, the file is then processed line by line
+input: file name, socket
+*/
+
+int processPipeFile(char* fileName,int pSockFd)
+{
+    int i,n,rtag,off,inflight,total;
+    int tags[MAXINFLIGHT];
+    char lines[MAXINFLIGHT][MAXMSG];
+    char ptarbuf[MAXMSG];
+    char ptmpobuf[MAXMSG];
+    FILE* pPFile;
+
+    if(ServerBuf.mode==NET_TEXT) return processInitFile(fileName,pSockFd);
+
+    if((pPFile=fopen(fileName,"r"))==NULL)
+    {
+        printf("\nError while opening file %s",fileName);
+        return -1;
+    }
+
+    for(i=0; i<MAXINFLIGHT; i++) tags[i]=0;
+    inflight=total=0;
+    while (1)
+    {
+            //read the next command while a slot is free
+        if (inflight<MAXINFLIGHT && pPFile!=NULL)
+        {
+            if (fgets(ptmpobuf,sizeof ptmpobuf,pPFile)==NULL)
+            {
+                fclose(pPFile);
+                pPFile=NULL;
+                continue;
+            }
+            for(i=0; ptmpobuf[i]==' '; i++) {}
+            n=strcspn(ptmpobuf+i,"\r\n");
+            ptmpobuf[i+n]='\0';
+            if (n<2 || ptmpobuf[i]=='#') continue;
+
+            for(n=0; tags[n]!=0; n++) {}
+            strcpy(lines[n],ptmpobuf+i);
+            if ((tags[n]=sendCommand(pSockFd,lines[n]))<0) exit(EX_OSERR);
+            inflight++;
+            total++;
+            continue;
+        }
+        if (inflight==0) break;
+
+            //the window is full or the file is over, collect a reply
+        if ((n=receiveMessage(pSockFd,&ServerBuf,ptarbuf,sizeof ptarbuf))<0) exit(EX_OSERR);
+        rtag=off=0;
+        if (ptarbuf[0]!='@' || sscanf(ptarbuf,"@%d %n",&rtag,&off)<1) rtag=0;
+        for(i=0; i<MAXINFLIGHT && (rtag==0 || tags[i]!=rtag); i++) {}
+        if (i==MAXINFLIGHT)
+        {
+            printf("\nReceived : %s",ptarbuf);
+            continue;
+        }
+        printf("\n%s -> %s",lines[i],ptarbuf+off);
+        tags[i]=0;
+        inflight--;
+    }
+    printf("\n%d commands processed",total);
+    return 0;
+}
+
+
 /*
 This fuction process commands from init file.
-'#' prefixed lines are not processed and inserted space before the command are ignored
+'#' prefixed lines are not processed and inserted space before the command are ignored.
+Each line is sent when the previous one is completed, a "timeout#seconds" line
+change the time allowed to the following lines
 input: file name, socket
 */
 
 int processInitFile(char* fileName,int pSockFd)
 {
-    int i,n;
-    char psrcbuf[128];
-    char ptarbuf[128];
-    char ptmpobuf[128];
+    int i,n,tag,line=0;
+    int timeout=LINE_TIMEOUT;
+    char psrcbuf[MAXMSG];
+    char ptarbuf[MAXMSG];
+    char ptmpobuf[MAXMSG];
     FILE* pPFile;
 
     if((pPFile=fopen(fileName,"r"))==NULL)
@@ -136,17 +437,21 @@ int processInitFile(char* fileName,int pSockFd)
     else
     {
         printf("\nProcessing init file %s",fileName);
-        while (fgets(ptmpobuf,MAXMSG,pPFile)!=NULL)
+        while (fgets(ptmpobuf,sizeof ptmpobuf,pPFile)!=NULL)
         {
-
+            line++;
             for(i=0; ptmpobuf[i]==' '; i++) {}
             strcpy(psrcbuf,ptmpobuf+i);
             if (strlen(psrcbuf)>=2 && psrcbuf[0]!='#')
             {
-                if (sendData(pSockFd,psrcbuf)<0) exit(EX_OSERR);
-                if ((n=receiveData(pSockFd,ptarbuf,MAXMSG)) < 0) exit(EX_OSERR);
-                printf("\nReceived : %s",ptarbuf);
-                usleep(999999);
+                if (sscanf(psrcbuf,"timeout#%d",&timeout)==1) continue;
+
+                /* The next line is sent as soon as the server complete this one */
+                if ((tag=sendCommand(pSockFd,psrcbuf))<0) exit(EX_OSERR);
+                n=receiveReplyTimeout(pSockFd,tag,ptarbuf,sizeof ptarbuf,timeout);
+                if (n==-1) exit(EX_OSERR);
+                if (n==-2) printf("\nLine %d not completed after %d s",line,timeout);
+                else printf("\nReceived : %s",ptarbuf);
             }
 
         }
@@ -158,7 +463,8 @@ int processInitFile(char* fileName,int pSockFd)
 
 /*
 This function enter in status machine mode.
-This mode allow user to modify volocity, positon and stop the stepper motor
+This mode allow user to modify volocity, positon and stop the stepper motor.
+The status word and the position are displayed when they change (framed protocol only)
 input: socket
 */
 void enterStatusMachine(int sockFd)
@@ -166,24 +472,32 @@ void enterStatusMachine(int sockFd)
 
     int state=0;
     int dsec,sec;
-    int stl,i,n;
-    int vitesse,position;
+    int i,n,tag;
+    int vitesse=0,position;
     char choice;
     char srcbuf[128];
     char tarbuf[128];
-    char tpobuf[128];
-    char stTab[8][30]=
+    char stTab[4][30]=
     {
-        "wsdo#6,6060,00,04,00000001",
-        "wsdo#6,6081,00,04,",
-
-        "wsdo#6,6040,00,04,0000007F",
-        "wsdo#6,607A,00,04,",
-
-        "wsdo#6,607A,00,04,0000017F",
+        "halt#6",
         "info#6",
+        "subscribe#6,6041,00",
+        "subscribe#6,6064,00,0,10",
+    };
+    char unsTab[2][30]=
+    {
+        "unsubscribe#6,6041,00",
+        "unsubscribe#6,6064,00",
     };
 
+    /* The server send the changes instead of being polled */
+    for(i=0; i<2 && ServerBuf.mode==NET_FRAMED; i++)
+    {
+        if ((tag=sendCommand(sockFd,stTab[2 + i]))<0) exit(EX_OSERR);
+        if ((n=receiveReply(sockFd,tag,tarbuf,sizeof tarbuf)) < 0) exit(EX_OSERR);
+        printf("\nReceived : %s",tarbuf);
+    }
+
     sec=dsec=0;
     while(state!=-1)
     {
@@ -195,7 +509,7 @@ void enterStatusMachine(int sockFd)
                 sec++;
                 if (sec==60) sec=0;
             }
-        usleep(10000);
+        if (receiveUpdates(sockFd,10) < 0) exit(EX_OSERR);
         dsec++;
 
         if (kbhit()!=0)
@@ -208,33 +522,6 @@ void enterStatusMachine(int sockFd)
                 printf("\nSet velocity: ");
                 scanf("%d",&vitesse);
                 vitesse=vitesse*256;
-                strcpy(srcbuf,stTab[1]);
-                itoa(vitesse,tpobuf,16);
-                stl=strlen(tpobuf);
-                stl=8-stl;
-                for(i=0; i<stl; i++)
-                {
-                    tpobuf[i]='0';
-                }
-                itoa(vitesse,tpobuf+stl,16);
-                strcat(srcbuf,tpobuf);
-
-                sendData(sockFd,srcbuf);
-                usleep(999999);
-
-                //Remove tag when used with echo server
-                if ((n=receiveData(sockFd,tarbuf,MAXMSG)) < 0) exit(EX_OSERR);
-                printf("\nReceived : %s",tarbuf);
-
-                sendData(sockFd,stTab[0]);
-                usleep(999999);
-
-                //Remove tag when used with echo server
-                if ((n=receiveData(sockFd,tarbuf,MAXMSG)) < 0) exit(EX_OSERR);
-                printf("\nReceived : %s",tarbuf);
-
-
-
                 printf("\n");
                 break;
 
@@ -242,54 +529,34 @@ void enterStatusMachine(int sockFd)
                 printf("\nSet position: ");
                 scanf("%d",&position);
                 position=position*64;
-                strcpy(srcbuf,stTab[3]);
-                itoa(position,tpobuf,16);
-                stl=strlen(tpobuf);
-                stl=8-stl;
-                for(i=0; i<stl; i++)
-                {
-                    tpobuf[i]='0';
-                }
-                itoa(position,tpobuf+stl,16);
-                strcat(srcbuf,tpobuf);
-
-                sendData(sockFd,stTab[2]);
-                usleep(2000000);
 
-                //Remove tag when used with echo server
-                if ((n=receiveData(sockFd,tarbuf,MAXMSG)) < 0) exit(EX_OSERR);
-                printf("\nReceived : %s",tarbuf);
-
-                sendData(sockFd,srcbuf);
-                usleep(999999);
-
-                //Remove tag when used with echo server
-                if ((n=receiveData(sockFd,tarbuf,MAXMSG)) < 0) exit(EX_OSERR);
+                //The server enable the drive and give the relative set-point in one command
+                sprintf(srcbuf,"move#6,%x,%x,r",position,vitesse);
+                if ((tag=sendCommand(sockFd,srcbuf))<0) exit(EX_OSERR);
+                if ((n=receiveReply(sockFd,tag,tarbuf,sizeof tarbuf)) < 0) exit(EX_OSERR);
                 printf("\nReceived : %s",tarbuf);
 
                 printf("\n");
                 break;
 
             case 's' :
-                sendData(sockFd,stTab[4]);
-                usleep(999999);
-                if ((n=receiveData(sockFd,tarbuf,MAXMSG)) < 0) exit(EX_OSERR);
+                if ((tag=sendCommand(sockFd,stTab[0]))<0) exit(EX_OSERR);
+                if ((n=receiveReply(sockFd,tag,tarbuf,sizeof tarbuf)) < 0) exit(EX_OSERR);
                 printf("\nReceived : %s",tarbuf);
 
                 printf("\n");
                 break;
 
             case 'i' :
-                sendData(sockFd,stTab[5]);
-                usleep(999999);
-                if ((n=receiveData(sockFd,tarbuf,MAXMSG)) < 0) exit(EX_OSERR);
+                if ((tag=sendCommand(sockFd,stTab[1]))<0) exit(EX_OSERR);
+                if ((n=receiveReply(sockFd,tag,tarbuf,sizeof tarbuf)) < 0) exit(EX_OSERR);
                 printf("\nReceived : %s",tarbuf);
 
                 printf("\n");
                 break;
 
             case 'h':
-                printf("\n type v : to define velocity");
+                printf("\n type v : to define velocity of the next moves");
                 printf("\n      p : to define new position");
                 printf("\n      s : to halt the motor");
                 printf("\n      i : to retrive information from the node");
@@ -298,6 +565,11 @@ void enterStatusMachine(int sockFd)
                 break;
 
             case 'q':
+                for(i=0; i<2 && ServerBuf.mode==NET_FRAMED; i++)
+                {
+                    if ((tag=sendCommand(sockFd,unsTab[i]))<0) exit(EX_OSERR);
+                    if ((n=receiveReply(sockFd,tag,tarbuf,sizeof tarbuf)) < 0) exit(EX_OSERR);
+                }
                 state=-1;
             }
         }
@@ -311,21 +583,33 @@ This function display the help
 void help_menu(void)
 {
     printf("   MANDATORY COMMAND (must be the first command):\n");
-    printf("     load#CanLibraryPath,channel,baudrate,nodeid,type (0:slave, 1:master)\n");
+    printf("     load#CanLibraryPath,channel,baudrate,nodeid,type (0:slave, 1:master)[,name]\n");
+    printf("        load again with another channel to serve one more bus, named bus1, bus2... by default\n");
+    printf("        a bus is addressed by its name after the # (ex : rsdo#bus1:6,1018,01)\n");
     printf("\n");
     printf("   NETWORK: (if nodeid=0x00 : broadcast)\n");
     printf("     ssta#nodeid : Start a node\n");
     printf("     ssto#nodeid : Stop a node\n");
     printf("     srst#nodeid : Reset a node\n");
-    printf("     scan : Reset all nodes and print message when bootup\n");
+    printf("     scan : List the nodes with their identity (nodeid=type,vendor,product,revision;...)\n");
     printf("     wait#seconds : Sleep for n seconds\n");
     printf("\n");
+    printf("   CLIENT:\n");
+    printf("     send command : Send a command string to the server\n");
+    printf("     pipe file : Send the commands of a file without waiting for each reply\n");
+    printf("     stat : Enter status machine mode\n");
+    printf("     send move#nodeid,position,velocity[,r] : move a drive, reply when the set-point is acknowledged\n");
+    printf("     send halt#nodeid : halt a drive, reply when it stand still\n");
+    printf("\n");
     printf("   SDO: (size in bytes)\n");
-    printf("     info#nodeid\n");
+    printf("     info#nodeid[,nodeid...] : identity of nodes, one reply per node, from the inventory file when it is recorded\n");
     printf("     rsdo#nodeid,index,subindex : read sdo\n");
     printf("        ex : rsdo#42,1018,01\n");
     printf("     wsdo#nodeid,index,subindex,size,data : write sdo\n");
     printf("        ex : wsdo#42,6200,01,01,FF\n");
+    printf("     send subscribe#nodeid,index,subindex[,mindelta[,maxrate]] : receive the changes of an entry\n");
+    printf("     dl#nodeid,index,subindex,file : download a file (firmware, program) to a domain entry\n");
+    printf("        ex : dl#6,1F50,01,firmware.bin\n");
     printf("\n");
     printf("   Note: All numbers are hex\n");
     printf("\n");
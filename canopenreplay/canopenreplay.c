@@ -0,0 +1,540 @@
+/*
+Program: canopenreplay.c
+Description: replay of a bus trace recorded by the CanOpenShell server (trace#start).
+The frames received by the gateway are sent again on SocketCAN interfaces (vcan0...),
+one interface for each bus of the trace, and the commands of the hosts are sent
+again to a server, each recorded session on its own connection. The frames and
+the commands keep their recorded order, at their recorded time or as fast as
+possible, so two runs on the same trace are comparable. The latency of each
+command (until its first reply) is measured and summarized at the end.
+The frames sent by the gateway are not replayed: the gateway under test send
+its own. The server must be loaded on the interfaces before the replay, with
+-c commands or another client. Linux only.
+*/
+
+#define _GNU_SOURCE
+
+#include "../netsocket/netsocket.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <sysexits.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <net/if.h>
+#include <linux/can.h>
+#include <linux/can/raw.h>
+
+#include "applicfg.h"
+#include "../COShellServer/trace.h"
+
+#define USAGE "Usage: %s [-f] [-i interface[,interface...]] [-s server] [-c command]... trace_file [command_file]\n"
+#define NPORT 5000
+#define MAXMSG 4096
+#define MAXINFLIGHT 32              //commands sent ahead of their reply on a connection
+#define MAXSESSIONS 16              //recorded sessions replayed at the same time
+#define MAXBUSES 4                  //interfaces, bus 0 of the trace on the first one
+#define MAXSETUP 8                  //-c commands
+#define REPLY_TIMEOUT 10            //seconds to wait for the last replies
+
+typedef struct
+{
+    long long t;                    //recorded time in ns
+    int session;                    //recorded session
+    char* command;
+} s_COMMAND;
+
+typedef struct
+{
+    int session;                    //recorded session
+    int sfd;
+    s_NETBUF buf;
+    int lastTag;
+    int inflight;
+    int tags[MAXINFLIGHT];          //0: free slot
+    long long sent[MAXINFLIGHT];    //send time of the commands in flight
+} s_CONNECTION;
+
+int openInterfaces(char*, int*);
+int loadTrace(char*, s_TRCHEADER**);
+int loadCommands(char*, s_COMMAND**);
+s_CONNECTION* getConnection(char*, int);
+int sendCommand(s_CONNECTION*, char*);
+int collectReplies(s_CONNECTION*);
+int waitReplies(long long);
+int sendRecord(int, s_TRCRECORD*);
+long long recordTime(s_TRCRECORD*);
+void printReport(double);
+
+s_CONNECTION Connections[MAXSESSIONS];
+int NConnections;
+long long* Latencies;               //ns, one for each command replied
+int NLatencies;
+int Errors;                         //commands replied 404
+int Skipped;                        //recorded commands that cannot be replayed
+int Timeouts;                       //commands not replied at the end
+long Frames, FramesSkipped;
+long long MaxLate;                  //longest delay of a frame after its time, ns
+
+/*
+This function return the time of the monotonic clock
+return: time in ns
+*/
+
+long long now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return (long long)ts.tv_sec*1000000000LL+ts.tv_nsec;
+}
+
+int main (int argc, char*argv[])
+{
+    int opt,i,n,ret,tag,fast=0,nifs=0,nsetup=0;
+    int fds[MAXBUSES];
+    char* interfaces=NULL;
+    char* server=NULL;
+    char* setup[MAXSETUP];
+    char name[MAXMSG];
+    char buf[MAXMSG];
+    s_TRCHEADER* trace=NULL;
+    s_TRCRECORD* records=NULL;
+    s_TRCRECORD* r;
+    s_COMMAND* commands=NULL;
+    s_CONNECTION* c;
+    unsigned long long first=0,head=0,f;
+    int ncommands=0,k,frame;
+    long long t0,start,due,te;
+
+    while((opt=getopt(argc,argv,"fi:s:c:"))!=-1)
+    {
+        switch(opt)
+        {
+        case 'f' : fast=1; break;
+        case 'i' : interfaces=optarg; break;
+        case 's' : server=optarg; break;
+        case 'c' :
+            if(nsetup<MAXSETUP) setup[nsetup++]=optarg;
+            break;
+        default :
+            fprintf(stderr,USAGE,argv[0]);
+            exit(EX_USAGE);
+        }
+    }
+    if(optind>=argc || (interfaces==NULL && server==NULL))
+    {
+        fprintf(stderr,USAGE,argv[0]);
+        fprintf(stderr,"  -f : as fast as possible instead of the recorded timing\n");
+        fprintf(stderr,"  -i : replay the frames received on each bus on an interface\n");
+        fprintf(stderr,"  -s : replay the commands of command_file (default trace_file%s) to a server\n",TRC_CMD_SUFFIX);
+        fprintf(stderr,"  -c : command sent to the server before the replay (ex: load#socketcan,vcan0,1M,1,1)\n");
+        exit(EX_USAGE);
+    }
+
+    initNet();
+    if(interfaces!=NULL)
+    {
+        if((nifs=openInterfaces(interfaces,fds))<0) exit(EX_OSERR);
+        if(loadTrace(argv[optind],&trace)<0) exit(EX_DATAERR);
+        records=(s_TRCRECORD*)((char*)trace+TRC_HEADER);
+        head=trace->head;
+        first=head>trace->records ? head-trace->records : 0;
+    }
+    if(server!=NULL)
+    {
+        snprintf(name,sizeof name,"%s%s",argv[optind],TRC_CMD_SUFFIX);
+        if((ncommands=loadCommands(optind+1<argc ? argv[optind+1] : name,&commands))<0) exit(EX_DATAERR);
+
+        /* The setup commands are completed before the clock start */
+        for(i=0; i<nsetup; i++)
+        {
+            if((c=getConnection(server,0))==NULL) exit(EX_OSERR);
+            snprintf(buf,sizeof buf,"@%d %s",tag=++c->lastTag,setup[i]);
+            if(sendMessage(c->sfd,&c->buf,buf)<0) exit(EX_OSERR);
+            do
+            {
+                if(receiveMessage(c->sfd,&c->buf,buf,sizeof buf)<0) exit(EX_OSERR);
+            }
+            while(sscanf(buf,"@%d",&n)!=1 || n!=tag);
+            printf("%s -> %s\n",setup[i],strchr(buf,' ')+1);
+        }
+    }
+
+    /* The replay start at the first event of the trace or of the commands */
+    while(first<head && records[first%trace->records].cobid&TRC_TX) first++;
+    t0=first<head ? recordTime(&records[first%trace->records]) : -1;
+    if(ncommands>0 && (t0<0 || commands[0].t<t0)) t0=commands[0].t;
+    printf("Replay of %llu records and %d commands%s\n",head-first,ncommands,fast ? " as fast as possible" : "");
+
+    start=now();
+    f=first;
+    k=0;
+    while(1)
+    {
+        /* The next event in the recorded order, the frames of the gateway are not replayed */
+        while(f<head && records[f%trace->records].cobid&TRC_TX) f++;
+        if(f==head && k==ncommands) break;
+        r=f<head ? &records[f%trace->records] : NULL;
+        frame=r!=NULL && (k==ncommands || recordTime(r)<=commands[k].t);
+        te=frame ? recordTime(r) : commands[k].t;
+        due=fast ? 0 : start+te-t0;
+
+        /* The replies are collected while waiting */
+        while(now()<due) if(waitReplies(due)<0) exit(EX_OSERR);
+
+        if(frame)
+        {
+            if(!fast && now()-due>MaxLate) MaxLate=now()-due;
+            ret=r->bus<nifs ? sendRecord(fds[r->bus],r) : 1;
+            if(ret<0) exit(EX_OSERR);
+            if(ret>0) FramesSkipped++;
+            else Frames++;
+            f++;
+            continue;
+        }
+
+        if((c=getConnection(server,commands[k].session))==NULL) exit(EX_OSERR);
+        while(c->inflight==MAXINFLIGHT) if(waitReplies(-1)<0) exit(EX_OSERR);
+        if(sendCommand(c,commands[k].command)<0) exit(EX_OSERR);
+        if(fast && waitReplies(0)<0) exit(EX_OSERR);
+        k++;
+    }
+
+    /* The last replies */
+    te=now()+REPLY_TIMEOUT*1000000000LL;
+    for(i=0; i<NConnections; i++)
+        while(Connections[i].inflight>0 && now()<te) if(waitReplies(te)<0) exit(EX_OSERR);
+    for(i=0; i<NConnections; i++)
+    {
+        Timeouts+=Connections[i].inflight;
+        disconnect(Connections[i].sfd);
+    }
+    printReport((now()-start)/1e9);
+    closeNet();
+    return 0;
+}
+
+
+/*
+This function open the SocketCAN interfaces of a comma separated list
+input: list, sockets
+return: number of interfaces or -1 if an error occure
+*/
+
+int openInterfaces(char* list, int* fds)
+{
+    int n=0;
+    char* p;
+    struct ifreq ifr;
+    struct sockaddr_can addr;
+
+    for(p=strtok(list,","); p!=NULL; p=strtok(NULL,","))
+    {
+        if(n==MAXBUSES)
+        {
+            fprintf(stderr,"Error: at most %d interfaces\n",MAXBUSES);
+            return -1;
+        }
+        memset(&ifr,0,sizeof ifr);
+        memset(&addr,0,sizeof addr);
+        snprintf(ifr.ifr_name,IFNAMSIZ,"%s",p);
+        addr.can_family=AF_CAN;
+        if((fds[n]=socket(PF_CAN,SOCK_RAW,CAN_RAW))<0 || ioctl(fds[n],SIOCGIFINDEX,&ifr)<0 ||
+           (addr.can_ifindex=ifr.ifr_ifindex, bind(fds[n],(struct sockaddr*)&addr,sizeof addr)<0))
+        {
+            perror(p);
+            return -1;
+        }
+        n++;
+    }
+    return n;
+}
+
+
+/*
+This function map a trace file
+input: file name, header receiving the mapping
+return: 0 or -1 if the file is not a trace
+*/
+
+int loadTrace(char* fileName, s_TRCHEADER** trace)
+{
+    int fd;
+    struct stat st;
+    s_TRCHEADER* h;
+
+    if((fd=open(fileName,O_RDONLY))<0 || fstat(fd,&st)<0)
+    {
+        perror(fileName);
+        return -1;
+    }
+    h=st.st_size>=TRC_HEADER ? mmap(NULL,st.st_size,PROT_READ,MAP_SHARED,fd,0) : MAP_FAILED;
+    close(fd);
+    if(h==MAP_FAILED || h->magic!=TRC_MAGIC || h->version!=TRC_VERSION || h->recordSize!=sizeof(s_TRCRECORD) ||
+       st.st_size<TRC_HEADER+(long long)h->records*(long long)sizeof(s_TRCRECORD))
+    {
+        fprintf(stderr,"Error: %s is not a trace file of this version\n",fileName);
+        return -1;
+    }
+    if(h->running) printf("Trace %s is still recording, the frames recorded until now are replayed\n",fileName);
+    *trace=h;
+    return 0;
+}
+
+
+/*
+This function read the commands of a command file, the commands that
+need data from the host (dl#, raw#) or change the connection (prot#, quit)
+and the trace commands are skipped
+input: file name, array receiving the commands
+return: number of commands or -1 if an error occure
+*/
+
+int loadCommands(char* fileName, s_COMMAND** commands)
+{
+    int n=0,size=0,session,off;
+    unsigned long sec,usec;
+    char line[MAXMSG];
+    char* p;
+    FILE* pFile;
+
+    if((pFile=fopen(fileName,"r"))==NULL)
+    {
+        perror(fileName);
+        return -1;
+    }
+    while(fgets(line,sizeof line,pFile)!=NULL)
+    {
+        line[strcspn(line,"\r\n")]='\0';
+        off=0;
+        if(sscanf(line,"%lu.%lu %d %n",&sec,&usec,&session,&off)!=3 || off==0) continue;
+        p=line+off;
+        if(!strncmp(p,"dl#",3) || !strncmp(p,"raw#",4) || !strncmp(p,"prot#",5) ||
+           !strncmp(p,"trace#",6) || !strncmp(p,"quit",4))
+        {
+            Skipped++;
+            continue;
+        }
+        if(n==size)
+        {
+            size=size ? size*2 : 256;
+            if((*commands=realloc(*commands,size*sizeof(s_COMMAND)))==NULL) exit(EX_OSERR);
+        }
+        (*commands)[n].t=sec*1000000000LL+usec*1000LL;
+        (*commands)[n].session=session;
+        if(((*commands)[n].command=strdup(p))==NULL) exit(EX_OSERR);
+        n++;
+    }
+    fclose(pFile);
+    return n;
+}
+
+
+/*
+This function return the connection that replay a recorded session, a new
+connection use the framed protocol to send the commands ahead of their reply
+input: server name, recorded session
+return: connection or NULL if an error occure
+*/
+
+s_CONNECTION* getConnection(char* server, int session)
+{
+    int i;
+    char buf[MAXMSG];
+    s_CONNECTION* c;
+
+    for(i=0; i<NConnections; i++) if(Connections[i].session==session) return &Connections[i];
+    if(NConnections==MAXSESSIONS)
+    {
+        fprintf(stderr,"Error: more than %d sessions in the commands\n",MAXSESSIONS);
+        return NULL;
+    }
+
+    c=&Connections[NConnections];
+    memset(c,0,sizeof *c);
+    c->session=session;
+    if((c->sfd=connectClient(server,NPORT))<0) return NULL;
+    initNetBuf(&c->buf,NET_TEXT);
+    if(sendMessage(c->sfd,&c->buf,"prot#frame")<0 || receiveMessage(c->sfd,&c->buf,buf,sizeof buf)<0 ||
+       strncmp(buf,"000",3))
+    {
+        fprintf(stderr,"Error: the server does not support the framed protocol\n");
+        return NULL;
+    }
+    c->buf.mode=NET_FRAMED;
+    NConnections++;
+    return c;
+}
+
+
+/*
+This function send a command tagged with a new correlation identifier
+input: connection, command
+return: 0 or -1 if an error occure
+*/
+
+int sendCommand(s_CONNECTION* c, char* command)
+{
+    int i;
+    char buf[MAXMSG];
+
+    for(i=0; c->tags[i]!=0; i++) {}
+    if(++c->lastTag<=0) c->lastTag=1;
+    snprintf(buf,sizeof buf,"@%d %s",c->lastTag,command);
+    c->tags[i]=c->lastTag;
+    c->sent[i]=now();
+    c->inflight++;
+    return sendMessage(c->sfd,&c->buf,buf)<0 ? -1 : 0;
+}
+
+
+/*
+This function match the replies received on a connection with the commands
+in flight, the other messages (later replies, subscription updates) are ignored
+input: connection
+return: number of commands replied or -1 if the framing is lost
+*/
+
+int collectReplies(s_CONNECTION* c)
+{
+    int i,n=0,tag,len;
+    char buf[MAXMSG];
+
+    while((len=extractMessage(&c->buf,buf,sizeof buf))!=-1)
+    {
+        if(len<0) return -1;
+        if(buf[0]!='@' || sscanf(buf,"@%d",&tag)!=1) continue;
+        for(i=0; i<MAXINFLIGHT && c->tags[i]!=tag; i++) {}
+        if(i==MAXINFLIGHT) continue;
+
+        if(NLatencies%1024==0 && (Latencies=realloc(Latencies,(NLatencies+1024)*sizeof(long long)))==NULL)
+            exit(EX_OSERR);
+        Latencies[NLatencies++]=now()-c->sent[i];
+        if(strstr(buf," 404 ")!=NULL) Errors++;
+        c->tags[i]=0;
+        c->inflight--;
+        n++;
+    }
+    return n;
+}
+
+
+/*
+This function wait for messages of the server until a time
+input: time of the monotonic clock in ns (0: do not wait, -1: until a message)
+return: number of commands replied or -1 if a connection is lost
+*/
+
+int waitReplies(long long until)
+{
+    int i,n=0,ret;
+    long long t;
+    struct pollfd pfds[MAXSESSIONS];
+    struct timespec ts;
+
+    for(i=0; i<NConnections; i++)
+    {
+        pfds[i].fd=Connections[i].sfd;
+        pfds[i].events=POLLIN;
+    }
+    t=until<=0 ? 0 : until-now();
+    if(t<0) t=0;
+    ts.tv_sec=t/1000000000LL;
+    ts.tv_nsec=t%1000000000LL;
+    if(ppoll(pfds,NConnections,until<0 ? NULL : &ts,NULL)<0 && errno!=EINTR) return -1;
+    for(i=0; i<NConnections; i++)
+    {
+        if(!(pfds[i].revents&(POLLIN|POLLHUP|POLLERR))) continue;
+        if(fillNetBuf(Connections[i].sfd,&Connections[i].buf)<=0 || (ret=collectReplies(&Connections[i]))<0)
+        {
+            fprintf(stderr,"Error: connection of session %d lost\n",Connections[i].session);
+            return -1;
+        }
+        n+=ret;
+    }
+    return n;
+}
+
+
+/*
+This function return the recorded time of a frame
+input: record
+return: time in ns
+*/
+
+long long recordTime(s_TRCRECORD* r)
+{
+    return r->sec*1000000000LL+r->nsec;
+}
+
+
+/*
+This function send a recorded frame on an interface, waiting while its queue is full
+input: socket, record
+return: 0, 1 if the record is not a valid frame or -1 if an error occure
+*/
+
+int sendRecord(int fd, s_TRCRECORD* r)
+{
+    struct can_frame frame;
+    struct pollfd pfd;
+
+    if(r->len>8) return 1;
+    memset(&frame,0,sizeof frame);
+    frame.can_id=(r->cobid&0x7FF)|(r->cobid&TRC_RTR ? CAN_RTR_FLAG : 0);
+    frame.can_dlc=r->len;
+    memcpy(frame.data,r->data,r->len);
+    while(write(fd,&frame,sizeof frame)<0)
+    {
+        if(errno!=ENOBUFS && errno!=EAGAIN && errno!=EINTR)
+        {
+            perror("write");
+            return -1;
+        }
+        pfd.fd=fd;
+        pfd.events=POLLOUT;
+        poll(&pfd,1,1);
+    }
+    return 0;
+}
+
+
+/* Sort the latencies */
+static int compareLatency(const void* a, const void* b)
+{
+    long long x=*(const long long*)a,y=*(const long long*)b;
+
+    return x<y ? -1 : x>y;
+}
+
+/*
+This function print the results of the replay
+input: duration in s
+*/
+
+void printReport(double elapsed)
+{
+    int i;
+    static const int pct[]={50,90,99};
+
+    printf("Elapsed %.3f s\n",elapsed);
+    printf("Frames: %ld sent (%.0f/s), %ld without interface",Frames,elapsed>0 ? Frames/elapsed : 0.0,FramesSkipped);
+    if(MaxLate>0) printf(", latest %.3f ms after its time",MaxLate/1e6);
+    printf("\n");
+    printf("Commands: %d replied (%.0f/s), %d errors, %d not replied, %d skipped\n",
+           NLatencies,elapsed>0 ? NLatencies/elapsed : 0.0,Errors,Timeouts,Skipped);
+    if(NLatencies==0) return;
+
+    qsort(Latencies,NLatencies,sizeof(long long),compareLatency);
+    printf("Latency us: min %lld",Latencies[0]/1000);
+    for(i=0; i<3; i++) printf(" p%d %lld",pct[i],Latencies[(long long)(NLatencies-1)*pct[i]/100]/1000);
+    printf(" max %lld\n",Latencies[NLatencies-1]/1000);
+}
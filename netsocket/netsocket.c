@@ -15,6 +15,10 @@
 #include <netinet/in.h>
 #include <netdb.h>
 #include <arpa/inet.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/uio.h>
 #endif
 
 #include "netsocket.h"
@@ -140,12 +144,7 @@ int acceptServ(int s, char* client)
 /*************************************************/
 int sendData(int s, char* buf)
 {
-    int n;
-
-    n=strlen(buf);
-    n=send(s,buf,n,0);
-
-    return n;
+    return sendAll(s,buf,strlen(buf));
 }
 
 /***************************************************************/
@@ -162,6 +161,256 @@ int receiveData(int s, char* buf, int len)
     return rlen;
 }
 
+/***************************************************************/
+/* This function initialise the receive buffer of a connection */
+/* input: receive buffer, protocol mode                        */
+/***************************************************************/
+void initNetBuf(s_NETBUF* nb, int mode)
+{
+    nb->mode=mode;
+    nb->len=0;
+}
+
+/***************************************************************/
+/* This function send a whole buffer, looping on partial sends */
+/* input: socket number, buffer, buffer length                 */
+/* return: number of sent bytes or -1 if an error occure       */
+/***************************************************************/
+int sendAll(int s, char* buf, int len)
+{
+    int n,sent=0;
+
+    while(sent<len)
+    {
+        if((n=send(s,buf+sent,len-sent,0))<=0) return -1;
+        sent+=n;
+    }
+    return sent;
+}
+
+/***********************************************************************************/
+/* This function send a message according to the protocol mode of the connection   */
+/* input: socket number, receive buffer of the connection, null terminated message */
+/* return: number of sent payload characters or -1 if an error occure              */
+/***********************************************************************************/
+int sendMessage(int s, s_NETBUF* nb, char* buf)
+{
+    return sendFrame(s,nb,buf,strlen(buf));
+}
+
+/***********************************************************************************/
+/* This function send a message that may contain any byte, it is delimited only by */
+/* the framed protocol                                                             */
+/* input: socket number, receive buffer of the connection, message, message length */
+/* return: number of sent payload bytes or -1 if an error occure                   */
+/***********************************************************************************/
+int sendFrame(int s, s_NETBUF* nb, char* buf, int n)
+{
+    char frame[NET_FRAME_MAX+4];
+
+    if(nb==NULL || nb->mode==NET_TEXT) return sendAll(s,buf,n);
+
+    if(n>NET_FRAME_MAX) return -1;
+    /* prefix and payload in one segment, a lone prefix would be delayed by Nagle */
+    frame[0]=(char)(n>>24);
+    frame[1]=(char)(n>>16);
+    frame[2]=(char)(n>>8);
+    frame[3]=(char)n;
+    memcpy(frame+4,buf,n);
+    if(sendAll(s,frame,n+4)<0) return -1;
+    return n;
+}
+
+/*********************************************************************/
+/* This function make the send and receive calls of a socket return */
+/* at once                                                           */
+/* input: socket number                                              */
+/* return: 0 or -1 if an error occure                                */
+/*********************************************************************/
+int setNonBlocking(int s)
+{
+#ifdef WIN32
+    u_long on=1;
+
+    return ioctlsocket(s,FIONBIO,&on)==0 ? 0 : -1;
+#else
+    int flags;
+
+    if((flags=fcntl(s,F_GETFL,0))<0) return -1;
+    return fcntl(s,F_SETFL,flags|O_NONBLOCK);
+#endif
+}
+
+/************************************************************/
+/* This function initialise the send buffer of a connection */
+/* input: send buffer                                       */
+/************************************************************/
+void initNetOut(s_NETOUT* out)
+{
+    out->start=0;
+    out->len=0;
+}
+
+/***************************************************************/
+/* This function copy bytes at the end of the send buffer ring */
+/* input: send buffer, bytes, number of bytes                  */
+/***************************************************************/
+static void appendNetOut(s_NETOUT* out, char* buf, int n)
+{
+    int end=(out->start+out->len)%NET_OUT_SIZE;
+    int first=NET_OUT_SIZE-end;
+
+    if(first>n) first=n;
+    memcpy(out->data+end,buf,first);
+    memcpy(out->data,buf+first,n-first);
+    out->len+=n;
+}
+
+/************************************************************************************/
+/* This function queue a message according to the protocol mode of the connection   */
+/* input: send buffer, receive buffer of the connection, null terminated message    */
+/* return: number of queued payload characters or -1 if the send buffer has no room */
+/************************************************************************************/
+int queueMessage(s_NETOUT* out, s_NETBUF* nb, char* buf)
+{
+    return queueFrame(out,nb,buf,strlen(buf));
+}
+
+/************************************************************************************/
+/* This function queue a message that may contain any byte, it is delimited only by */
+/* the framed protocol                                                              */
+/* input: send buffer, receive buffer of the connection, message, message length    */
+/* return: number of queued payload bytes or -1 if the send buffer has no room      */
+/************************************************************************************/
+int queueFrame(s_NETOUT* out, s_NETBUF* nb, char* buf, int n)
+{
+    char prefix[4];
+
+    if(nb==NULL || nb->mode==NET_TEXT)
+    {
+        if(n>NET_OUT_SIZE-out->len) return -1;
+        appendNetOut(out,buf,n);
+        return n;
+    }
+
+    if(n>NET_FRAME_MAX || n+4>NET_OUT_SIZE-out->len) return -1;
+    prefix[0]=(char)(n>>24);
+    prefix[1]=(char)(n>>16);
+    prefix[2]=(char)(n>>8);
+    prefix[3]=(char)n;
+    appendNetOut(out,prefix,4);
+    appendNetOut(out,buf,n);
+    return n;
+}
+
+/***********************************************************************/
+/* This function write the queued bytes that the socket accept without */
+/* waiting                                                             */
+/* input: socket number, send buffer                                   */
+/* return: number of bytes still queued or -1 if an error occure       */
+/***********************************************************************/
+int flushNetOut(int s, s_NETOUT* out)
+{
+    int n,first;
+#ifndef WIN32
+    struct iovec iov[2];
+#endif
+
+    while(out->len>0)
+    {
+        first=NET_OUT_SIZE-out->start;
+        if(first>out->len) first=out->len;
+#ifdef WIN32
+        n=send(s,out->data+out->start,first,0);
+        if(n<0 && WSAGetLastError()==WSAEWOULDBLOCK) break;
+#else
+            //the ring may wrap, its two parts are written together
+        iov[0].iov_base=out->data+out->start;
+        iov[0].iov_len=first;
+        iov[1].iov_base=out->data;
+        iov[1].iov_len=out->len-first;
+        n=writev(s,iov,out->len>first ? 2 : 1);
+        if(n<0 && (errno==EAGAIN || errno==EWOULDBLOCK)) break;
+        if(n<0 && errno==EINTR) continue;
+#endif
+        if(n<=0) return -1;
+        out->start=(out->start+n)%NET_OUT_SIZE;
+        out->len-=n;
+    }
+    if(out->len==0) out->start=0;
+    return out->len;
+}
+
+/**********************************************************************************/
+/* This function append the bytes available on the socket to the receive buffer   */
+/* input: socket number, receive buffer                                           */
+/* return: number of received bytes, 0 when the host disconnected, -1 if an error */
+/* occure and -2 if the buffer is full (framed message too long)                  */
+/**********************************************************************************/
+int fillNetBuf(int s, s_NETBUF* nb)
+{
+    int rlen;
+
+    if(nb->len>=(int)sizeof nb->data) return -2;
+    rlen=recv(s,nb->data+nb->len,sizeof nb->data-nb->len,0);
+    if(rlen>0) nb->len+=rlen;
+    return rlen;
+}
+
+/*******************************************************************/
+/* This function remove the first complete message from the buffer */
+/* input: receive buffer, message buffer, message buffer length    */
+/* return: message length, -1 if no complete message is buffered   */
+/* or -2 if the length prefix is invalid (framing lost)            */
+/*******************************************************************/
+int extractMessage(s_NETBUF* nb, char* buf, int len)
+{
+    int n,used;
+    unsigned char* p=(unsigned char*)nb->data;
+
+    if(nb->mode==NET_TEXT)
+    {
+            //legacy mode: everything received so far is one message
+        if(nb->len==0) return -1;
+        n=used=nb->len;
+    }
+    else
+    {
+        if(nb->len<4) return -1;
+        n=(p[0]<<24)|(p[1]<<16)|(p[2]<<8)|p[3];
+            //unrecoverable framing error, the connection must be closed
+        if(n<0 || n>NET_FRAME_MAX) return -2;
+        if(nb->len<n+4) return -1;
+        used=n+4;
+        p+=4;
+    }
+
+    if(n>len-1) n=len-1;
+    memcpy(buf,p,n);
+    buf[n]='\0';
+
+    nb->len-=used;
+    memmove(nb->data,nb->data+used,nb->len);
+    return n;
+}
+
+/************************************************************************/
+/* This function wait until a complete message is received              */
+/* input: socket number, receive buffer, message buffer, buffer length  */
+/* return: message length or a negative value as returned by fillNetBuf */
+/* (-2 also when the framing is lost)                                   */
+/************************************************************************/
+int receiveMessage(int s, s_NETBUF* nb, char* buf, int len)
+{
+    int n;
+
+    while((n=extractMessage(nb,buf,len))==-1)
+    {
+        if((n=fillNetBuf(s,nb))<=0) return n==0 ? -1 : n;
+    }
+    return n;
+}
+
 /********************************/
 /* This function close a socket */
 /* input: socket number         */
@@ -1,6 +1,50 @@
 #ifndef NETSOCKET_H_INCLUDED
 #define NETSOCKET_H_INCLUDED
 
+/*
+Wire protocol modes of a connection.
+NET_TEXT is the legacy mode where each recv() is taken as one message.
+NET_FRAMED prefix each message with its length on 4 bytes (network byte order)
+and is negotiated by the client with the "prot#frame" command.
+*/
+#define NET_TEXT 0
+#define NET_FRAMED 1
+
+/* Largest message payload accepted by the framed protocol */
+#define NET_FRAME_MAX 4096
+
+/*
+Bytes of the send buffer of a connection, and the levels of the watermarks:
+the server stop reading a host whose pending replies are above the high
+watermark, until they are below the low watermark.
+*/
+#define NET_OUT_SIZE 65536
+#define NET_OUT_HIGH 49152
+#define NET_OUT_LOW 16384
+
+/*
+Reusable receive buffer of a connection.
+Bytes are accumulated until a whole message is available.
+*/
+typedef struct
+{
+    int mode;                           /* NET_TEXT or NET_FRAMED */
+    int len;                            /* number of buffered bytes */
+    char data[NET_FRAME_MAX + 4];       /* length prefix and payload */
+} s_NETBUF;
+
+/*
+Send buffer of a non blocking connection.
+The messages are queued in a ring and written when the socket accept them,
+the used part of the ring is written with one writev call.
+*/
+typedef struct
+{
+    int start;                          /* offset of the first byte to send */
+    int len;                            /* number of bytes to send */
+    char data[NET_OUT_SIZE];
+} s_NETOUT;
+
 /*
 This funcion load winsock.dll for windows and create socket
 return: nothing or -1 if an error occure
@@ -42,6 +86,93 @@ return: number of received characters
 */
 int receiveData(int, char*, int);
 
+/*
+This function initialise the receive buffer of a connection
+input: receive buffer, protocol mode
+*/
+void initNetBuf(s_NETBUF*, int);
+
+/*
+This function send a whole buffer, looping on partial sends
+input: socket number, buffer, buffer length
+return: number of sent bytes or -1 if an error occure
+*/
+int sendAll(int, char*, int);
+
+/*
+This function send a message according to the protocol mode of the connection
+input: socket number, receive buffer of the connection, null terminated message
+return: number of sent payload characters or -1 if an error occure
+*/
+int sendMessage(int, s_NETBUF*, char*);
+
+/*
+This function send a message that may contain any byte, it is delimited only by
+the framed protocol
+input: socket number, receive buffer of the connection, message, message length
+return: number of sent payload bytes or -1 if an error occure
+*/
+int sendFrame(int, s_NETBUF*, char*, int);
+
+/*
+This function make the send and receive calls of a socket return at once
+input: socket number
+return: 0 or -1 if an error occure
+*/
+int setNonBlocking(int);
+
+/*
+This function initialise the send buffer of a connection
+input: send buffer
+*/
+void initNetOut(s_NETOUT*);
+
+/*
+This function queue a message according to the protocol mode of the connection
+input: send buffer, receive buffer of the connection, null terminated message
+return: number of queued payload characters or -1 if the send buffer has no room
+*/
+int queueMessage(s_NETOUT*, s_NETBUF*, char*);
+
+/*
+This function queue a message that may contain any byte, it is delimited only by
+the framed protocol
+input: send buffer, receive buffer of the connection, message, message length
+return: number of queued payload bytes or -1 if the send buffer has no room
+*/
+int queueFrame(s_NETOUT*, s_NETBUF*, char*, int);
+
+/*
+This function write the queued bytes that the socket accept without waiting
+input: socket number, send buffer
+return: number of bytes still queued or -1 if an error occure
+*/
+int flushNetOut(int, s_NETOUT*);
+
+/*
+This function append the bytes available on the socket to the receive buffer (one recv call)
+input: socket number, receive buffer
+return: number of received bytes, 0 when the host disconnected, -1 if an error occure
+and -2 if the buffer is full (framed message too long)
+*/
+int fillNetBuf(int, s_NETBUF*);
+
+/*
+This function remove the first complete message from the receive buffer
+input: receive buffer, message buffer, message buffer length
+return: message length, -1 if no complete message is buffered or -2 if the
+length prefix is invalid: the framing is lost and the connection must be closed
+*/
+int extractMessage(s_NETBUF*, char*, int);
+
+/*
+This function wait until a complete message is received
+input: socket number, receive buffer, message buffer, message buffer length
+return: message length or a negative value as returned by fillNetBuf (-2 also
+when the framing is lost)
+*/
+int receiveMessage(int, s_NETBUF*, char*, int);
+
 /*
 This function close a socket
 input: socket number